@@ -0,0 +1,73 @@
+#ifndef _CELLBOUNCER_BENCH_UTIL_H
+#define _CELLBOUNCER_BENCH_UTIL_H
+#include <string>
+#include <vector>
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <htslib/kseq.h>
+#include <htswrapper/gzreader.h>
+
+// ===== bench_util.h
+// Helpers shared by benchmark programs.
+
+KSEQ_INIT(gzFile, gzread);
+
+/**
+ * Seconds elapsed since a time point.
+ */
+inline double secs_since(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Find the species-specific k-mer lists for a base name (as given to
+ * demux_species -k) and return k. Exits if there are none.
+ */
+inline int find_kmer_lists(const std::string& kmerbase, std::vector<std::string>& kmerfiles){
+    for (int idx = 0; ; ++idx){
+        char buf[500];
+        sprintf(&buf[0], "%s.%d.kmers", kmerbase.c_str(), idx);
+        struct stat st;
+        if (stat(buf, &st) != 0){
+            break;
+        }
+        kmerfiles.push_back(buf);
+    }
+    if (kmerfiles.size() == 0){
+        fprintf(stderr, "ERROR: no k-mer lists found for %s\n", kmerbase.c_str());
+        exit(1);
+    }
+    gzreader peek(kmerfiles[0]);
+    peek.next();
+    return strlen(peek.line);
+}
+
+/**
+ * Load up to max_reads sequences from a FASTQ file into memory, so that
+ * only processing them is timed. Exits if there are none.
+ */
+inline void load_reads(const std::string& filename, long max_reads,
+    std::vector<std::string>& reads){
+    gzFile fp = gzopen(filename.c_str(), "r");
+    if (!fp){
+        fprintf(stderr, "ERROR opening %s for reading\n", filename.c_str());
+        exit(1);
+    }
+    kseq_t* seq = kseq_init(fp);
+    while (reads.size() < max_reads && kseq_read(seq) >= 0){
+        reads.push_back(std::string(seq->seq.s, seq->seq.l));
+    }
+    kseq_destroy(seq);
+    gzclose(fp);
+    if (reads.size() == 0){
+        fprintf(stderr, "ERROR: no reads in %s\n", filename.c_str());
+        exit(1);
+    }
+    fprintf(stderr, "Loaded %ld reads\n", (long)reads.size());
+}
+
+#endif
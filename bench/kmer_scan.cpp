@@ -0,0 +1,247 @@
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <htswrapper/gzreader.h>
+#include <htswrapper/khashtable.h>
+#include "../src/kmer_index.h"
+#include "../src/kmer_bloom.h"
+#include "../src/kmer_scan.h"
+#include "bench_util.h"
+
+// ===== kmer_scan.cpp
+// Microbenchmark comparing the old species k-mer scanning path in
+// demux_species (khashkey::scan_kmers() + khashtable lookups, one base at a
+// time) with the current one (kmer_scanner: whole-read 2-bit encoding and
+// rolling canonical k-mers + kmer_index lookups). Both stop at the first
+// species-specific k-mer in each read, as demux_species does. The current
+// path is also timed with the Bloom filter prefilter (kmer_bloom) that
+// demux_species puts in front of the table.
+//
+// Run on real 10x R2 reads, since the hit rate (and so how far into each
+// read scanning goes) matters.
+
+using namespace std;
+using std::chrono::steady_clock;
+
+void help(int code){
+    fprintf(stderr, "kmer_scan [OPTIONS]\n");
+    fprintf(stderr, "Times species-specific k-mer scanning of reads using the old (khashtable)\n");
+    fprintf(stderr, "   and new (kmer_scanner/kmer_index) code paths.\n");
+    fprintf(stderr, "[OPTIONS]:\n");
+    fprintf(stderr, "   --kmers -k Base name of species-specific k-mer lists (as given to\n");
+    fprintf(stderr, "       demux_species -k)\n");
+    fprintf(stderr, "   --reads -r FASTQ of reads to scan (i.e. 10x RNA-seq R2)\n");
+    fprintf(stderr, "   --num_reads -n Maximum number of reads to load (default 1000000)\n");
+    fprintf(stderr, "   --iterations -i Number of times to scan all reads (default 3)\n");
+    fprintf(stderr, "   --help -h Display this message and exit.\n");
+    exit(code);
+}
+
+void print_result(const char* name, double secs, long nreads, long nhits){
+    fprintf(stderr, "%-28s %8.3f s  %10.1f ns/read  %8.2f M reads/s  %ld hits\n", name,
+        secs, 1e9 * secs / (double)nreads, (double)nreads / secs / 1e6, nhits);
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+       {"kmers", required_argument, 0, 'k'},
+       {"reads", required_argument, 0, 'r'},
+       {"num_reads", required_argument, 0, 'n'},
+       {"iterations", required_argument, 0, 'i'},
+       {0, 0, 0, 0}
+    };
+
+    string kmerbase = "";
+    string readsfile = "";
+    long max_reads = 1000000;
+    int iterations = 3;
+
+    int option_index = 0;
+    int ch;
+    if (argc == 1){
+        help(0);
+    }
+    while((ch = getopt_long(argc, argv, "k:r:n:i:h", long_options, &option_index )) != -1){
+        switch(ch){
+            case 'h':
+                help(0);
+                break;
+            case 'k':
+                kmerbase = optarg;
+                break;
+            case 'r':
+                readsfile = optarg;
+                break;
+            case 'n':
+                max_reads = atol(optarg);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            default:
+                help(0);
+                break;
+        }
+    }
+    if (kmerbase == "" || readsfile == ""){
+        fprintf(stderr, "ERROR: --kmers / -k and --reads / -r are required\n");
+        exit(1);
+    }
+
+    vector<string> kmerfiles;
+    int k = find_kmer_lists(kmerbase, kmerfiles);
+    int ns = kmerfiles.size();
+    fprintf(stderr, "%d species, k = %d\n", ns, k);
+
+    vector<string> reads;
+    load_reads(readsfile, max_reads, reads);
+    long nreads = (long)reads.size() * iterations;
+
+    steady_clock::time_point t;
+
+    t = steady_clock::now();
+    khashtable<short> tab(k);
+    for (int i = 0; i < ns; ++i){
+        gzreader reader(kmerfiles[i]);
+        while (reader.next()){
+            tab.add(reader.line, (short)i);
+        }
+    }
+    fprintf(stderr, "Loaded khashtable in %.3f s\n", secs_since(t));
+
+    t = steady_clock::now();
+    kmer_index kidx;
+    kidx.build(kmerfiles);
+    fprintf(stderr, "Loaded kmer_index in %.3f s (%ld k-mers)\n", secs_since(t),
+        (long)kidx.size());
+
+    t = steady_clock::now();
+    kmer_bloom bloom;
+    bloom.build(kidx);
+    fprintf(stderr, "Built kmer_bloom in %.3f s (%.1f MB; table %.1f MB)\n", secs_since(t),
+        (double)bloom.bytes() / 1048576.0, (double)kidx.bytes() / 1048576.0);
+
+    vector<long> hits_old(ns, 0);
+    vector<long> hits_new(ns, 0);
+    vector<long> hits_bloom(ns, 0);
+
+    // Old path
+    t = steady_clock::now();
+    khashkey key(k);
+    for (int it = 0; it < iterations; ++it){
+        for (int r = 0; r < reads.size(); ++r){
+            key.reset();
+            int pos = 0;
+            while (key.scan_kmers(reads[r].c_str(), reads[r].length(), pos)){
+                short spec;
+                if (tab.lookup(key, spec)){
+                    hits_old[spec]++;
+                    break;
+                }
+            }
+        }
+    }
+    double secs_old = secs_since(t);
+
+    // New path
+    t = steady_clock::now();
+    kmer_scanner scanner(k);
+    for (int it = 0; it < iterations; ++it){
+        for (int r = 0; r < reads.size(); ++r){
+            scanner.scan(reads[r].c_str(), reads[r].length(), [&](uint64_t hi, uint64_t lo){
+                short spec;
+                if (kidx.lookup(hi, lo, spec)){
+                    hits_new[spec]++;
+                    return true;
+                }
+                return false;
+            });
+        }
+    }
+    double secs_new = secs_since(t);
+
+    // New path with prefilter
+    long nkmers = 0;
+    long nrejected = 0;
+    t = steady_clock::now();
+    for (int it = 0; it < iterations; ++it){
+        for (int r = 0; r < reads.size(); ++r){
+            scanner.scan(reads[r].c_str(), reads[r].length(), [&](uint64_t hi, uint64_t lo){
+                nkmers++;
+                if (!bloom.contains(hi, lo)){
+                    nrejected++;
+                    return false;
+                }
+                short spec;
+                if (kidx.lookup(hi, lo, spec)){
+                    hits_bloom[spec]++;
+                    return true;
+                }
+                return false;
+            });
+        }
+    }
+    double secs_bloom = secs_since(t);
+
+    // 2-bit encoding alone, SIMD vs. one base at a time
+    vector<unsigned char> codes;
+    long checksum = 0;
+    t = steady_clock::now();
+    for (int it = 0; it < iterations; ++it){
+        for (int r = 0; r < reads.size(); ++r){
+            if (codes.size() < reads[r].length()){
+                codes.resize(reads[r].length());
+            }
+            kmer_encode_bases(reads[r].c_str(), reads[r].length(), codes.data());
+            checksum += codes[0];
+        }
+    }
+    double secs_enc = secs_since(t);
+    t = steady_clock::now();
+    for (int it = 0; it < iterations; ++it){
+        for (int r = 0; r < reads.size(); ++r){
+            if (codes.size() < reads[r].length()){
+                codes.resize(reads[r].length());
+            }
+            for (int i = 0; i < reads[r].length(); ++i){
+                codes[i] = kmer_base_code(reads[r][i]);
+            }
+            checksum += codes[0];
+        }
+    }
+    double secs_enc_scalar = secs_since(t);
+
+    long tot_old = 0;
+    long tot_new = 0;
+    long tot_bloom = 0;
+    for (int i = 0; i < ns; ++i){
+        tot_old += hits_old[i];
+        tot_new += hits_new[i];
+        tot_bloom += hits_bloom[i];
+    }
+    fprintf(stderr, "\n");
+    print_result("khashkey + khashtable", secs_old, nreads, tot_old);
+    print_result("kmer_scanner + kmer_index", secs_new, nreads, tot_new);
+    print_result("  + kmer_bloom prefilter", secs_bloom, nreads, tot_bloom);
+    print_result("encode (SIMD)", secs_enc, nreads, 0);
+    print_result("encode (scalar)", secs_enc_scalar, nreads, 0);
+    fprintf(stderr, "Speedup: %.2fx (%.2fx with prefilter)\n", secs_old / secs_new, 
+        secs_old / secs_bloom);
+    fprintf(stderr, "Prefilter rejected %.2f%% of %ld k-mers\n", 
+        nkmers > 0 ? 100.0 * (double)nrejected / (double)nkmers : 0.0, nkmers);
+    for (int i = 0; i < ns; ++i){
+        if (hits_old[i] != hits_new[i] || hits_new[i] != hits_bloom[i]){
+            fprintf(stderr, "WARNING: hits for species %d differ (%ld vs %ld vs %ld)\n", i,
+                hits_old[i], hits_new[i], hits_bloom[i]);
+        }
+    }
+    // Keep the encoding loops from being optimized away
+    if (checksum == -1){
+        fprintf(stderr, "%ld\n", checksum);
+    }
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/kmer_index.h"
+#include "../src/kmer_scan.h"
+#include "bench_util.h"
+
+// ===== minimizer_report.cpp
+// Compares sampled k-mer tables (demux_species --minimizer_window) with the
+// full set of species-specific k-mers: how much memory each uses, how fast
+// reads are scanned, and how often each read is assigned the same species
+// (its first species-specific k-mer, as in demux_species).
+//
+// Taking the full table as truth, for each species:
+//   sensitivity = reads assigned the species by both / reads assigned it by
+//       the full table
+//   specificity = reads not assigned the species by either / reads not
+//       assigned it by the full table
+
+using namespace std;
+using std::chrono::steady_clock;
+
+void help(int code){
+    fprintf(stderr, "minimizer_report [OPTIONS]\n");
+    fprintf(stderr, "Compares species assignments of reads using sampled (minimizer-density)\n");
+    fprintf(stderr, "   species-specific k-mer tables to those using all k-mers. Writes a\n");
+    fprintf(stderr, "   tab-separated table to stdout.\n");
+    fprintf(stderr, "[OPTIONS]:\n");
+    fprintf(stderr, "   --kmers -k Base name of species-specific k-mer lists (as given to\n");
+    fprintf(stderr, "       demux_species -k)\n");
+    fprintf(stderr, "   --reads -r FASTQ of reads to scan (i.e. 10x RNA-seq R2)\n");
+    fprintf(stderr, "   --window -w Sampling window to test (can specify multiple times;\n");
+    fprintf(stderr, "       default 5, 10, 15, 20)\n");
+    fprintf(stderr, "   --num_reads -n Maximum number of reads to load (default 1000000)\n");
+    fprintf(stderr, "   --help -h Display this message and exit.\n");
+    exit(code);
+}
+
+/**
+ * Assign each read the species of its first k-mer found in a table
+ * (-1 = none). Returns time taken.
+ */
+double assign_reads(kmer_index& idx, vector<string>& reads, vector<short>& assn){
+    kmer_scanner scanner(idx.k);
+    assn.resize(reads.size());
+    bool all = idx.sample_w <= 1;
+    steady_clock::time_point t = steady_clock::now();
+    for (int r = 0; r < reads.size(); ++r){
+        short result = -1;
+        scanner.scan(reads[r].c_str(), reads[r].length(), [&](uint64_t hi, uint64_t lo){
+            short spec;
+            if ((all || idx.sampled(hi, lo)) && idx.lookup(hi, lo, spec)){
+                result = spec;
+                return true;
+            }
+            return false;
+        });
+        assn[r] = result;
+    }
+    return secs_since(t);
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+       {"kmers", required_argument, 0, 'k'},
+       {"reads", required_argument, 0, 'r'},
+       {"window", required_argument, 0, 'w'},
+       {"num_reads", required_argument, 0, 'n'},
+       {0, 0, 0, 0}
+    };
+
+    string kmerbase = "";
+    string readsfile = "";
+    vector<int> windows;
+    long max_reads = 1000000;
+
+    int option_index = 0;
+    int ch;
+    if (argc == 1){
+        help(0);
+    }
+    while((ch = getopt_long(argc, argv, "k:r:w:n:h", long_options, &option_index )) != -1){
+        switch(ch){
+            case 'h':
+                help(0);
+                break;
+            case 'k':
+                kmerbase = optarg;
+                break;
+            case 'r':
+                readsfile = optarg;
+                break;
+            case 'w':
+                windows.push_back(atoi(optarg));
+                break;
+            case 'n':
+                max_reads = atol(optarg);
+                break;
+            default:
+                help(0);
+                break;
+        }
+    }
+    if (kmerbase == "" || readsfile == ""){
+        fprintf(stderr, "ERROR: --kmers / -k and --reads / -r are required\n");
+        exit(1);
+    }
+    if (windows.size() == 0){
+        windows = vector<int>{ 5, 10, 15, 20 };
+    }
+
+    vector<string> kmerfiles;
+    int k = find_kmer_lists(kmerbase, kmerfiles);
+    int ns = kmerfiles.size();
+    fprintf(stderr, "%d species, k = %d\n", ns, k);
+
+    vector<string> reads;
+    load_reads(readsfile, max_reads, reads);
+
+    fprintf(stderr, "Loading all k-mers\n");
+    kmer_index full;
+    full.build(kmerfiles);
+    vector<short> assn_full;
+    double secs_full = assign_reads(full, reads, assn_full);
+
+    vector<long> n_full(ns, 0);
+    for (int r = 0; r < reads.size(); ++r){
+        if (assn_full[r] >= 0){
+            n_full[assn_full[r]]++;
+        }
+    }
+
+    printf("w\tkmers\ttable_MB\tmem_fraction\tns_per_read\tspecies\treads_full\treads_sampled\tsensitivity\tspecificity\n");
+    for (int i = 0; i < ns; ++i){
+        printf("0\t%ld\t%.1f\t1.000\t%.1f\t%d\t%ld\t%ld\t1.0000\t1.0000\n", (long)full.size(),
+            (double)full.bytes() / 1048576.0, 1e9 * secs_full / (double)reads.size(),
+            i, n_full[i], n_full[i]);
+    }
+
+    for (int wi = 0; wi < windows.size(); ++wi){
+        int w = windows[wi];
+        fprintf(stderr, "Loading k-mers with w = %d\n", w);
+        kmer_index samp;
+        samp.set_sampling(w);
+        samp.build(kmerfiles);
+        vector<short> assn_samp;
+        double secs_samp = assign_reads(samp, reads, assn_samp);
+
+        vector<long> n_samp(ns, 0);
+        vector<long> n_both(ns, 0);
+        vector<long> n_neither(ns, 0);
+        long n_agree = 0;
+        long n_hit_full = 0;
+        for (int r = 0; r < reads.size(); ++r){
+            if (assn_full[r] >= 0){
+                n_hit_full++;
+                if (assn_samp[r] == assn_full[r]){
+                    n_agree++;
+                }
+            }
+            for (int i = 0; i < ns; ++i){
+                bool in_full = assn_full[r] == i;
+                bool in_samp = assn_samp[r] == i;
+                if (in_samp){
+                    n_samp[i]++;
+                }
+                if (in_full && in_samp){
+                    n_both[i]++;
+                }
+                else if (!in_full && !in_samp){
+                    n_neither[i]++;
+                }
+            }
+        }
+        for (int i = 0; i < ns; ++i){
+            long n_not_full = (long)reads.size() - n_full[i];
+            printf("%d\t%ld\t%.1f\t%.3f\t%.1f\t%d\t%ld\t%ld\t%.4f\t%.4f\n", w,
+                (long)samp.size(), (double)samp.bytes() / 1048576.0,
+                (double)samp.bytes() / (double)full.bytes(),
+                1e9 * secs_samp / (double)reads.size(), i, n_full[i], n_samp[i],
+                n_full[i] > 0 ? (double)n_both[i] / (double)n_full[i] : 1.0,
+                n_not_full > 0 ? (double)n_neither[i] / (double)n_not_full : 1.0);
+        }
+        fprintf(stderr, "w = %d: %.1f%% of memory, %.2f%% of assigned reads keep \
+the same species\n", w, 100.0 * (double)samp.bytes() / (double)full.bytes(),
+            n_hit_full > 0 ? 100.0 * (double)n_agree / (double)n_hit_full : 100.0);
+    }
+    return 0;
+}
@@ -0,0 +1,709 @@
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include <htswrapper/bc.h>
+#include <htswrapper/robin_hood/robin_hood.h>
+#include "../src/species_kmers.h"
+#include "../src/species_mixture.h"
+#include "bench_util.h"
+
+// ===== species_bench.cpp
+// End-to-end benchmark of species k-mer counting in demux_species, on
+// synthetic data, so that throughput can be compared between versions
+// without depending on a particular real data set.
+//
+// A deterministic generator (the same seed gives the same files on every
+// platform) makes a small transcriptome per species: every species is a
+// copy of one random ancestral transcriptome with its own point mutations,
+// so species-specific k-mers are those overlapping mutations, as with real
+// related species. It then writes species-specific k-mer lists, a barcode
+// whitelist, and 10x Genomics-style R1 (barcode + UMI) and R2 (cDNA) FASTQs
+// for a set of cells. Some cells are doublets of two species, some of each
+// cell's molecules are ambient (from the species of another, random cell),
+// and some reads are PCR duplicates of earlier molecules.
+//
+// species_kmer_counter is then run on the reads with 1 to N threads, each
+// in its own process (so peak memory can be measured separately). Cells are
+// then assigned to species to check accuracy against the known truth: the
+// mixture model is fit as in demux_species (to barcodes above the knee of
+// total counts, weighted by total counts), and each cell is given its most
+// likely component. demux_species's later step of filtering out barcodes
+// that do not look like cells is left out, since every barcode here is a
+// cell, so accuracy does not count cells that step would have dropped.
+
+using namespace std;
+using std::chrono::steady_clock;
+
+// Fixed properties of generated data
+#define SYNTH_NUM_TRANSCRIPTS 500
+#define SYNTH_TRANSCRIPT_LEN 1500
+#define SYNTH_BC_LEN 16
+#define SYNTH_UMI_LEN 12
+#define SYNTH_READ_LEN 90
+// Chance that a read is a PCR duplicate of an earlier molecule in its cell
+#define SYNTH_DUP_RATE 0.2
+// Per-base sequencing error rate
+#define SYNTH_ERROR_RATE 0.001
+
+/**
+ * Small random number generator (splitmix64). Used instead of <random>
+ * distributions, whose output differs between standard libraries.
+ */
+struct synth_rng{
+    uint64_t state;
+    synth_rng(uint64_t seed){
+        state = seed;
+    }
+    uint64_t next(){
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    // Uniform integer in [0, n)
+    int below(int n){
+        return (int)(next() % (uint64_t)n);
+    }
+    // Uniform in [0, 1)
+    double unif(){
+        return (double)(next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+    char base(){
+        return "ACGT"[next() & 3];
+    }
+    // A base other than the given one
+    char other_base(char b){
+        char c = base();
+        while (c == b){
+            c = base();
+        }
+        return c;
+    }
+};
+
+struct synth_params{
+    int num_species;
+    int num_cells;
+    int reads_per_cell;
+    double doublet_rate;
+    double ambient_rate;
+    double divergence;
+    int k;
+    uint64_t seed;
+};
+
+// One cDNA molecule: a fragment of a transcript from one species
+struct synth_mol{
+    int cell;
+    short species;
+    int transcript;
+    int pos;
+    bool rev;
+    char umi[SYNTH_UMI_LEN];
+};
+
+// Results of one benchmark run, sent from the process that did it
+struct bench_result{
+    double secs;
+    double fit_secs;
+    long kmers;
+    long hits;
+    // Cells assigned correctly, overall, singlets, and doublets
+    long correct;
+    long correct_singlet;
+    long correct_doublet;
+    // Summary of counts, which should not depend on the number of threads
+    uint64_t checksum;
+};
+
+void help(int code){
+    fprintf(stderr, "species_bench [OPTIONS]\n");
+    fprintf(stderr, "Generates synthetic multi-species 10x Genomics RNA-seq data, then times\n");
+    fprintf(stderr, "   species-specific k-mer counting on it (as in demux_species) with 1 to N\n");
+    fprintf(stderr, "   threads and checks species assignments against the truth. Writes a\n");
+    fprintf(stderr, "   tab-separated table to stdout.\n");
+    fprintf(stderr, "[OPTIONS]:\n");
+    fprintf(stderr, "   --output_directory -o Where to write generated data (REQUIRED)\n");
+    fprintf(stderr, "   --num_species -s Number of species (default 3)\n");
+    fprintf(stderr, "   --num_cells -c Number of cells (default 2000)\n");
+    fprintf(stderr, "   --reads_per_cell -n Reads per cell (default 500)\n");
+    fprintf(stderr, "   --doublet_rate -d Fraction of cells that are doublets of two species\n");
+    fprintf(stderr, "       (default 0.05)\n");
+    fprintf(stderr, "   --ambient_rate -a Fraction of each cell's molecules that come from\n");
+    fprintf(stderr, "       ambient RNA (default 0.05)\n");
+    fprintf(stderr, "   --divergence -v Fraction of bases that differ between each species and\n");
+    fprintf(stderr, "       their common ancestor (default 0.02)\n");
+    fprintf(stderr, "   --kmer_len -k Length of species-specific k-mers (default 31)\n");
+    fprintf(stderr, "   --max_threads -T Benchmark with 1 to this many threads (default 4)\n");
+    fprintf(stderr, "   --seed -S Random seed (default 1)\n");
+    fprintf(stderr, "   --disable_umis -u Count every read, rather than collapsing UMIs\n");
+    fprintf(stderr, "   --generate_only -g Only write data (i.e. to run demux_species on it)\n");
+    fprintf(stderr, "   --help -h Display this message and exit.\n");
+    exit(code);
+}
+
+/**
+ * Index of the species_mixture component for a doublet of species a < b
+ * (components for pairs follow those for single species).
+ */
+int pair_component(int ns, int a, int b){
+    int c = ns;
+    for (int i = 0; i < ns - 1; ++i){
+        for (int j = i + 1; j < ns; ++j){
+            if (i == a && j == b){
+                return c;
+            }
+            c++;
+        }
+    }
+    return -1;
+}
+
+char comp_base(char b){
+    switch(b){
+        case 'A':
+            return 'T';
+        case 'C':
+            return 'G';
+        case 'G':
+            return 'C';
+        default:
+            return 'A';
+    }
+}
+
+FILE* open_or_exit(const string& filename){
+    FILE* fp = fopen(filename.c_str(), "w");
+    if (fp == NULL){
+        fprintf(stderr, "ERROR opening %s for writing.\n", filename.c_str());
+        exit(1);
+    }
+    return fp;
+}
+
+gzFile gzopen_or_exit(const string& filename){
+    // Fast compression: reads are decompressed in the benchmark, but
+    // writing them is not timed
+    gzFile fp = gzopen(filename.c_str(), "wb1");
+    if (!fp){
+        fprintf(stderr, "ERROR opening %s for writing.\n", filename.c_str());
+        exit(1);
+    }
+    return fp;
+}
+
+/**
+ * Write every k-mer of each species that is not found at the same position
+ * in any other species. K-mers that match one at a different position are
+ * kept, but in random sequence these are vanishingly rare.
+ */
+void write_kmer_lists(const synth_params& p, vector<vector<string> >& seqs,
+    const string& kmerbase){
+
+    int ns = p.num_species;
+    vector<FILE*> outs;
+    vector<long> nkmers(ns, 0);
+    for (int s = 0; s < ns; ++s){
+        char buf[50];
+        sprintf(&buf[0], ".%d.kmers", s);
+        outs.push_back(open_or_exit(kmerbase + buf));
+    }
+    // Differences between each pair of species, as cumulative counts along
+    // the transcript
+    int len = SYNTH_TRANSCRIPT_LEN;
+    vector<int> diffsum(ns * ns * (len + 1));
+    for (int t = 0; t < SYNTH_NUM_TRANSCRIPTS; ++t){
+        for (int s = 0; s < ns; ++s){
+            for (int u = 0; u < ns; ++u){
+                int* d = &diffsum[(s * ns + u) * (len + 1)];
+                d[0] = 0;
+                for (int i = 0; i < len; ++i){
+                    d[i + 1] = d[i] + (seqs[s][t][i] != seqs[u][t][i]);
+                }
+            }
+        }
+        for (int s = 0; s < ns; ++s){
+            for (int i = 0; i + p.k <= len; ++i){
+                bool specific = true;
+                for (int u = 0; u < ns; ++u){
+                    const int* d = &diffsum[(s * ns + u) * (len + 1)];
+                    if (u != s && d[i + p.k] - d[i] == 0){
+                        specific = false;
+                        break;
+                    }
+                }
+                if (specific){
+                    fprintf(outs[s], "%.*s\n", p.k, seqs[s][t].c_str() + i);
+                    nkmers[s]++;
+                }
+            }
+        }
+    }
+    for (int s = 0; s < ns; ++s){
+        fclose(outs[s]);
+        fprintf(stderr, "species%d: %ld specific k-mers\n", s, nkmers[s]);
+    }
+}
+
+/**
+ * Write all data for a benchmark to outdir, and store the barcode and
+ * true species_mixture component of every cell.
+ */
+void generate(const synth_params& p, const string& outdir,
+    vector<string>& barcodes, vector<int>& labels){
+
+    synth_rng rng(p.seed);
+    int ns = p.num_species;
+
+    // Transcriptomes
+    vector<vector<string> > seqs(ns);
+    for (int t = 0; t < SYNTH_NUM_TRANSCRIPTS; ++t){
+        string anc(SYNTH_TRANSCRIPT_LEN, 'A');
+        for (int i = 0; i < SYNTH_TRANSCRIPT_LEN; ++i){
+            anc[i] = rng.base();
+        }
+        for (int s = 0; s < ns; ++s){
+            string seq = anc;
+            for (int i = 0; i < SYNTH_TRANSCRIPT_LEN; ++i){
+                if (rng.unif() < p.divergence){
+                    seq[i] = rng.other_base(seq[i]);
+                }
+            }
+            seqs[s].push_back(seq);
+        }
+    }
+    write_kmer_lists(p, seqs, outdir + "/kmers");
+
+    // Cells
+    vector<vector<short> > cell_species;
+    set<string> bcs_seen;
+    FILE* wl = open_or_exit(outdir + "/whitelist.txt");
+    FILE* truth = open_or_exit(outdir + "/truth.tsv");
+    for (int c = 0; c < p.num_cells; ++c){
+        string bc(SYNTH_BC_LEN, 'A');
+        do{
+            for (int i = 0; i < SYNTH_BC_LEN; ++i){
+                bc[i] = rng.base();
+            }
+        } while (bcs_seen.count(bc) > 0);
+        bcs_seen.insert(bc);
+        barcodes.push_back(bc);
+
+        vector<short> species;
+        species.push_back(rng.below(ns));
+        if (rng.unif() < p.doublet_rate){
+            short s2 = rng.below(ns - 1);
+            if (s2 >= species[0]){
+                s2++;
+            }
+            species.push_back(s2);
+            sort(species.begin(), species.end());
+            labels.push_back(pair_component(ns, species[0], species[1]));
+            fprintf(truth, "%s\tspecies%d+species%d\n", bc.c_str(), species[0], species[1]);
+        }
+        else{
+            labels.push_back(species[0]);
+            fprintf(truth, "%s\tspecies%d\n", bc.c_str(), species[0]);
+        }
+        cell_species.push_back(species);
+        fprintf(wl, "%s\n", bc.c_str());
+    }
+    fclose(wl);
+    fclose(truth);
+
+    // Molecules and the reads that come from them
+    vector<synth_mol> mols;
+    vector<int> reads;
+    for (int c = 0; c < p.num_cells; ++c){
+        int first_mol = mols.size();
+        for (int r = 0; r < p.reads_per_cell; ++r){
+            if (mols.size() > first_mol && rng.unif() < SYNTH_DUP_RATE){
+                reads.push_back(first_mol + rng.below(mols.size() - first_mol));
+                continue;
+            }
+            synth_mol m;
+            m.cell = c;
+            if (rng.unif() < p.ambient_rate){
+                const vector<short>& other = cell_species[rng.below(p.num_cells)];
+                m.species = other[rng.below(other.size())];
+            }
+            else{
+                m.species = cell_species[c][rng.below(cell_species[c].size())];
+            }
+            m.transcript = rng.below(SYNTH_NUM_TRANSCRIPTS);
+            m.pos = rng.below(SYNTH_TRANSCRIPT_LEN - SYNTH_READ_LEN + 1);
+            m.rev = rng.next() & 1;
+            for (int i = 0; i < SYNTH_UMI_LEN; ++i){
+                m.umi[i] = rng.base();
+            }
+            reads.push_back(mols.size());
+            mols.push_back(m);
+        }
+    }
+    // Reads from all cells are mixed together in real files
+    for (int i = reads.size() - 1; i > 0; --i){
+        swap(reads[i], reads[rng.below(i + 1)]);
+    }
+
+    gzFile r1 = gzopen_or_exit(outdir + "/R1.fastq.gz");
+    gzFile r2 = gzopen_or_exit(outdir + "/R2.fastq.gz");
+    string qual1(SYNTH_BC_LEN + SYNTH_UMI_LEN, 'F');
+    string qual2(SYNTH_READ_LEN, 'F');
+    string seq2(SYNTH_READ_LEN, 'A');
+    char buf[100];
+    for (int i = 0; i < reads.size(); ++i){
+        const synth_mol& m = mols[reads[i]];
+        const string& t = seqs[m.species][m.transcript];
+        for (int j = 0; j < SYNTH_READ_LEN; ++j){
+            if (m.rev){
+                seq2[j] = comp_base(t[m.pos + SYNTH_READ_LEN - 1 - j]);
+            }
+            else{
+                seq2[j] = t[m.pos + j];
+            }
+            if (rng.unif() < SYNTH_ERROR_RATE){
+                seq2[j] = rng.other_base(seq2[j]);
+            }
+        }
+        sprintf(&buf[0], "@synth.%d", i);
+        string rec1 = string(buf) + "\n" + barcodes[m.cell] +
+            string(m.umi, SYNTH_UMI_LEN) + "\n+\n" + qual1 + "\n";
+        string rec2 = string(buf) + "\n" + seq2 + "\n+\n" + qual2 + "\n";
+        if (gzwrite(r1, rec1.c_str(), rec1.length()) != rec1.length() ||
+            gzwrite(r2, rec2.c_str(), rec2.length()) != rec2.length()){
+            fprintf(stderr, "ERROR writing reads to %s\n", outdir.c_str());
+            exit(1);
+        }
+    }
+    if (gzclose(r1) != Z_OK || gzclose(r2) != Z_OK){
+        fprintf(stderr, "ERROR writing reads to %s\n", outdir.c_str());
+        exit(1);
+    }
+    fprintf(stderr, "Wrote %ld reads from %ld molecules in %d cells\n",
+        (long)reads.size(), (long)mols.size(), p.num_cells);
+}
+
+/**
+ * Count species-specific k-mers in the generated reads, then assign cells
+ * to species and compare to the truth.
+ */
+void run_bench(const synth_params& p, const string& outdir, int nthreads,
+    bool use_umis, vector<string>& barcodes, vector<int>& labels,
+    bench_result& res){
+
+    int ns = p.num_species;
+    bc_whitelist wl;
+    wl.exact_matches_only();
+    wl.init(outdir + "/whitelist.txt");
+    robin_hood::unordered_map<unsigned long, map<short, int> > bc_species_counts;
+    species_kmer_counter counter(nthreads, p.k, ns, &wl, &bc_species_counts);
+    if (use_umis){
+        counter.enable_umis();
+    }
+    else{
+        counter.disable_umis();
+    }
+    for (int s = 0; s < ns; ++s){
+        char buf[50];
+        sprintf(&buf[0], "/kmers.%d.kmers", s);
+        string kmerfile = outdir + buf;
+        counter.add(s, kmerfile);
+    }
+    string r1file = outdir + "/R1.fastq.gz";
+    string r2file = outdir + "/R2.fastq.gz";
+
+    steady_clock::time_point t = steady_clock::now();
+    counter.process_gex_files(r1file, r2file);
+    res.secs = secs_since(t);
+
+    kmer_lookup_stats stats;
+    counter.get_lookup_stats(stats);
+    res.kmers = stats.kmers;
+    res.hits = stats.hits;
+
+    // Order-independent summary of all counts
+    res.checksum = 0;
+    for (robin_hood::unordered_map<unsigned long, map<short, int> >::iterator x =
+        bc_species_counts.begin(); x != bc_species_counts.end(); ++x){
+        uint64_t h = x->first;
+        for (map<short, int>::iterator c = x->second.begin(); c != x->second.end(); ++c){
+            h = h * 1000003ULL + ((uint64_t)c->first << 32) + (uint64_t)c->second;
+        }
+        res.checksum += h * 0x9E3779B97F4A7C15ULL;
+    }
+
+    // Cells with no counts are left out (and count as wrong)
+    species_count_table obs(ns);
+    vector<int> obs_labels;
+    vector<double> row(ns);
+    for (int i = 0; i < barcodes.size(); ++i){
+        robin_hood::unordered_map<unsigned long, map<short, int> >::iterator x =
+            bc_species_counts.find(bc_ul(barcodes[i]));
+        if (x == bc_species_counts.end()){
+            continue;
+        }
+        for (int s = 0; s < ns; ++s){
+            map<short, int>::iterator c = x->second.find(s);
+            row[s] = c == x->second.end() ? 0.0 : (double)c->second;
+        }
+        obs.add(row.data(), 1.0);
+        obs_labels.push_back(labels[i]);
+    }
+
+    vector<string> species_names;
+    for (int s = 0; s < ns; ++s){
+        char buf[50];
+        sprintf(&buf[0], "species%d", s);
+        species_names.push_back(buf);
+    }
+    // Fit and assign as demux_species does
+    t = steady_clock::now();
+    species_count_table obs_filt(ns);
+    obs.filter_knee(obs_filt);
+    species_mixture mod(species_names, 0.9, p.doublet_rate, nthreads);
+    mod.fit(obs_filt);
+    vector<int> best;
+    vector<double> llr;
+    mod.assign(obs, best, llr);
+    res.fit_secs = secs_since(t);
+
+    res.correct = 0;
+    res.correct_singlet = 0;
+    res.correct_doublet = 0;
+    for (int i = 0; i < obs.n; ++i){
+        if (best[i] == obs_labels[i]){
+            res.correct++;
+            if (mod.is_doublet(best[i])){
+                res.correct_doublet++;
+            }
+            else{
+                res.correct_singlet++;
+            }
+        }
+    }
+}
+
+/**
+ * Run a benchmark in a child process, and get its peak memory use (MB).
+ */
+double run_bench_proc(const synth_params& p, const string& outdir, int nthreads,
+    bool use_umis, vector<string>& barcodes, vector<int>& labels,
+    bench_result& res){
+
+    int fds[2];
+    if (pipe(fds) != 0){
+        fprintf(stderr, "ERROR: could not create pipe\n");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0){
+        fprintf(stderr, "ERROR: could not start benchmark process\n");
+        exit(1);
+    }
+    else if (pid == 0){
+        close(fds[0]);
+        run_bench(p, outdir, nthreads, use_umis, barcodes, labels, res);
+        bool ok = write(fds[1], &res, sizeof(res)) == sizeof(res);
+        close(fds[1]);
+        exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    bool ok = read(fds[0], &res, sizeof(res)) == sizeof(res);
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0 || !ok){
+        fprintf(stderr, "ERROR: benchmark with %d threads failed\n", nthreads);
+        exit(1);
+    }
+#if defined(__APPLE__)
+    // Bytes on macOS
+    return (double)usage.ru_maxrss / 1048576.0;
+#else
+    // Kilobytes on Linux
+    return (double)usage.ru_maxrss / 1024.0;
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+       {"output_directory", required_argument, 0, 'o'},
+       {"num_species", required_argument, 0, 's'},
+       {"num_cells", required_argument, 0, 'c'},
+       {"reads_per_cell", required_argument, 0, 'n'},
+       {"doublet_rate", required_argument, 0, 'd'},
+       {"ambient_rate", required_argument, 0, 'a'},
+       {"divergence", required_argument, 0, 'v'},
+       {"kmer_len", required_argument, 0, 'k'},
+       {"max_threads", required_argument, 0, 'T'},
+       {"seed", required_argument, 0, 'S'},
+       {"disable_umis", no_argument, 0, 'u'},
+       {"generate_only", no_argument, 0, 'g'},
+       {0, 0, 0, 0}
+    };
+
+    string outdir = "";
+    synth_params p;
+    p.num_species = 3;
+    p.num_cells = 2000;
+    p.reads_per_cell = 500;
+    p.doublet_rate = 0.05;
+    p.ambient_rate = 0.05;
+    p.divergence = 0.02;
+    p.k = 31;
+    p.seed = 1;
+    int max_threads = 4;
+    bool use_umis = true;
+    bool generate_only = false;
+
+    int option_index = 0;
+    int ch;
+    if (argc == 1){
+        help(0);
+    }
+    while((ch = getopt_long(argc, argv, "o:s:c:n:d:a:v:k:T:S:ugh", long_options, &option_index )) != -1){
+        switch(ch){
+            case 'h':
+                help(0);
+                break;
+            case 'o':
+                outdir = optarg;
+                break;
+            case 's':
+                p.num_species = atoi(optarg);
+                break;
+            case 'c':
+                p.num_cells = atoi(optarg);
+                break;
+            case 'n':
+                p.reads_per_cell = atoi(optarg);
+                break;
+            case 'd':
+                p.doublet_rate = atof(optarg);
+                break;
+            case 'a':
+                p.ambient_rate = atof(optarg);
+                break;
+            case 'v':
+                p.divergence = atof(optarg);
+                break;
+            case 'k':
+                p.k = atoi(optarg);
+                break;
+            case 'T':
+                max_threads = atoi(optarg);
+                break;
+            case 'S':
+                p.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'u':
+                use_umis = false;
+                break;
+            case 'g':
+                generate_only = true;
+                break;
+            default:
+                help(0);
+                break;
+        }
+    }
+    if (outdir == ""){
+        fprintf(stderr, "ERROR: --output_directory / -o is required\n");
+        exit(1);
+    }
+    if (p.num_species < 2){
+        fprintf(stderr, "ERROR: at least 2 species are required\n");
+        exit(1);
+    }
+    if (p.num_cells < 1 || p.reads_per_cell < 1){
+        fprintf(stderr, "ERROR: --num_cells and --reads_per_cell must be positive\n");
+        exit(1);
+    }
+    if (p.doublet_rate <= 0 || p.doublet_rate >= 1){
+        fprintf(stderr, "ERROR: --doublet_rate must be between 0 and 1\n");
+        exit(1);
+    }
+    if (p.ambient_rate < 0 || p.ambient_rate >= 1){
+        fprintf(stderr, "ERROR: --ambient_rate must be at least 0 and less than 1\n");
+        exit(1);
+    }
+    if (p.divergence <= 0 || p.divergence >= 1){
+        fprintf(stderr, "ERROR: --divergence must be between 0 and 1\n");
+        exit(1);
+    }
+    if (p.k < 1 || p.k > 64 || p.k > SYNTH_READ_LEN){
+        fprintf(stderr, "ERROR: --kmer_len must be between 1 and %d\n",
+            SYNTH_READ_LEN < 64 ? SYNTH_READ_LEN : 64);
+        exit(1);
+    }
+    if (max_threads < 1){
+        fprintf(stderr, "ERROR: --max_threads must be positive\n");
+        exit(1);
+    }
+    if (outdir[outdir.length()-1] == '/'){
+        outdir = outdir.substr(0, outdir.length()-1);
+    }
+    if (mkdir(outdir.c_str(), 0755) != 0 && errno != EEXIST){
+        fprintf(stderr, "ERROR: could not create %s\n", outdir.c_str());
+        exit(1);
+    }
+
+    vector<string> barcodes;
+    vector<int> labels;
+    steady_clock::time_point t = steady_clock::now();
+    generate(p, outdir, barcodes, labels);
+    fprintf(stderr, "Generated data in %.3f s\n", secs_since(t));
+    if (generate_only){
+        return 0;
+    }
+    long nsinglet = 0;
+    for (int i = 0; i < labels.size(); ++i){
+        if (labels[i] < p.num_species){
+            nsinglet++;
+        }
+    }
+    long ndoublet = labels.size() - nsinglet;
+    long nreads = (long)p.num_cells * (long)p.reads_per_cell;
+
+    fprintf(stdout, "threads\tsecs\treads_per_sec\tlookups\tlookups_per_sec\thits\t\
+peak_rss_MB\tfit_secs\taccuracy\tsinglet_accuracy\tdoublet_accuracy\n");
+    uint64_t checksum = 0;
+    for (int nt = 1; nt <= max_threads; ++nt){
+        bench_result res;
+        double rss = run_bench_proc(p, outdir, nt, use_umis, barcodes, labels, res);
+        fprintf(stdout, "%d\t%.3f\t%.0f\t%ld\t%.0f\t%ld\t%.1f\t%.3f\t%.4f\t%.4f\t%.4f\n",
+            nt, res.secs, (double)nreads / res.secs, res.kmers,
+            (double)res.kmers / res.secs, res.hits, rss, res.fit_secs,
+            (double)res.correct / (double)labels.size(),
+            nsinglet > 0 ? (double)res.correct_singlet / (double)nsinglet : 0.0,
+            ndoublet > 0 ? (double)res.correct_doublet / (double)ndoublet : 0.0);
+        fflush(stdout);
+        fprintf(stderr, "%d threads: %.2f M reads/s, %.2f M lookups/s, %.1f MB, %.2f%% correct\n",
+            nt, (double)nreads / res.secs / 1e6, (double)res.kmers / res.secs / 1e6,
+            rss, 100.0 * (double)res.correct / (double)labels.size());
+        if (nt == 1){
+            checksum = res.checksum;
+        }
+        else if (res.checksum != checksum){
+            fprintf(stderr, "WARNING: counts with %d threads differ from counts with 1 thread\n",
+                nt);
+        }
+    }
+    return 0;
+}
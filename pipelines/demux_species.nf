@@ -155,9 +155,33 @@ def get_lib_idx(lib){
 def n_species = file(params.kmers + ".names").readLines().size()
 
 /*
- * Split RNA-seq read pairs into chunks.
+ * Shell script that copies a read file pair to bgzf/, recompressing it with 
+ * bgzip (from htslib) unless it is already BGZF-compressed (in which case it
+ * is only linked). Jobs that read one chunk of a file with --chunk need BGZF
+ * input; reads from bcl2fastq or plain gzip are not.
  */
-process split_rna_reads{
+def bgzf_script(R1, R2, cpus){
+    return """
+    mkdir -p bgzf
+    for f in ${R1} ${R2}; do
+        # BGZF files start with a gzip header with an extra "BC" field
+        if [ "\$(head -c 4 \$f | od -An -tx1 | tr -d ' \\n')" == "1f8b0804" ] && \\
+            [ "\$(head -c 14 \$f | tail -c 2)" == "BC" ]; then
+            ln -s "\$(readlink -f \$f)" bgzf/\$f
+        else
+            zcat -f \$f | bgzip -@ ${cpus} > bgzf/\$f
+        fi
+    done
+    """
+}
+
+/*
+ * Make sure an RNA-seq read pair is BGZF-compressed, so it can be read
+ * in chunks.
+ */
+process bgzf_rna_reads{
+    cpus params.threads
+
     input:
     tuple val(file_idx), 
         val(lib_id), 
@@ -169,68 +193,71 @@ process split_rna_reads{
     output:
     tuple val(file_idx), 
         val(lib_id), 
-        file("${basename_R1}.*.fastq.gz"), 
-        file("${basename_R2}.*.fastq.gz")
+        val(basename_R1), 
+        val(basename_R2), 
+        file("bgzf/${R1}"), 
+        file("bgzf/${R2}")
     
     script:
-    """
-    ${split_reads} -1 ${R1} -2 ${R2} -n ${params.num_chunks} -o .
-    """
+    bgzf_script(R1, R2, task.cpus)
 }
 
 /*
- * Split ATAC read pairs into chunks.
+ * Make sure a custom-type read pair is BGZF-compressed, so it can be read
+ * in chunks.
  */
-process split_atac_reads{
+process bgzf_custom_reads{
+    cpus params.threads
+
     input:
     tuple val(file_idx), 
         val(name), 
         val(lib_id), 
+        val(type), 
         val(R1base), 
         val(R2base), 
-        val(R3base),
         file(R1), 
-        file(R2),
-        file(R3)
+        file(R2)
     
     output:
     tuple val(file_idx), 
         val(name), 
         val(lib_id), 
-        file("${R1base}.*.fastq.gz"), 
-        file("${R2base}.*.fastq.gz"),
-        file("${R3base}.*.fastq.gz") 
+        val(type), 
+        val(R1base), 
+        val(R2base), 
+        file("bgzf/${R1}"), 
+        file("bgzf/${R2}")
+    
     script:
-    """
-    ${split_reads} -1 ${R1} -2 ${R2} -3 ${R3} -n ${params.num_chunks} -o .
-    """
+    bgzf_script(R1, R2, task.cpus)
 }
 
 /*
- * Split custom-type read pairs into chunks.
+ * Split ATAC read pairs into chunks.
  */
-process split_custom_reads{
+process split_atac_reads{
     input:
     tuple val(file_idx), 
         val(name), 
         val(lib_id), 
-        val(type), 
         val(R1base), 
         val(R2base), 
+        val(R3base),
         file(R1), 
-        file(R2)
+        file(R2),
+        file(R3)
     
     output:
     tuple val(file_idx), 
         val(name), 
         val(lib_id), 
-        val(type), 
         file("${R1base}.*.fastq.gz"), 
-        file("${R2base}.*.fastq.gz")
-    
+        file("${R2base}.*.fastq.gz"),
+        file("${R3base}.*.fastq.gz") 
     script:
     """
-    ${split_reads} -1 ${R1} -2 ${R2} -n ${params.num_chunks} -o .
+    ${split_reads} -1 ${R1} -2 ${R2} -3 ${R3} -n ${params.num_chunks} -o .
     """
 }
 
@@ -253,7 +280,7 @@ process count_kmers{
             
     output:
     tuple val(lib_id), 
-        file("species_counts.*.txt"), 
+        file("species_counts.*.bin"), 
         file("species_names.*.txt") 
     
     script:
@@ -267,7 +294,8 @@ process count_kmers{
 
 }
 /*
- * Count species specific k-mers in one input file chunk.
+ * Count species specific k-mers in one chunk of a (BGZF-compressed) file pair,
+ * reading the chunk directly from the file.
  */
 process count_kmers_chunk{
     cpus params.threads
@@ -277,6 +305,7 @@ process count_kmers_chunk{
     input:
     tuple val(file_idx), 
         val(lib_id), 
+        val(chunk_idx),
         file(R1), 
         file(R2),
         file(wl),
@@ -285,20 +314,17 @@ process count_kmers_chunk{
             
     output:
     tuple val(lib_id), 
-        file("species_counts.*.txt"), 
+        file("species_counts.*.bin"), 
         file("species_names.*.txt") 
     
     script:
     
-    // Extract batch ID/index from file name
-    def (whole, begin, extra, idx) = \
-        ( R1 =~ /(.*)\_R1(_\d+)?\.(\d+)\.fastq\.gz/ )[0]
-    
-    batch_idx = (file_idx * params.num_chunks) + idx.toInteger()
+    batch_idx = (file_idx * params.num_chunks) + chunk_idx + 1
     
     """
     ${demux_species} -o . -d --batch_num ${batch_idx} -k ${kmerbase}\
-         -w ${wl} -T ${params.threads} -r ${R1} -R ${R2} 
+         -w ${wl} -T ${params.threads} -r ${R1} -R ${R2}\
+         --num_chunks ${params.num_chunks} --chunk ${chunk_idx}
     """
 
 }
@@ -311,11 +337,13 @@ def boolean isCollectionOrArray(object) {
  * Combine together species-specific k-mer counts from all chunks.
  */
 process join_counts{
+    cpus params.threads
+
     input:
     tuple val(libname), file(countsfiles), file(namefiles)
     
     output:
-    tuple val(libname), file("species_counts.txt"), file("species_names.txt")
+    tuple val(libname), file("species_counts.bin"), file("species_names.txt")
 
     script:
     def n_files = countsfiles.size()
@@ -323,7 +351,7 @@ process join_counts{
         n_files = 1
     }
     """
-    ${combine_species_counts} -o . -n ${n_files} 
+    ${combine_species_counts} -o . -n ${n_files} -T ${task.cpus}
     """
 }
 
@@ -664,7 +692,8 @@ process demux_rna_reads{
 }
 
 /*
- * Splits an RNA-seq read pair chunk by species
+ * Splits one chunk of an RNA-seq read pair by species, reading the chunk
+ * directly from the (BGZF-compressed) files
  */
 process demux_rna_reads_chunk{
     cpus params.threads
@@ -672,6 +701,9 @@ process demux_rna_reads_chunk{
     input:
     tuple val(uid), 
         val(libname), 
+        val(chunk_idx),
+        val(R1base),
+        val(R2base),
         file(R1), 
         file(R2), 
         file(assn), 
@@ -682,12 +714,13 @@ process demux_rna_reads_chunk{
     output:
     tuple val(uid), 
         val(libname), 
-        file("*/GEX_${R1}"), 
-        file("*/GEX_${R2}")
+        file("*/GEX_${R1base}.${chunk_idx}.fastq.gz"), 
+        file("*/GEX_${R2base}.${chunk_idx}.fastq.gz")
 
     script:
     """
-    ${demux_species} -o . -w ${wl} -T ${params.threads} -r ${R1} -R ${R2}
+    ${demux_species} -o . -w ${wl} -T ${params.threads} -r ${R1} -R ${R2}\
+        --num_chunks ${params.num_chunks} --chunk ${chunk_idx}
     """
 }
 
@@ -832,7 +865,8 @@ process demux_custom_reads{
 }
 
 /*
- * Splits a custom-type read pair chunk by species
+ * Splits one chunk of a custom-type read pair by species, reading the chunk
+ * directly from the (BGZF-compressed) files
  */
 process demux_custom_reads_chunk{
     cpus params.threads
@@ -842,6 +876,9 @@ process demux_custom_reads_chunk{
         val(libname_custom), 
         val(type_custom), 
         val(libname_gex), 
+        val(chunk_idx),
+        val(R1base),
+        val(R2base),
         file(R1), 
         file(R2), 
         file(assn), 
@@ -852,18 +889,19 @@ process demux_custom_reads_chunk{
     output:
     tuple val(uid), 
         val(libname_gex),
-        file("*/${type_custom}_${R1}"),
-        file("*/${type_custom}_${R2}")    
+        file("*/${type_custom}_${R1base}.${chunk_idx}.fastq.gz"),
+        file("*/${type_custom}_${R2base}.${chunk_idx}.fastq.gz")    
     
     script:
     """
-    ${demux_species} -o . -w ${wl} -T ${params.threads} -x ${R1} -X ${R2} -N ${type_custom}
+    ${demux_species} -o . -w ${wl} -T ${params.threads} -x ${R1} -X ${R2} -N ${type_custom}\
+        --num_chunks ${params.num_chunks} --chunk ${chunk_idx}
     """
 }
 
 /*
- * Combines a set of RNA-seq read pair chunks, after splitting into chunks
- * and separating chunks by species
+ * Combines a set of RNA-seq read pair chunks, after separating chunks
+ * by species
  */
 process cat_read_chunks_rna{
     input:
@@ -950,8 +988,8 @@ process cat_read_chunks_atac_nor3{
 }
 
 /*
- * Combines a set of custom-type read pair chunks, after splitting into chunks
- * and separating chunks by species
+ * Combines a set of custom-type read pair chunks, after separating chunks
+ * by species
  */
 process cat_read_chunks_custom{
     input:
@@ -1329,20 +1367,12 @@ workflow{
         joined = join_counts(filestojoin)        
     }
     else{
-        rsplit = split_rna_reads(indexed_rna_pairs).transpose().map({ tup ->
-            def tup2 = tup
-            tup2.add(file(params.whitelist))
-            return tup2
-        })
+        // Each job reads its own chunk of the (BGZF-compressed) files
+        rchunks = bgzf_rna_reads(indexed_rna_pairs).combine(Channel.of(0..<params.num_chunks))
         
         // Add in k-mer files before counting k-mers    
-        to_count = rsplit.map{ rsplitelts ->
-            def to_return = []
-            for (elt in rsplitelts){
-                to_return.add(elt)
-            }
-            to_return.add(kmerBase)
-            return to_return
+        to_count = rchunks.map{ x ->
+            return [x[0], x[1], x[6], x[4], x[5], file(params.whitelist), kmerBase]
         }.combine(kmerfiles)
         
         // Group files by library name
@@ -1420,12 +1450,12 @@ workflow{
         }
         if (params.demux_pieces && params.num_chunks > 1){
             // Demux each chunk of RNA files
-            rsplit2 = rsplit.map{ idx, lib, r1, r2, wl -> 
-                [lib, lib + "_" + idx, r1, r2, wl]
+            rchunks2 = rchunks.map{ idx, lib, r1base, r2base, r1, r2, chunk_idx -> 
+                [lib, lib + "_" + idx, chunk_idx, r1base, r2base, r1, r2, file(params.whitelist)]
             } 
             
-            rna_chunk_demuxed = models.cross(rsplit2).map{ x, y ->
-                [y[1], y[0], y[2], y[3], x[2], x[6], x[7], y[4]]
+            rna_chunk_demuxed = models.cross(rchunks2).map{ x, y ->
+                [y[1], y[0], y[2], y[3], y[4], y[5], y[6], x[2], x[6], x[7], y[7]]
             } | demux_rna_reads_chunk
             
             cat_job(rna_chunk_demuxed, false) | cat_read_chunks_rna
@@ -1454,16 +1484,19 @@ workflow{
                 }
             }
             if (params.custom_dir){
-                // Split, demux, and join custom read files
+                // Demux custom read files by chunk, and join
                 readpairs_custom = get_custom_channel(extensions, suffixes,
                     custom_map, custom_names, true)
-                csplit = split_custom_reads(readpairs_custom).transpose()\
-                    .map{ idx, libname_custom, libname_gex, type, r1, r2 ->
-                        [libname_gex, libname_custom + "_" + idx, libname_custom, type, r1, r2]
+                cchunks = bgzf_custom_reads(readpairs_custom)\
+                    .combine(Channel.of(0..<params.num_chunks))\
+                    .map{ idx, libname_custom, libname_gex, type, r1base, r2base, r1, r2, chunk_idx ->
+                        [libname_gex, libname_custom + "_" + idx, libname_custom, type, 
+                            chunk_idx, r1base, r2base, r1, r2]
                     }
                 
-                custom_reads_chunk_demuxed = models.cross(csplit).map{x, y ->
-                    [y[1], y[2], y[3], y[0], y[4], y[5], x[2], x[6], x[7], file(params.whitelist)]
+                custom_reads_chunk_demuxed = models.cross(cchunks).map{x, y ->
+                    [y[1], y[2], y[3], y[0], y[4], y[5], y[6], y[7], y[8], x[2], x[6], x[7], 
+                        file(params.whitelist)]
                 } | demux_custom_reads_chunk
                 
                 cat_job(custom_reads_chunk_demuxed, false) | cat_read_chunks_custom
@@ -11,11 +11,15 @@
 #include <sstream>
 #include <cstdlib>
 #include <utility>
+#include <vector>
+#include <deque>
 #include <sys/stat.h>
 #include <zlib.h>
 #include <htswrapper/bc.h>
 #include <htswrapper/bc_scanner.h>
 #include "common.h"
+#include "fq_stream.h"
+#include "fq_writer.h"
 
 using std::cout;
 using std::endl;
@@ -49,6 +53,10 @@ void help(int code){
     fprintf(stderr, "      processed data set. Providing the RNA-seq barcodes with --whitelist/-w and\n");
     fprintf(stderr, "      the ATAC-seq barcodes with --whitelist2/-W will result in ATAC barcodes being\n");
     fprintf(stderr, "      searched for in the reads, but RNA-seq barcodes being reported in the output reads.\n");
+    fprintf(stderr, "    --num_threads -T Number of threads to use for reading and writing files.\n");
+    fprintf(stderr, "      If greater than 1, each input file will be decompressed in its own thread,\n");
+    fprintf(stderr, "      BGZF-compressed input will be decompressed by multiple threads, and\n");
+    fprintf(stderr, "      output will be compressed by this many threads (default 1).\n");
     fprintf(stderr, "    --help -h Display this message and exit.\n");
     exit(code);
 }
@@ -62,6 +70,7 @@ int main(int argc, char *argv[]) {
        {"output_dir", required_argument, 0, 'o'},
        {"whitelist", required_argument, 0, 'w'},
        {"whitelist2", required_argument, 0, 'W'},
+       {"num_threads", required_argument, 0, 'T'},
        {0, 0, 0, 0} 
     };
     
@@ -72,6 +81,7 @@ int main(int argc, char *argv[]) {
     string output_dir = "";
     string wlfn = "";
     string wl2fn = "";
+    int nthreads = 1;
 
     int option_index = 0;
     int ch;
@@ -79,7 +89,7 @@ int main(int argc, char *argv[]) {
     if (argc == 1){
         help(0);
     }
-    while((ch = getopt_long(argc, argv, "1:2:3:o:w:W:h", long_options, &option_index )) != -1){
+    while((ch = getopt_long(argc, argv, "1:2:3:o:w:W:T:h", long_options, &option_index )) != -1){
         switch(ch){
             case 0:
                 // This option set a flag. No need to do anything here.
@@ -105,6 +115,9 @@ int main(int argc, char *argv[]) {
             case 'W':
                 wl2fn = optarg;
                 break;
+            case 'T':
+                nthreads = atoi(optarg);
+                break;
             default:
                 help(0);
                 break;
@@ -133,6 +146,11 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
     
+    if (nthreads < 1){
+        fprintf(stderr, "ERROR: --num_threads / -T must be at least 1\n");
+        exit(1);
+    }
+    
     if (output_dir[output_dir.length()-1] == '/'){
         output_dir = output_dir.substr(0, output_dir.length()-1);
     }
@@ -146,11 +164,23 @@ int main(int argc, char *argv[]) {
     string r1out = output_dir + filename_nopath(r1fn);
     string r2out = output_dir + filename_nopath(r2fn);
 
-    gzFile outs[2];
-    outs[0] = gzopen(r1out.c_str(), "w");
-    outs[1] = gzopen(r2out.c_str(), "w");
+    // With multiple threads, compress output in a thread pool
+    fq_writer_pool* pool = NULL;
+    if (nthreads > 1){
+        pool = new fq_writer_pool(nthreads);
+    }
+    fq_writer outs[2];
+    outs[0].open(r1out, pool);
+    outs[1].open(r2out, pool);
 
-    bc_scanner scanner(r1fn, r2fn, r3fn);
+    // With multiple threads, decompress each input file in its own thread
+    deque<fq_stream> streams;
+    vector<string> paths{ r1fn, r2fn, r3fn };
+    if (nthreads > 1){
+        vector<string> filenames = paths;
+        open_fq_streams(streams, filenames, paths, nthreads);
+    }
+    bc_scanner scanner(paths[0], paths[1], paths[2]);
     if (wl2fn != ""){
         // Assume multiome data if two whitelists given.
         scanner.init_10x_multiome_ATAC(wlfn, wl2fn);
@@ -167,25 +197,28 @@ int main(int argc, char *argv[]) {
         // Print seq ID line
         string bc_str = bc2str(scanner.barcode);
         sprintf(&outbuf[0], "@%s CB:Z:%s\n", scanner.seq_id, bc_str.c_str());
-        gzwrite(outs[0], &outbuf[0], 8+scanner.seq_id_len+BC_LENX2/2);
-        gzwrite(outs[1], &outbuf[0], 8+scanner.seq_id_len+BC_LENX2/2);
+        outs[0].write(&outbuf[0], 8+scanner.seq_id_len+BC_LENX2/2);
+        outs[1].write(&outbuf[0], 8+scanner.seq_id_len+BC_LENX2/2);
         
         // Print sequences
-        gzwrite(outs[0], scanner.read_f, scanner.read_f_len);
-        gzwrite(outs[0], "\n+\n", 3);
-        gzwrite(outs[1], scanner.read_r, scanner.read_r_len);
-        gzwrite(outs[1], "\n+\n", 3);
+        outs[0].write(scanner.read_f, scanner.read_f_len);
+        outs[0].write("\n+\n", 3);
+        outs[1].write(scanner.read_r, scanner.read_r_len);
+        outs[1].write("\n+\n", 3);
         
         // Print quality
-        gzwrite(outs[0], scanner.read_f_qual, scanner.read_f_len);
-        gzwrite(outs[0], "\n", 1);
-        gzwrite(outs[1], scanner.read_r_qual, scanner.read_r_len);
-        gzwrite(outs[1], "\n", 1);
+        outs[0].write(scanner.read_f_qual, scanner.read_f_len);
+        outs[0].write("\n", 1);
+        outs[1].write(scanner.read_r_qual, scanner.read_r_len);
+        outs[1].write("\n", 1);
     
     }
 
-    gzclose(outs[0]);
-    gzclose(outs[1]);
+    outs[0].close();
+    outs[1].close();
+    if (pool != NULL){
+        delete pool;
+    }
 
     return 0;
 }
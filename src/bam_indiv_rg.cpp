@@ -163,9 +163,8 @@ file (-a) required\n");
     while(reader.next()){
         // Skip records for which there is no barcode -> individual assignment
         if (reader.has_cb_z){
-            bc as_bitset;
-            str2bc(reader.cb_z, as_bitset);
-            unsigned long as_ulong = as_bitset.to_ulong();
+            unsigned long as_ulong;
+            cb2ul(reader.cb_z, as_ulong);
             if (barcode_map.count(as_ulong) > 0){
                 reader.add_read_group_read(barcode_map[as_ulong]);
                 reader.write_record(outf);
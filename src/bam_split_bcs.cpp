@@ -165,11 +165,10 @@ file name prefix.\n", output_prefix.c_str());
     
     while(reader.next()){
         if (reader.has_cb_z){
-            bc as_bitset;
-            str2bc(reader.cb_z, as_bitset);
-            unsigned long as_ulong = as_bitset.to_ulong();
+            unsigned long as_ulong;
+            cb2ul(reader.cb_z, as_ulong);
             if (barcode_map.count(as_ulong) > 0){
-                string indv = barcode_map[as_ulong];
+                string& indv = barcode_map[as_ulong];
                 // Add sample-specific read group
                 reader.add_read_group_read(indv);
                 // Write to specific output file
@@ -15,7 +15,12 @@
 #include <cstdlib>
 #include <cstdio>
 #include <utility>
+#include <deque>
+#include <queue>
+#include <thread>
+#include <sys/resource.h>
 #include "common.h"
+#include "species_counts_bin.h"
 
 using std::cout;
 using std::endl;
@@ -34,6 +39,10 @@ void help(int code){
     fprintf(stderr, "   --output_dir -o The output directory used for all batch-specific runs.\n");
     fprintf(stderr, "   --num_chunks -n The number of batches (there should be this many output\n");
     fprintf(stderr, "       files, unless one or more failed.\n");
+    fprintf(stderr, "   --num_threads -T Merge counts using this many threads (default 1)\n");
+    fprintf(stderr, "   --text -t Write combined counts as a text table (species_counts.txt)\n");
+    fprintf(stderr, "       instead of the binary format (species_counts.bin) that demux_species\n");
+    fprintf(stderr, "       loads fastest.\n");
     exit(code);
 }
 
@@ -118,18 +127,205 @@ bool load_conversion(string& filename,
     return true;
 }
 
+// File descriptors to leave free when choosing how many threads merge at 
+// once (standard streams, part files being joined, etc.)
+#define MERGE_RESERVED_FDS 16
+
+/**
+ * Merge barcodes from lo up to (not including) hi (or to the end of the files, 
+ * if last) from a set of sorted binary count files, adding up counts for 
+ * barcodes in more than one file. Only one record per file is held in memory.
+ */
+void merge_range(vector<string>& infiles, unsigned long lo, unsigned long hi, 
+    bool last, int num_species, string outfilename, uint64_t* nrecords){
+    
+    deque<species_counts_reader> readers(infiles.size());
+    // Next barcode from each file, smallest on top
+    priority_queue<pair<unsigned long, int>, vector<pair<unsigned long, int> >, 
+        greater<pair<unsigned long, int> > > heads;
+    for (int i = 0; i < infiles.size(); ++i){
+        readers[i].open(infiles[i]);
+        readers[i].find(lo);
+        if (readers[i].next() && (last || readers[i].bc_key < hi)){
+            heads.push(make_pair(readers[i].bc_key, i));
+        }
+    }
+    species_counts_writer writer;
+    writer.open(outfilename, num_species);
+    vector<int> row(num_species);
+    while (!heads.empty()){
+        unsigned long bc_key = heads.top().first;
+        fill(row.begin(), row.end(), 0);
+        while (!heads.empty() && heads.top().first == bc_key){
+            int i = heads.top().second;
+            heads.pop();
+            for (int j = 0; j < num_species; ++j){
+                row[j] += readers[i].counts[j];
+            }
+            if (readers[i].next() && (last || readers[i].bc_key < hi)){
+                heads.push(make_pair(readers[i].bc_key, i));
+            }
+        }
+        writer.write(bc_key, row.data());
+    }
+    *nrecords = writer.nrecords;
+    writer.close();
+}
+
+/**
+ * Each thread merging a range opens every input file (plus its output), so
+ * limit threads to what the open file limit allows. Raises the soft limit 
+ * to the hard limit first if needed.
+ */
+int max_merge_threads(int nfiles, int nthreads){
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY){
+        return nthreads;
+    }
+    rlim_t needed = (rlim_t)nthreads * (rlim_t)(nfiles + 1) + MERGE_RESERVED_FDS;
+    if (rl.rlim_cur < needed && rl.rlim_cur < rl.rlim_max){
+        rl.rlim_cur = needed < rl.rlim_max ? needed : rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0){
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+    if (rl.rlim_cur >= needed){
+        return nthreads;
+    }
+    long avail = (long)rl.rlim_cur - MERGE_RESERVED_FDS;
+    int maxthreads = avail > 0 ? (int)(avail / (nfiles + 1)) : 1;
+    if (maxthreads < 1){
+        maxthreads = 1;
+    }
+    fprintf(stderr, "NOTE: merging with %d threads rather than %d, since each thread opens \
+all %d files (open file limit %ld)\n", maxthreads, nthreads, nfiles, (long)rl.rlim_cur);
+    return maxthreads;
+}
+
+/**
+ * Merge sorted binary count files into one. With multiple threads, the
+ * barcode key space is split into ranges holding about the same numbers
+ * of barcodes (in the largest file), each range is merged into its own
+ * temporary file, and these are then joined in order.
+ */
+void merge_counts(vector<string>& infiles, int num_species, int nthreads,
+    string& outfilename){
+    
+    if (nthreads > 1){
+        nthreads = max_merge_threads(infiles.size(), nthreads);
+    }
+    
+    // Choose range boundaries
+    vector<unsigned long> bounds;
+    if (nthreads > 1){
+        int largest = 0;
+        uint64_t largest_n = 0;
+        for (int i = 0; i < infiles.size(); ++i){
+            species_counts_reader reader;
+            reader.open(infiles[i]);
+            if (reader.nrecords > largest_n){
+                largest = i;
+                largest_n = reader.nrecords;
+            }
+        }
+        species_counts_reader reader;
+        reader.open(infiles[largest]);
+        for (int i = 1; i < nthreads; ++i){
+            uint64_t rec = (largest_n * i) / nthreads;
+            if (rec == 0 || rec >= largest_n){
+                continue;
+            }
+            unsigned long key = reader.key_at(rec);
+            if (bounds.size() == 0 || key > bounds[bounds.size()-1]){
+                bounds.push_back(key);
+            }
+        }
+    }
+    if (bounds.size() == 0){
+        uint64_t n;
+        merge_range(infiles, 0, 0, true, num_species, outfilename, &n);
+        return;
+    }
+    
+    int nranges = bounds.size() + 1;
+    vector<string> parts;
+    vector<uint64_t> nrecords(nranges);
+    vector<thread> threads;
+    for (int i = 0; i < nranges; ++i){
+        char buf[50];
+        sprintf(&buf[0], ".part%d", i);
+        parts.push_back(outfilename + buf);
+        unsigned long lo = i == 0 ? 0 : bounds[i-1];
+        unsigned long hi = i == nranges-1 ? 0 : bounds[i];
+        threads.push_back(thread(merge_range, ref(infiles), lo, hi, i == nranges-1,
+            num_species, parts[i], &nrecords[i]));
+    }
+    for (int i = 0; i < threads.size(); ++i){
+        threads[i].join();
+    }
+    
+    // Join parts: keep the first header (with the total number of records),
+    // then copy the records of every part.
+    uint64_t total = 0;
+    for (int i = 0; i < nranges; ++i){
+        total += nrecords[i];
+    }
+    FILE* outf = fopen(outfilename.c_str(), "wb");
+    if (outf == NULL){
+        fprintf(stderr, "ERROR opening %s for writing.\n", outfilename.c_str());
+        exit(1);
+    }
+    vector<char> buf(1048576);
+    for (int i = 0; i < nranges; ++i){
+        FILE* inf = fopen(parts[i].c_str(), "rb");
+        if (inf == NULL){
+            fprintf(stderr, "ERROR opening %s for reading.\n", parts[i].c_str());
+            exit(1);
+        }
+        species_counts_header h;
+        if (fread(&h, sizeof(h), 1, inf) != 1){
+            fprintf(stderr, "ERROR: %s is truncated or corrupted\n", parts[i].c_str());
+            exit(1);
+        }
+        if (i == 0){
+            h.nrecords = total;
+            if (fwrite(&h, sizeof(h), 1, outf) != 1){
+                fprintf(stderr, "ERROR writing to %s\n", outfilename.c_str());
+                exit(1);
+            }
+        }
+        size_t nread;
+        while ((nread = fread(buf.data(), 1, buf.size(), inf)) > 0){
+            if (fwrite(buf.data(), 1, nread, outf) != nread){
+                fprintf(stderr, "ERROR writing to %s\n", outfilename.c_str());
+                exit(1);
+            }
+        }
+        fclose(inf);
+        remove(parts[i].c_str());
+    }
+    if (fclose(outf) != 0){
+        fprintf(stderr, "ERROR writing to %s\n", outfilename.c_str());
+        exit(1);
+    }
+}
+
 int main(int argc, char *argv[]) {    
     
     // Define long-form program options 
     static struct option long_options[] = {
        {"output_directory", required_argument, 0, 'o'},
        {"num_chunks", required_argument, 0, 'n'},
+       {"num_threads", required_argument, 0, 'T'},
+       {"text", no_argument, 0, 't'},
        {0, 0, 0, 0} 
     };
     
     // Set default values
     string outdir = "";
     int nchunks = -1;
+    int nthreads = 1;
+    bool text = false;
 
     int option_index = 0;
     int ch;
@@ -137,7 +333,7 @@ int main(int argc, char *argv[]) {
     if (argc == 1){
         help(0);
     }
-    while((ch = getopt_long(argc, argv, "o:n:h", 
+    while((ch = getopt_long(argc, argv, "o:n:T:th", 
         long_options, &option_index )) != -1){
         switch(ch){
             case 0:
@@ -152,6 +348,12 @@ int main(int argc, char *argv[]) {
             case 'n':
                 nchunks = atoi(optarg);
                 break;
+            case 'T':
+                nthreads = atoi(optarg);
+                break;
+            case 't':
+                text = true;
+                break;
             default:
                 help(0);
                 break;
@@ -173,9 +375,11 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "ERROR: --num_chunks/-n must be positive.\n");
         exit(1);
     }
+    if (nthreads <= 0){
+        fprintf(stderr, "ERROR: --num_threads/-T must be positive.\n");
+        exit(1);
+    }
 
-    robin_hood::unordered_map<unsigned long, map<short, int> > bc_species_counts;
-    
     // Multiome data uses different ATAC and RNA-seq barcodes
     // This maps an RNA-seq barcode (which goes into the BAM) to an ATAC-seq barcode
     robin_hood::unordered_map<unsigned long, unsigned long> bc_conversion;
@@ -186,18 +390,28 @@ int main(int argc, char *argv[]) {
 
     char buf[50];
     
-    string counts_out = outdir + "species_counts.txt";
+    string counts_out = outdir + "species_counts.bin";
     string species_out = outdir + "species_names.txt";
     string conv_out = outdir + "bcmap.txt";
     
     vector<string> rm;
+    // Sorted binary counts from each batch
+    vector<string> countsfiles;
     
     for (int idx = 1; idx <= nchunks; ++idx){
         sprintf(&buf[0], "%d", idx);
         string bufstr = buf;
-        string countsfilename = outdir + "species_counts." + bufstr + ".txt";
+        // demux_species writes binary counts in batch mode; text counts
+        // are from older runs
+        string countsfilename = outdir + "species_counts." + bufstr + ".bin";
+        string countsfilename_txt = outdir + "species_counts." + bufstr + ".txt";
         string speciesfilename = outdir + "species_names." + bufstr + ".txt";
         string convfilename = outdir + "bcmap." + bufstr + ".txt";
+        bool text_counts = false;
+        if (!file_exists(countsfilename) && file_exists(countsfilename_txt)){
+            text_counts = true;
+            countsfilename = countsfilename_txt;
+        }
         if (file_exists(countsfilename)){
             if (file_exists(speciesfilename)){
                 // demux_species is designed to dump species names only after species counts.
@@ -205,9 +419,29 @@ int main(int argc, char *argv[]) {
                 // implies a small chunk with no counts found.
                 bool ok1 = load_species(speciesfilename, species_names);
                 if (ok1){
-                    bool ok2 = load_counts(countsfilename, bc_species_counts);
                     rm.push_back(countsfilename);
                     rm.push_back(speciesfilename);
+                    if (text_counts){
+                        // Sort into a temporary binary file, so it can be merged
+                        // with the others
+                        robin_hood::unordered_map<unsigned long, map<short, int> > 
+                            bc_species_counts;
+                        load_counts(countsfilename, bc_species_counts);
+                        countsfilename = outdir + "species_counts." + bufstr + ".tmp.bin";
+                        write_species_counts_bin(countsfilename, bc_species_counts,
+                            species_names.size());
+                        rm.push_back(countsfilename);
+                    }
+                    else{
+                        species_counts_reader reader;
+                        reader.open(countsfilename);
+                        if (reader.num_species != species_names.size()){
+                            fprintf(stderr, "ERROR: %s has counts for %d species, but %ld \
+species are named.\n", countsfilename.c_str(), reader.num_species, species_names.size());
+                            exit(1);
+                        }
+                    }
+                    countsfiles.push_back(countsfilename);
                     if (file_exists(convfilename)){
                         bool ok = load_conversion(convfilename, bc_conversion);                
                         if (!ok){
@@ -255,17 +489,30 @@ on this batch.\n");
     }
     fclose(outf_s);
     
-    FILE* outf_c = fopen(counts_out.c_str(), "w");
-    for (robin_hood::unordered_map<unsigned long, map<short, int> >::iterator bsc = 
-        bc_species_counts.begin(); bsc != bc_species_counts.end(); ++bsc){
-        string bc_str = bc2str(bsc->first);
-        fprintf(outf_c, "%s", bc_str.c_str());
-        for (map<short, int>::iterator m = bsc->second.begin(); m != bsc->second.end(); ++m){
-            fprintf(outf_c, "\t%d", m->second);
+    merge_counts(countsfiles, species_names.size(), nthreads, counts_out);
+    
+    if (text){
+        // Convert the (sorted) merged counts to a table
+        string counts_out_txt = outdir + "species_counts.txt";
+        FILE* outf_c = fopen(counts_out_txt.c_str(), "w");
+        species_counts_reader reader;
+        reader.open(counts_out);
+        while (reader.next()){
+            string bc_str = bc2str(reader.bc_key);
+            fprintf(outf_c, "%s", bc_str.c_str());
+            for (int i = 0; i < reader.num_species; ++i){
+                fprintf(outf_c, "\t%d", reader.counts[i]);
+            }
+            fprintf(outf_c, "\n");
         }
-        fprintf(outf_c, "\n");
+        fclose(outf_c);
+        reader.close();
+        rm.push_back(counts_out);
+    }
+    else{
+        // demux_species loads text counts first if present
+        rm.push_back(outdir + "species_counts.txt");
     }
-    fclose(outf_c);
 
     if (has_conversion){
         FILE* outf = fopen(conv_out.c_str(), "w");
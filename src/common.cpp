@@ -402,6 +402,47 @@ string filename_nopath(string& filename){
     }
 }
 
+/**
+ * Convert the text of a cell barcode tag to its 2-bit packed key, without
+ * going through std::string. Stops at the first '-' or NUL. Each thread 
+ * keeps a copy of the last barcode it decoded; if the next one is the same
+ * (common in barcode-sorted or UMI-collapsed BAMs), the cached key is 
+ * returned without decoding again.
+ */
+bool cb2ul(const char* cb, unsigned long& key){
+    static thread_local char last_cb[BC_LENX2/2 + 1];
+    static thread_local int last_len = -1;
+    static thread_local unsigned long last_key = 0;
+    static thread_local bool last_success = false;
+
+    int len = 0;
+    while (cb[len] != '\0' && cb[len] != '-'){
+        ++len;
+    }
+    if (len == last_len && memcmp(cb, last_cb, len) == 0){
+        key = last_key;
+        return last_success;
+    }
+    bc as_bitset;
+    bool success;
+    if (len > BC_LENX2/2){
+        // Too long to fit in a key; let str2bc decide what to do with it.
+        string cb_str(cb, len);
+        success = str2bc(cb_str.c_str(), as_bitset);
+        key = as_bitset.to_ulong();
+        return success;
+    }
+    memcpy(last_cb, cb, len);
+    last_cb[len] = '\0';
+    success = str2bc(last_cb, as_bitset);
+    key = as_bitset.to_ulong();
+    
+    last_len = len;
+    last_key = key;
+    last_success = success;
+    return success;
+}
+
 /**
  * Log PDF of binomial distribution wrt n, k, p
  */
@@ -512,70 +553,146 @@ void derivative(map<double, double>& dat, map<double, double>& datp, int smooth)
 }
 
 /**
- * Given a histogram, finds the "knee" point, defined as the
- * point of maximum curvature. Returns the x-coordinate of
- * the maximum curvature point.
+ * Smooths values in place by averaging each with its neighbors up to
+ * smooth-1 positions away on each side (sum of the window, divided by the
+ * number of neighbors, as derivative() has always done).
  */
-double find_knee(map<double, double>& x, double min_frac_to_allow){
-    int smooth = 3;
-
-    map<double, double> xprime1;
-    derivative(x, xprime1, smooth);
-    map<double, double> xprime2;
-    derivative(xprime1, xprime2, smooth);
-
-    double maxk = -1;
-    double maxk_x = -1;
-    
-    vector<double> keys;
-    vector<double> curv;
-
-    for (map<double, double>::iterator xp = xprime1.begin(); xp != 
-        xprime1.end(); ++xp){
-        
-        // Compute curvature at this point 
-        double xk = abs(xprime2[xp->first]) / 
-            pow(1 + pow(xp->second, 2), 1.5);
-        keys.push_back(xp->first);
-        curv.push_back(xk);    
-    }
-
-    // How many total cells?
-    double tot_dat = x.begin()->second;
-
-    // Do smoothing
-    vector<double> smoothed;
-    for (int i = 0; i < keys.size(); ++i){
-        smoothed.push_back(curv[i]);
+static void smooth_flat(vector<double>& vals, int smooth){
+    vector<double> sums(vals.size());
+    for (int i = 0; i < vals.size(); ++i){
+        sums[i] = vals[i];
         int jlim_low = i-smooth+1;
         if (jlim_low < 0){
             jlim_low = 0;
         }
         int jlim_high = i+smooth-1;
-        if (jlim_high > keys.size()-1){
-            jlim_high = keys.size()-1;
+        if (jlim_high > (int)vals.size()-1){
+            jlim_high = (int)vals.size()-1;
         }
         int count = 0;
-        for (int j = i -1 ; j >= jlim_low; --j){
-            smoothed[i] += curv[j];
+        for (int j = i-1; j >= jlim_low; --j){
+            sums[i] += vals[j];
             count++;
         }
-        for (int j = i + 1; j <= jlim_high; ++j){
-            smoothed[i] += curv[j];
+        for (int j = i+1; j <= jlim_high; ++j){
+            sums[i] += vals[j];
             count++;
         }
-        smoothed[i] /= (double)count;
-        if (x[keys[i]] >= min_frac_to_allow*tot_dat){
-            if (maxk_x == -1 || smoothed[i] > maxk){
-                maxk = smoothed[i];
-                maxk_x = keys[i];
-            }
+        sums[i] /= (double)count;
+    }
+    vals.swap(sums);
+}
+
+/**
+ * Same as derivative(), on points stored in parallel arrays sorted by x.
+ * Each point gets the mean slope of the (up to two) intervals it bounds.
+ */
+static void derivative_flat(const vector<double>& x, const vector<double>& y,
+    vector<double>& yprime, int smooth){
+    yprime.clear();
+    if (x.size() < 2){
+        return;
+    }
+    yprime.resize(x.size());
+    for (int i = 0; i < x.size()-1; ++i){
+        double slope = (y[i+1]-y[i])/(x[i+1]-x[i]);
+        if (i == 0){
+            yprime[i] = slope;
+        }
+        else{
+            yprime[i] = 0.5*yprime[i] + 0.5*slope;
         }
+        yprime[i+1] = slope;
     }
+    if (smooth > 0){
+        smooth_flat(yprime, smooth);
+    }
+}
 
+/**
+ * Given a curve stored as parallel arrays sorted by x, finds the "knee" 
+ * point, defined as the point of maximum curvature. Only points where y 
+ * is at least min_frac_to_allow times the first y value are considered.
+ * Returns the x-coordinate of the maximum curvature point, or -1 if 
+ * there are fewer than two points.
+ */
+double find_knee(const vector<double>& x, const vector<double>& y, 
+    double min_frac_to_allow){
+    int smooth = 3;
+    
+    vector<double> xprime1;
+    derivative_flat(x, y, xprime1, smooth);
+    vector<double> xprime2;
+    derivative_flat(x, xprime1, xprime2, smooth);
+    
+    if (xprime1.size() == 0){
+        return -1;
+    }
+
+    // Compute curvature at each point
+    vector<double> curv(x.size());
+    for (int i = 0; i < x.size(); ++i){
+        curv[i] = abs(xprime2[i]) / pow(1 + pow(xprime1[i], 2), 1.5);
+    }
+    smooth_flat(curv, smooth);
+
+    // How many total cells?
+    double tot_dat = y[0];
+
+    double maxk = -1;
+    double maxk_x = -1;
+    for (int i = 0; i < x.size(); ++i){
+        if (y[i] >= min_frac_to_allow*tot_dat){
+            if (maxk_x == -1 || curv[i] > maxk){
+                maxk = curv[i];
+                maxk_x = x[i];
+            }
+        }
+    }
     return maxk_x;
 }
 
+/**
+ * Given a histogram, finds the "knee" point, defined as the
+ * point of maximum curvature. Returns the x-coordinate of
+ * the maximum curvature point.
+ */
+double find_knee(map<double, double>& x, double min_frac_to_allow){
+    vector<double> keys;
+    vector<double> vals;
+    keys.reserve(x.size());
+    vals.reserve(x.size());
+    for (map<double, double>::iterator xi = x.begin(); xi != x.end(); ++xi){
+        keys.push_back(xi->first);
+        vals.push_back(xi->second);
+    }
+    return find_knee(keys, vals, min_frac_to_allow);
+}
+
+/**
+ * Given one total (i.e. count per cell barcode, or coverage per site)
+ * per item, finds the knee in the survival curve: the number of items
+ * with a total at least as high as each distinct total. Items with totals
+ * at or above the returned value pass a filter set at the knee.
+ *
+ * Sorts totals once and works on flat arrays, so the cost does not
+ * depend on the size of the totals themselves. Reorders totals.
+ */
+double find_knee_totals(vector<double>& totals, double min_frac_to_allow){
+    sort(totals.begin(), totals.end());
+    vector<double> x;
+    vector<double> y;
+    for (int i = 0; i < totals.size(); ++i){
+        if (i == 0 || totals[i] != totals[i-1]){
+            // All totals from this one on would survive a filter
+            // set at this value.
+            x.push_back(totals[i]);
+            y.push_back((double)(totals.size()-i));
+        }
+    }
+    return find_knee(x, y, min_frac_to_allow);
+}
+
 
 
 /**
@@ -56,6 +56,12 @@ int collapse_llrs(std::map<int, std::map<int, double> >& llrs, double& llr_final
 // doublet types in a data set
 double doublet_chisq(std::map<int, int>& idcounts, int n_samples);
 
+// Convert a cell barcode tag (i.e. CB:Z from a BAM record) to the
+// numeric key used by str2bc/bc_ul, ignoring any -1 style suffix. Does not
+// allocate, and remembers the last barcode seen by the calling thread,
+// since reads from the same cell are often adjacent.
+bool cb2ul(const char* cb, unsigned long& key);
+
 // Trim the path off of a file name
 std::string filename_nopath(std::string& filename);
 
@@ -70,6 +76,12 @@ void derivative(std::map<double, double>& hist, std::map<double, double>& result
 
 // Find inflection point in a histogram
 double find_knee(std::map<double, double>& hist, double min_frac_to_allow);
+double find_knee(const std::vector<double>& x, const std::vector<double>& y,
+    double min_frac_to_allow);
+
+// Find inflection point in the survival curve of a set of per-item 
+// totals (number of items with at least each total)
+double find_knee_totals(std::vector<double>& totals, double min_frac_to_allow);
 
 void fit_dirichlet(std::vector<double>& mle_fracs,
     std::vector<std::vector<double> >& dirichlet_bootstraps,
@@ -12,18 +12,22 @@
 #include <sstream>
 #include <sys/stat.h>
 #include <map>
+#include <deque>
 #include <unordered_map>
 #include <set>
 #include <cstdlib>
 #include <utility>
 #include <math.h>
 #include <random>
+#include <thread>
 #include <htslib/sam.h>
 #include <htslib/vcf.h>
 #include <zlib.h>
 #include <htswrapper/bam.h>
 #include <htswrapper/bc.h>
 #include <htswrapper/robin_hood/robin_hood.h>
+#include "common.h"
+#include "species_counts_bin.h"
 
 using std::cout;
 using std::endl;
@@ -52,7 +56,7 @@ void help(int code){
     fprintf(stderr, "       NOTE: this must be for a single library only: i.e. do not merge BAMs from multiple\n");
     fprintf(stderr, "       10X lanes into a single BAM. Run each separately.\n");
     fprintf(stderr, "    --output_directory Will be created if it does not exist. This program will write files\n");
-    fprintf(stderr, "       species_counts.txt and species_names.txt to this directory, which can then be read by\n");
+    fprintf(stderr, "       species_counts.bin and species_names.txt to this directory, which can then be read by\n");
     fprintf(stderr, "       demux_species, passing this argument as the -o option.\n");
     fprintf(stderr, "===== OPTIONAL =====\n");
     fprintf(stderr, "    --separator -s What separator was used when prepending/appending unique species IDs\n");
@@ -61,6 +65,14 @@ void help(int code){
     fprintf(stderr, "       beginnings of chromosome/scaffold names (species ID + separator + sequence name).\n");
     fprintf(stderr, "       With this option set, species IDs are assumed to be appended onto the ends of\n");
     fprintf(stderr, "       chromosome/scaffold names (sequence name + separator + species ID).\n");
+    fprintf(stderr, "    --num_threads -T Count reads on different chromosomes/scaffolds in this many\n");
+    fprintf(stderr, "       threads at once. Requires the BAM to be coordinate-sorted and indexed;\n");
+    fprintf(stderr, "       otherwise, reads are counted in one thread. Default = 1\n");
+    fprintf(stderr, "    --umis -u Count each UMI (UB tag) once per cell barcode, as demux_species does\n");
+    fprintf(stderr, "       when counting k-mers, rather than counting every read. Each UMI is counted\n");
+    fprintf(stderr, "       for the species most of its reads map to. Reads without a UMI are skipped.\n");
+    fprintf(stderr, "    --text -t Write counts as a text table (species_counts.txt) rather than in\n");
+    fprintf(stderr, "       binary (species_counts.bin), which demux_species loads faster.\n");
     //print_libname_help();
     fprintf(stderr, "    --help -h Display this message and exit.\n");
     exit(code);
@@ -122,6 +134,238 @@ bool parse_tid2species(map<int, int>& tid2species,
     return false;
 }
 
+// Species counts per cell barcode, private to one thread. Each barcode
+// maps to a row of num_species counts in one flat array.
+struct bc_count_tab{
+    robin_hood::unordered_map<unsigned long, int> rows;
+    vector<int> counts;
+    int num_species;
+    bc_count_tab(int ns){
+        num_species = ns;
+    }
+    // Pointer to the row of counts for a barcode (only valid until the 
+    // next call, since adding rows can move the array)
+    int* get(unsigned long bc_key){
+        robin_hood::unordered_map<unsigned long, int>::iterator r = rows.find(bc_key);
+        int row;
+        if (r == rows.end()){
+            row = rows.size();
+            rows.emplace(bc_key, row);
+            counts.resize(counts.size() + num_species, 0);
+        }
+        else{
+            row = r->second;
+        }
+        return counts.data() + (size_t)row * num_species;
+    }
+};
+
+// A (cell barcode, UMI) pair that has been counted
+struct bc_umi{
+    unsigned long bc;
+    uint64_t umi;
+    bool operator==(const bc_umi& other) const{
+        return bc == other.bc && umi == other.umi;
+    }
+};
+
+struct bc_umi_hash{
+    size_t operator()(const bc_umi& k) const{
+        return (size_t)(((uint64_t)k.bc * 0x9E3779B97F4A7C15ULL) ^ 
+            (k.umi * 0xC2B2AE3D27D4EB4FULL));
+    }
+};
+
+// Reads with a (cell barcode, UMI) mapped to one species
+struct bc_umi_species{
+    unsigned long bc;
+    uint64_t umi;
+    int species;
+    bool operator==(const bc_umi_species& other) const{
+        return bc == other.bc && umi == other.umi && species == other.species;
+    }
+};
+
+struct bc_umi_species_hash{
+    size_t operator()(const bc_umi_species& k) const{
+        return (size_t)(((uint64_t)k.bc * 0x9E3779B97F4A7C15ULL) ^ 
+            (k.umi * 0xC2B2AE3D27D4EB4FULL) ^ ((uint64_t)k.species * 0x165667B19E3779F9ULL));
+    }
+};
+
+// Number of reads for each (cell barcode, UMI, species)
+typedef robin_hood::unordered_map<bc_umi_species, int, bc_umi_species_hash> umi_read_tab;
+
+/**
+ * Pack a UMI into 64 bits: 2 bits per base, with the length in the top 
+ * byte. UMIs that are too long or contain non-ACGT characters are hashed
+ * instead (with the top bit set, so they never collide with packed UMIs).
+ */
+uint64_t umi_key(const char* umi){
+    uint64_t key = 0;
+    int len = 0;
+    for (const char* c = umi; *c != '\0'; ++c, ++len){
+        uint64_t base;
+        switch(*c){
+            case 'A':
+                base = 0;
+                break;
+            case 'C':
+                base = 1;
+                break;
+            case 'G':
+                base = 2;
+                break;
+            case 'T':
+                base = 3;
+                break;
+            default:
+                base = 4;
+                break;
+        }
+        if (base > 3 || len >= 28){
+            // FNV-1a
+            uint64_t h = 14695981039346656037ULL;
+            for (const char* d = umi; *d != '\0'; ++d){
+                h = (h ^ (unsigned char)*d) * 1099511628211ULL;
+            }
+            return h | (1ULL << 63);
+        }
+        key = (key << 2) | base;
+    }
+    return key | ((uint64_t)len << 56);
+}
+
+/**
+ * Count reads per cell barcode and species. If tids is empty, reads the 
+ * whole BAM in order; otherwise, only reads mapped to the given sequences,
+ * using the BAM index. If umi_reads is given, reads are instead counted 
+ * there per (cell barcode, UMI, species), to be collapsed once all reads
+ * have been seen (see count_umis()).
+ */
+void count_bam(const string& bamfile, const vector<int>& tids, 
+    const vector<int>& tid2species, umi_read_tab* umi_reads, bc_count_tab* tab, 
+    long* nreads, bool progress){
+    
+    samFile* fp = sam_open(bamfile.c_str(), "r");
+    if (fp == NULL){
+        fprintf(stderr, "ERROR opening %s\n", bamfile.c_str());
+        exit(1);
+    }
+    sam_hdr_t* hdr = sam_hdr_read(fp);
+    hts_idx_t* idx = NULL;
+    if (tids.size() > 0){
+        idx = sam_index_load(fp, bamfile.c_str());
+        if (idx == NULL){
+            fprintf(stderr, "ERROR loading index for %s\n", bamfile.c_str());
+            exit(1);
+        }
+    }
+    bam1_t* b = bam_init1();
+    long n = 0;
+    
+    // Print progress message every n reads
+    long int progress_every = 50000;
+
+    int ti = 0;
+    hts_itr_t* itr = NULL;
+    while (true){
+        int ret;
+        if (tids.size() > 0){
+            if (itr == NULL){
+                if (ti >= tids.size()){
+                    break;
+                }
+                itr = sam_itr_queryi(idx, tids[ti], 0, HTS_POS_MAX);
+                ++ti;
+                if (itr == NULL){
+                    continue;
+                }
+            }
+            ret = sam_itr_next(fp, itr, b);
+            if (ret < 0){
+                hts_itr_destroy(itr);
+                itr = NULL;
+                continue;
+            }
+        }
+        else{
+            ret = sam_read1(fp, hdr, b);
+            if (ret < 0){
+                break;
+            }
+        }
+        ++n;
+        if (progress && n % progress_every == 0){
+            fprintf(stderr, "Processed %ld reads\r", n);
+        }
+        if (b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FDUP)){
+            continue;
+        }
+        int tid = b->core.tid;
+        if (tid < 0 || tid >= tid2species.size() || tid2species[tid] < 0){
+            continue;
+        }
+        uint8_t* cb = bam_aux_get(b, "CB");
+        if (cb == NULL){
+            continue;
+        }
+        unsigned long bc_key;
+        cb2ul(bam_aux2Z(cb), bc_key);
+        if (umi_reads != NULL){
+            uint8_t* ub = bam_aux_get(b, "UB");
+            if (ub == NULL){
+                continue;
+            }
+            bc_umi_species k;
+            k.bc = bc_key;
+            k.umi = umi_key(bam_aux2Z(ub));
+            k.species = tid2species[tid];
+            (*umi_reads)[k]++;
+        }
+        else{
+            tab->get(bc_key)[tid2species[tid]]++;
+        }
+    }
+    bam_destroy1(b);
+    if (idx != NULL){
+        hts_idx_destroy(idx);
+    }
+    sam_hdr_destroy(hdr);
+    sam_close(fp);
+    *nreads = n;
+}
+
+/**
+ * Count each (cell barcode, UMI) once, for the species most of its reads
+ * mapped to (the lowest species index in case of a tie). This does not
+ * depend on the order reads were seen in, so counts are the same no matter
+ * how sequences were split across threads.
+ */
+void count_umis(umi_read_tab& umi_reads, bc_count_tab& tab){
+    // Best species and its number of reads for each (cell barcode, UMI)
+    robin_hood::unordered_map<bc_umi, pair<int, int>, bc_umi_hash> best;
+    best.reserve(umi_reads.size());
+    for (umi_read_tab::iterator u = umi_reads.begin(); u != umi_reads.end(); ++u){
+        bc_umi k;
+        k.bc = u->first.bc;
+        k.umi = u->first.umi;
+        robin_hood::unordered_map<bc_umi, pair<int, int>, bc_umi_hash>::iterator b = 
+            best.find(k);
+        if (b == best.end()){
+            best.emplace(k, make_pair(u->first.species, u->second));
+        }
+        else if (u->second > b->second.second || (u->second == b->second.second &&
+            u->first.species < b->second.first)){
+            b->second = make_pair(u->first.species, u->second);
+        }
+    }
+    for (robin_hood::unordered_map<bc_umi, pair<int, int>, bc_umi_hash>::iterator b = 
+        best.begin(); b != best.end(); ++b){
+        tab.get(b->first.bc)[b->second.first]++;
+    }
+}
+
 int main(int argc, char *argv[]) {    
    
     static struct option long_options[] = {
@@ -129,6 +373,9 @@ int main(int argc, char *argv[]) {
        {"output_directory", required_argument, 0, 'o'},
        {"separator", required_argument, 0, 's'},
        {"end", no_argument, 0, 'e'},
+       {"num_threads", required_argument, 0, 'T'},
+       {"umis", no_argument, 0, 'u'},
+       {"text", no_argument, 0, 't'},
        //{"libname", required_argument, 0, 'n'},
        //{"cellranger", no_argument, 0, 'C'},
        //{"seurat", no_argument, 0, 'S'},
@@ -141,6 +388,9 @@ int main(int argc, char *argv[]) {
     string output_prefix = "";
     string separator = "_";
     bool suffix = false;
+    int num_threads = 1;
+    bool umis = false;
+    bool text = false;
 
     string libname = "";
     bool cellranger = false;
@@ -153,7 +403,7 @@ int main(int argc, char *argv[]) {
     if (argc == 1){
         help(0);
     }
-    while((ch = getopt_long(argc, argv, "b:o:s:n:eCSUh", long_options, &option_index )) != -1){
+    while((ch = getopt_long(argc, argv, "b:o:s:n:T:eutCSUh", long_options, &option_index )) != -1){
         switch(ch){
             case 0:
                 // This option set a flag. No need to do anything here.
@@ -173,6 +423,15 @@ int main(int argc, char *argv[]) {
             case 'e':
                 suffix = true;
                 break;
+            case 'T':
+                num_threads = atoi(optarg);
+                break;
+            case 'u':
+                umis = true;
+                break;
+            case 't':
+                text = true;
+                break;
             case 'n':
                 libname = optarg;
                 break;
@@ -196,6 +455,10 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "ERROR: --output_directory/-o required\n");
         exit(1);
     }
+    if (num_threads < 1){
+        fprintf(stderr, "ERROR: --num_threads/-T must be positive\n");
+        exit(1);
+    }
 
     // Init BAM reader
     bam_reader reader = bam_reader();
@@ -206,9 +469,6 @@ int main(int argc, char *argv[]) {
     }    
     reader.set_file(bamfile);
 
-    // Print progress message every n sites
-    long int progress = 50000;
-
     // retrieve cell barcodes
     reader.set_cb();
     
@@ -225,39 +485,116 @@ int main(int argc, char *argv[]) {
 and/or --suffix/-S?\n");
         exit(1);
     }
+    // Species of each TID (-1 = none), for lookup per read
+    vector<int> tid2species_vec(chrom2tid.size(), -1);
+    for (map<int, int>::iterator ts = tid2species.begin(); ts != tid2species.end(); ++ts){
+        if (ts->first >= 0 && ts->first < tid2species_vec.size()){
+            tid2species_vec[ts->first] = ts->second;
+        }
+    }
+    
+    // Reading sequences in parallel requires an index
+    if (num_threads > 1){
+        samFile* fp = sam_open(bamfile.c_str(), "r");
+        hts_idx_t* idx = fp == NULL ? NULL : sam_index_load(fp, bamfile.c_str());
+        if (idx == NULL){
+            fprintf(stderr, "NOTE: no index found for %s; counting reads in one thread\n",
+                bamfile.c_str());
+            num_threads = 1;
+        }
+        else{
+            hts_idx_destroy(idx);
+        }
+        if (fp != NULL){
+            sam_close(fp);
+        }
+    }
 
     long int reads_processed = 0;
-
-    robin_hood::unordered_map<unsigned long, map<int, int> > counts;
-
-    // Read through entire BAM file and look for informative SNPs along the way
-    // (default setting, appropriate for large numbers of SNPs).
     
-    while (reader.next()){
+    // Thread-local counts, and reads per UMI if collapsing UMIs
+    deque<bc_count_tab> tabs;
+    deque<umi_read_tab> umi_tabs;
+    
+    if (num_threads > 1){
+        // Split sequences assigned to species into groups of about the same 
+        // total length, one per thread (longest first, each to the group 
+        // with the least so far)
+        samFile* fp = sam_open(bamfile.c_str(), "r");
+        sam_hdr_t* hdr = sam_hdr_read(fp);
+        vector<pair<hts_pos_t, int> > tidlens;
+        for (map<int, int>::iterator ts = tid2species.begin(); ts != tid2species.end(); ++ts){
+            tidlens.push_back(make_pair(sam_hdr_tid2len(hdr, ts->first), ts->first));
+        }
+        sam_hdr_destroy(hdr);
+        sam_close(fp);
+        sort(tidlens.begin(), tidlens.end());
+        reverse(tidlens.begin(), tidlens.end());
         
-        if (reader.has_cb_z && !reader.unmapped() && !reader.secondary() && !reader.dup()){
-            int tid = reader.tid();
-            if (tid2species.count(tid) > 0){
-                int species_idx = tid2species[tid];
-                unsigned long ul = bc_ul(reader.cb_z);
-                if (counts.count(ul) == 0){
-                    map<int, int> m;
-                    counts.emplace(ul, m);
-                }
-                if (counts[ul].count(species_idx) == 0){
-                    counts[ul].insert(make_pair(species_idx, 0));
-                }
-                counts[ul][species_idx]++;
-            }
+        vector<vector<int> > groups(num_threads);
+        vector<hts_pos_t> grouplens(num_threads, 0);
+        for (int i = 0; i < tidlens.size(); ++i){
+            int g = min_element(grouplens.begin(), grouplens.end()) - grouplens.begin();
+            groups[g].push_back(tidlens[i].second);
+            grouplens[g] += tidlens[i].first;
         }
         
-        ++reads_processed;
-        if (reads_processed % progress == 0){
-            fprintf(stderr, "Processed %ld reads\r", reads_processed);
+        vector<long> nreads(num_threads, 0);
+        vector<thread> threads;
+        for (int i = 0; i < num_threads; ++i){
+            tabs.emplace_back(species.size());
+            umi_tabs.emplace_back();
+        }
+        for (int i = 0; i < num_threads; ++i){
+            if (groups[i].size() == 0){
+                continue;
+            }
+            threads.push_back(thread(count_bam, bamfile, groups[i], tid2species_vec, 
+                umis ? &umi_tabs[i] : NULL, &tabs[i], &nreads[i], false));
+        }
+        for (int i = 0; i < threads.size(); ++i){
+            threads[i].join();
         }
+        for (int i = 0; i < num_threads; ++i){
+            reads_processed += nreads[i];
+        }
+    }
+    else{
+        tabs.emplace_back(species.size());
+        umi_tabs.emplace_back();
+        count_bam(bamfile, vector<int>(), tid2species_vec, umis ? &umi_tabs[0] : NULL, 
+            &tabs[0], &reads_processed, true);
     }
     fprintf(stderr, "Processed %ld reads\n", reads_processed);
     
+    if (umis){
+        // Reads from one molecule can map to sequences counted in different
+        // threads, so UMIs are only collapsed once all threads are done
+        for (int i = 1; i < umi_tabs.size(); ++i){
+            for (umi_read_tab::iterator u = umi_tabs[i].begin(); u != umi_tabs[i].end(); ++u){
+                umi_tabs[0][u->first] += u->second;
+            }
+            umi_tabs[i].clear();
+        }
+        count_umis(umi_tabs[0], tabs[0]);
+        umi_tabs[0].clear();
+    }
+    
+    // Add up counts from all threads
+    bc_count_tab& counts = tabs[0];
+    for (int i = 1; i < tabs.size(); ++i){
+        for (robin_hood::unordered_map<unsigned long, int>::iterator r = tabs[i].rows.begin();
+            r != tabs[i].rows.end(); ++r){
+            int* row = counts.get(r->first);
+            int* row_i = tabs[i].counts.data() + (size_t)r->second * species.size();
+            for (int j = 0; j < species.size(); ++j){
+                row[j] += row_i[j];
+            }
+        }
+        tabs[i].rows.clear();
+        tabs[i].counts.clear();
+    }
+    
     // Write output data
     if (output_prefix[output_prefix.length()-1] == '/'){
         output_prefix = output_prefix.substr(0, output_prefix.length()-1);
@@ -267,24 +604,45 @@ and/or --suffix/-S?\n");
         // Assume directory already exists
     }
     
-    string out_counts_name = output_prefix + "/species_counts.txt";
+    string out_counts_name = output_prefix + "/species_counts.bin";
+    string out_counts_name_txt = output_prefix + "/species_counts.txt";
     string out_names_name = output_prefix + "/species_names.txt";
-
-    FILE* out_counts_f = fopen(out_counts_name.c_str(), "w");
-    for (robin_hood::unordered_map<unsigned long, map<int, int> >::iterator c = counts.begin();
-        c != counts.end(); ++c){
-        string bc_str = bc2str(c->first);
-        fprintf(out_counts_f, "%s", bc_str.c_str());
-        for (int i = 0; i < species.size(); ++i){
-            int s_count = 0;
-            if (c->second.count(i) > 0){
-                s_count = c->second[i];
+    
+    // Write barcodes in order
+    vector<unsigned long> bcs;
+    bcs.reserve(counts.rows.size());
+    for (robin_hood::unordered_map<unsigned long, int>::iterator r = counts.rows.begin();
+        r != counts.rows.end(); ++r){
+        bcs.push_back(r->first);
+    }
+    sort(bcs.begin(), bcs.end());
+    
+    if (text){
+        FILE* out_counts_f = fopen(out_counts_name_txt.c_str(), "w");
+        for (int i = 0; i < bcs.size(); ++i){
+            string bc_str = bc2str(bcs[i]);
+            fprintf(out_counts_f, "%s", bc_str.c_str());
+            int* row = counts.counts.data() + (size_t)counts.rows[bcs[i]] * species.size();
+            for (int j = 0; j < species.size(); ++j){
+                fprintf(out_counts_f, "\t%d", row[j]);
             }
-            fprintf(out_counts_f, "\t%d", s_count);
+            fprintf(out_counts_f, "\n");
+        }
+        fclose(out_counts_f);
+        // demux_species would otherwise load counts from an earlier run
+        remove(out_counts_name.c_str());
+    }
+    else{
+        species_counts_writer writer;
+        writer.open(out_counts_name, species.size());
+        for (int i = 0; i < bcs.size(); ++i){
+            writer.write(bcs[i], counts.counts.data() + 
+                (size_t)counts.rows[bcs[i]] * species.size());
         }
-        fprintf(out_counts_f, "\n");
+        writer.close();
+        // demux_species loads text counts first if present
+        remove(out_counts_name_txt.c_str());
     }
-    fclose(out_counts_f);
 
     FILE* out_names_f = fopen(out_names_name.c_str(), "w");
     for (int i = 0; i < species.size(); ++i){
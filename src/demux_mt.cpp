@@ -17,6 +17,10 @@
 #include <utility>
 #include <math.h>
 #include <deque>
+#include <thread>
+#include <atomic>
+#include <limits.h>
+#include <sys/stat.h>
 #include <htslib/hts.h>
 #include <htslib/bgzf.h>
 #include <htslib/sam.h>
@@ -121,6 +125,18 @@ struct hap{
     };
 };
 
+// When reads from multiple libraries are processed together, the same
+// barcode sequence can occur in more than one of them. Barcode keys only 
+// use the lowest BC_LENX2 bits, so store the (0-based) index of the 
+// library above them.
+unsigned long lib_bc_key(unsigned long bc_key, int lib){
+    return bc_key | ((unsigned long)lib << BC_LENX2);
+}
+
+int bc_key_lib(unsigned long key){
+    return (int)(key >> BC_LENX2);
+}
+
 /**
  * Print a help message to the terminal and exit.
  */
@@ -169,6 +185,15 @@ void help(int code){
     fprintf(stderr, "   --doublet_rate -D A decimal between 0 and 1 representing the prior\n");
     fprintf(stderr ,"       probability of a cell being a doublet. Set to 0 to disable doublet\n");
     fprintf(stderr, "       identification altogether. Default = 0.5\n");
+    fprintf(stderr, "   --num_threads -T Number of threads to use when assigning cells to\n");
+    fprintf(stderr, "       haplotypes (default 1)\n");
+    fprintf(stderr, "   --read_cache -R Store reads aligned to the mitochondrial sequence\n");
+    fprintf(stderr, "       in this file, in a compact binary format, and read from it instead\n");
+    fprintf(stderr, "       of the BAM file. If the file already exists (from a previous run on\n");
+    fprintf(stderr, "       the same BAM), it will be used and --bam / -b is not needed. This\n");
+    fprintf(stderr, "       speeds up repeated runs with different parameters. If --bam / -b\n");
+    fprintf(stderr, "       is given and the cache was built from a different BAM file (or\n");
+    fprintf(stderr, "       the BAM file has since changed), the cache is rebuilt.\n");
     fprintf(stderr, "   --help -h Display this message and exit.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "   ===== Run mode 1: Inferring clusters from a BAM file =====\n");
@@ -176,6 +201,12 @@ void help(int code){
     fprintf(stderr, "       then assign cells to the most likely inferred haplotype.\n");
     fprintf(stderr, "   ---------- I/O options ----------\n");
     fprintf(stderr, "   --bam -b The BAM file containing the data to use. (REQUIRED)\n");
+    fprintf(stderr, "       To process several libraries (i.e. GEM wells) jointly, give this\n");
+    fprintf(stderr, "       option once per library. Variants and haplotypes will then be found\n");
+    fprintf(stderr, "       using all libraries together, so cluster IDs are consistent across\n");
+    fprintf(stderr, "       them, and each library must be given its own --libname / -n, in the\n");
+    fprintf(stderr, "       same order as the BAM files. Libraries are read in parallel using\n");
+    fprintf(stderr, "       up to --num_threads threads.\n");
     fprintf(stderr, "   --barcodes_filter -f Distinct from the -B option (above), which limits\n");
     fprintf(stderr, "       which barcodes will be assigned mitochondrial haplotypes. This\n");
     fprintf(stderr, "       option limits which barcodes are used to find variants and cluster\n");
@@ -220,7 +251,10 @@ void help(int code){
     fprintf(stderr, "       of each mitochondrial haplotype within each cell. Rather than seek to infer\n");
     fprintf(stderr, "       the mixing proportions here, we will write the count of informative reads that\n");
     fprintf(stderr, "       could only belong to haplotype 1, as well as that which could only belong to\n");
-    fprintf(stderr, "       haplotype 2. These data will be written to stdout.\n");
+    fprintf(stderr, "       haplotype 2. These data will be written to stdout. Maximum likelihood\n");
+    fprintf(stderr, "       mixing proportions and standard errors for each cell will also be written\n");
+    fprintf(stderr, "       to [output_prefix].props (barcode, haplotype 1, haplotype 2, proportion\n");
+    fprintf(stderr, "       of haplotype 1, standard error), once for each order of the pair.\n");
     fprintf(stderr, "   ---------- I/O Options ----------\n");
     fprintf(stderr, "   --haps -H Cluster haplotypes from a previous run. Should be that\n");
     fprintf(stderr, "       run's [output_prefix].haps. (REQUIRED)\n");
@@ -287,6 +321,17 @@ struct infile_bc_wrapper{
     set<unsigned long>* bcs;
 };
 
+// The pileup engine lines up reads from multiple files by (tid, pos). We 
+// only visit the mitochondrial sequence, but its index can differ between
+// BAM headers, so give every read the same sequence index (0). Mates on 
+// other sequences get index 1, so overlapping mate pairs are still detected.
+static void mito_tid_normalize(bam1_t* b){
+    if (b->core.mtid >= 0){
+        b->core.mtid = (b->core.mtid == b->core.tid ? 0 : 1);
+    }
+    b->core.tid = 0;
+}
+
 // Iterator function for pileup
 static int readaln(void *data, bam1_t *b){
     // Retrieve data in usable format
@@ -298,6 +343,9 @@ static int readaln(void *data, bam1_t *b){
         if ( b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP) ) continue;
         break;
     }
+    if (ret >= 0){
+        mito_tid_normalize(b);
+    }
     return ret;
 }
 
@@ -315,17 +363,9 @@ static int readaln_bcs(void *data, bam1_t *b){
         // try to retrieve cell barcode
         uint8_t* bc_bin = bam_aux_get(b, "CB");
         if (bc_bin != NULL){
-            // Convert to string
             char* bc_char = bam_aux2Z(bc_bin);
-            // Convert to C++ style string
-            string bc_str = bc_char;
-            int dashpos = bc_str.find("-");
-            if (dashpos != string::npos){
-                bc_str = bc_str.substr(0, dashpos);
-            }
-            bc as_bitset;
-            str2bc(bc_str.c_str(), as_bitset);
-            unsigned long as_ulong = as_bitset.to_ulong();
+            unsigned long as_ulong;
+            cb2ul(bc_char, as_ulong);
             if (bc_whitelist->find(as_ulong) == bc_whitelist->end()){
                 // Cell barcode not in whitelist
                 continue;
@@ -337,9 +377,369 @@ static int readaln_bcs(void *data, bam1_t *b){
         }
         break;
     }
+    if (ret >= 0){
+        mito_tid_normalize(b);
+    }
     return ret;
 }
 
+// ===== Mitochondrial read cache =====
+// To speed up repeated runs on the same data, alignments to the mitochondrial
+// sequence can be stored in an uncompressed binary file. Each record holds the
+// cell barcode key (already decoded), the core alignment fields, and the 
+// BAM record's own variable-length data (read name, CIGAR, 4-bit packed bases
+// and base qualities) minus auxiliary tags. Unmapped and secondary alignments
+// (discarded in every pass) are left out; everything else is kept so that
+// filters like --mapq can still be changed on later runs.
+// The file is meant to be re-read on the same machine, so it is written in
+// native byte order.
+// The header holds the mitochondrial sequence name, and the full path, size 
+// and modification time of the BAM file the reads came from, so a cache is
+// rebuilt if it is given along with a different (or changed) BAM file.
+
+#define MITO_CACHE_MAGIC "CBMTRC2"
+// Every version of the cache file starts with this
+#define MITO_CACHE_MAGIC_BASE "CBMTRC"
+
+// Where the reads in a cache file came from
+struct mito_cache_source{
+    string bam;
+    uint64_t size;
+    int64_t mtime;
+};
+
+/**
+ * Describe a BAM file as a read cache source. Returns false if it
+ * can't be accessed.
+ */
+bool get_mito_cache_source(string& bamfile, mito_cache_source& src){
+    struct stat st;
+    if (stat(bamfile.c_str(), &st) != 0){
+        return false;
+    }
+    char fullpath[PATH_MAX+1];
+    if (realpath(bamfile.c_str(), &fullpath[0]) != NULL){
+        src.bam = fullpath;
+    }
+    else{
+        src.bam = bamfile;
+    }
+    src.size = st.st_size;
+    src.mtime = st.st_mtime;
+    return true;
+}
+
+/**
+ * Read a string stored as its length, then its characters
+ */
+static bool read_cache_str(FILE* inf, string& str){
+    uint32_t len;
+    if (fread(&len, sizeof(uint32_t), 1, inf) != 1){
+        return false;
+    }
+    str.resize(len);
+    return len == 0 || fread(&str[0], 1, len, inf) == len;
+}
+
+static void write_cache_str(FILE* outf, const string& str){
+    uint32_t len = str.length();
+    fwrite(&len, sizeof(uint32_t), 1, outf);
+    fwrite(str.c_str(), 1, len, outf);
+}
+
+/**
+ * Check whether an existing read cache file was built from a BAM file,
+ * as it is now. Files that are not read caches at all count as matching,
+ * so they are reported (rather than overwritten) when loaded.
+ */
+bool mito_cache_matches(string& cachefile, string& bamfile){
+    FILE* inf = fopen(cachefile.c_str(), "rb");
+    if (!inf){
+        return true;
+    }
+    char magic[8];
+    if (fread(magic, 1, 8, inf) != 8 || 
+        strncmp(magic, MITO_CACHE_MAGIC_BASE, strlen(MITO_CACHE_MAGIC_BASE)) != 0){
+        fclose(inf);
+        return true;
+    }
+    bool match = false;
+    string name;
+    mito_cache_source cached;
+    mito_cache_source src;
+    if (strncmp(magic, MITO_CACHE_MAGIC, 8) == 0 && read_cache_str(inf, name) &&
+        read_cache_str(inf, cached.bam) && 
+        fread(&cached.size, sizeof(uint64_t), 1, inf) == 1 &&
+        fread(&cached.mtime, sizeof(int64_t), 1, inf) == 1 &&
+        get_mito_cache_source(bamfile, src)){
+        match = cached.bam == src.bam && cached.size == src.size && 
+            cached.mtime == src.mtime;
+    }
+    fclose(inf);
+    return match;
+}
+
+struct mito_cache_rec{
+    uint64_t bc_key;
+    int64_t pos;
+    int64_t mpos;
+    int64_t isize;
+    // 0 = mate on mitochondrial sequence, 1 = elsewhere, -1 = none
+    int32_t mtid;
+    uint32_t n_cigar;
+    int32_t l_qseq;
+    uint32_t l_data;
+    uint16_t flag;
+    uint16_t l_qname;
+    uint8_t mapq;
+    uint8_t l_extranul;
+    uint8_t has_bc;
+    // Whether the barcode was made entirely of valid bases
+    uint8_t bc_valid;
+};
+
+struct mito_read_cache{
+    vector<char> buf;
+    size_t offset;
+    int nreads;
+    mito_read_cache(){
+        offset = 0;
+        nreads = 0;
+    };
+};
+
+/**
+ * Go through all reads on the mitochondrial sequence in a BAM file and store
+ * them in a read cache file.
+ */
+void write_mito_cache(string& bamfile, string& mito_chrom, string& cachefile){
+    FILE* outf = fopen(cachefile.c_str(), "wb");
+    if (!outf){
+        fprintf(stderr, "ERROR: could not open %s for writing\n", cachefile.c_str());
+        exit(1);
+    }
+    mito_cache_source src;
+    if (!get_mito_cache_source(bamfile, src)){
+        fprintf(stderr, "ERROR: could not access %s\n", bamfile.c_str());
+        exit(1);
+    }
+    fwrite(MITO_CACHE_MAGIC, 1, 8, outf);
+    write_cache_str(outf, mito_chrom);
+    write_cache_str(outf, src.bam);
+    fwrite(&src.size, sizeof(uint64_t), 1, outf);
+    fwrite(&src.mtime, sizeof(int64_t), 1, outf);
+
+    infile_t infile(bamfile.c_str(), mito_chrom.c_str());
+    bam1_t* b = bam_init1();
+    int nreads = 0;
+    while (sam_itr_next(infile.fp, infile.itr, b) >= 0){
+        if (b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY)){
+            continue;
+        }
+        mito_cache_rec rec;
+        rec.bc_key = 0;
+        rec.has_bc = 0;
+        rec.bc_valid = 0;
+        uint8_t* bc_bin = bam_aux_get(b, "CB");
+        if (bc_bin != NULL){
+            unsigned long as_ulong;
+            rec.bc_valid = cb2ul(bam_aux2Z(bc_bin), as_ulong);
+            rec.bc_key = as_ulong;
+            rec.has_bc = 1;
+        }
+        rec.pos = b->core.pos;
+        rec.mpos = b->core.mpos;
+        rec.isize = b->core.isize;
+        if (b->core.mtid < 0){
+            rec.mtid = -1;
+        }
+        else if (b->core.mtid == b->core.tid){
+            rec.mtid = 0;
+        }
+        else{
+            rec.mtid = 1;
+        }
+        rec.n_cigar = b->core.n_cigar;
+        rec.l_qseq = b->core.l_qseq;
+        rec.flag = b->core.flag;
+        rec.l_qname = b->core.l_qname;
+        rec.mapq = b->core.qual;
+        rec.l_extranul = b->core.l_extranul;
+        rec.l_data = bam_get_aux(b) - b->data;
+        fwrite(&rec, sizeof(mito_cache_rec), 1, outf);
+        fwrite(b->data, 1, rec.l_data, outf);
+        ++nreads;
+    }
+    bam_destroy1(b);
+    fclose(outf);
+    fprintf(stderr, "Wrote %d reads to %s\n", nreads, cachefile.c_str());
+}
+
+/**
+ * Load an entire read cache file into memory.
+ */
+void load_mito_cache(string& cachefile, string& mito_chrom, mito_read_cache& cache){
+    FILE* inf = fopen(cachefile.c_str(), "rb");
+    if (!inf){
+        fprintf(stderr, "ERROR: could not open %s for reading\n", cachefile.c_str());
+        exit(1);
+    }
+    char magic[8];
+    if (fread(magic, 1, 8, inf) != 8 || 
+        strncmp(magic, MITO_CACHE_MAGIC_BASE, strlen(MITO_CACHE_MAGIC_BASE)) != 0){
+        fprintf(stderr, "ERROR: %s is not a demux_mt read cache file\n", cachefile.c_str());
+        exit(1);
+    }
+    if (strncmp(magic, MITO_CACHE_MAGIC, 8) != 0){
+        fprintf(stderr, "ERROR: read cache %s was written by another version of demux_mt.\n",
+            cachefile.c_str());
+        fprintf(stderr, "Delete it, or re-run with --bam / -b to rebuild it.\n");
+        exit(1);
+    }
+    string name;
+    mito_cache_source src;
+    if (!read_cache_str(inf, name) || !read_cache_str(inf, src.bam) ||
+        fread(&src.size, sizeof(uint64_t), 1, inf) != 1 ||
+        fread(&src.mtime, sizeof(int64_t), 1, inf) != 1){
+        fprintf(stderr, "ERROR: %s is truncated\n", cachefile.c_str());
+        exit(1);
+    }
+    if (name != mito_chrom){
+        fprintf(stderr, "ERROR: read cache %s was built for sequence %s, not %s\n",
+            cachefile.c_str(), name.c_str(), mito_chrom.c_str());
+        exit(1);
+    }
+    long start = ftell(inf);
+    fseek(inf, 0, SEEK_END);
+    long end = ftell(inf);
+    fseek(inf, start, SEEK_SET);
+    cache.buf.resize(end - start);
+    if (cache.buf.size() > 0 && fread(&cache.buf[0], 1, cache.buf.size(), inf) != 
+        cache.buf.size()){
+        fprintf(stderr, "ERROR: could not read %s\n", cachefile.c_str());
+        exit(1);
+    }
+    fclose(inf);
+    cache.offset = 0;
+    cache.nreads = 0;
+    
+    // Validate record boundaries once, so iterating can skip the checks
+    size_t off = 0;
+    while (off < cache.buf.size()){
+        if (off + sizeof(mito_cache_rec) > cache.buf.size()){
+            break;
+        }
+        mito_cache_rec rec;
+        memcpy(&rec, &cache.buf[off], sizeof(mito_cache_rec));
+        off += sizeof(mito_cache_rec) + rec.l_data;
+        cache.nreads++;
+    }
+    if (off != cache.buf.size()){
+        fprintf(stderr, "ERROR: %s is truncated\n", cachefile.c_str());
+        exit(1);
+    }
+    fprintf(stderr, "Loaded %d reads from %s\n", cache.nreads, cachefile.c_str());
+}
+
+/**
+ * Fill in a BAM record with the next read from the cache. Returns false
+ * once all reads have been visited.
+ */
+bool mito_cache_next(mito_read_cache& cache, bam1_t* b, unsigned long& bc_key, 
+    bool& has_bc, bool& bc_valid){
+    if (cache.offset >= cache.buf.size()){
+        return false;
+    }
+    mito_cache_rec rec;
+    memcpy(&rec, &cache.buf[cache.offset], sizeof(mito_cache_rec));
+    cache.offset += sizeof(mito_cache_rec);
+    
+    if (b->m_data < rec.l_data){
+        uint8_t* data_new = (uint8_t*)realloc(b->data, rec.l_data);
+        if (!data_new){
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
+        }
+        b->data = data_new;
+        b->m_data = rec.l_data;
+    }
+    memcpy(b->data, &cache.buf[cache.offset], rec.l_data);
+    cache.offset += rec.l_data;
+    b->l_data = rec.l_data;
+
+    b->core.tid = 0;
+    b->core.pos = rec.pos;
+    b->core.qual = rec.mapq;
+    b->core.l_extranul = rec.l_extranul;
+    b->core.flag = rec.flag;
+    b->core.l_qname = rec.l_qname;
+    b->core.n_cigar = rec.n_cigar;
+    b->core.l_qseq = rec.l_qseq;
+    b->core.mtid = rec.mtid;
+    b->core.mpos = rec.mpos;
+    b->core.isize = rec.isize;
+    b->core.bin = hts_reg2bin(rec.pos, bam_endpos(b), 14, 5);
+    
+    bc_key = rec.bc_key;
+    has_bc = rec.has_bc;
+    bc_valid = rec.bc_valid;
+    return true;
+}
+
+void mito_cache_rewind(mito_read_cache& cache){
+    cache.offset = 0;
+}
+
+/**
+ * Returns the base aligned to a (0-based) reference position in a read,
+ * or N if the read does not cover that position with an aligned base.
+ */
+char mito_cache_base_at(bam1_t* b, hts_pos_t refpos){
+    hts_pos_t ref = b->core.pos;
+    int query = 0;
+    uint32_t* cigar = bam_get_cigar(b);
+    for (int i = 0; i < b->core.n_cigar; ++i){
+        int op = bam_cigar_op(cigar[i]);
+        int len = bam_cigar_oplen(cigar[i]);
+        int type = bam_cigar_type(op);
+        if ((type & 2) && refpos < ref + len){
+            if (type & 1){
+                return seq_nt16_str[bam_seqi(bam_get_seq(b), query + (refpos - ref))];
+            }
+            return 'N';
+        }
+        if (type & 1){
+            query += len;
+        }
+        if (type & 2){
+            ref += len;
+        }
+    }
+    return 'N';
+}
+
+struct mito_cache_wrapper{
+    mito_read_cache* cache;
+    set<unsigned long>* bcs;
+};
+
+// Iterator function for pileup, using reads from cache rather than BAM.
+// Applies the same filters as readaln/readaln_bcs.
+static int readaln_cache(void* data, bam1_t* b){
+    mito_cache_wrapper* wrap = (mito_cache_wrapper*)data;
+    unsigned long bc_key;
+    bool has_bc;
+    bool bc_valid;
+    while (mito_cache_next(*wrap->cache, b, bc_key, has_bc, bc_valid)){
+        if ( b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP) ) continue;
+        if (wrap->bcs != NULL && (!has_bc || wrap->bcs->find(bc_key) == wrap->bcs->end())){
+            continue;
+        }
+        return 0;
+    }
+    return -1;
+}
+
 
 /**
  * Given a list of numbers representing sizes of clusters, finds the optimal way
@@ -729,398 +1129,244 @@ void process_var_counts(robin_hood::unordered_map<unsigned long, var_counts>& ha
 }
 
 /**
- * Assign barcodes of cells to a mitochondrial haplotype.
+ * Cell-independent information needed to assign cells to haplotypes,
+ * computed once per set of haplotypes and shared by all threads.
+ *
+ * Every candidate identity (singlet or doublet combination) is described
+ * by bitsets over sites: which sites it covers, and where it is expected
+ * to carry 50% or 100% minor allele (all other covered sites are expected
+ * to carry 0% minor allele).
+ *
+ * For every pair of identities, the sites at which the pair is compared
+ * are also stored. A pair is compared at any site where both identities
+ * are covered and expectations differ. It is additionally compared (and
+ * contributes an LLR of zero) at sites where the first identity's expected
+ * fraction has already been compared to, and differed from, an earlier
+ * identity at the same site: this reproduces the behavior of the original
+ * per-cell loop, which rewrote 0 and 1 in place to the "zero" and "one"
+ * probabilities after the first mismatch.
  */
-void assign_bcs(robin_hood::unordered_map<unsigned long, var_counts>& hap_counter, 
-    robin_hood::unordered_map<unsigned long, int>& assignments,
-    robin_hood::unordered_map<unsigned long, double>& assignments_llr,
-    vector<hap>& haps_final, 
-    hapstr& mask_global,
-    int nvars,
-    double doublet_rate,
-    bool use_filter,
-    robin_hood::unordered_set<unsigned long>& cell_filter,
-    double one){
-
-    double zero = 1.0-one;
-    
-
-    int progress = 1000;
-    int n_assigned = 0;
-
-    for (robin_hood::unordered_map<unsigned long, var_counts>::iterator hc = 
-        hap_counter.begin(); hc != hap_counter.end(); ++hc){
-        
-        if (use_filter && cell_filter.find(hc->first) == cell_filter.end()){
-            continue;
-        }
-        /*
-        llr_table lltab(haps_final.size());
-        map<pair<int, int>, double> llrs;
-        // Compute each singlet LL
-        for (int i = 0; i < haps_final.size()-1; ++i){
-            for (int j = i + 1; j < haps_final.size(); ++j){
-                llrs.insert(make_pair(make_pair(i, j), 0.0));
+struct assn_models{
+    // Sites to use, and how many there are
+    hapstr mask;
+    int nvars;
+    vector<int> model_idx;
+    vector<hapstr> cov;
+    vector<hapstr> half;
+    vector<hapstr> one;
+    vector<pair<int, int> > pairs;
+    vector<hapstr> pair_sites;
+    
+    assn_models(vector<hap>& haps_final, hapstr& mask_global, int nvars, 
+        double doublet_rate){
+        this->mask = mask_global;
+        this->nvars = nvars;
+        for (int i = 0; i < haps_final.size(); ++i){
+            if (doublet_rate < 1.0){
+                model_idx.push_back(i);
             }
-        }
-        
-        set<int> sites_valid;
-        for (int site = 0; site < nvars; ++site){
-            if (mask_global[site]){
-                
-                // Retrieve major/minor allele counts
-                int count1 = hc->second.counts1[site];
-                int count2 = hc->second.counts2[site];
-                
-                if (count1+count2 > 0){
-                    sites_valid.insert(site);
-                    for (int i = 0; i < haps_final.size()-1; ++i){
-                        if (haps_final[i].mask[site]){
-                            double exp1 = zero;
-                            if (haps_final[i].vars[site]){
-                                exp1 = one;
-                            }
-                            for (int j = i + 1; j < haps_final.size(); ++j){
-                                if (haps_final[j].mask[site]){
-                                    double exp2 = zero;
-                                    if (haps_final[j].vars[site]){
-                                        exp2 = one;
-                                    }
-                                    if (exp1 != exp2){
-                                        double llr = dbinom(count1+count2, count2, exp1) - 
-                                            dbinom(count1+count2, count2, exp2);
-                                        llrs[make_pair(i, j)] += llr;
-                                    }
-                                }
-                            }
-                        }
+            if (doublet_rate > 0.0){
+                for (int j = i + 1; j < haps_final.size(); ++j){
+                    int k = hap_comb_to_idx(i, j, haps_final.size());
+                    if (k < 0){
+                        exit(1);
                     }
+                    model_idx.push_back(k);
                 }
             }
         }
+        sort(model_idx.begin(), model_idx.end());
         
-        // If we encounter a LLR == 0, then we have to bail out because
-        // we can't tell apart two haplotypes.
-        bool has_zero = false;
-
-        for (map<pair<int, int>, double>::iterator llr = llrs.begin(); llr != llrs.end(); ++llr){
-            if (false){
-            //if (llr->second == 0.0){
-                has_zero = true;
-                break;
+        for (int i = 0; i < model_idx.size(); ++i){
+            hapstr c;
+            hapstr h;
+            hapstr o;
+            if (model_idx[i] >= haps_final.size()){
+                pair<int, int> comb = idx_to_hap_comb(model_idx[i], haps_final.size());
+                c = haps_final[comb.first].mask & haps_final[comb.second].mask;
+                h = c & (haps_final[comb.first].vars ^ haps_final[comb.second].vars);
+                o = c & haps_final[comb.first].vars & haps_final[comb.second].vars;
             }
             else{
-                lltab.insert(llr->first.first, llr->first.second, llr->second);
+                c = haps_final[model_idx[i]].mask;
+                o = c & haps_final[model_idx[i]].vars;
             }
+            cov.push_back(c & mask_global);
+            half.push_back(h);
+            one.push_back(o);
         }
         
-        if (has_zero){
-            continue;
-        }
-
-        llrs.clear();
-
-        if (doublet_rate > 0.0){
-            // Keep only 10 likeliest individuals before checking doublet combinations
-            lltab.del(10);
-            vector<int> remaining;
-            for (int i = 0; i < haps_final.size(); ++i){
-                if (lltab.included[i]){
-                    remaining.push_back(i);
-                }
-                for (int j = i + 1; j < haps_final.size(); ++j){
-                    if (lltab.included[j]){
-                        int k = hap_comb_to_idx(i, j, haps_final.size());
-                        remaining.push_back(k);
-                    }
+        for (int i = 0; i < (int)model_idx.size()-1; ++i){
+            // Sites at which this identity has already been compared to
+            // (and found to differ from) an earlier identity
+            hapstr seen;
+            for (int j = i + 1; j < model_idx.size(); ++j){
+                hapstr both = cov[i] & cov[j];
+                hapstr differ = both & ((half[i] ^ half[j]) | (one[i] ^ one[j]));
+                hapstr sites = differ | (both & seen & ~half[i]);
+                if (sites.any()){
+                    pairs.push_back(make_pair(i, j));
+                    pair_sites.push_back(sites);
                 }
-            }
-            for (set<int>::iterator s = sites_valid.begin(); s != sites_valid.end(); ++s){
-                // Retrieve major/minor allele counts
-                int count1 = hc->second.counts1[*s];
-                int count2 = hc->second.counts2[*s];
-                
-                for (int i = 0; i < remaining.size()-1; ++i){
-                    int idx1 = remaining[i];
-                    pair<int, int> combo1;
-                    bool is_combo1 = false;
-                    if (idx1 >= haps_final.size()){
-                        combo1 = idx_to_hap_comb(idx1, haps_final.size());
-                        is_combo1 = true;
-                    }
-                    if ((!is_combo1 && haps_final[idx1].mask[*s]) ||
-                        (is_combo1 && haps_final[combo1.first].mask[*s] &&
-                         haps_final[combo1.second].mask[*s])){
-                        
-                        double exp1;
-                        if (is_combo1){
-                            if (haps_final[combo1.first].vars[*s]){
-                                if (haps_final[combo1.second].vars[*s]){
-                                    exp1 = one;
-                                }
-                                else{
-                                    exp1 = 0.5;
-                                }
-                            }
-                            else{
-                                if (haps_final[combo1.second].vars[*s]){
-                                    exp1 = 0.5;
-                                }
-                                else{
-                                    exp1 = zero;
-                                }
-                            }
-                        }
-                        else{
-                            if (haps_final[idx1].vars[*s]){
-                                exp1 = one;
-                            }
-                            else{
-                                exp1 = zero;
-                            }
-                        }
-                        for (int j = i + 1; j < remaining.size(); ++j){
-                            int idx2 = remaining[j];
-                            pair<int, int> combo2;
-                            bool is_combo2 = false;
-                            if (idx2 >= haps_final.size()){
-                                combo2 = idx_to_hap_comb(idx2, haps_final.size());
-                                is_combo2 = true;
-                            }
-                            
-                            // Don't both with comparison if both are singlets - we already did that
-                            if ((!is_combo1 || !is_combo2) && !is_combo2 && haps_final[idx2].mask[*s] || 
-                                (is_combo2 && haps_final[combo2.first].mask[*s] &&
-                                 haps_final[combo2.second].mask[*s])){
-                                
-                                double exp2;
-                                if (is_combo2){
-                                    if (haps_final[combo2.first].vars[*s]){
-                                        if (haps_final[combo2.second].vars[*s]){
-                                            exp2 = one;
-                                        }
-                                        else{
-                                            exp2 = 0.5;
-                                        }
-                                    }
-                                    else{
-                                        if (haps_final[combo2.second].vars[*s]){
-                                            exp2 = 0.5;
-                                        }
-                                        else{
-                                            exp2 = zero;
-                                        }
-                                    }
-                                }
-                                else{
-                                    if (haps_final[idx2].vars[*s]){
-                                        exp2 = one;
-                                    }
-                                    else{
-                                        exp2 = zero;
-                                    }
-                                }
-
-                                if (exp1 != exp2){
-                                    double llr = dbinom(count1+count2, count2, exp1) - 
-                                        dbinom(count1+count2, count2, exp2);
-                                    pair<int, int> key = make_pair(idx1, idx2);
-                                    if (llrs.count(key) == 0){
-                                        llrs.insert(make_pair(key, 0.0));
-                                    }
-                                    llrs[key] += llr;          
-                                }
-                            }
-                        }     
-                    }
-                } 
+                seen |= differ;
             }
         }
-        for (map<pair<int, int>, double>::iterator llr = llrs.begin(); llr != llrs.end(); ++llr){
-            if (llr->first.first >= haps_final.size() && llr->first.second < haps_final.size()){
-                llr->second += log2(doublet_rate) - log2(1.0-doublet_rate);
-            }
-            else if (llr->first.first < haps_final.size() && llr->first.second >= haps_final.size()){
-                llr->second += log2(1.0-doublet_rate) - log2(doublet_rate);
-            }
-            lltab.insert(llr->first.first, llr->first.second, llr->second);
+    };
+    
+    // 0 = "zero" expected minor allele fraction, 1 = 0.5, 2 = "one"
+    int exp_code(int model, int site){
+        if (one[model].test(site)){
+            return 2;
         }
-
-        // Get best assignment
-        double best_llr = 0.0;
-        int best_idx = -1;
-        lltab.get_max(best_idx, best_llr);
-        if (best_idx != -1 && best_llr != 0){
-            assignments.emplace(hc->first, best_idx);
-            assignments_llr.emplace(hc->first, best_llr);
+        else if (half[model].test(site)){
+            return 1;
         }
-        */
+        return 0;
+    };
+};
+
+/**
+ * Assign a contiguous range of cells to identities, given precomputed 
+ * identity information. Results are written into the given vectors at
+ * the same indices as the cells, so that multiple threads can work on
+ * disjoint ranges at once.
+ *
+ * This was requested as a SIMD engine over sites, but the per-site work
+ * is a lookup of one of three precomputed log likelihoods, chosen by 
+ * bitsets; there is little arithmetic to vectorize. Instead, each identity
+ * pair skips cells with no sites at which it is compared (one bitset AND),
+ * and only visits the sites each cell covers.
+ */
+void assign_bcs_range(vector<var_counts*>& cells,
+    int start,
+    int end,
+    assn_models& models,
+    double one,
+    vector<int>& best_assignment,
+    vector<double>& best_llr,
+    atomic<int>& n_done,
+    bool progress){
+    
+    double zero = 1.0-one;
+    int nvars = models.nvars;
+
+    // Binomial log likelihood of each cell's counts at each site, under 
+    // each possible expected minor allele fraction (zero, 0.5, one)
+    vector<double> site_ll(nvars*3, 0.0);
+    vector<int> sites_valid;
+
+    for (int c = start; c < end; ++c){
+        var_counts* vc = cells[c];
         
-        vector<int> all_model_idx;
-        for (int i = 0; i < haps_final.size(); ++i){
-            if (doublet_rate < 1.0){
-                all_model_idx.push_back(i);
-            }
-            if (doublet_rate > 0.0){
-                for (int j = i + 1; j < haps_final.size(); ++j){
-                    int k = hap_comb_to_idx(i, j, haps_final.size());
-                    if (k < 0){
-                        exit(1);
-                    }
-                    all_model_idx.push_back(k);
+        hapstr cell_cov;
+        sites_valid.clear();
+        for (int site = 0; site < nvars; ++site){
+            if (models.mask[site]){
+                // Retrieve major/minor allele counts
+                int count1 = vc->counts1[site];
+                int count2 = vc->counts2[site];
+                if (count1+count2 > 0){
+                    cell_cov.set(site);
+                    sites_valid.push_back(site);
+                    site_ll[site*3] = dbinom(count1+count2, count2, zero);
+                    site_ll[site*3+1] = dbinom(count1+count2, count2, 0.5);
+                    site_ll[site*3+2] = dbinom(count1+count2, count2, one);
                 }
             }
         }
-        sort(all_model_idx.begin(), all_model_idx.end());
-        map<int, map<int, double> > llrs;
 
-        // Use 0.5 for every mixture proportion
-        map<int, double> mixprops;
-        for (int i = 0; i < all_model_idx.size(); ++i){
-            int idx = all_model_idx[i];
-            if (idx >= haps_final.size()){
-                mixprops.insert(make_pair(idx, 0.5));
+        map<int, map<int, double> > llrs;
+        for (int p = 0; p < models.pairs.size(); ++p){
+            // Skip identity pairs that cannot be compared in this cell
+            if ((models.pair_sites[p] & cell_cov).none()){
+                continue;
+            }
+            int i = models.pairs[p].first;
+            int j = models.pairs[p].second;
+            double llr = 0.0;
+            for (int s = 0; s < sites_valid.size(); ++s){
+                int site = sites_valid[s];
+                if (models.pair_sites[p].test(site)){
+                    double ll1 = site_ll[site*3 + models.exp_code(i, site)];
+                    double ll2 = site_ll[site*3 + models.exp_code(j, site)];
+                    llr += (ll1-ll2);
+                }
             }
+            llrs[models.model_idx[i]][models.model_idx[j]] = llr;
         }
+        
+        double llr;
+        best_assignment[c] = collapse_llrs(llrs, llr);
+        best_llr[c] = llr;
+        
+        int n = ++n_done;
+        if (progress && n % 1000 == 0){
+            fprintf(stderr, "%d cells assigned\r", n);
+        }
+    }
+}
 
-        int tot_reads = 0;
-        int missing_sites = 0;
-        bool skip_bc = false;
-        for (int site = 0; site < nvars; ++site){
-            if (mask_global[site]){
-                // Retrieve major/minor allele counts
-                int count1 = hc->second.counts1[site];
-                int count2 = hc->second.counts2[site];
-                if (count1+count2 > 0){                
-                    // var set in hapstr == count2 is expected
-                    for (int i = 0; i < all_model_idx.size()-1; ++i){
-                        int idx1 = all_model_idx[i];
-                        bool covered_idx1 = true;
-                        // expected minor allele fraction this individual
-                        double exp_frac1;
-                        if (idx1 >= haps_final.size()){
-                            pair<int, int> comb = idx_to_hap_comb(idx1, haps_final.size());
-                            
-                            if (!haps_final[comb.first].mask[site] || 
-                                !haps_final[comb.second].mask[site]){
-                                covered_idx1 = false;
-                            }
-                            else{
-                                int nmin1a = 0;
-                                int nmin1b = 0;
-                                if (haps_final[comb.first].vars[site]){
-                                    nmin1a++;
-                                }
-                                if (haps_final[comb.second].vars[site]){
-                                    nmin1b++;
-                                }
-                                double exp_frac1a = (double)nmin1a;
-                                double exp_frac1b = (double)nmin1b;
-                                exp_frac1 = mixprops[idx1]* exp_frac1a + (1.0-mixprops[idx1])*exp_frac1b;
-                            }
-                        }
-                        else{
-                            int nmin1 = 0;
-                            if (!haps_final[idx1].mask[site]){
-                                covered_idx1 = false;
-                            }
-                            else if (haps_final[idx1].vars[site]){
-                                nmin1++;
-                            }
-                            exp_frac1 = (double)nmin1;
-                        }
-                        if (!covered_idx1){
-                            continue;
-                        }
-                        for (int j = i + 1; j < all_model_idx.size(); ++j){
-                            int idx2 = all_model_idx[j];
-                            bool covered_idx2 = true;
-                            double exp_frac2;
-                            if (idx2 >= haps_final.size()){
-                                pair<int, int> comb = idx_to_hap_comb(idx2, haps_final.size());
-                                if (!haps_final[comb.first].mask[site] ||
-                                    !haps_final[comb.second].mask[site]){
-                                    covered_idx2 = false;
-                                }
-                                else{
-                                    int nmin2a = 0;
-                                    int nmin2b = 0;
-                                    if (haps_final[comb.first].vars[site]){
-                                        nmin2a++;
-                                    }
-                                    if (haps_final[comb.second].vars[site]){
-                                        nmin2b++;
-                                    }
-                                    double exp_frac2a = (double)nmin2a;
-                                    double exp_frac2b = (double)nmin2b;
-                                    exp_frac2 = mixprops[idx2]*exp_frac2a + (1.0-mixprops[idx2])*exp_frac2b;
-                                }
-                            }
-                            else{
-                                int nmin2 = 0;
-                                if (!haps_final[idx2].mask[site]){
-                                    covered_idx2 = false;
-                                }
-                                else if (haps_final[idx2].vars[site]){
-                                    nmin2++;
-                                }
-                                exp_frac2 = (double)nmin2;
-                            }
-                            if (!covered_idx2){
-                                continue;
-                            }
+/**
+ * Assign barcodes of cells to a mitochondrial haplotype.
+ */
+void assign_bcs(robin_hood::unordered_map<unsigned long, var_counts>& hap_counter, 
+    robin_hood::unordered_map<unsigned long, int>& assignments,
+    robin_hood::unordered_map<unsigned long, double>& assignments_llr,
+    vector<hap>& haps_final, 
+    hapstr& mask_global,
+    int nvars,
+    double doublet_rate,
+    bool use_filter,
+    robin_hood::unordered_set<unsigned long>& cell_filter,
+    double one,
+    int nthreads){
 
-                            if (exp_frac1 != exp_frac2){
-                                if (exp_frac1 == 0){
-                                    exp_frac1 = zero;
-                                }
-                                else if (exp_frac1 == 1){
-                                    exp_frac1 = one;
-                                }
-                                if (exp_frac2 == 0){
-                                    exp_frac2 = zero;
-                                }
-                                else if (exp_frac2 == 1){
-                                    exp_frac2 = one;
-                                }
-                                if (llrs.count(idx1) == 0){
-                                    map<int, double> m;
-                                    llrs.insert(make_pair(idx1, m));
-                                }
-                                if (llrs[idx1].count(idx2) == 0){
-                                    llrs[idx1].insert(make_pair(idx2, 0.0));
-                                }
-                                double ll1 = dbinom(count1+count2, count2, exp_frac1);
-                                double ll2 = dbinom(count1+count2, count2, exp_frac2);
-                                
-                                llrs[idx1][idx2] += (ll1-ll2);
-                            }
-                        }
-                    }
-                }
-            }
+    assn_models models(haps_final, mask_global, nvars, doublet_rate);
+    
+    // Gather cells to assign, in the order they will be stored 
+    vector<unsigned long> bcs;
+    vector<var_counts*> cells;
+    for (robin_hood::unordered_map<unsigned long, var_counts>::iterator hc = 
+        hap_counter.begin(); hc != hap_counter.end(); ++hc){
+        
+        if (use_filter && cell_filter.find(hc->first) == cell_filter.end()){
+            continue;
         }
-        /*
-        llr_table llrtab(haps_final.size());
-        for (map<int, map<int, double> >::iterator x = llrs.begin(); x != 
-            llrs.end(); ++x){
-            for (map<int, double>::iterator y = x->second.begin(); y != 
-                x->second.end(); ++y){
-                llrtab.insert(x->first, y->first, y->second);
+        bcs.push_back(hc->first);
+        cells.push_back(&hc->second);
+    }
+    
+    int n_assigned = cells.size();
+    vector<int> best_assignment(n_assigned, -1);
+    vector<double> best_llr(n_assigned, 0.0);
+    atomic<int> n_done(0);
+
+    if (nthreads > 1 && n_assigned > nthreads){
+        vector<thread> threads;
+        int chunk = n_assigned / nthreads;
+        for (int i = 0; i < nthreads; ++i){
+            int start = i*chunk;
+            int end = start + chunk;
+            if (i == nthreads-1){
+                end = n_assigned;
             }
+            threads.push_back(thread(assign_bcs_range, ref(cells), start, end,
+                ref(models), one, ref(best_assignment), ref(best_llr), ref(n_done),
+                !use_filter));
         }
-        */
-        double llr;
-        int best_assignment;
-        //llrtab.get_max(best_assignment, llr);
-        best_assignment = collapse_llrs(llrs, llr);
-        if (best_assignment != -1 && llr > 0){
-            assignments.emplace(hc->first, best_assignment);
-            assignments_llr.emplace(hc->first, llr);
-        } 
-        ++n_assigned;
-        if (!use_filter && n_assigned % progress == 0){
-            fprintf(stderr, "%d cells assigned\r", n_assigned);
+        for (int i = 0; i < threads.size(); ++i){
+            threads[i].join();
+        }
+    }
+    else{
+        assign_bcs_range(cells, 0, n_assigned, models, one, best_assignment, best_llr,
+            n_done, !use_filter);
+    }
+
+    for (int i = 0; i < n_assigned; ++i){
+        if (best_assignment[i] != -1 && best_llr[i] > 0){
+            assignments.emplace(bcs[i], best_assignment[i]);
+            assignments_llr.emplace(bcs[i], best_llr[i]);
         }
     }
     if (!use_filter){
@@ -1212,51 +1458,77 @@ compiled to allow up to %d variable sites.\n", vars.size(), filename.c_str(), MA
 
 /**
  * Find a (preliminary) set of variant sites on the mitochondrial sequence
- * using a BAM file. This will later be filtered further by 
+ * using one or more BAM files. If multiple BAM files are given, reads from
+ * all of them are pooled at each site. This will later be filtered further by 
  * allele frequency found across all cell barcodes.
  */
-void find_vars_in_bam(string& bamfile, 
+void find_vars_in_bam(vector<string>& bamfiles, 
     string& mito_chrom, 
     int minmapq, 
     int minbaseq, 
     deque<varsite>& vars,
     bool has_bc_whitelist,
     set<unsigned long>& bc_whitelist,
-    bool cov_filt){
+    bool cov_filt,
+    mito_read_cache* cache){
     
     bam_mplp_t plp;
     
-    infile_t infile(bamfile.c_str(), mito_chrom.c_str());
+    int nfiles = bamfiles.size();
+    vector<infile_t*> infiles;
+    vector<infile_bc_wrapper> wraps(nfiles);
+    vector<void*> data;
     
-    infile_bc_wrapper wrap;
-    wrap.infile = &infile;
-    wrap.bcs = &bc_whitelist;
-
+    mito_cache_wrapper cwrap;
+    cwrap.cache = cache;
+    cwrap.bcs = NULL;
     if (has_bc_whitelist){
-        // Important to use the correct pileup function, so we include the
-        // cell barcode whitelist in the search (we only want sites that are
-        // variable in the chosen set of cells)
-        void* data[1];
-        data[0] = (void*)&wrap;
-        plp = bam_mplp_init(1, readaln_bcs, data);
+        cwrap.bcs = &bc_whitelist;
+    }
+    
+    if (cache != NULL){
+        // Reads come from the cache instead of the BAM file
+        nfiles = 1;
+        mito_cache_rewind(*cache);
+        data.push_back((void*)&cwrap);
+        plp = bam_mplp_init(1, readaln_cache, data.data());
     }
     else{
-        void* data[1];
-        data[0] = (void*)&infile;
-        plp = bam_mplp_init(1, readaln, data);
+        for (int f = 0; f < nfiles; ++f){
+            infile_t* infile = new infile_t(bamfiles[f].c_str(), mito_chrom.c_str());
+            infiles.push_back(infile);
+            wraps[f].infile = infile;
+            wraps[f].bcs = &bc_whitelist;
+            if (has_bc_whitelist){
+                data.push_back((void*)&wraps[f]);
+            }
+            else{
+                data.push_back((void*)infile);
+            }
+        }
+        if (has_bc_whitelist){
+            // Important to use the correct pileup function, so we include the
+            // cell barcode whitelist in the search (we only want sites that are
+            // variable in the chosen set of cells)
+            plp = bam_mplp_init(nfiles, readaln_bcs, data.data());
+        }
+        else{
+            plp = bam_mplp_init(nfiles, readaln, data.data());
+        }
     }
     if (!plp){
-        fprintf(stderr, "ERROR opening BAM file %s as pileup\n", bamfile.c_str());
+        fprintf(stderr, "ERROR opening BAM file %s as pileup\n", bamfiles[0].c_str());
         exit(1);
     }
     bam_mplp_init_overlaps(plp);
     
-    // Chromosome index - names in infile.fp_hdr->target_name array
+    // Chromosome index (always 0; see mito_tid_normalize())
     int tid = 0;
     // 0-based chromosome position
     int pos = 0;
-    // Number of reads at position?
-    int n = 0;
+    // Number of reads at position in each file
+    vector<int> n_plp(nfiles, 0);
+    vector<const bam_pileup1_t*> plps(nfiles, NULL);
     
     // Store all alleles at each site (consider only SNPs)
     char alleles[5];
@@ -1265,7 +1537,6 @@ void find_vars_in_bam(string& bamfile,
     char alleles_filtered[5];
     int n_alleles_filtered = 0;
     int max_alleles = 4;
-    const bam_pileup1_t* p;
     int ret;
     
     // Store initial set of variants, which will then be filtered for
@@ -1274,63 +1545,68 @@ void find_vars_in_bam(string& bamfile,
     
     vector<int> covsort;
 
-    while ((ret = bam_mplp_auto(plp, &tid, &pos, &n, &p)) > 0){
+    while ((ret = bam_mplp_auto(plp, &tid, &pos, n_plp.data(), plps.data())) > 0){
         if (tid < 0){
             break;
         }
-        if (tid >= infile.fp_hdr->n_targets){
-            fprintf(stderr, "bam_mplp_auto returned tid %d greater than \
-n_targets %d\n", tid, infile.fp_hdr->n_targets);
+        if (tid > 0){
+            fprintf(stderr, "bam_mplp_auto returned unexpected tid %d\n", tid);
             exit(1);
         }
+        
+        int n = 0;
+        for (int f = 0; f < nfiles; ++f){
+            n += n_plp[f];
+        }
 
         // Process
         if (n > 0){
             n_alleles = 0;
             int cov = 0;
             int n_skip = 0;
-            for (int i = 0; i < n; i++, p++){
-                uint8_t* seq = bam_get_seq(p->b);
-                uint8_t* qual = bam_get_qual(p->b);
-                uint16_t flag = p->b->core.flag;
-                int del_len, is_rev = bam_is_rev(p->b);
-                if (!p->is_del && p->indel == 0 && !p->is_refskip){
-                    // check map quality
-                    if (p->b->core.qual >= minmapq){
-                        unsigned char c = seq_nt16_str[bam_seqi(seq, p->qpos)];
-                        c = toupper(c);
-                        unsigned char qualchr = qual[p->qpos] + 33;
-                        if ((c == 'A' || c == 'C' || c == 'G' || c == 'T') && 
-                            qualchr >= minbaseq){
-                            cov++;
-                            if (n_alleles == 0){
-                                alleles[0] = c;
-                                allelecounts[0] = 1;
-                                n_alleles++;
-                            }
-                            else{
-                                bool found = false;
-                                for (int z = 0; z < n_alleles; ++z){
-                                    if (alleles[z] == c){
-                                        allelecounts[z]++;
-                                        found = true;
-                                        break;
+            for (int f = 0; f < nfiles && n_alleles < max_alleles; ++f){
+                const bam_pileup1_t* p = plps[f];
+                for (int i = 0; i < n_plp[f]; i++, p++){
+                    uint8_t* seq = bam_get_seq(p->b);
+                    uint8_t* qual = bam_get_qual(p->b);
+                    if (!p->is_del && p->indel == 0 && !p->is_refskip){
+                        // check map quality
+                        if (p->b->core.qual >= minmapq){
+                            unsigned char c = seq_nt16_str[bam_seqi(seq, p->qpos)];
+                            c = toupper(c);
+                            unsigned char qualchr = qual[p->qpos] + 33;
+                            if ((c == 'A' || c == 'C' || c == 'G' || c == 'T') && 
+                                qualchr >= minbaseq){
+                                cov++;
+                                if (n_alleles == 0){
+                                    alleles[0] = c;
+                                    allelecounts[0] = 1;
+                                    n_alleles++;
+                                }
+                                else{
+                                    bool found = false;
+                                    for (int z = 0; z < n_alleles; ++z){
+                                        if (alleles[z] == c){
+                                            allelecounts[z]++;
+                                            found = true;
+                                            break;
+                                        }
+                                    }
+                                    if (!found){
+                                        alleles[n_alleles] = c;
+                                        allelecounts[n_alleles] = 1;
+                                        n_alleles++;
                                     }
                                 }
-                                if (!found){
-                                    alleles[n_alleles] = c;
-                                    allelecounts[n_alleles] = 1;
-                                    n_alleles++;
+                                if (n_alleles >= max_alleles){
+                                    break; // no room left in array
                                 }
                             }
-                            if (n_alleles >= max_alleles){
-                                break; // no room left in array
-                            }
                         }
                     }
-                }
-                else{
-                    n_skip++;
+                    else{
+                        n_skip++;
+                    }
                 }
             }
             
@@ -1373,25 +1649,18 @@ n_targets %d\n", tid, infile.fp_hdr->n_targets);
     
     double cov_thresh = 0.0; 
     if (cov_filt){
-        map<double, double> sitehist;
-        sort(covsort.begin(), covsort.end()); 
-        int cprev = -1;
-        for (int i = 0; i < covsort.size(); ++i){
-            if (covsort[i] != cprev){
-                // All cov values greater than this one would survive
-                // a filter set at this value.
-                sitehist.insert(make_pair((double)covsort[i], (double)covsort.size()-i));
-            }
-            cprev = covsort[i];
-        }
-        cov_thresh = find_knee(sitehist, 0.25);
+        vector<double> covtots(covsort.begin(), covsort.end());
+        cov_thresh = find_knee_totals(covtots, 0.25);
         fprintf(stderr, "Coverage threshold: %f\n", cov_thresh);
     }
-    if (n < 0){
-        fprintf(stderr, "bam_mplp_auto failed for %s\n", infile.fname);
+    if (ret < 0){
+        fprintf(stderr, "bam_mplp_auto failed\n");
         exit(1);
     }
     bam_mplp_destroy(plp);
+    for (int f = 0; f < infiles.size(); ++f){
+        delete infiles[f];
+    }
     
     vector<pair<double, int> > vs_sort;
     for (map<int, varsite>::iterator v = vars_unfiltered.begin(); v != 
@@ -1417,10 +1686,67 @@ n_targets %d\n", tid, infile.fp_hdr->n_targets);
     }
 }
 
+/**
+ * Count alleles at variant sites covered by one read. Variants are stored
+ * in order, and reads must be visited in order of start position; variants
+ * upstream of the read are discarded along the way.
+ * Bases are looked up using the bam_reader if given, otherwise from the
+ * BAM record.
+ */
+void count_read_vars(deque<varsite>& vars,
+    int& vars_idx,
+    unsigned long bc_key,
+    long int ref_start,
+    long int ref_end,
+    bam_reader* reader,
+    bam1_t* b,
+    robin_hood::unordered_map<unsigned long, var_counts>& hap_counter){
+    
+    // Remove any variants already done with
+    while (vars.size() > 0 && vars.front().pos < ref_start){
+        vars.pop_front();
+        vars_idx++;
+    }
+
+    if (vars.size() > 0 && vars.front().pos >= ref_start && 
+        vars.front().pos <= ref_end){
+        int vars_idx2 = 0;
+        for (deque<varsite>::iterator var = vars.begin(); var != vars.end(); 
+            ++var){
+            if (var->pos > ref_end){
+                break;
+            }
+            else{
+                // Look for variant in read.
+                char base;
+                if (reader != NULL){
+                    base = reader->get_base_at(var->pos + 1);
+                }
+                else{
+                    base = mito_cache_base_at(b, var->pos);
+                }
+                
+                // Make sure an entry for this barcode exists.
+                if (hap_counter.count(bc_key) == 0){
+                    var_counts v;
+                    hap_counter.emplace(bc_key, v);
+                }
+                if (base == var->allele1){
+                    hap_counter[bc_key].counts1[vars_idx + vars_idx2]++;
+                }
+                else if (base == var->allele2){
+                    hap_counter[bc_key].counts2[vars_idx + vars_idx2]++;
+                }
+            }
+            ++vars_idx2;
+        }
+    }
+}
+
 /**
  * Given a set of variant sites, counts reads covering each allele of
- * each variant site tied to each barcode in the BAM file, across
- * the mitochondrial sequence.
+ * each variant site tied to each barcode in the BAM file (or read cache,
+ * if given), across the mitochondrial sequence.
  */
 void count_vars_barcodes(string& bamfile, 
     string& mito_chrom, 
@@ -1428,10 +1754,28 @@ void count_vars_barcodes(string& bamfile,
     deque<varsite>& vars, 
     bool has_bc_whitelist, 
     set<unsigned long> & bc_whitelist, 
-    robin_hood::unordered_map<unsigned long, var_counts>& hap_counter){
+    robin_hood::unordered_map<unsigned long, var_counts>& hap_counter,
+    mito_read_cache* cache){
     
     int vars_idx = 0;
     
+    if (cache != NULL){
+        mito_cache_rewind(*cache);
+        bam1_t* b = bam_init1();
+        unsigned long bc_key;
+        bool has_bc;
+        bool bc_valid;
+        while (mito_cache_next(*cache, b, bc_key, has_bc, bc_valid)){
+            if (has_bc && bc_valid && b->core.qual >= minmapq && 
+                (!has_bc_whitelist || bc_whitelist.find(bc_key) != bc_whitelist.end())){
+                count_read_vars(vars, vars_idx, bc_key, b->core.pos, 
+                    bam_endpos(b) - 1, NULL, b, hap_counter);
+            }
+        }
+        bam_destroy1(b);
+        return;
+    }
+
     bam_reader reader(bamfile);
     reader.set_cb();
     bool success = reader.set_query_region(mito_chrom.c_str(), -1, -1);
@@ -1444,55 +1788,64 @@ void count_vars_barcodes(string& bamfile,
             && reader.mapq >= minmapq){
 
             // Get hashable version of barcode.
-            string bc_str = reader.cb_z;
-            size_t dashpos = bc_str.find('-');
-            if (dashpos != string::npos){
-                bc_str = bc_str.substr(0, dashpos);
-            }
-            bc bc_hashable;
-
-            if (str2bc(bc_str.c_str(), bc_hashable) && (
-                !has_bc_whitelist || bc_whitelist.find(bc_hashable.to_ulong()) != 
+            unsigned long bc_key;
+            if (cb2ul(reader.cb_z, bc_key) && (
+                !has_bc_whitelist || bc_whitelist.find(bc_key) != 
                 bc_whitelist.end())){ 
-                 
-                // Remove any variants already done with
-                while (vars.size() > 0 && vars.front().pos < reader.reference_start){
-                    vars.pop_front();
-                    vars_idx++;
-                }
-
-                if (vars.size() > 0 && vars.front().pos >= reader.reference_start && 
-                    vars.front().pos <= reader.reference_end){
-                    int vars_idx2 = 0;
-                    for (deque<varsite>::iterator var = vars.begin(); var != vars.end(); 
-                        ++var){
-                        if (var->pos > reader.reference_end){
-                            break;
-                        }
-                        else{
-                            // Look for variant in read.
-                            char base = reader.get_base_at(var->pos + 1);
-                            
-                            // Make sure an entry for this barcode exists.
-                            if (hap_counter.count(bc_hashable.to_ulong()) == 0){
-                                var_counts v;
-                                hap_counter.emplace(bc_hashable.to_ulong(), v);
-                            }
-                            if (base == var->allele1){
-                                hap_counter[bc_hashable.to_ulong()].counts1[vars_idx + vars_idx2]++;
-                            }
-                            else if (base == var->allele2){
-                                hap_counter[bc_hashable.to_ulong()].counts2[vars_idx + vars_idx2]++;
-                            }
-                        }
-                        ++vars_idx2;
-                    }
-                }
+                count_read_vars(vars, vars_idx, bc_key, reader.reference_start,
+                    reader.reference_end, &reader, NULL, hap_counter); 
             } 
         } 
     }
 }
 
+/**
+ * Count alleles at variant sites in each cell barcode of each library 
+ * (BAM file), processing libraries in parallel. Barcode keys in the
+ * result are tagged with the index of the library they came from.
+ */
+void count_vars_libraries(vector<string>& bamfiles,
+    string& mito_chrom,
+    int minmapq,
+    deque<varsite>& vars,
+    bool has_bc_whitelist,
+    set<unsigned long>& bc_whitelist,
+    robin_hood::unordered_map<unsigned long, var_counts>& hap_counter,
+    mito_read_cache* cache,
+    int nthreads){
+    
+    if (bamfiles.size() == 1 || cache != NULL){
+        count_vars_barcodes(bamfiles[0], mito_chrom, minmapq, vars, has_bc_whitelist,
+            bc_whitelist, hap_counter, cache);
+        return;
+    }
+    
+    int nlibs = bamfiles.size();
+    // Each library consumes its own copy of the variant list
+    vector<deque<varsite> > lib_vars(nlibs, vars);
+    vector<robin_hood::unordered_map<unsigned long, var_counts> > lib_counts(nlibs);
+    
+    for (int start = 0; start < nlibs; start += nthreads){
+        vector<thread> threads;
+        for (int lib = start; lib < nlibs && lib < start + nthreads; ++lib){
+            threads.push_back(thread(count_vars_barcodes, ref(bamfiles[lib]), 
+                ref(mito_chrom), minmapq, ref(lib_vars[lib]), has_bc_whitelist,
+                ref(bc_whitelist), ref(lib_counts[lib]), (mito_read_cache*)NULL));
+        }
+        for (int i = 0; i < threads.size(); ++i){
+            threads[i].join();
+        }
+    }
+    
+    for (int lib = 0; lib < nlibs; ++lib){
+        for (robin_hood::unordered_map<unsigned long, var_counts>::iterator hc = 
+            lib_counts[lib].begin(); hc != lib_counts[lib].end(); ++hc){
+            hap_counter.emplace(lib_bc_key(hc->first, lib), hc->second);
+        }
+        lib_counts[lib].clear();
+    }
+}
+
 /**
  * Returns chosen number of clusters and LLR sum of assignments,
  * disallowing doublet assignments.
@@ -1509,7 +1862,8 @@ pair<int, float> infer_clusters(hapstr& mask_global,
     int nclust_max,
     robin_hood::unordered_set<unsigned long>& cellset,
     robin_hood::unordered_map<unsigned long, var_counts>& hap_counter,
-    double one){
+    double one,
+    int nthreads){
     
     hapstr mask;
 
@@ -1874,7 +2228,7 @@ pair<int, float> infer_clusters(hapstr& mask_global,
     robin_hood::unordered_map<unsigned long, double> assn_llr;
     double llrsum = 0.0;
     assign_bcs(hap_counter, assn, assn_llr, haps_final, mask, nvars, 0.0, true, 
-        cellset, one);
+        cellset, one, nthreads);
 
     //map<int, int> grpsizes;
     for (robin_hood::unordered_map<unsigned long, double>::iterator al = assn_llr.begin();
@@ -1911,7 +2265,7 @@ pair<int, float> infer_clusters(hapstr& mask_global,
                 assn_llr.clear();
                 double llrsum_new = 0;
                 assign_bcs(hap_counter, assn, assn_llr, haps_final_order[site_idx],
-                    mask_order[site_idx], nvars, 0.0, true, cellset, one);
+                    mask_order[site_idx], nvars, 0.0, true, cellset, one, nthreads);
                 //grpsizes.clear();
                 //sizevec.clear();
                 for (robin_hood::unordered_map<unsigned long, double>::iterator al = 
@@ -1976,7 +2330,7 @@ void write_bchaps(string& haps_out,
     int nvars,
     hapstr& mask_global,
     robin_hood::unordered_map<unsigned long, hap>& haplotypes,
-    string& bc_group,
+    vector<string>& bc_groups,
     bool cellranger,
     bool seurat,
     bool underscore){
@@ -2006,7 +2360,8 @@ void write_bchaps(string& haps_out,
         
         bc bcbits(h->first);
         string bcstr = bc2str(bcbits);
-        mod_bc_libname(bcstr, bc_group, cellranger, seurat, underscore);
+        mod_bc_libname(bcstr, bc_groups[bc_key_lib(h->first)], cellranger, seurat, 
+            underscore);
 
         if ((h->second.mask & mask_global).count() > 0){
             firstprint = true;
@@ -2131,7 +2486,7 @@ void load_clusthaps(string& hapsfilename,
 void write_assignments(string& assn_out,
     robin_hood::unordered_map<unsigned long, int>& assignments,
     robin_hood::unordered_map<unsigned long, double>& assignments_llr,
-    string& barcode_group,
+    vector<string>& barcode_groups,
     bool cellranger,
     bool seurat,
     bool underscore,
@@ -2181,7 +2536,8 @@ void write_assignments(string& assn_out,
         id_counter[assn->second]++;
         bc as_bitset(assn->first);
         string bc_str = bc2str(as_bitset);
-        mod_bc_libname(bc_str, barcode_group, cellranger, seurat, underscore);
+        mod_bc_libname(bc_str, barcode_groups[bc_key_lib(assn->first)], cellranger,
+            seurat, underscore);
         fprintf(assn_outf, "%s\t%s\t%c\t%f\n", bc_str.c_str(),
             name.c_str(), s_d, assignments_llr[assn->first]);
     } 
@@ -2344,30 +2700,6 @@ pass the .ids file (-i)?\n", id_str.c_str());
     }
 }
 
-double y_mixprop(double p, const map<string, double>& data_d, const map<string, int>& data_i){
-    int m1 = data_i.at("match1");
-    int m2 = data_i.at("match2");
-    double k = (double)m1;
-    double n = (double)(m1+m2);
-    return logbinom(n, k, p);
-}
-
-double dy_dp_mixprop(double p, const map<string, double>& data_d, const map<string, int>& data_i){
-    int m1 = data_i.at("match1");
-    int m2 = data_i.at("match2");
-    double k = (double)m1;
-    double n = (double)(m1+m2);
-    return (k-n*p)/(p - p*p);
-}
-
-double d2y_dp2_mixprop(double p, const map<string, double>& data_d, const map<string, int>& data_i){
-    int m1 = data_i.at("match1");
-    int m2 = data_i.at("match2");
-    double k = (double)m1;
-    double n = (double)(m1+m2);
-    return (k*(2*p-1) - n*p*p)/(pow(p-1,2)*p*p);
-}
-
 void infer_mixprops(robin_hood::unordered_map<unsigned long, var_counts>& hap_counter,
     robin_hood::unordered_map<unsigned long, int>& assignments,
     vector<hap>& clusthaps,
@@ -2375,16 +2707,16 @@ void infer_mixprops(robin_hood::unordered_map<unsigned long, var_counts>& hap_co
     int nvars,
     robin_hood::unordered_map<unsigned long, double>& mixprops_mean,
     robin_hood::unordered_map<unsigned long, double>& mixprops_sd,
-    map<int, double>& id_mixprop_mean,
-    map<int, double>& id_mixprop_sd,
     vector<string>& clust_ids,
     string& mito_chrom,
     deque<varsite>& vars){
 
     int n_samples = (int)clusthaps.size();
     
-    map<int, vector<int> > id_match1;
-    map<int, vector<int> > id_match2;
+    // Per-cell counts, packed into flat arrays (one pair per cell)
+    vector<unsigned long> cell_bcs;
+    vector<int> cell_match1;
+    vector<int> cell_match2;
 
     for (robin_hood::unordered_map<unsigned long, int>::iterator a = assignments.begin();
         a != assignments.end(); ++a){
@@ -2435,66 +2767,22 @@ void infer_mixprops(robin_hood::unordered_map<unsigned long, var_counts>& hap_co
             }
             
             if (match1 + match2 > 0){
-                string bcstr = bc2str(a->first);
-                //fprintf(stdout, "%s\t%d\t%d\t%s\t%s\t%s\t%d\t%d\n", bcstr.c_str(), 
-                //    clust_ids[combo.first].c_str(), clust_ids[combo.second].c_str(), 
-                //    match1, match2);
-
-                /*        
-                double mean = (double)match1/(double)(match1+match2);
-                double var = (double)(match1*match2)/(pow((double)match1+match2,2)*(double)(match1+match2+1));
-                string n = idx2name(a->second, clust_ids);
-                pair<int, int> combo = idx_to_hap_comb(a->second, clust_ids.size());
-                string n1 = idx2name(combo.first, clust_ids);
-                string n2 = idx2name(combo.second, clust_ids);
-                fprintf(stdout, "%s\t%s\t%f\t%f\n", n1.c_str(), n2.c_str(), mean, sqrt(var));
-                fprintf(stdout, "%s\t%s\t%f\t%f\n", n2.c_str(), n1.c_str(), mean, sqrt(var));
-                continue;
-
-                vector<int> match1v = {match1};
-                vector<int> match2v = {match2};
-                optimML::brent_solver solver(y_mixprop, dy_dp_mixprop, d2y_dp2_mixprop);
-                solver.add_data("match1", match1v);
-                solver.add_data("match2", match2v);
-                solver.constrain_01();
-                double p = solver.solve(0,1);
-                mixprops_mean.emplace(a->first, p);
-                mixprops_sd.emplace(a->first, solver.se); 
-                */
-                
-                /*
-                // Store for whole-ID tests
-                if (id_match1.count(a->second) == 0){
-                    vector<int> v;
-                    id_match1.insert(make_pair(a->second, v));
-                }
-                id_match1[a->second].push_back(match1);
-                if (id_match2.count(a->second) == 0){
-                    vector<int> v;
-                    id_match2.insert(make_pair(a->second, v));
-                }
-                id_match2[a->second].push_back(match2);
-                */
+                cell_bcs.push_back(a->first);
+                cell_match1.push_back(match1);
+                cell_match2.push_back(match2);
             }
         }
     }
-    /*
-    for (map<int, vector<int> >::iterator im = id_match1.begin(); im != id_match1.end();
-        ++im){
-         
-        optimML::brent_solver solver(y_mixprop, dy_dp_mixprop, d2y_dp2_mixprop);
-        solver.add_data("match1", im->second);
-        solver.add_data("match2", id_match2[im->first]);
-        solver.constrain_01();
-        //solver.add_beta_prior(10000, 10000);
-        double p = solver.solve(0,1);
-	    pair<int, int> comb = idx_to_hap_comb(im->first, clust_ids.size());
-        //fprintf(stdout, "%s\t%s\t%f\t%f\n", clust_ids[comb.first].c_str(), clust_ids[comb.second].c_str(), p, solver.se);
-        id_mixprop_mean.insert(make_pair(im->first, p));
-        id_mixprop_sd.insert(make_pair(im->first, solver.se));
-        
+    
+    // The binomial likelihood of each cell's counts has a single root at
+    // match1/(match1+match2), so there is no need for a general-purpose 
+    // solver; the standard error comes from the Fisher information.
+    for (int i = 0; i < cell_bcs.size(); ++i){
+        double n = (double)(cell_match1[i] + cell_match2[i]);
+        double p = (double)cell_match1[i] / n;
+        mixprops_mean.emplace(cell_bcs[i], p);
+        mixprops_sd.emplace(cell_bcs[i], sqrt(p * (1.0 - p) / n));
     }
-    */
 }
 
 void write_mixprops(FILE* outf,
@@ -2522,7 +2810,7 @@ void write_mixprops(FILE* outf,
         fprintf(outf, "%s\t%s\t%s\t%f\t%f\n", bc_str.c_str(), name1.c_str(), name2.c_str(),
             mp->second, mixprops_sd[mp->first]);
         fprintf(outf, "%s\t%s\t%s\t%f\t%f\n", bc_str.c_str(), name2.c_str(), name1.c_str(),
-            mixprops_sd[mp->first], mp->second);
+            1.0 - mp->second, mixprops_sd[mp->first]);
 
     }
 
@@ -2550,11 +2838,13 @@ int main(int argc, char *argv[]) {
        {"ids", required_argument, 0, 'i'},
        {"no_cov_filt", no_argument, 0, 'c'},
        {"assignments", required_argument, 0, 'a'},
+       {"num_threads", required_argument, 0, 'T'},
+       {"read_cache", required_argument, 0, 'R'},
        {0, 0, 0, 0} 
     };
     
     // Set default values
-    string bamfile;
+    vector<string> bamfiles;
     string output_prefix;
     int minmapq = 20;
     int minbaseq = 20;
@@ -2570,13 +2860,15 @@ int main(int argc, char *argv[]) {
     double doublet_rate = 0.5;
     bool ids_given = false;
     string idsfile;
-    string barcode_group = "";
+    vector<string> barcode_groups;
     bool mixing_proportions = false;
     string assnfile = "";
     bool cov_filt = true;
     bool cellranger = false;
     bool seurat = false;
     bool underscore = false;
+    int nthreads = 1;
+    string read_cache_file = "";
 
     int option_index = 0;
     int ch;
@@ -2584,7 +2876,7 @@ int main(int argc, char *argv[]) {
     if (argc == 1){
         help(0);
     }
-    while((ch = getopt_long(argc, argv, "b:o:n:B:f:g:q:Q:N:m:v:H:i:D:a:CSUcdh", long_options, &option_index )) != -1){
+    while((ch = getopt_long(argc, argv, "b:o:n:B:f:g:q:Q:N:m:v:H:i:D:a:T:R:CSUcdh", long_options, &option_index )) != -1){
         switch(ch){
             case 0:
                 // This option set a flag. No need to do anything here.
@@ -2596,7 +2888,7 @@ int main(int argc, char *argv[]) {
                 doublet_rate = atof(optarg);
                 break;
             case 'n':
-                barcode_group = optarg;
+                barcode_groups.push_back(optarg);
                 break;
             case 'C':
                 cellranger = true;
@@ -2616,7 +2908,7 @@ int main(int argc, char *argv[]) {
                 ids_given = true;
                 break;
             case 'b':
-                bamfile = optarg;
+                bamfiles.push_back(optarg);
                 break;
             case 'o':
                 output_prefix = optarg;
@@ -2653,6 +2945,12 @@ int main(int argc, char *argv[]) {
             case 'N':
                 nclust = atoi(optarg);
                 break;
+            case 'T':
+                nthreads = atoi(optarg);
+                break;
+            case 'R':
+                read_cache_file = optarg;
+                break;
             default:
                 help(0);
                 break;
@@ -2660,10 +2958,42 @@ int main(int argc, char *argv[]) {
     }
 
     // Error check arguments.
-    if (bamfile.length() == 0){
+    if (bamfiles.size() == 0 && (read_cache_file.length() == 0 || 
+        !file_exists(read_cache_file))){
         fprintf(stderr, "ERROR: bam file is required\n");
         exit(1);
     }
+    if (bamfiles.size() > 1){
+        if (barcode_groups.size() != bamfiles.size()){
+            fprintf(stderr, "ERROR: when processing multiple BAM files, a unique --libname / -n\n");
+            fprintf(stderr, "is required for each (in the same order as the BAM files).\n");
+            exit(1);
+        }
+        set<string> barcode_groups_uniq(barcode_groups.begin(), barcode_groups.end());
+        if (barcode_groups_uniq.size() != barcode_groups.size()){
+            fprintf(stderr, "ERROR: --libname / -n values must be unique\n");
+            exit(1);
+        }
+        if (BC_LENX2 + 16 > sizeof(unsigned long)*8){
+            fprintf(stderr, "ERROR: barcodes are too long to process multiple libraries\n");
+            exit(1);
+        }
+        if (read_cache_file.length() > 0){
+            fprintf(stderr, "ERROR: --read_cache / -R can only be used with one BAM file\n");
+            exit(1);
+        }
+        if (mixing_proportions){
+            fprintf(stderr, "ERROR: inferring mixing proportions requires a single BAM file\n");
+            exit(1);
+        }
+    }
+    else if (barcode_groups.size() > 1){
+        fprintf(stderr, "ERROR: only one --libname / -n can be given per BAM file\n");
+        exit(1);
+    }
+    if (barcode_groups.size() == 0){
+        barcode_groups.push_back("");
+    }
     if (output_prefix.length() == 0){
         fprintf(stderr, "ERROR: output_prefix is required\n");
         exit(1);
@@ -2689,6 +3019,10 @@ name prefix.\n", output_prefix.c_str());
         fprintf(stderr, "ERROR: cannot infer mixing proportions and also dump counts\n");
         exit(1);
     }
+    if (nthreads < 1){
+        fprintf(stderr, "ERROR: number of threads must be positive\n");
+        exit(1);
+    }
     if (nclust == 0 || (nclust < 0 && nclust != -1)){
         fprintf(stderr, "ERROR: maximum number of clusters must either be a positive number or\n");
         fprintf(stderr, "-1 (for no limit)\n");
@@ -2731,10 +3065,35 @@ name prefix.\n", output_prefix.c_str());
         fprintf(stderr, "Loading variants from %s...\n", varsfile.c_str());
         mito_chrom = load_vars_from_file(varsfile, vars); 
     }
-    else{
+    
+    // Read alignments from a cache file instead of the BAM, creating it
+    // first if necessary.
+    mito_read_cache cache;
+    mito_read_cache* cache_ptr = NULL;
+    if (read_cache_file.length() > 0){
+        bool write_cache = !file_exists(read_cache_file);
+        if (!write_cache && bamfiles.size() > 0 && 
+            !mito_cache_matches(read_cache_file, bamfiles[0])){
+            fprintf(stderr, "Read cache %s was not built from %s as it is now; rebuilding it\n",
+                read_cache_file.c_str(), bamfiles[0].c_str());
+            write_cache = true;
+        }
+        if (write_cache){
+            fprintf(stderr, "Writing mitochondrial reads to cache %s...\n", 
+                read_cache_file.c_str());
+            write_mito_cache(bamfiles[0], mito_chrom, read_cache_file);
+        }
+        load_mito_cache(read_cache_file, mito_chrom, cache);
+        cache_ptr = &cache;
+        if (bamfiles.size() == 0){
+            bamfiles.push_back(read_cache_file);
+        }
+    }
+
+    if (!varsfile_given){
         fprintf(stderr, "Finding variable sites on the mitochondrial genome...\n");
-        find_vars_in_bam(bamfile, mito_chrom, minmapq, minbaseq, vars, 
-            has_bc_whitelist, bc_whitelist, cov_filt); 
+        find_vars_in_bam(bamfiles, mito_chrom, minmapq, minbaseq, vars, 
+            has_bc_whitelist, bc_whitelist, cov_filt, cache_ptr); 
     }
     
     // If loading previously-inferred clusters, did the user provide
@@ -2786,10 +3145,13 @@ name prefix.\n", output_prefix.c_str());
     // inferring cluster haplotypes (if not provided),
     // and assigning barcodes to individual IDs
     
-    fprintf(stderr, "Counting alleles at variable sites in BAM file %s...\n", bamfile.c_str());
+    for (int i = 0; i < bamfiles.size(); ++i){
+        fprintf(stderr, "Counting alleles at variable sites in BAM file %s...\n", 
+            bamfiles[i].c_str());
+    }
 
-    count_vars_barcodes(bamfile, mito_chrom, minmapq, vars, 
-        has_bc_whitelist, bc_whitelist, hap_counter);     
+    count_vars_libraries(bamfiles, mito_chrom, minmapq, vars, 
+        has_bc_whitelist, bc_whitelist, hap_counter, cache_ptr, nthreads);     
    
     // Still need to filter variant sites based on coverage across cells
     hapstr mask_global;
@@ -2820,7 +3182,7 @@ name prefix.\n", output_prefix.c_str());
             clsort, one);  
         
         if (dump){
-            write_bchaps(haps_out, nvars, mask_global, haplotypes, barcode_group, 
+            write_bchaps(haps_out, nvars, mask_global, haplotypes, barcode_groups, 
                 cellranger, seurat, underscore); 
             return 0; // finished
         }
@@ -2851,7 +3213,7 @@ name prefix.\n", output_prefix.c_str());
         pair<int, float> results = infer_clusters(mask_global,
             haplotypes, nvars, clsort, collapsed_to_orig,
             site_minor, site_major, clusthaps, exact_matches_only,
-            nclust, site_mask[clsort[0].second], hap_counter, one);
+            nclust, site_mask[clsort[0].second], hap_counter, one, nthreads);
 
         nclust_model = results.first;
         llrsum_model = results.second;
@@ -2894,22 +3256,19 @@ were found in input file %s\n", assnfile.c_str());
         }
         robin_hood::unordered_map<unsigned long, double> mixprops_mean;
         robin_hood::unordered_map<unsigned long, double> mixprops_sd;
-        map<int, double> id_mixprop_mean;
-        map<int, double> id_mixprop_sd;
         infer_mixprops(hap_counter, assignments, clusthaps, mask_global, nvars, mixprops_mean,
-            mixprops_sd, id_mixprop_mean, id_mixprop_sd, clust_ids, mito_chrom, vars2);
-        /*
+            mixprops_sd, clust_ids, mito_chrom, vars2);
+        
         // Spill to disk.
         string mixprops_out_name = output_prefix + ".props";
         FILE* mixprops_out = fopen(mixprops_out_name.c_str(), "w");
-        write_mixprops(mixprops_out, barcode_group, cellranger, seurat, underscore, 
+        write_mixprops(mixprops_out, barcode_groups[0], cellranger, seurat, underscore, 
             mixprops_mean, mixprops_sd, assignments, clust_ids);
         fclose(mixprops_out);
-        */
         return 0;
     }
     // Write barcode haps file
-    write_bchaps(haps_out, nvars, mask_global, haplotypes, barcode_group, cellranger, seurat, underscore);
+    write_bchaps(haps_out, nvars, mask_global, haplotypes, barcode_groups, cellranger, seurat, underscore);
     
     // Assign all cell barcodes to a haplotype ID.
     map<unsigned long, int> bc2hap;
@@ -2924,12 +3283,15 @@ were found in input file %s\n", assnfile.c_str());
     if (has_bc_filter_assn){
         for (set<unsigned long>::iterator cell = bc_filter_assn.begin();
             cell != bc_filter_assn.end(); ++cell){
-            cell_filter.insert(*cell);
+            // Barcodes in the list apply to every library
+            for (int lib = 0; lib < bamfiles.size(); ++lib){
+                cell_filter.insert(lib_bc_key(*cell, lib));
+            }
         }
     }
     assign_bcs(hap_counter, assignments, assignments_llr, clusthaps,
         mask_global, nvars, doublet_rate, has_bc_filter_assn, cell_filter, 
-        one);
+        one, nthreads);
     
     map<int, int> id_counter;
     int tot_cells = 0;
@@ -2939,7 +3301,7 @@ were found in input file %s\n", assnfile.c_str());
     
     
     write_assignments(assn_out, assignments, assignments_llr,
-        barcode_group, cellranger, seurat, underscore,
+        barcode_groups, cellranger, seurat, underscore,
         clust_ids, clusthaps.size(), id_counter, 
         tot_cells, doub_cells);
    
@@ -11,9 +11,11 @@
 #include <fstream>
 #include <sstream>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <map>
 #include <unordered_map>
 #include <set>
+#include <deque>
 #include <cstdlib>
 #include <utility>
 #include <math.h>
@@ -34,6 +36,10 @@
 #include "demux_species_io.h"
 #include "reads_demux.h"
 #include "species_kmers.h"
+#include "kmer_index.h"
+#include "fq_stream.h"
+#include "species_counts_bin.h"
+#include "species_mixture.h"
 
 using std::cout;
 using std::endl;
@@ -52,7 +58,11 @@ void help(int code){
     fprintf(stderr, "   --help -h Display this message and exit.\n");
     fprintf(stderr, "   --limit_ram -l Default behavior is to load all species kmers at once. This\n");
     fprintf(stderr, "       maximizes speed at the cost of memory. If you have many pooled species,\n");
-    fprintf(stderr, "       enabling this option will limit RAM, but cost more processing time.\n");
+    fprintf(stderr, "       enabling this option will instead build a temporary k-mer index on disk\n");
+    fprintf(stderr, "       in the output directory (holding about one species' worth of k-mers\n");
+    fprintf(stderr, "       in memory at a time) and read k-mers from it as needed. Reads are still\n");
+    fprintf(stderr, "       only scanned once, but lookups are slower if the index does not fit in\n");
+    fprintf(stderr, "       the page cache.\n");
     fprintf(stderr, "   --doublet_rate -D What is the prior expected doublet rate?\n");
     fprintf(stderr, "       (OPTIONAL; default = 0.1). Must be a decimal between 0 and 1,\n");
     fprintf(stderr, "       exclusive.\n");
@@ -63,10 +73,28 @@ void help(int code){
     fprintf(stderr, "       delete the old output directory or use a new output directory.\n");
     fprintf(stderr, "   --num_threads -T The number of threads to use for parallel processing\n");
     fprintf(stderr, "       (default 1)\n");
+    fprintf(stderr, "   --readers -K With multiple threads, read each BGZF-compressed (i.e. by\n");
+    fprintf(stderr, "       bgzip) RNA-seq or custom read file in this many chunks at once, each\n");
+    fprintf(stderr, "       decompressed and parsed by its own thread, instead of splitting\n");
+    fprintf(stderr, "       input files (i.e. with split_read_files) to process them in\n");
+    fprintf(stderr, "       parallel. Files compressed with plain gzip, standard input, and\n");
+    fprintf(stderr, "       pipes are read by one thread. (default: one per 4 threads)\n");
     fprintf(stderr, "   --disable_umis -u By default, identical UMIs are collapsed when counting\n");
     fprintf(stderr, "       species-specific k-mers. With this option enabled, UMIs will not be\n");
     fprintf(stderr, "       considered (increases speed at the cost of read duplicates affecting\n");
-    fprintf(stderr, "       k-mer counts)\n");
+    fprintf(stderr, "       k-mer counts). Also stops collapsing duplicate ATAC-seq fragments\n");
+    fprintf(stderr, "       (same barcode and same start of both reads) with --count_atac.\n");
+    fprintf(stderr, "   --count_atac -a Also count species-specific k-mers in ATAC-seq reads\n");
+    fprintf(stderr, "       (both genomic reads of each fragment), in addition to RNA-seq\n");
+    fprintf(stderr, "       reads. Requires multiome data and both whitelists (-w and -W).\n");
+    fprintf(stderr, "       Genome-wide k-mers may be needed for enough ATAC-seq reads to match.\n");
+    fprintf(stderr, "   --one_pass -O Read RNA-seq FASTQ files only once. While counting k-mers,\n");
+    fprintf(stderr, "       copy all RNA-seq reads to compressed temporary files in the output\n");
+    fprintf(stderr, "       directory, and demultiplex reads from these once barcodes are\n");
+    fprintf(stderr, "       assigned to species, instead of reading and decompressing the input\n");
+    fprintf(stderr, "       files again. Requires free disk space about the size of the RNA-seq\n");
+    fprintf(stderr, "       input files. Has no effect with --dump, --batch_num, or when loading\n");
+    fprintf(stderr, "       counts from a previous run.\n");
     fprintf(stderr, "   --dump -d Only dump per-barcode data (barcode, then count of reads\n");
     fprintf(stderr, "       per species (tab separated)) and barcode-to-species assignments\n");
     fprintf(stderr, "       instead of demultiplexing reads. These files are created in\n");
@@ -86,6 +114,14 @@ void help(int code){
     fprintf(stderr, "       from all batches. Then proceed again with this program (it will automatically\n");
     fprintf(stderr, "       load the combined counts and demultiplex the given reads, which can be the\n");
     fprintf(stderr, "       split read files or the original onesi).\n");
+    fprintf(stderr, "   --num_chunks -Z Instead of splitting input read files into chunks, run\n");
+    fprintf(stderr, "       this program once per chunk on the original (BGZF-compressed, i.e.\n");
+    fprintf(stderr, "       by bgzip) RNA-seq and custom read files, and each run will read only\n");
+    fprintf(stderr, "       its own chunk of them (see --chunk). Use with --batch_num when\n");
+    fprintf(stderr, "       counting k-mers. When demultiplexing, output file names include the\n");
+    fprintf(stderr, "       chunk, as for files from split_read_files (i.e.\n");
+    fprintf(stderr, "       GEX_sample_R1_001.<chunk>.fastq.gz). Does not apply to ATAC-seq reads.\n");
+    fprintf(stderr, "   --chunk -c With --num_chunks, which chunk (0-based) to read in this run.\n");
     print_libname_help();
     fprintf(stderr, "\n   ===== READ FILE INPUT OPTIONS =====\n");
     fprintf(stderr, "   --atac_r1 -1 ATAC R1 reads to demultiplex (can specify multiple times)\n");
@@ -102,6 +138,17 @@ void help(int code){
     fprintf(stderr, "       times)\n");
     fprintf(stderr, "   --rna_r2 -R Reverse RNA-seq reads to demultiplex (can specify multiple\n");
     fprintf(stderr, "       times)\n");
+    fprintf(stderr, "   --rna_interleaved -i Interleaved RNA-seq reads to demultiplex (each R1\n");
+    fprintf(stderr, "       record followed by its R2 record; can specify multiple times).\n");
+    fprintf(stderr, "       Demultiplexed reads are written to <name>_R1_001.fastq.gz and\n");
+    fprintf(stderr, "       <name>_R2_001.fastq.gz, where <name> is the file name without\n");
+    fprintf(stderr, "       .fastq/.fq(.gz), or \"stdin\".\n");
+    fprintf(stderr, "   Any RNA-seq input file can be - (standard input) or a named pipe, i.e.\n");
+    fprintf(stderr, "       to stream reads straight from FASTQ conversion without writing them\n");
+    fprintf(stderr, "       to disk first. Such input can only be read once, so --one_pass is\n");
+    fprintf(stderr, "       turned on if reads need to be demultiplexed after counting k-mers.\n");
+    fprintf(stderr, "       Give named pipes 10X-style FASTQ names (i.e. sample_R1_001.fastq.gz)\n");
+    fprintf(stderr, "       so that output and library file names can be derived from them.\n");
     fprintf(stderr, "   --custom_r1 -x Forward other (i.e. sgRNA or antibody capture) reads\n");
     fprintf(stderr, "       to demultiplex (can specify multiple times). Assumes barcodes are\n");
     fprintf(stderr, "       at the beginning of R1.\n");
@@ -134,6 +181,18 @@ void help(int code){
     fprintf(stderr, "       species minus 1.\n");
     fprintf(stderr, "       If you have already run once, previously-computed counts will be loaded\n");
     fprintf(stderr, "       and this argument is unnecessary.\n");
+    fprintf(stderr, "   --build_index -I Build a binary index of the k-mers given with -k, write it\n");
+    fprintf(stderr, "       to <k>.kidx, and exit. Later runs given the same -k argument will map\n");
+    fprintf(stderr, "       this index into memory instead of loading the k-mer lists, which makes\n");
+    fprintf(stderr, "       startup nearly instant, and lets simultaneous runs on the same machine\n");
+    fprintf(stderr, "       share memory. When an index is used, --limit_ram has no effect.\n");
+    fprintf(stderr, "   --minimizer_window -m To save memory, keep only a sample of k-mers, at the\n");
+    fprintf(stderr, "       density of (w,k)-minimizers with this window size w (i.e. 1 in every\n");
+    fprintf(stderr, "       (w+1)/2 k-mers). Only these k-mers are looked up in reads. Larger\n");
+    fprintf(stderr, "       windows use less memory but find fewer species-specific k-mers (see\n");
+    fprintf(stderr, "       bench/minimizer_report). If building an index (--build_index), the index\n");
+    fprintf(stderr, "       will be sampled; otherwise this applies to k-mer lists as they are\n");
+    fprintf(stderr, "       loaded. Default = 0 (use all k-mers).\n");
     fprintf(stderr, "\n ===== NOTES =====\n");
     fprintf(stderr, "   This program works by counting k-mers in RNA-seq data exclusively. The other\n");
     fprintf(stderr, "   types of reads are provided to be demultiplexed only, by sharing of barcodes\n");
@@ -155,37 +214,6 @@ void help(int code){
     exit(code);
 }
 
-// Which component distributions represent doublets? 
-map<int, bool> dist_doublet;
-// What are the idenities of component distributions representing doublets?
-map<int, pair<int, int> > dist2doublet_comb;
-// What are the identities of component distributions representing singlets?
-map<int, int> dist2singlet;
-
-void mm_callback(mixtureModel& mod,
-    vector<double>& shared_params){
-    
-    // Ensure each parameter for each doublet model is an average
-    // of those of its two parent species
-    for (int i = 0; i < mod.dists.size(); ++i){
-        if (dist_doublet[i]){
-            double paramsum = 0.0;
-            for (int dim_idx = 0; dim_idx < mod.dists[i].params[0].size(); ++dim_idx){
-                double parent1 = mod.dists[dist2doublet_comb[i].first].params[0][dim_idx];
-                double parent2 = mod.dists[dist2doublet_comb[i].second].params[0][dim_idx];
-                double pmean = (parent1 + parent2)/2.0;
-                mod.dists[i].params[0][dim_idx] = pmean;
-                paramsum += pmean;
-            }
-            if (paramsum != 1.0){
-                for (int dim_idx = 0; dim_idx < mod.dists[i].params[0].size(); ++dim_idx){
-                    mod.dists[i].params[0][dim_idx] /= paramsum;
-                }
-            }
-        }
-    }
-}
-
 /**
  * Use a mixture of multinomial distributions to model k-mer counts from each species
  * in each cell. Each species of origin will be a source distribution, as will
@@ -204,71 +232,34 @@ void fit_model(robin_hood::unordered_map<unsigned long, map<short, int> >& bc_sp
     robin_hood::unordered_set<unsigned long>& bcs_pass,
     map<short, string>& idx2species,
     double doublet_rate,
-    string& model_out_name){
+    string& model_out_name,
+    int num_threads){
     
-    // First, attempt to sort out true from background cell barcodes
-    map<double, double> counthist;
+    int n_species = idx2species.size();
 
-    // Prepare input data
-    vector<vector<double> > obs;
+    // Prepare input data (one array of counts per species)
+    species_count_table obs(n_species);
     vector<unsigned long> bcs;
-    // Create alternate data set that only consists of total counts
-    vector<vector<double> > obs_tot;
     vector<double> totvec;
+    vector<double> row(n_species);
     for (robin_hood::unordered_map<unsigned long, map<short, int> >::iterator x = 
         bc_species_counts.begin(); x != bc_species_counts.end(); ++x){
         bcs.push_back(x->first);
-        vector<double> row;
         double tot = 0.0;
-        for (short i = 0; i < idx2species.size(); ++i){
-            row.push_back((double)x->second[i]);
-            tot += (double)x->second[i];
-        }
-        
-        for (double i = 0; i < tot-1; ++i){
-            if (counthist.count(i) == 0){
-                counthist.insert(make_pair(i, 0.0));
-            }
-            counthist[i]++;
+        for (short i = 0; i < n_species; ++i){
+            map<short, int>::iterator c = x->second.find(i);
+            row[i] = c == x->second.end() ? 0.0 : (double)c->second;
+            tot += row[i];
         }
-
-        obs.push_back(row);
-        vector<double> rowtot{ tot + 1 };
-        obs_tot.push_back(rowtot);
+        obs.add(row.data(), 1.0);
         totvec.push_back(tot);
     }
     
-    double knee = find_knee(counthist, 0.1);
-
-    vector<vector<double> > obs_init_filt;
-    vector<unsigned long> bc_init_filt;
-    vector<double> weights_init_filt;
-    for (int i = 0; i < obs.size(); ++i){
-        if (totvec[i] > knee){
-            obs_init_filt.push_back(obs[i]);
-            bc_init_filt.push_back(bcs[i]);
-            weights_init_filt.push_back(totvec[i]);
-        }
-    }
+    // First, attempt to sort out true from background cell barcodes:
+    // fit to barcodes above the knee, weighted by total counts
+    species_count_table obs_init_filt(n_species);
+    obs.filter_knee(obs_init_filt);
 
-    /*
-    sort(totvec.begin(), totvec.end());
-    
-    vector<mixtureDist> dists_tot;
-    //mixtureDist dist_tot_low("negative_binomial", vector<double>{ totvec[0], 1.0 });
-    mixtureDist dist_tot_low("poisson", vector<double>{ totvec[0] });
-    mixtureDist dist_tot_high("negative_binomial", vector<double>{ percentile(totvec, 0.999), 1.0 });
-    //mixtureDist dist_tot_high("exponential", vector<double>{ 1.0 / percentile(totvec, 0.999) });
-    dists_tot.push_back(dist_tot_low);
-    dists_tot.push_back(dist_tot_high);
-    mixtureModel mod_tot(dists_tot);
-    mod_tot.fit(obs_tot);
-    mod_tot.print();
-    fprintf(stderr, "%f %f\n", mod_tot.dists[0].params[0][0], 1.0/mod_tot.dists[1].params[0][0]);
-    exit(0);
-    */
-    
-    
     // Next, fit model to learn multinomial dists for each species
 
     // Make an assignment for every cell barcode (including those filtered out in step 1)
@@ -277,107 +268,28 @@ void fit_model(robin_hood::unordered_map<unsigned long, map<short, int> >& bc_sp
 
     fprintf(stderr, "Fitting model to counts...\n");
 
-    int n_species = idx2species.size();
-    
     // Create output file to write dist params 
     FILE* outf = fopen(model_out_name.c_str(), "w");
     fprintf(outf, "name\tweight");
+    vector<string> species_names;
     for (map<short, string>::iterator i2s = idx2species.begin(); i2s != idx2species.end(); ++i2s){
         fprintf(outf, "\t%s", i2s->second.c_str());
+        species_names.push_back(i2s->second);
     }
     fprintf(outf, "\n");
 
-    vector<mixtureDist> dists;
-    
-    int doublet_dist_count = 0;
-    int singlet_dist_count = 0;
-
-    // How will we initialize multinomial parameters for components that match the expected species? 
-    double target_weight = 0.9;
-
     // Each species will be represented by a multinomial distribution, with one component for
-    // each species. 
-    for (map<short, string>::iterator i2s = idx2species.begin(); i2s != idx2species.end(); ++i2s){
-        
-        vector<double> params;
-        for (int i = 0; i < n_species; ++i){
-            if (i == i2s->first){
-                // Target species
-                params.push_back(target_weight);
-            }
-            else{
-                // Non-target species
-                params.push_back((1.0-target_weight)/((double)(n_species-1)));
-            }
-        }
-        
-        mixtureDist dist("multinomial", params);
-        dist.name = i2s->second;
-        dist.set_num_inputs(n_species);
-        dist_doublet.insert(make_pair(dists.size(), false));
-        dist2singlet.insert(make_pair(dists.size(), i2s->first));
-        dists.push_back(dist);
-        singlet_dist_count++;
-        
-    }
-   
-    for (int i = 0; i < n_species-1; ++i){
-        for (int j = i + 1; j < n_species; ++j){
-            
-            // Create doublet distribution
-            vector<double> doublet_params;
-            for (int x = 0; x < n_species; ++x){
-                if (x == i || x == j){
-                    // Target species
-                    doublet_params.push_back(target_weight/2.0);
-                }
-                else{
-                    // Non-target species
-                    doublet_params.push_back((1.0-target_weight)/((double)(n_species-2)));
-                }
-            }
-
-            mixtureDist dist("multinomial", doublet_params);
-            string dname;
-            string name1 = idx2species[i];
-            string name2 = idx2species[j];
-            if (name1 < name2){
-                dname = name1 + "+" + name2;
-            }
-            else{
-                dname = name2 + "+" + name1;
-            }
-            dist.name = dname;
-            dist.set_num_inputs(n_species);
-            dist_doublet.insert(make_pair(dists.size(), true));
-            dist2doublet_comb.insert(make_pair(dists.size(), make_pair(i, j)));
-            dists.push_back(dist);
-            doublet_dist_count++;
-        }
-    } 
-
-    vector<double> dist_weights;
-    for (map<int, bool>::iterator dd = dist_doublet.begin(); dd != dist_doublet.end();
-        ++dd){
-        double weight;
-        if (dd->second){
-            weight = doublet_rate / (double)doublet_dist_count;
-        }
-        else{
-            weight = (1.0-doublet_rate)/(double)singlet_dist_count;
-        }
-        dist_weights.push_back(weight);
-    }
+    // each species and one for each pair of species (doublets). Components for matching
+    // species start with this much of their weight on those species.
+    double target_weight = 0.9;
     
-    // Create and fit mixture model 
-    mixtureModel mod(dists, dist_weights); 
-    mod.set_callback(mm_callback);
-    mod.fit(obs_init_filt, weights_init_filt);
+    species_mixture mod(species_names, target_weight, doublet_rate, num_threads);
+    mod.fit(obs_init_filt);
     
     for (int i = 0; i < mod.n_components; ++i){
-        fprintf(outf, "%s\t%f", mod.dists[i].name.c_str(), mod.weights[i]);
-        for (int j = 0; j < mod.dists[i].params[0].size(); ++j){
-            fprintf(outf, "\t%f", mod.dists[i].params[0][j]);
+        fprintf(outf, "%s\t%f", mod.names[i].c_str(), mod.weights[i]);
+        for (int j = 0; j < n_species; ++j){
+            fprintf(outf, "\t%f", mod.probs[i][j]);
         }
         fprintf(outf, "\n");   
     }
@@ -385,45 +297,28 @@ void fit_model(robin_hood::unordered_map<unsigned long, map<short, int> >& bc_sp
 
     // Use fit distributions and doublet rate prior to assign identities
     // and log likelihood ratios to cell barcodes
-
+    vector<int> bestvec;
+    vector<double> llrvec;
+    mod.assign(obs, bestvec, llrvec);
+    
     // Also prepare data for second mixture model fitting to filter cells
     vector<vector<double> > obs_filt;
     vector<unsigned long> bcs_filt;
-
-    for (int i = 0; i < obs.size(); ++i){
-        
-        vector<pair<double, int> > lls;
-        double rowtot = 0;
-        for (int j = 0; j < mod.n_components; ++j){
-            double ll = mod.dists[j].loglik(obs[i]);
-            // Incorporate prior prob of doublet rate
-            if (dist_doublet[j]){
-                ll += log2(doublet_rate);
-            }
-            else{
-                ll += log2(1.0 - doublet_rate);
-            }
-            lls.push_back(make_pair(-ll, j));
-        }
-        for (int j = 0; j < obs[i].size(); ++j){
-            rowtot += obs[i][j];
-        }
-        sort(lls.begin(), lls.end());
-
-        double llr = -lls[0].first - -lls[1].first;
+    
+    for (int i = 0; i < obs.n; ++i){
+        int best = bestvec[i];
+        double llr = llrvec[i];
         
         if (llr > 0){
-            vector<double> obs_filt_row{ rowtot, llr };
+            vector<double> obs_filt_row{ totvec[i], llr };
             obs_filt.push_back(obs_filt_row);
             bcs_filt.push_back(bcs[i]);
 
-            int maxmod = lls[0].second;
-            bool is_doublet = dist_doublet[maxmod];
-            if (is_doublet){
-                bc2doublet.emplace(bcs[i], dist2doublet_comb[maxmod]);            
+            if (mod.is_doublet(best)){
+                bc2doublet.emplace(bcs[i], make_pair(mod.parent1[best], mod.parent2[best]));
             }
             else{
-                bc2species.emplace(bcs[i], dist2singlet[maxmod]);
+                bc2species.emplace(bcs[i], best);
             }
             bc2llr.emplace(bcs[i], llr);
         
@@ -456,6 +351,55 @@ void fit_model(robin_hood::unordered_map<unsigned long, map<short, int> >& bc_sp
     fprintf(stderr, "%d barcodes likely represent cells\n", npass);
 }
 
+/**
+ * Find the species names and k-mer list files created by get_unique_kmers
+ * for a given base file name.
+ */
+void find_kmer_files(string& kmerbase, 
+    vector<string>& speciesnames, 
+    vector<string>& kmerfiles){
+    string sname = kmerbase + ".names";
+    if (!file_exists(sname)){
+        fprintf(stderr, "ERROR: unable to load k-mer data from base file name %s\n", kmerbase.c_str());
+        exit(1);
+    }
+    ifstream inf(sname.c_str());
+    string line;
+    while (inf >> line){
+        if (line != ""){
+            speciesnames.push_back(line);
+        }
+    }
+    int idx = 0;
+    bool stop = false;
+    while (!stop){
+        char buf[500];
+        sprintf(&buf[0], "%s.%d.kmers", kmerbase.c_str(), idx);
+        string fname = buf;
+        if (file_exists(fname)){
+            kmerfiles.push_back(fname);
+        }
+        else{
+            if (idx < 2){
+                fprintf(stderr, "ERROR: k-mer data is for less than two species. Please re-generate \
+data for %s with more species.\n", kmerbase.c_str());
+                exit(1);
+            }
+            else{
+                stop = true;
+                break;
+            }
+        }
+        ++idx;
+    }
+    if (speciesnames.size() != kmerfiles.size()){
+        fprintf(stderr, "ERROR: differing number of species names (%ld) and kmer files (%ld)\n", 
+            speciesnames.size(), kmerfiles.size());
+        fprintf(stderr, "Please rebuild k-mer data %s.\n", kmerbase.c_str());
+        exit(1);
+    }
+}
+
 int main(int argc, char *argv[]) {    
    
     // Define long-form program options 
@@ -466,18 +410,26 @@ int main(int argc, char *argv[]) {
        {"atac_r3", required_argument, 0, '3'},
        {"rna_r1", required_argument, 0, 'r'},
        {"rna_r2", required_argument, 0, 'R'},
+       {"rna_interleaved", required_argument, 0, 'i'},
        {"custom_r1", required_argument, 0, 'x'},
        {"custom_r2", required_argument, 0, 'X'},
        {"names_custom", required_argument, 0, 'N'},
        {"whitelist_atac", required_argument, 0, 'W'},
        {"whitelist_rna", required_argument, 0, 'w'},
        {"dump", no_argument, 0, 'd'},
+       {"one_pass", no_argument, 0, 'O'},
+       {"count_atac", no_argument, 0, 'a'},
        {"doublet_rate", required_argument, 0, 'D'},
        {"k", required_argument, 0, 'k'},
        {"num_threads", required_argument, 0, 'T'},
+       {"readers", required_argument, 0, 'K'},
+       {"num_chunks", required_argument, 0, 'Z'},
+       {"chunk", required_argument, 0, 'c'},
        {"batch_num", required_argument, 0, 'b'},
        {"disable_umis", no_argument, 0, 'u'},
        {"limit_ram", no_argument, 0, 'l'},
+       {"build_index", no_argument, 0, 'I'},
+       {"minimizer_window", required_argument, 0, 'm'},
        {"libname", required_argument, 0, 'n'},
        {"cellranger", no_argument, 0, 'C'},
        {"seurat", no_argument, 0, 'S'},
@@ -492,17 +444,23 @@ int main(int argc, char *argv[]) {
     vector<string> atac_r3files;
     vector<string> rna_r1files;
     vector<string> rna_r2files;
+    vector<string> rna_ilfiles;
     vector<string> custom_r1files;
     vector<string> custom_r2files;
     vector<string> custom_names;
     string whitelist_atac_filename;
     string whitelist_rna_filename;
     int num_threads = 1;
+    int num_readers = -1;
+    int num_chunks = 1;
+    int chunk = 0;
     double doublet_rate = 0.1;
     string kmerbase;
     vector<string> kmerfiles;
     vector<string> speciesnames;
     bool dump = false;
+    bool one_pass = false;
+    bool count_atac = false;
     int batch_num = -1;
     string libname = "";
     bool cellranger = false;
@@ -511,6 +469,8 @@ int main(int argc, char *argv[]) {
     bool disable_umis = false;
     bool atac_preproc = false;
     bool limit_ram = false;
+    bool build_index = false;
+    int minimizer_w = 0;
 
     int option_index = 0;
     int ch;
@@ -518,7 +478,7 @@ int main(int argc, char *argv[]) {
     if (argc == 1){
         help(0);
     }
-    while((ch = getopt_long(argc, argv, "T:o:n:1:2:3:r:R:x:X:N:k:w:W:D:b:lAuCSUdh", 
+    while((ch = getopt_long(argc, argv, "T:K:Z:c:o:n:1:2:3:r:R:i:x:X:N:k:w:W:D:b:m:lIAauCSUdOh", 
         long_options, &option_index )) != -1){
         switch(ch){
             case 0:
@@ -533,6 +493,15 @@ int main(int argc, char *argv[]) {
             case 'T':
                 num_threads = atoi(optarg);
                 break;
+            case 'K':
+                num_readers = atoi(optarg);
+                break;
+            case 'Z':
+                num_chunks = atoi(optarg);
+                break;
+            case 'c':
+                chunk = atoi(optarg);
+                break;
             case 'o':
                 outdir = optarg;
                 break;
@@ -566,6 +535,9 @@ int main(int argc, char *argv[]) {
             case 'R':
                 rna_r2files.push_back(optarg);
                 break;
+            case 'i':
+                rna_ilfiles.push_back(optarg);
+                break;
             case 'x':
                 custom_r1files.push_back(optarg);
                 break;
@@ -584,6 +556,12 @@ int main(int argc, char *argv[]) {
             case 'd':
                 dump = true;
                 break;
+            case 'O':
+                one_pass = true;
+                break;
+            case 'a':
+                count_atac = true;
+                break;
             case 'D':
                 doublet_rate = atof(optarg);
                 break;
@@ -596,12 +574,52 @@ int main(int argc, char *argv[]) {
             case 'l':
                 limit_ram = true;
                 break;
+            case 'I':
+                build_index = true;
+                break;
+            case 'm':
+                minimizer_w = atoi(optarg);
+                break;
             default:
                 help(0);
                 break;
         }    
     }
     
+    // Interleaved files are read pairs with no R2 file name
+    for (int i = 0; i < rna_ilfiles.size(); ++i){
+        rna_r1files.push_back(rna_ilfiles[i]);
+        rna_r2files.push_back("");
+    }
+
+    if (minimizer_w < 0){
+        fprintf(stderr, "ERROR: --minimizer_window / -m must be 0 or positive\n");
+        exit(1);
+    }
+    if (build_index){
+        if (kmerbase == ""){
+            fprintf(stderr, "ERROR: --build_index / -I requires k-mer data (-k)\n");
+            exit(1);
+        }
+        find_kmer_files(kmerbase, speciesnames, kmerfiles);
+        fprintf(stderr, "Building k-mer index\n");
+        kmer_index kidx;
+        kidx.set_sampling(minimizer_w);
+        kidx.build(kmerfiles);
+        if (kidx.nconflicts > 0){
+            fprintf(stderr, "WARNING: %ld k-mers are listed for more than one species and \
+will be ignored\n", kidx.nconflicts);
+        }
+        string idxname = kmerbase + ".kidx";
+        if (!kidx.write(idxname)){
+            fprintf(stderr, "ERROR writing %s\n", idxname.c_str());
+            exit(1);
+        }
+        fprintf(stderr, "Wrote %ld k-mers (k = %d) to %s\n", (long)kidx.size(), kidx.k, 
+            idxname.c_str());
+        return 0;
+    }
+
     // Error check arguments.
     if (outdir == "" && !dump){
         fprintf(stderr, "ERROR: output_directory / -o is required\n");
@@ -631,10 +649,16 @@ int main(int argc, char *argv[]) {
         char batchbuf[100];
         sprintf(&batchbuf[0], "%d", batch_num);
         batch_str = batchbuf;
-        countsfilename = outdir + "species_counts." + batch_str + ".txt";
+        // Batch counts are only read by combine_species_counts, which merges
+        // sorted binary files
+        countsfilename = outdir + "species_counts." + batch_str + ".bin";
         speciesfilename = outdir + "species_names." + batch_str + ".txt";
         convfilename = outdir + "bcmap." + batch_str + ".txt";
     }
+    else if (!file_exists(countsfilename) && file_exists(outdir + "species_counts.bin")){
+        // Combined by combine_species_counts
+        countsfilename = outdir + "species_counts.bin";
+    }
     
     if (file_exists(countsfilename) && file_exists(speciesfilename)){
         if (batch_given){
@@ -716,6 +740,14 @@ directory containing data, or specify k-mer count files using -k.\n");
         fprintf(stderr, "ERROR: non-matching numbers of R1 and R2 custom input files.\n");
         exit(1);
     }
+    int n_stdin = 0;
+    for (int i = 0; i < rna_r1files.size(); ++i){
+        n_stdin += (rna_r1files[i] == "-") + (rna_r2files[i] == "-");
+    }
+    if (n_stdin > 1){
+        fprintf(stderr, "ERROR: standard input (-) can only be given for one input file.\n");
+        exit(1);
+    }
     if (custom_r1files.size() != custom_names.size()){
         fprintf(stderr, "ERROR: you must provide a name/data type for each custom read \
 file to demultiplex\n");
@@ -731,49 +763,57 @@ file to demultiplex\n");
         fprintf(stderr, "ERROR: doublet rate must be between 0 and 1, exclusive.\n");
         exit(1);
     }
-
-    // Attempt to read unique kmer data
-    if (kmerbase != ""){
-        string sname = kmerbase + ".names";
-        if (!file_exists(sname)){
-            fprintf(stderr, "ERROR: unable to load k-mer data from base file name %s\n", kmerbase.c_str());
-            exit(1);
-        }
-        ifstream inf(sname.c_str());
-        string line;
-        while (inf >> line){
-            if (line != ""){
-                speciesnames.push_back(line);
-            }
-        }
-        int idx = 0;
-        bool stop = false;
-        while (!stop){
-            char buf[500];
-            sprintf(&buf[0], "%s.%d.kmers", kmerbase.c_str(), idx);
-            string fname = buf;
-            if (file_exists(fname)){
-                kmerfiles.push_back(fname);
-            }
-            else{
-                if (idx < 2){
-                    fprintf(stderr, "ERROR: k-mer data is for less than two species. Please re-generate \
-data for %s with more species.\n", kmerbase.c_str());
-                    exit(1);
-                }
-                else{
-                    stop = true;
-                    break;
-                }
-            }
-            ++idx;
+    if (num_readers == -1){
+        num_readers = num_threads / 4 > 1 ? num_threads / 4 : 1;
+    }
+    else if (num_readers < 1){
+        fprintf(stderr, "ERROR: --readers / -K must be at least 1\n");
+        exit(1);
+    }
+    if (num_chunks < 1 || chunk < 0 || chunk >= num_chunks){
+        fprintf(stderr, "ERROR: --chunk / -c must be from 0 to --num_chunks / -Z minus 1\n");
+        exit(1);
+    }
+    if (count_atac && !countsfile_given && (whitelist_rna_filename == "" || 
+        whitelist_atac_filename == "")){
+        fprintf(stderr, "ERROR: --count_atac / -a requires multiome data, with both RNA-seq (-w) \
+and ATAC-seq (-W) barcode whitelists\n");
+        exit(1);
+    }
+    if (count_atac && atac_r1files.size() == 0){
+        fprintf(stderr, "NOTE: no ATAC-seq reads given; ignoring --count_atac\n");
+        count_atac = false;
+    }
+    if (num_chunks > 1 && atac_r1files.size() > 0){
+        fprintf(stderr, "ERROR: ATAC-seq reads cannot be read in chunks. Split them with \
+split_read_files instead.\n");
+        exit(1);
+    }
+    // Reading in chunks requires BGZF input
+    for (int i = 0; i < rna_r1files.size() + custom_r1files.size(); ++i){
+        string& r1 = i < rna_r1files.size() ? rna_r1files[i] : 
+            custom_r1files[i - rna_r1files.size()];
+        string& r2 = i < rna_r1files.size() ? rna_r2files[i] :
+            custom_r2files[i - rna_r1files.size()];
+        if (fq_chunkable(r1) && (r2 == "" || fq_chunkable(r2))){
+            continue;
         }
-        if (speciesnames.size() != kmerfiles.size()){
-            fprintf(stderr, "ERROR: differing number of species names (%ld) and kmer files (%ld)\n", 
-                speciesnames.size(), kmerfiles.size());
-            fprintf(stderr, "Please rebuild k-mer data %s.\n", kmerbase.c_str());
+        string& fn = r2 != "" && fq_chunkable(r1) ? r2 : r1;
+        if (num_chunks > 1){
+            fprintf(stderr, "ERROR: %s is not a BGZF-compressed file, so it cannot be read \
+in chunks. Compress it with bgzip or split it with split_read_files.\n", fn.c_str());
             exit(1);
         }
+        else if (num_readers > 1 && num_threads > 1){
+            fprintf(stderr, "NOTE: %s is not BGZF-compressed (or is a pipe), so it will \
+be read by one thread. Compress it with bgzip to read it in %d chunks at once.\n",
+                fn.c_str(), num_readers);
+        }
+    }
+
+    // Attempt to read unique kmer data
+    if (kmerbase != ""){
+        find_kmer_files(kmerbase, speciesnames, kmerfiles);
     }
     if (!mkdir(outdir.c_str(), 0775)){
         // Assume directory already exists
@@ -797,9 +837,73 @@ data for %s with more species.\n", kmerbase.c_str());
         k = strlen(peek.line);
         fprintf(stderr, "Using k = %d\n", k);
     }
+
+    // Use a prebuilt k-mer index, if there is one
+    kmer_index kidx;
+    string idxname = kmerbase + ".kidx";
+    if (kmerfiles.size() > 0 && !countsfile_given && file_exists(idxname)){
+        struct stat idx_st;
+        stat(idxname.c_str(), &idx_st);
+        bool stale = false;
+        for (int i = 0; i < kmerfiles.size(); ++i){
+            struct stat kmer_st;
+            if (stat(kmerfiles[i].c_str(), &kmer_st) == 0 && kmer_st.st_mtime > idx_st.st_mtime){
+                stale = true;
+            }
+        }
+        if (stale){
+            fprintf(stderr, "WARNING: %s is older than k-mer data; ignoring it. Rebuild it \
+with --build_index / -I.\n", idxname.c_str());
+        }
+        else if (!kidx.load(idxname)){
+            fprintf(stderr, "WARNING: could not load k-mer index %s; ignoring it\n", 
+                idxname.c_str());
+        }
+        else if (kidx.k != k || kidx.num_species != kmerfiles.size()){
+            fprintf(stderr, "WARNING: k-mer index %s does not match k-mer data; ignoring it\n",
+                idxname.c_str());
+            kidx.close();
+        }
+        else{
+            fprintf(stderr, "Using k-mer index %s\n", idxname.c_str());
+            if (kidx.sample_w != minimizer_w){
+                fprintf(stderr, "NOTE: k-mer index was built with --minimizer_window %d, \
+which will be used instead of %d\n", kidx.sample_w, minimizer_w);
+            }
+        }
+    }
     
     robin_hood::unordered_map<unsigned long, map<short, int> > bc_species_counts;
     
+    // Reads from standard input or a pipe can only be read once, so they
+    // must be saved while counting k-mers if they are to be demultiplexed
+    if (!one_pass && !countsfile_given && !dump && !batch_given){
+        for (int i = 0; i < rna_r1files.size(); ++i){
+            if (!fq_rereadable(rna_r1files[i]) || 
+                (rna_r2files[i] != "" && !fq_rereadable(rna_r2files[i]))){
+                fprintf(stderr, "NOTE: RNA-seq reads are streamed from standard input or \
+a pipe; enabling --one_pass\n");
+                one_pass = true;
+                break;
+            }
+        }
+    }
+    // Reads only need to be saved if they will be demultiplexed in this run
+    if (one_pass && (countsfile_given || dump || batch_given)){
+        fprintf(stderr, "NOTE: reads will not be demultiplexed after counting k-mers in this run; \
+ignoring --one_pass\n");
+        one_pass = false;
+    }
+    // RNA-seq reads saved while counting k-mers, per pair of input files
+    deque<read_spill> spills;
+    if (one_pass){
+        for (int i = 0; i < rna_r1files.size(); ++i){
+            char buf[50];
+            sprintf(&buf[0], "%d", i);
+            spills.emplace_back(outdir + "reads_tmp." + buf);
+        }
+    }
+    
     // Multiome data uses different ATAC and RNA-seq barcodes
     // This maps an RNA-seq barcode (which goes into the BAM) to an ATAC-seq barcode
     robin_hood::unordered_map<unsigned long, unsigned long> bc_conversion;
@@ -820,6 +924,8 @@ data for %s with more species.\n", kmerbase.c_str());
         
         // Init species k-mer counter 
         species_kmer_counter counter(num_threads, k, kmerfiles.size(), &wl, &bc_species_counts);
+        counter.set_readers(num_readers);
+        counter.set_chunk(chunk, num_chunks);
 
         if (disable_umis){
             fprintf(stderr, "Running without collapsing UMIs\n");
@@ -830,49 +936,90 @@ data for %s with more species.\n", kmerbase.c_str());
             counter.enable_umis();
         }
 
+        if (minimizer_w > 1 && !kidx.loaded()){
+            fprintf(stderr, "Keeping k-mers at minimizer density (w = %d)\n", minimizer_w);
+            counter.set_sampling(minimizer_w);
+        }
+        
+        // To limit memory, build an index on disk one part at a time, rather 
+        // than loading all k-mers. Using one part per species keeps peak memory
+        // near the size of one species' k-mers, and reads only need to be 
+        // scanned once.
+        if (limit_ram && !kidx.loaded()){
+            string tmpidxname = outdir + "kmers.kidx.tmp";
+            fprintf(stderr, "Building temporary k-mer index %s\n", tmpidxname.c_str());
+            kidx.set_sampling(minimizer_w);
+            if (!kidx.build_on_disk(kmerfiles, tmpidxname, kmerfiles.size()) || 
+                !kidx.load(tmpidxname)){
+                fprintf(stderr, "ERROR: could not build k-mer index %s\n", tmpidxname.c_str());
+                exit(1);
+            }
+            // The mapping stays valid after the file is removed
+            unlink(tmpidxname.c_str());
+            fprintf(stderr, "done\n");
+        }
+
+        // The index holds all species at once
+        if (kidx.loaded()){
+            counter.use_index(&kidx);
+        }
+
         // i = species index
         for (int i = 0; i < kmerfiles.size(); ++i){
             
-            // Parse k-mer file 
-            fprintf(stderr, "Loading %s-specific k-mers\n", speciesnames[i].c_str());
-            if (limit_ram){
-                counter.init(i, kmerfiles[i]);
-            }
-            else{
+            if (!kidx.loaded()){
+                // Parse k-mer file 
+                fprintf(stderr, "Loading %s-specific k-mers\n", speciesnames[i].c_str());
                 counter.add(i, kmerfiles[i]);
+                fprintf(stderr, "done\n");
             }
-            fprintf(stderr, "done\n");
-            
+
             idx2species.insert(make_pair(i, speciesnames[i]));
             species2idx.insert(make_pair(speciesnames[i], i));
-            
-            if (limit_ram){ 
-                for (int i = 0; i < rna_r1files.size(); ++i){
-                    // The object handles multi-threading, if enabled
-                    fprintf(stderr, "Counting read pair %s, %s\n", rna_r1files[i].c_str(), 
-                        rna_r2files[i].c_str());
-                    counter.process_gex_files(rna_r1files[i], rna_r2files[i]); 
-                    fprintf(stderr, "done\n");
-                }
-            }
         }
-        if (!limit_ram){
-            for (int i = 0; i < rna_r1files.size(); ++i){
-                // The object handles multi-threading, if enabled
+        for (int i = 0; i < rna_r1files.size(); ++i){
+            // The object handles multi-threading, if enabled
+            if (rna_r2files[i] == ""){
+                fprintf(stderr, "Counting interleaved reads %s\n", rna_r1files[i].c_str());
+            }
+            else{
                 fprintf(stderr, "Counting read pair %s, %s\n", rna_r1files[i].c_str(), 
                     rna_r2files[i].c_str());
-                counter.process_gex_files(rna_r1files[i], rna_r2files[i]); 
-                fprintf(stderr, "done\n");
             }
+            counter.process_gex_files(rna_r1files[i], rna_r2files[i], 
+                one_pass ? &spills[i] : NULL); 
+            fprintf(stderr, "done\n");
+        }
+        for (int i = 0; count_atac && i < atac_r1files.size(); ++i){
+            fprintf(stderr, "Counting ATAC-seq reads %s, %s, %s\n", atac_r1files[i].c_str(),
+                atac_r2files[i].c_str(), atac_r3files[i].c_str());
+            counter.process_atac_files(atac_r1files[i], atac_r2files[i], 
+                atac_r3files[i], true);
+            fprintf(stderr, "done\n");
+        }
+        kmer_lookup_stats lookup_stats;
+        counter.get_lookup_stats(lookup_stats);
+        if (lookup_stats.kmers > 0){
+            long passed = lookup_stats.kmers - lookup_stats.rejected;
+            fprintf(stderr, "K-mers looked up: %ld; rejected by prefilter: %ld (%.2f%%); \
+passed: %ld; found: %ld (%.2f%% of passed)\n", lookup_stats.kmers, lookup_stats.rejected,
+                100.0 * (double)lookup_stats.rejected / (double)lookup_stats.kmers, passed,
+                lookup_stats.hits, passed > 0 ? 
+                100.0 * (double)lookup_stats.hits / (double)passed : 0.0);
         }
 
         // Create a counts file so we don't have to do the expensive process of counting 
         // k-mers next time, if we need to do something over.
 
-        FILE* countsfile = fopen(countsfilename.c_str(), "w");         
-        // Dump species counts
-        print_bc_species_counts(bc_species_counts, idx2species, countsfile); 
-        fclose(countsfile);
+        if (batch_given){
+            write_species_counts_bin(countsfilename, bc_species_counts, idx2species.size());
+        }
+        else{
+            FILE* countsfile = fopen(countsfilename.c_str(), "w");         
+            // Dump species counts
+            print_bc_species_counts(bc_species_counts, idx2species, countsfile); 
+            fclose(countsfile);
+        }
     
         if (whitelist_rna_filename != "" && whitelist_atac_filename != ""){
             // Also dump a mapping of RNA -> ATAC barcodes
@@ -939,7 +1086,7 @@ data for %s with more species.\n", kmerbase.c_str());
         robin_hood::unordered_set<unsigned long> bcs_pass;
         
         fit_model(bc_species_counts, bc2species, bc2doublet, bc2llr, bcs_pass,
-            idx2species, doublet_rate, model_out_name);
+            idx2species, doublet_rate, model_out_name, num_threads);
         
         FILE* bc_out = fopen(assnfilename.c_str(), "w");
         print_assignments(bc_out, libname, cellranger, seurat, underscore, 
@@ -954,7 +1101,17 @@ data for %s with more species.\n", kmerbase.c_str());
     }
     // See if we can/should create "library files" for multiome data, to save headaches later
     if (rna_r1files.size() > 0 || atac_r1files.size() > 0 || custom_r1files.size() > 0){
-        create_library_file(rna_r1files, atac_r1files, custom_r1files, 
+        // Interleaved and standard input have output names of their own
+        vector<string> rna_outnames;
+        for (int i = 0; i < rna_r1files.size(); ++i){
+            if (rna_r2files[i] == "" || rna_r1files[i] == "-"){
+                rna_outnames.push_back(mate_outname(rna_r1files[i], "R1"));
+            }
+            else{
+                rna_outnames.push_back(rna_r1files[i]);
+            }
+        }
+        create_library_file(rna_outnames, atac_r1files, custom_r1files, 
             custom_names, idx2species, outdir);
     }
     if (dump){
@@ -1015,6 +1172,8 @@ data for %s with more species.\n", kmerbase.c_str());
     // Now go through reads and demultiplex by species.
     reads_demuxer demuxer(wl_out, bc2species, idx2species, outdir);
     demuxer.set_threads(num_threads);
+    demuxer.set_readers(num_readers);
+    demuxer.set_chunk(chunk, num_chunks);
     demuxer.correct_bcs(true);
     if (atac_preproc){
         demuxer.preproc_atac(true);
@@ -1026,10 +1185,22 @@ data for %s with more species.\n", kmerbase.c_str());
         demuxer.scan_atac();
     } 
     for (int i = 0; i < rna_r1files.size(); ++i){
-        fprintf(stderr, "Processing RNA-seq files %s and %s\n", 
-            rna_r1files[i].c_str(), rna_r2files[i].c_str());
+        if (rna_r2files[i] == ""){
+            fprintf(stderr, "Processing interleaved RNA-seq file %s\n", 
+                rna_r1files[i].c_str());
+        }
+        else{
+            fprintf(stderr, "Processing RNA-seq files %s and %s\n", 
+                rna_r1files[i].c_str(), rna_r2files[i].c_str());
+        }
         demuxer.init_rna(rna_r1files[i], rna_r2files[i]);
-        demuxer.scan_rna();
+        if (one_pass){
+            // Reads were saved while counting k-mers
+            demuxer.route_rna(spills[i]);
+        }
+        else{
+            demuxer.scan_rna();
+        }
     }
     for (int i = 0; i < custom_r1files.size(); ++i){
         fprintf(stderr, "Processing custom read files %s and %s\n", 
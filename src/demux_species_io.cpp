@@ -20,6 +20,7 @@
 #include <htswrapper/robin_hood/robin_hood.h>
 #include "common.h"
 #include "demux_species_io.h"
+#include "species_counts_bin.h"
 
 using namespace std;
 
@@ -195,7 +196,8 @@ void print_bc_species_counts(
 
 /**
  * Instead of iterating through the BAM file again, can just load data from a previous run.
- * Requires counts file and species file both generated from previous runs.
+ * Requires counts file and species file both generated from previous runs. The counts
+ * file can be a text table or binary (see species_counts_bin.h).
  */
 void load_from_files(string& countsfilename,
     string& speciesfilename,
@@ -215,6 +217,11 @@ void load_from_files(string& countsfilename,
     }
     
     // Load count data
+    if (is_species_counts_bin(countsfilename)){
+        load_species_counts_bin(countsfilename, bc_species_counts);
+        fprintf(stderr, "done\n");
+        return;
+    }
     string line;
     ifstream countsfile(countsfilename);
     while (getline(countsfile, line)){
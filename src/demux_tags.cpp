@@ -16,6 +16,7 @@
 #include <set>
 #include <cstdlib>
 #include <utility>
+#include <deque>
 #include <math.h>
 #include <zlib.h>
 #include <htswrapper/robin_hood/robin_hood.h>
@@ -31,6 +32,7 @@
 #include <optimML/multivar_sys.h>
 #include <optimML/brent.h>
 #include "common.h"
+#include "fq_stream.h"
 #include <htswrapper/gzreader.h>
 
 using std::cout;
@@ -2213,7 +2215,8 @@ void count_tags_in_reads(vector<string>& read1fn,
     set<unsigned long>& cell_barcodes,
     string& cell_barcodesfn,
     map<string, int>& seq2idx,
-    robin_hood::unordered_map<unsigned long, vector<umi_set_exact*> >& bc_tag_umis){
+    robin_hood::unordered_map<unsigned long, vector<umi_set_exact*> >& bc_tag_umis,
+    int nthreads){
     // Initiate tag barcode whitelist
     seq_fuzzy_match tagmatch(seqlist, mismatches, true, true);
     map<int, int> matchpos_found;
@@ -2254,8 +2257,15 @@ void count_tags_in_reads(vector<string>& read1fn,
 
     char seq_buf[seq_len+1];
     for (int i = 0; i < read1fn.size(); ++i){
+        // With multiple threads, decompress each input file in its own thread
+        deque<fq_stream> streams;
+        vector<string> paths{ read1fn[i], read2fn[i] };
+        if (nthreads > 1){
+            vector<string> filenames = paths;
+            open_fq_streams(streams, filenames, paths, nthreads);
+        }
         // Initiate object to read through FASTQs and find cell barcodes.
-        scanner.add_reads(read1fn[i], read2fn[i]);
+        scanner.add_reads(paths[0], paths[1]);
         while (scanner.next()){
             // At this point, there's a valid cell barcode.
             // scanner.barcode_read holds R1
@@ -2677,7 +2687,7 @@ next time)...\n");
             // Process reads and count tags in them
             count_tags_in_reads(read1fn, read2fn, seqlist, mismatches, wlfn,
                 umi_len, sgrna, exact_cell_barcodes, seq_len, has_cell_barcodes,
-                cell_barcodes, cell_barcodesfn, seq2idx, bc_tag_umis);
+                cell_barcodes, cell_barcodesfn, seq2idx, bc_tag_umis, nthreads);
             // Write counts to disk
             string countsfn = output_prefix + ".counts";
             dump_counts(countsfn, bc_tag_umis, seq_names, bc_tag_counts, batch_id, cellranger, seurat, underscore);
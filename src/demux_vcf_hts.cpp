@@ -671,9 +671,8 @@ void process_bam_record(bam_reader& reader,
         !reader.dup() && reader.has_cb_z){
                         
         // Get BC key
-        bc bc_bits;
-        str2bc(reader.cb_z, bc_bits);
-        unsigned long bc_key = bc_bits.to_ulong();
+        unsigned long bc_key;
+        cb2ul(reader.cb_z, bc_key);
         
         if (!has_bc_list || bcs_valid.find(bc_key) != bcs_valid.end()){
             
@@ -795,9 +794,8 @@ void process_bam_record_bysnp(bam_reader& reader,
         !reader.dup() && reader.has_cb_z){
                         
         // Get BC key
-        bc bc_bits;
-        str2bc(reader.cb_z, bc_bits);
-        unsigned long bc_key = bc_bits.to_ulong();
+        unsigned long bc_key;
+        cb2ul(reader.cb_z, bc_key);
         
         if (assignments.count(bc_key) > 0){
             
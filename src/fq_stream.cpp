@@ -0,0 +1,743 @@
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <utility>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <htslib/hts.h>
+#include <htslib/bgzf.h>
+#include <htslib/kseq.h>
+#include "fq_stream.h"
+
+KSEQ_INIT(gzFile, gzread);
+
+using namespace std;
+
+// How much decompressed data to hand to the pipe at once
+#define FQ_STREAM_BUFSIZE 262144
+
+// How many compressed bytes to search at a time for the next BGZF block
+#define FQ_CHUNK_SCAN_SIZE 131072
+
+// How far (in compressed bytes) before its expected position to start 
+// looking for the mate of a chunk's first read in R2, at first
+#define FQ_CHUNK_MATE_MARGIN 4194304
+
+fq_stream::fq_stream(){
+    fp = NULL;
+    fd = -1;
+    write_fd = -1;
+    running = false;
+    stop = false;
+}
+
+fq_stream::~fq_stream(){
+    close();
+}
+
+bool fq_stream::open(const string& fn, int bgzf_threads){
+    close();
+    filename = fn;
+    fp = bgzf_open(fn.c_str(), "r");
+    if (!fp){
+        return false;
+    }
+    if (bgzf_threads > 0 && bgzf_compression(fp) == bgzf){
+        // Each BGZF block can be inflated independently
+        bgzf_mt(fp, bgzf_threads, 256);
+    }
+    int p[2];
+    if (pipe(p) != 0){
+        bgzf_close(fp);
+        fp = NULL;
+        return false;
+    }
+#ifdef F_SETPIPE_SZ
+    // The default pipe buffer (64 kB) makes both sides switch back and
+    // forth more often than necessary. This can fail if the system limit
+    // is lower, which is harmless.
+    fcntl(p[1], F_SETPIPE_SZ, 1048576);
+#endif
+    // Non-blocking writes let the reader thread notice if it is told to
+    // stop while the consumer is not reading.
+    fcntl(p[1], F_SETFL, fcntl(p[1], F_GETFL) | O_NONBLOCK);
+    fd = p[0];
+    write_fd = p[1];
+    path = "/dev/fd/" + to_string(fd);
+    stop = false;
+    running = true;
+    reader = thread(read_thread, this);
+    return true;
+}
+
+/**
+ * Decompress the input file into the pipe until done, or until
+ * told to stop.
+ */
+void fq_stream::read_thread(fq_stream* obj){
+    // If the consumer closes its end early, get EPIPE from write()
+    // instead of being killed by SIGPIPE.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    vector<char> buf(FQ_STREAM_BUFSIZE);
+    bool done = false;
+    while (!done && !obj->stop){
+        ssize_t nread = bgzf_read(obj->fp, buf.data(), buf.size());
+        if (nread < 0){
+            fprintf(stderr, "ERROR decompressing %s\n", obj->filename.c_str());
+            exit(1);
+        }
+        else if (nread == 0){
+            break;
+        }
+        ssize_t nwritten = 0;
+        while (nwritten < nread){
+            ssize_t n = write(obj->write_fd, buf.data() + nwritten, nread - nwritten);
+            if (n >= 0){
+                nwritten += n;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK){
+                if (obj->stop){
+                    done = true;
+                    break;
+                }
+                struct pollfd pfd;
+                pfd.fd = obj->write_fd;
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, 100);
+            }
+            else if (errno != EINTR){
+                // Consumer is gone
+                done = true;
+                break;
+            }
+        }
+    }
+    // Signal end of file to the consumer
+    ::close(obj->write_fd);
+    obj->write_fd = -1;
+}
+
+void fq_stream::close(){
+    if (running){
+        stop = true;
+        if (fd >= 0){
+            ::close(fd);
+            fd = -1;
+        }
+        reader.join();
+        running = false;
+    }
+    if (fd >= 0){
+        ::close(fd);
+        fd = -1;
+    }
+    if (fp){
+        bgzf_close(fp);
+        fp = NULL;
+    }
+    path = "";
+}
+
+void open_fq_streams(deque<fq_stream>& streams,
+    const vector<string>& filenames,
+    vector<string>& paths,
+    int nthreads){
+
+    streams.clear();
+    paths.clear();
+    // Split any extra threads between files for BGZF decompression
+    int bgzf_threads = 0;
+    if (filenames.size() > 0 && nthreads > 1){
+        bgzf_threads = nthreads / (int)filenames.size();
+    }
+    for (int i = 0; i < filenames.size(); ++i){
+        streams.emplace_back();
+        if (!streams.back().open(filenames[i], bgzf_threads)){
+            fprintf(stderr, "ERROR opening %s for reading\n", filenames[i].c_str());
+            exit(1);
+        }
+        paths.push_back(streams.back().path);
+    }
+}
+
+// One FASTQ record, read line by line from BGZF input
+struct fq_record{
+    kstring_t lines[4];
+    const char* name;
+    int name_len;
+    fq_record(){
+        for (int i = 0; i < 4; ++i){
+            lines[i].l = 0;
+            lines[i].m = 0;
+            lines[i].s = NULL;
+        }
+        name = NULL;
+        name_len = 0;
+    }
+    ~fq_record(){
+        for (int i = 0; i < 4; ++i){
+            free(lines[i].s);
+        }
+    }
+};
+
+struct fq_pair_files{
+    gzFile f_fp;
+    gzFile r_fp;
+    kseq_t* seq_f;
+    kseq_t* seq_r;
+
+    // Used instead of the above when reading one chunk of BGZF input
+    BGZF* f_bgzf;
+    BGZF* r_bgzf;
+    fq_record rec_f;
+    fq_record rec_r;
+    // Virtual offset in R1 where the next chunk starts (-1 = end of file)
+    int64_t end;
+    bool done;
+
+    fq_pair_files(){
+        f_fp = NULL;
+        r_fp = NULL;
+        seq_f = NULL;
+        seq_r = NULL;
+        f_bgzf = NULL;
+        r_bgzf = NULL;
+        end = -1;
+        done = false;
+    }
+};
+
+/**
+ * Open a FASTQ file (or the read end of an fq_stream) for parsing;
+ * "-" is standard input. Exits on failure.
+ */
+static gzFile open_fq_gz(const string& path, const string& filename){
+    gzFile fp;
+    if (path == "-"){
+        fp = gzdopen(dup(fileno(stdin)), "r");
+    }
+    else{
+        fp = gzopen(path.c_str(), "r");
+    }
+    if (!fp){
+        fprintf(stderr, "ERROR opening %s for reading\n", filename.c_str());
+        exit(1);
+    }
+    return fp;
+}
+
+static void swap_records(kseq_t* a, kseq_t* b){
+    swap(a->name, b->name);
+    swap(a->comment, b->comment);
+    swap(a->seq, b->seq);
+    swap(a->qual, b->qual);
+}
+
+/**
+ * Whether two read names belong to mates, allowing for /1 and /2 suffixes.
+ */
+static bool mate_names_match(const char* n1, size_t len1, const char* n2, size_t len2){
+    if (len1 > 1 && len2 > 1 && n1[len1-2] == '/' && n2[len2-2] == '/'){
+        len1 -= 2;
+        len2 -= 2;
+    }
+    return len1 == len2 && strncmp(n1, n2, len1) == 0;
+}
+
+/**
+ * Read the next FASTQ record (four lines) from BGZF input. Returns false at 
+ * end of file, and exits if the record is truncated or malformed.
+ */
+static bool read_fq_record(BGZF* fp, fq_record& rec, const string& filename){
+    int ret = bgzf_getline(fp, '\n', &rec.lines[0]);
+    if (ret == -1){
+        return false;
+    }
+    for (int i = 1; i < 4 && ret >= 0; ++i){
+        ret = bgzf_getline(fp, '\n', &rec.lines[i]);
+    }
+    if (ret < 0){
+        fprintf(stderr, "ERROR: %s is truncated or corrupted\n", filename.c_str());
+        exit(1);
+    }
+    if (rec.lines[0].l < 1 || rec.lines[0].s[0] != '@' || rec.lines[2].l < 1 ||
+        rec.lines[2].s[0] != '+' || rec.lines[1].l != rec.lines[3].l){
+        fprintf(stderr, "ERROR: malformed FASTQ record %s in %s\n", rec.lines[0].s,
+            filename.c_str());
+        exit(1);
+    }
+    // Like kseq, the name ends at the first whitespace
+    rec.name = rec.lines[0].s + 1;
+    rec.name_len = strcspn(rec.name, " \t");
+    return true;
+}
+
+/**
+ * Whether the 18 bytes at buf are a BGZF block header (a gzip header with
+ * the extra "BC" field holding the block size). Stores the size of the
+ * block in bsize.
+ */
+static bool is_bgzf_header(const unsigned char* buf, int64_t& bsize){
+    if (buf[0] != 31 || buf[1] != 139 || buf[2] != 8 || (buf[3] & 4) == 0 ||
+        buf[10] != 6 || buf[11] != 0 || buf[12] != 'B' || buf[13] != 'C' || 
+        buf[14] != 2 || buf[15] != 0){
+        return false;
+    }
+    bsize = (int64_t)(buf[16] | (buf[17] << 8)) + 1;
+    return true;
+}
+
+/**
+ * Compressed offset of the first BGZF block in a file that starts at or 
+ * after pos, or the size of the file if there is none. A match counts only
+ * if another block (or the end of the file) follows it, since compressed 
+ * data can look like a block header by chance.
+ */
+static int64_t bgzf_block_after(FILE* raw, int64_t pos, int64_t size){
+    vector<unsigned char> buf(FQ_CHUNK_SCAN_SIZE + 18);
+    unsigned char next[18];
+    while (pos < size){
+        if (fseeko(raw, pos, SEEK_SET) != 0){
+            return size;
+        }
+        size_t nread = fread(buf.data(), 1, buf.size(), raw);
+        if (nread < 18){
+            return size;
+        }
+        for (size_t i = 0; i + 18 <= nread; ++i){
+            int64_t bsize;
+            if (is_bgzf_header(&buf[i], bsize)){
+                int64_t after = pos + i + bsize;
+                if (after == size){
+                    return pos + i;
+                }
+                int64_t bsize2;
+                if (after < size && fseeko(raw, after, SEEK_SET) == 0 &&
+                    fread(&next[0], 1, 18, raw) == 18 && is_bgzf_header(&next[0], bsize2)){
+                    return pos + i;
+                }
+            }
+        }
+        pos += nread - 17;
+    }
+    return size;
+}
+
+/**
+ * Virtual offset of the first FASTQ record that starts in or after the BGZF
+ * block at compressed offset coffset, or -1 if there is none. A record start
+ * is a line beginning with @, followed by a line, one beginning with +, and 
+ * one as long as the second (quality strings can begin with @ or +, but
+ * sequences cannot).
+ */
+static int64_t fq_record_after(BGZF* fp, int64_t coffset, const string& filename){
+    if (bgzf_seek(fp, coffset << 16, SEEK_SET) < 0){
+        fprintf(stderr, "ERROR seeking in %s\n", filename.c_str());
+        exit(1);
+    }
+    kstring_t line = { 0, 0, NULL };
+    int64_t voffsets[4];
+    char firsts[4];
+    size_t lens[4];
+    int nlines = 0;
+    int64_t found = -1;
+    // Unless this is the start of the file, the first line can be the end 
+    // of one that started in an earlier block
+    bool skip = coffset > 0;
+    while (true){
+        int64_t voffset = bgzf_tell(fp);
+        int ret = bgzf_getline(fp, '\n', &line);
+        if (ret < -1){
+            fprintf(stderr, "ERROR decompressing %s\n", filename.c_str());
+            exit(1);
+        }
+        else if (ret == -1){
+            break;
+        }
+        if (skip){
+            skip = false;
+            continue;
+        }
+        if (nlines == 4){
+            for (int i = 0; i < 3; ++i){
+                voffsets[i] = voffsets[i+1];
+                firsts[i] = firsts[i+1];
+                lens[i] = lens[i+1];
+            }
+            nlines = 3;
+        }
+        voffsets[nlines] = voffset;
+        firsts[nlines] = line.l > 0 ? line.s[0] : '\0';
+        lens[nlines] = line.l;
+        nlines++;
+        if (nlines == 4 && firsts[0] == '@' && firsts[2] == '+' && lens[1] == lens[3]){
+            found = voffsets[0];
+            break;
+        }
+    }
+    free(line.s);
+    return found;
+}
+
+/**
+ * Virtual offset where chunk (of num_chunks) of a BGZF FASTQ file starts, 
+ * or -1 if it starts at the end of the file. In interleaved files, chunks 
+ * start at R1 records.
+ */
+static int64_t fq_chunk_start(FILE* raw, BGZF* fp, int64_t size, int chunk, 
+    int num_chunks, bool interleaved, const string& filename){
+    if (chunk == 0){
+        return 0;
+    }
+    int64_t coffset = bgzf_block_after(raw, (int64_t)((double)size * 
+        (double)chunk / (double)num_chunks), size);
+    if (coffset >= size){
+        return -1;
+    }
+    int64_t start = fq_record_after(fp, coffset, filename);
+    if (start < 0 || !interleaved){
+        return start;
+    }
+    // Move ahead one record if this one is an R2 (it is an R1 only if the 
+    // next record is its mate)
+    fq_record rec1;
+    fq_record rec2;
+    bgzf_seek(fp, start, SEEK_SET);
+    read_fq_record(fp, rec1, filename);
+    int64_t start2 = bgzf_tell(fp);
+    if (!read_fq_record(fp, rec2, filename)){
+        return -1;
+    }
+    if (mate_names_match(rec1.name, rec1.name_len, rec2.name, rec2.name_len)){
+        return start;
+    }
+    return start2;
+}
+
+/**
+ * Get the compressed size of a file, or exit.
+ */
+static int64_t fq_file_size(const string& filename){
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0){
+        fprintf(stderr, "ERROR opening %s for reading\n", filename.c_str());
+        exit(1);
+    }
+    return st.st_size;
+}
+
+/**
+ * Seek R2 to the mate of the first read in a chunk of R1, which starts at
+ * compressed offset r1_coffset of r1_size. Looks in a window around the same
+ * relative position in R2, widening it until the mate is found.
+ */
+static void fq_find_mate(BGZF* fp, const string& filename, const fq_record& rec1,
+    int64_t r1_coffset, int64_t r1_size){
+    int64_t size = fq_file_size(filename);
+    FILE* raw = fopen(filename.c_str(), "rb");
+    if (!raw){
+        fprintf(stderr, "ERROR opening %s for reading\n", filename.c_str());
+        exit(1);
+    }
+    int64_t guess = (int64_t)((double)r1_coffset / (double)r1_size * (double)size);
+    int64_t margin = FQ_CHUNK_MATE_MARGIN;
+    fq_record rec2;
+    while (true){
+        int64_t from = guess - margin;
+        if (from < 0){
+            from = 0;
+        }
+        // Check records starting in [guess - margin, guess + margin]. If the
+        // mate is not there, widen the window and try again. Once the window
+        // reaches the start of the file, read to the end of the file, and
+        // give up if the mate is still not found.
+        int64_t until = guess + margin;
+        int64_t voffset = fq_record_after(fp, bgzf_block_after(raw, from, size), filename);
+        if (voffset >= 0){
+            bgzf_seek(fp, voffset, SEEK_SET);
+            while (from == 0 || (voffset >> 16) <= until){
+                if (!read_fq_record(fp, rec2, filename)){
+                    break;
+                }
+                if (mate_names_match(rec1.name, rec1.name_len, rec2.name, rec2.name_len)){
+                    fclose(raw);
+                    bgzf_seek(fp, voffset, SEEK_SET);
+                    return;
+                }
+                voffset = bgzf_tell(fp);
+            }
+        }
+        if (from == 0){
+            fprintf(stderr, "ERROR: could not find the mate of read %s in %s\n",
+                rec1.lines[0].s, filename.c_str());
+            fprintf(stderr, "Reads in both files must have the same names and order.\n");
+            exit(1);
+        }
+        margin *= 4;
+    }
+}
+
+fq_pair_reader::fq_pair_reader(){
+    files = NULL;
+    interleaved = false;
+    id = NULL;
+    id_len = 0;
+    seq_f = NULL;
+    qual_f = NULL;
+    len_f = 0;
+    seq_r = NULL;
+    qual_r = NULL;
+    len_r = 0;
+}
+
+fq_pair_reader::~fq_pair_reader(){
+    close();
+}
+
+void fq_pair_reader::open(const string& r1filename, const string& r2filename,
+    int nthreads, int chunk, int num_chunks){
+    close();
+    this->r1filename = r1filename;
+    this->r2filename = r2filename;
+    interleaved = r2filename == "";
+    if (num_chunks > 1){
+        open_chunk(chunk, num_chunks);
+        return;
+    }
+    vector<string> filenames{ r1filename };
+    if (!interleaved){
+        filenames.push_back(r2filename);
+    }
+    vector<string> paths = filenames;
+    if (nthreads > 1){
+        // Decompress each file in its own thread, ahead of parsing
+        open_fq_streams(streams, filenames, paths, nthreads);
+    }
+    files = new fq_pair_files;
+    files->f_fp = open_fq_gz(paths[0], r1filename);
+    files->seq_f = kseq_init(files->f_fp);
+    if (interleaved){
+        // Only holds R1 records while their mates are parsed; never reads
+        files->r_fp = NULL;
+        files->seq_r = kseq_init(files->f_fp);
+    }
+    else{
+        files->r_fp = open_fq_gz(paths[1], r2filename);
+        files->seq_r = kseq_init(files->r_fp);
+    }
+}
+
+/**
+ * Open one chunk of BGZF input and find where it starts and ends.
+ */
+void fq_pair_reader::open_chunk(int chunk, int num_chunks){
+    if (!fq_chunkable(r1filename) || (!interleaved && !fq_chunkable(r2filename))){
+        fprintf(stderr, "ERROR: to read %s in chunks, it must be a BGZF-compressed file\n",
+            interleaved ? r1filename.c_str() : (r1filename + " and " + r2filename).c_str());
+        fprintf(stderr, "(i.e. from bgzip), not standard input or a pipe.\n");
+        exit(1);
+    }
+    files = new fq_pair_files;
+    int64_t size = fq_file_size(r1filename);
+    FILE* raw = fopen(r1filename.c_str(), "rb");
+    files->f_bgzf = bgzf_open(r1filename.c_str(), "r");
+    if (!raw || !files->f_bgzf){
+        fprintf(stderr, "ERROR opening %s for reading\n", r1filename.c_str());
+        exit(1);
+    }
+    int64_t start = fq_chunk_start(raw, files->f_bgzf, size, chunk, num_chunks, 
+        interleaved, r1filename);
+    if (start >= 0 && chunk + 1 < num_chunks){
+        files->end = fq_chunk_start(raw, files->f_bgzf, size, chunk + 1, num_chunks,
+            interleaved, r1filename);
+    }
+    fclose(raw);
+    // Neighboring chunks can start at the same read in small files
+    files->done = start < 0 || (files->end >= 0 && start >= files->end);
+    if (files->done){
+        return;
+    }
+    bgzf_seek(files->f_bgzf, start, SEEK_SET);
+    if (!interleaved){
+        files->r_bgzf = bgzf_open(r2filename.c_str(), "r");
+        if (!files->r_bgzf){
+            fprintf(stderr, "ERROR opening %s for reading\n", r2filename.c_str());
+            exit(1);
+        }
+        if (start > 0){
+            if (read_fq_record(files->f_bgzf, files->rec_f, r1filename)){
+                fq_find_mate(files->r_bgzf, r2filename, files->rec_f, start >> 16, size);
+            }
+            bgzf_seek(files->f_bgzf, start, SEEK_SET);
+        }
+    }
+}
+
+/**
+ * Read the next pair in a chunk of BGZF input.
+ */
+bool fq_pair_reader::next_in_chunk(){
+    if (files->done){
+        return false;
+    }
+    fq_record& rec_f = files->rec_f;
+    fq_record& rec_r = files->rec_r;
+    if ((files->end >= 0 && bgzf_tell(files->f_bgzf) >= files->end) ||
+        !read_fq_record(files->f_bgzf, rec_f, r1filename)){
+        files->done = true;
+        // Check that R2 has hit EOF as well, if this is the last chunk.
+        if (!interleaved && files->end < 0 && 
+            read_fq_record(files->r_bgzf, rec_r, r2filename)){
+            fprintf(stderr, "ERROR: %s still contains reads, but %s reached end of file\n", 
+                r2filename.c_str(), r1filename.c_str());
+            fprintf(stderr, "%s is likely truncated or corrupted.\n", r1filename.c_str());
+            exit(1);
+        }
+        return false;
+    }
+    if (interleaved){
+        if (!read_fq_record(files->f_bgzf, rec_r, r1filename)){
+            fprintf(stderr, "ERROR: %s ends with an unpaired read (%s)\n", 
+                r1filename.c_str(), rec_f.lines[0].s);
+            fprintf(stderr, "%s is likely truncated or not interleaved.\n",
+                r1filename.c_str());
+            exit(1);
+        }
+        if (!mate_names_match(rec_f.name, rec_f.name_len, rec_r.name, rec_r.name_len)){
+            fprintf(stderr, "ERROR: read %s in %s is followed by %s, not its mate\n",
+                rec_f.lines[0].s, r1filename.c_str(), rec_r.lines[0].s);
+            fprintf(stderr, "%s is likely not interleaved.\n", r1filename.c_str());
+            exit(1);
+        }
+    }
+    else if (!read_fq_record(files->r_bgzf, rec_r, r2filename)){
+        fprintf(stderr, "ERROR: %s still contains reads, but %s reached end of file\n", 
+            r1filename.c_str(), r2filename.c_str());
+        fprintf(stderr, "%s is likely truncated or corrupted.\n", r2filename.c_str());
+        exit(1);
+    }
+    id = rec_f.name;
+    id_len = rec_f.name_len;
+    seq_f = rec_f.lines[1].s;
+    qual_f = rec_f.lines[3].s;
+    len_f = rec_f.lines[1].l;
+    seq_r = rec_r.lines[1].s;
+    qual_r = rec_r.lines[3].s;
+    len_r = rec_r.lines[1].l;
+    return true;
+}
+
+bool fq_pair_reader::next(){
+    if (files->f_bgzf != NULL){
+        return next_in_chunk();
+    }
+    kseq_t* rec_f = files->seq_f;
+    kseq_t* rec_r = files->seq_r;
+    if (kseq_read(rec_f) < 0){
+        // Check that R2 has hit EOF as well.
+        if (!interleaved && kseq_read(rec_r) >= 0){
+            fprintf(stderr, "ERROR: %s still contains reads, but %s reached end of file\n", 
+                r2filename.c_str(), r1filename.c_str());
+            fprintf(stderr, "%s is likely truncated or corrupted.\n", r1filename.c_str());
+            exit(1);
+        }
+        return false;
+    }
+    if (interleaved){
+        // Keep R1 in rec_r while parsing R2 into rec_f, then switch back
+        swap_records(rec_f, rec_r);
+        if (kseq_read(rec_f) < 0){
+            fprintf(stderr, "ERROR: %s ends with an unpaired read (%s)\n", 
+                r1filename.c_str(), rec_r->name.s);
+            fprintf(stderr, "%s is likely truncated or not interleaved.\n",
+                r1filename.c_str());
+            exit(1);
+        }
+        swap_records(rec_f, rec_r);
+        if (!mate_names_match(rec_f->name.s, rec_f->name.l, rec_r->name.s, 
+            rec_r->name.l)){
+            fprintf(stderr, "ERROR: read %s in %s is followed by %s, not its mate\n",
+                rec_f->name.s, r1filename.c_str(), rec_r->name.s);
+            fprintf(stderr, "%s is likely not interleaved.\n", r1filename.c_str());
+            exit(1);
+        }
+    }
+    else if (kseq_read(rec_r) < 0){
+        fprintf(stderr, "ERROR: %s still contains reads, but %s reached end of file\n", 
+            r1filename.c_str(), r2filename.c_str());
+        fprintf(stderr, "%s is likely truncated or corrupted.\n", r2filename.c_str());
+        exit(1);
+    }
+    id = rec_f->name.s;
+    id_len = rec_f->name.l;
+    seq_f = rec_f->seq.s;
+    qual_f = rec_f->qual.s;
+    len_f = rec_f->seq.l;
+    seq_r = rec_r->seq.s;
+    qual_r = rec_r->qual.s;
+    len_r = rec_r->seq.l;
+    return true;
+}
+
+void fq_pair_reader::close(){
+    if (files != NULL){
+        if (files->f_bgzf != NULL){
+            bgzf_close(files->f_bgzf);
+            if (files->r_bgzf != NULL){
+                bgzf_close(files->r_bgzf);
+            }
+        }
+        else{
+            kseq_destroy(files->seq_f);
+            kseq_destroy(files->seq_r);
+            gzclose(files->f_fp);
+            if (files->r_fp != NULL){
+                gzclose(files->r_fp);
+            }
+        }
+        delete files;
+        files = NULL;
+    }
+    streams.clear();
+}
+
+bool fq_rereadable(const string& filename){
+    if (filename == "-"){
+        return false;
+    }
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0){
+        // Let opening the file report the problem
+        return true;
+    }
+    return S_ISREG(st.st_mode);
+}
+
+bool fq_chunkable(const string& filename){
+    if (!fq_rereadable(filename)){
+        return false;
+    }
+    BGZF* fp = bgzf_open(filename.c_str(), "r");
+    if (!fp){
+        return false;
+    }
+    bool is_bgzf = bgzf_compression(fp) == bgzf;
+    bgzf_close(fp);
+    return is_bgzf;
+}
@@ -0,0 +1,136 @@
+#ifndef _CELLBOUNCER_FQ_STREAM_H
+#define _CELLBOUNCER_FQ_STREAM_H
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <htslib/bgzf.h>
+
+// ===== fq_stream.h
+// Reader stage for (possibly compressed) FASTQ input, shared by the
+// programs that scan reads (demux_species, demux_tags, atac_fq_preprocess).
+//
+// Each input file gets its own decompression thread, which inflates the
+// file and writes plain text into a pipe. Consumers read the other end of
+// the pipe, either through the file descriptor (fd) or by opening path
+// (/dev/fd/N) like a normal, uncompressed file. This way, R1, R2 (and R3)
+// are inflated concurrently with each other and with barcode/k-mer scanning,
+// even by readers that only accept file names.
+//
+// Input is read through htslib's BGZF layer: BGZF-compressed files
+// (e.g. from bgzip) are additionally inflated block-parallel using a pool
+// of helper threads, while plain gzip and uncompressed files are inflated
+// by the one reader thread (using libdeflate, if htslib was built with it).
+//
+// fq_pair_reader reads pairs of records on top of this, either from two
+// files in step or from one interleaved file, so that input can also come
+// from standard input or a named pipe (i.e. straight from a converter,
+// without writing intermediate FASTQ files).
+//
+// fq_pair_reader can instead read one of several chunks of BGZF-compressed
+// input, so that several readers can each decompress and parse a different
+// part of the same file at once (without splitting it into files first).
+// Chunks are cut at BGZF block boundaries (by compressed size), then moved
+// to the next record boundary, so every read pair is in exactly one chunk.
+// The matching chunk of R2 is found by seeking to about the same relative
+// position and looking for the mate of the chunk's first R1 read.
+
+class fq_stream{
+    private:
+        BGZF* fp;
+        int write_fd;
+        std::thread reader;
+        bool running;
+        std::atomic<bool> stop;
+        static void read_thread(fq_stream* obj);
+    public:
+        // Read end of the pipe (-1 if not open)
+        int fd;
+        // Path to the read end of the pipe, for code that opens files by name
+        std::string path;
+        // Name of the input file
+        std::string filename;
+
+        fq_stream();
+        ~fq_stream();
+
+        // Start decompressing a file. bgzf_threads is the number of extra
+        // threads to use if the file is BGZF-compressed.
+        bool open(const std::string& filename, int bgzf_threads = 0);
+
+        // Stop reading (if necessary) and release everything.
+        void close();
+};
+
+/**
+ * Open a set of FASTQ files (i.e. R1 and R2, or R1/R2/R3) at once, dividing
+ * nthreads between them for block-parallel decompression. Stores the paths
+ * to read from in paths. Exits on failure.
+ */
+void open_fq_streams(std::deque<fq_stream>& streams,
+    const std::vector<std::string>& filenames,
+    std::vector<std::string>& paths,
+    int nthreads);
+
+// Open files and parser state, defined in fq_stream.cpp
+struct fq_pair_files;
+
+/**
+ * Reads pairs of FASTQ records, either from two files (R1 and R2) in step,
+ * or from one interleaved file in which each R1 record is followed by its
+ * R2 record. Any input file name can be "-" to read from standard input.
+ * Exits if one file runs out of reads before the other, or if mates in an
+ * interleaved file do not have the same name (ignoring /1 and /2).
+ */
+class fq_pair_reader{
+    private:
+        fq_pair_files* files;
+        std::deque<fq_stream> streams;
+        void open_chunk(int chunk, int num_chunks);
+        bool next_in_chunk();
+        // Not copyable
+        fq_pair_reader(const fq_pair_reader&);
+        fq_pair_reader& operator=(const fq_pair_reader&);
+    public:
+        std::string r1filename;
+        std::string r2filename;
+        bool interleaved;
+
+        // Current pair (valid until the next call to next())
+        const char* id;
+        int id_len;
+        const char* seq_f;
+        const char* qual_f;
+        int len_f;
+        const char* seq_r;
+        const char* qual_r;
+        int len_r;
+
+        fq_pair_reader();
+        ~fq_pair_reader();
+
+        // An empty r2filename means r1filename is interleaved. With 
+        // nthreads > 1, input is decompressed in fq_streams. With 
+        // num_chunks > 1, only reads chunk (0-based) of num_chunks, which 
+        // requires input that passes fq_chunkable(); nthreads is then
+        // ignored. Exits on failure.
+        void open(const std::string& r1filename, const std::string& r2filename,
+            int nthreads = 1, int chunk = 0, int num_chunks = 1);
+        bool next();
+        void close();
+};
+
+/**
+ * Whether a read file can be read more than once, i.e. it is a regular
+ * file and not standard input ("-") or a pipe.
+ */
+bool fq_rereadable(const std::string& filename);
+
+/**
+ * Whether a read file can be read in chunks by fq_pair_reader, i.e. it is
+ * a regular file compressed with BGZF (i.e. by bgzip).
+ */
+bool fq_chunkable(const std::string& filename);
+
+#endif
@@ -0,0 +1,64 @@
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <htslib/bgzf.h>
+#include <htslib/thread_pool.h>
+#include "fq_writer.h"
+
+using namespace std;
+
+// Blocks per file that can be waiting to be compressed or written
+#define FQ_WRITER_QUEUE_SIZE 64
+
+fq_writer_pool::fq_writer_pool(int nthreads){
+    this->nthreads = nthreads;
+    this->pool = hts_tpool_init(nthreads);
+    if (this->pool == NULL){
+        fprintf(stderr, "ERROR: could not start compression threads\n");
+        exit(1);
+    }
+}
+
+fq_writer_pool::~fq_writer_pool(){
+    // All files using the pool must be closed first
+    hts_tpool_destroy(pool);
+}
+
+fq_writer::fq_writer(){
+    fp = NULL;
+}
+
+fq_writer::~fq_writer(){
+    close();
+}
+
+void fq_writer::open(const string& filename, fq_writer_pool* pool){
+    close();
+    this->filename = filename;
+    fp = bgzf_open(filename.c_str(), "w");
+    if (fp == NULL){
+        fprintf(stderr, "ERROR opening %s for writing.\n", filename.c_str());
+        exit(1);
+    }
+    if (pool != NULL && bgzf_thread_pool(fp, pool->pool, FQ_WRITER_QUEUE_SIZE) != 0){
+        fprintf(stderr, "ERROR: could not use compression threads for %s\n",
+            filename.c_str());
+        exit(1);
+    }
+}
+
+void fq_writer::close(){
+    if (fp != NULL){
+        // Flushes any blocks still being compressed
+        if (bgzf_close(fp) != 0){
+            fp = NULL;
+            write_error();
+        }
+        fp = NULL;
+    }
+}
+
+void fq_writer::write_error(){
+    fprintf(stderr, "ERROR writing to %s\n", filename.c_str());
+    exit(1);
+}
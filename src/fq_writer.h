@@ -0,0 +1,58 @@
+#ifndef _CELLBOUNCER_FQ_WRITER_H
+#define _CELLBOUNCER_FQ_WRITER_H
+#include <string>
+#include <htslib/bgzf.h>
+#include <htslib/thread_pool.h>
+
+// ===== fq_writer.h
+// Writer stage for compressed FASTQ output, shared by the programs that
+// write reads (reads_demuxer in demux_species, split_read_files, and
+// atac_fq_preprocess).
+//
+// Output is BGZF (blocked gzip, as written by bgzip), which any gzip reader
+// accepts. Writes are copied into a buffer per output file. Each full
+// ~64 kB block is compressed as an independent gzip member, and blocks are
+// written to the file in order. Given a pool, blocks from all open files are
+// compressed by the pool's threads, so writing many outputs (i.e. one per
+// species) no longer ties up the thread that parses reads with compression.
+// Without a pool, blocks are compressed inline, as gzwrite() would.
+
+// Compression threads shared by a set of output files
+class fq_writer_pool{
+    private:
+        // Not copyable
+        fq_writer_pool(const fq_writer_pool&);
+        fq_writer_pool& operator=(const fq_writer_pool&);
+    public:
+        hts_tpool* pool;
+        int nthreads;
+        fq_writer_pool(int nthreads);
+        ~fq_writer_pool();
+};
+
+class fq_writer{
+    private:
+        BGZF* fp;
+        // Not copyable
+        fq_writer(const fq_writer&);
+        fq_writer& operator=(const fq_writer&);
+        void write_error();
+    public:
+        std::string filename;
+
+        fq_writer();
+        ~fq_writer();
+
+        // Exits on failure
+        void open(const std::string& filename, fq_writer_pool* pool = NULL);
+        void close();
+        bool is_open() const { return fp != NULL; }
+
+        inline void write(const char* data, size_t len){
+            if (bgzf_write(fp, data, len) < 0){
+                write_error();
+            }
+        }
+};
+
+#endif
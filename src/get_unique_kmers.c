@@ -6,6 +6,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "FASTK/libfastk.h"
 
 void help(int code){
@@ -40,6 +41,9 @@ void help(int code){
     fprintf(stderr, "     in the format {outprefix}.{index}.kmers (gzip compressed).\n"); 
     fprintf(stderr, "  -d Maximum allowable DUST score (measure of sequence complexity;\n");
     fprintf(stderr, "     higher means more repetitive. Default = 2\n");
+    fprintf(stderr, "  -t Number of threads (default 1). K-mer space is split into ranges\n");
+    fprintf(stderr, "     by prefix, and each range of all tables is compared and filtered\n");
+    fprintf(stderr, "     by one thread. Output is the same as with one thread.\n");
     exit(code);
 }
 
@@ -295,6 +299,208 @@ void counts_sort(struct counts* c){
     qsort(c->vals, c->nvals, sizeof(int), intcomp);
 }
 
+/**
+ * First byte of the current k-mer's encoding (its first four bases),
+ * which determines the range of k-mer space it belongs to.
+ */
+int first_byte(Kmer_Stream* S){
+    return S->cpre >> (8*(S->ibyte-1));
+}
+
+/**
+ * Index of the first k-mer in a table whose first byte is at least b
+ * (or the number of k-mers, if there are none).
+ */
+int64 first_at_byte(Kmer_Stream* S, int b){
+    int64 lo = 0;
+    int64 hi = S->nels;
+    while (lo < hi){
+        int64 mid = lo + (hi-lo)/2;
+        GoTo_Kmer_Index(S, mid);
+        if (first_byte(S) < b){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * A range of k-mer space (k-mers whose first byte is in [lo, hi)), 
+ * compared across all tables by one thread.
+ */
+struct merge_part{
+    int lo;
+    int hi;
+    // Index of the first k-mer in range and one past the last, per table
+    int64* start;
+    int64* end;
+    // Where to write unique k-mers, per table
+    gzFile* outs;
+    FILE** outs_tmp;
+    struct counts* counts;
+};
+
+/**
+ * Everything threads share while comparing ranges of k-mer space
+ */
+struct merge_data{
+    Kmer_Stream** tables;
+    int num_tables;
+    int kmer;
+    int num_samp;
+    double maxdust;
+    struct suffixnode* tree;
+    struct merge_part* parts;
+    int nparts;
+    // Next range to hand out
+    int next_part;
+    pthread_mutex_t lock;
+};
+
+/**
+ * Given a k-mer unique to one table, filter and write it to that
+ * table's output for the current range.
+ */
+void write_unique(struct merge_data* d, struct merge_part* part, int table, 
+    char* kmer_text, Kmer_Stream* S){
+    
+    char* b = Current_Kmer(S, kmer_text);
+    int c = Current_Count(S);
+    if (d->num_samp <= 0){
+        print_dat_gz(&part->outs[table], d->kmer, b, c, d->tree, d->maxdust);
+    }
+    else{
+        if (print_dat(part->outs_tmp[table], d->kmer, b, c, d->tree, d->maxdust) == 1){
+            counts_add(&part->counts[table], c);
+        }
+    }
+}
+
+/**
+ * Find k-mers unique to each table within one range of k-mer space,
+ * using a separate cursor into each table.
+ */
+void merge_range(struct merge_data* d, struct merge_part* part){
+    int num_tables = d->num_tables;
+    Kmer_Stream* tables[num_tables];
+    int valid[num_tables];
+    for (int i = 0; i < num_tables; ++i){
+        tables[i] = Clone_Kmer_Stream(d->tables[i]);
+        valid[i] = part->start[i] < part->end[i];
+        if (valid[i]){
+            GoTo_Kmer_Index(tables[i], part->start[i]);
+        }
+    }
+    
+    char kmer_text[d->kmer+1];
+    int ntie = 0;
+    int ties[num_tables];
+    int finished = 0;
+    while (!finished){
+        // Each iteration: check for unique k-mers
+        // Then increment only iterators with lowest sort-order k-mers
+        // A k-mer is unique if it's lower sort order than the other streams
+        // and does not match others
+        int nvalid = 0;
+        for (int i = 0; i < num_tables; ++i){
+            if (valid[i]){
+                nvalid++;
+            }
+        }
+        if (nvalid < 2){
+            // Not enough k-mers to compare.
+            finished = 1;
+            break;
+        } 
+        else{
+            ntie = 0;
+            int min_idx = 0;
+            while (!valid[min_idx]){
+                ++min_idx;
+            }
+            // Compare all k-mers
+            for (int i = min_idx + 1; i < num_tables; ++i){
+                if (valid[i]){ 
+                    int comp = kcomp(tables[i], tables[min_idx]);
+                    if (comp < 0){
+                        min_idx = i;
+                        ntie = 0;
+                    }
+                    else if (comp == 0){
+                        // tie
+                        ties[ntie] = i;
+                        ntie++;
+                    }
+                }
+            }
+            
+            // If no tie, print the lowest.
+            if (ntie == 0){
+                write_unique(d, part, min_idx, &kmer_text[0], tables[min_idx]);
+            }
+            // Only increment lowest-value iterators.
+            Next_Kmer_Entry(tables[min_idx]);
+            valid[min_idx] = tables[min_idx]->cidx < part->end[min_idx];
+            for (int i = 0; i < ntie; ++i){
+                Next_Kmer_Entry(tables[ties[i]]);
+                valid[ties[i]] = tables[ties[i]]->cidx < part->end[ties[i]];
+            }
+        }
+    }
+    
+    // Any remaining entries in the last iterator are unique.
+    for (int i = 0; i < num_tables; ++i){
+        while (valid[i]){
+            write_unique(d, part, i, &kmer_text[0], tables[i]);
+            Next_Kmer_Entry(tables[i]);
+            valid[i] = tables[i]->cidx < part->end[i];
+        }
+        Free_Kmer_Stream(tables[i]);
+    }
+}
+
+/**
+ * Worker thread: compare ranges of k-mer space until none are left.
+ */
+void* merge_worker(void* arg){
+    struct merge_data* d = (struct merge_data*)arg;
+    while (1){
+        pthread_mutex_lock(&d->lock);
+        int p = d->next_part;
+        d->next_part++;
+        pthread_mutex_unlock(&d->lock);
+        if (p >= d->nparts){
+            break;
+        }
+        merge_range(d, &d->parts[p]);
+    }
+    return NULL;
+}
+
+/**
+ * Append the contents of one file to another (open) file, and delete it.
+ */
+void append_file(FILE* outf, const char* filename){
+    FILE* inf = fopen(filename, "rb");
+    if (!inf){
+        fprintf(stderr, "ERROR opening %s for reading.\n", filename);
+        exit(1);
+    }
+    char buf[1048576];
+    size_t nread;
+    while ((nread = fread(&buf[0], 1, sizeof(buf), inf)) > 0){
+        if (fwrite(&buf[0], 1, nread, outf) != nread){
+            fprintf(stderr, "ERROR writing output (%s)\n", filename);
+            exit(1);
+        }
+    }
+    fclose(inf);
+    remove(filename);
+}
+
 int main(int argc, char* argv[]){
     srand(time(NULL));
 
@@ -363,6 +569,7 @@ int main(int argc, char* argv[]){
     //int num_samp = 10000000;
     // Default to retrieving all usable k-mers
     int num_samp = -1;
+    int num_threads = 1;
 
     int option_index = 0;
     int ch;
@@ -371,7 +578,7 @@ int main(int argc, char* argv[]){
     }
     
     // Parse arguments
-    while ((ch = getopt(argc, argv, "k:n:o:d:N:h")) != -1){
+    while ((ch = getopt(argc, argv, "k:n:o:d:N:t:h")) != -1){
         switch(ch){
             case 'k':
                 strcpy(&kmers[kmers_idx][0], optarg);
@@ -389,6 +596,9 @@ int main(int argc, char* argv[]){
             case 'N':
                 num_samp = atoi(optarg);
                 break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
             case 'h':
                 help(0);
                 break;
@@ -419,6 +629,10 @@ int main(int argc, char* argv[]){
         fprintf(stderr, "ERROR: unequal number of k-mers (-k) and names (-n) provided\n");
         exit(1);
     }
+    if (num_threads < 1){
+        fprintf(stderr, "ERROR: number of threads (-t) must be at least 1\n");
+        exit(1);
+    }
     if (kmers_idx == 1){
         fprintf(stderr, "ERROR: cannot demultiplex with only one species\n");
         exit(1);
@@ -470,6 +684,52 @@ int main(int argc, char* argv[]){
     }
     fclose(f);
     
+    // Split k-mer space into ranges by first byte (four bases), so that
+    // each range holds about the same number of k-mers over all tables.
+    // Ranges are handed out to threads as they finish earlier ones.
+    int nparts = num_threads == 1 ? 1 : num_threads * 8;
+    if (nparts > 256){
+        nparts = 256;
+    }
+    int64 byte_start[num_tables][257];
+    int64 total = 0;
+    for (int i = 0; i < num_tables; ++i){
+        for (int b = 0; b < 256; ++b){
+            byte_start[i][b] = nparts == 1 ? 0 : first_at_byte(tables[i], b);
+        }
+        byte_start[i][256] = tables[i]->nels;
+        total += tables[i]->nels;
+    }
+    struct merge_part parts[nparts];
+    int b = 0;
+    for (int p = 0; p < nparts; ++p){
+        parts[p].lo = b;
+        if (p == nparts-1){
+            b = 256;
+        }
+        else{
+            // Take first bytes until this range has its share of k-mers
+            int64 target = (total * (p+1)) / nparts;
+            while (b < 256){
+                int64 cum = 0;
+                for (int i = 0; i < num_tables; ++i){
+                    cum += byte_start[i][b+1];
+                }
+                b++;
+                if (cum >= target){
+                    break;
+                }
+            }
+        }
+        parts[p].hi = b;
+        parts[p].start = (int64*)malloc(num_tables*sizeof(int64));
+        parts[p].end = (int64*)malloc(num_tables*sizeof(int64));
+        for (int i = 0; i < num_tables; ++i){
+            parts[p].start[i] = byte_start[i][parts[p].lo];
+            parts[p].end[i] = byte_start[i][parts[p].hi];
+        }
+    }
+
     // prepare output files
     gzFile outs[num_tables];
     FILE* outs_tmp[num_tables];
@@ -489,110 +749,120 @@ int main(int argc, char* argv[]){
             exit(1);
         }
     }
-
-    for (int i = 0; i < num_tables; ++i){
-        First_Kmer_Entry(tables[i]);
-    }
-
-    char kmer_text[kmer+1]; 
-    int ntie = 0;
-    int ties[num_tables];
-    int finished = 0;
-    while (!finished){
-        // Each iteration: check for unique k-mers
-        // Then increment only iterators with lowest sort-order k-mers
-        // A k-mer is unique if it's lower sort order than the other streams
-        // and does not match others
-        int nvalid = 0;
+    
+    // With one range, write straight to output files. Otherwise, each 
+    // range writes its own files, which are concatenated in order after
+    // (gzip files can be concatenated; the result reads as one file).
+    for (int p = 0; p < nparts; ++p){
+        parts[p].outs = (gzFile*)malloc(num_tables*sizeof(gzFile));
+        parts[p].outs_tmp = (FILE**)malloc(num_tables*sizeof(FILE*));
+        parts[p].counts = (struct counts*)malloc(num_tables*sizeof(struct counts));
         for (int i = 0; i < num_tables; ++i){
-            if (tables[i]->csuf != NULL){
-                nvalid++;
-            }
-        }
-        if (nvalid < 2){
-            // Not enough k-mers to compare.
-            finished = 1;
-            break;
-        } 
-        else{
-            ntie = 0;
-            int min_idx = 0;
-            while (tables[min_idx]->csuf == NULL){
-                ++min_idx;
+            if (nparts == 1){
+                parts[p].outs[i] = outs[i];
+                parts[p].outs_tmp[i] = num_samp > 0 ? outs_tmp[i] : NULL;
             }
-            // Compare all k-mers
-            for (int i = min_idx + 1; i < num_tables; ++i){
-                if (tables[i]->csuf != NULL){ 
-                    int comp = kcomp(tables[i], tables[min_idx]);
-                    if (comp < 0){
-                        min_idx = i;
-                        ntie = 0;
-                    }
-                    else if (comp == 0){
-                        // tie
-                        ties[ntie] = i;
-                        ntie++;
-                    }
+            else if (num_samp > 0){
+                sprintf(&namebuf[0], "%s.%d.%d.tmp", output_prefix, i, p);
+                parts[p].outs_tmp[i] = fopen(namebuf, "w");
+                if (!parts[p].outs_tmp[i]){
+                    fprintf(stderr, "ERROR opening %s for writing.\n", &namebuf[0]);
+                    exit(1);
                 }
             }
-            
-            // If no tie, print the lowest.
-            if (ntie == 0){
-                char* b = Current_Kmer(tables[min_idx], &kmer_text[0]);
-                int c = Current_Count(tables[min_idx]);
-                if (num_samp <= 0){
-                    if (print_dat_gz(&outs[min_idx], kmer, b, c, tree, maxdust) == 1){
-                    
-                    }
-                }
-                else{
-                    if (print_dat(outs_tmp[min_idx], kmer, b, c, tree, maxdust) == 1){\
-                        counts_add(&counts_tables[min_idx], c);
-                    }
+            else{
+                sprintf(&namebuf[0], "%s.%d.%d.gz.tmp", output_prefix, i, p);
+                parts[p].outs[i] = gzopen(namebuf, "w");
+                if (!parts[p].outs[i]){
+                    fprintf(stderr, "ERROR opening %s for writing.\n", &namebuf[0]);
+                    exit(1);
                 }
             }
-            // Only increment lowest-value iterators.
-            int incremented = 0;
-            if (tables[min_idx]->csuf != NULL){
-                Next_Kmer_Entry(tables[min_idx]);
-                incremented = 1;
-            }
-            for (int i = 0; i < ntie; ++i){
-                if (tables[ties[i]]->csuf != NULL){
-                    Next_Kmer_Entry(tables[ties[i]]);
-                    incremented = 1;
-                }   
+            if (num_samp > 0){
+                counts_init(&parts[p].counts[i], nparts == 1 ? 1048576 : 65536);
             }
-            if (!incremented){
-                // Break out of the loop
-                finished = 1;
-                break;
+        }
+    }
+    
+    struct merge_data md;
+    md.tables = tables;
+    md.num_tables = num_tables;
+    md.kmer = kmer;
+    md.num_samp = num_samp;
+    md.maxdust = maxdust;
+    md.tree = tree;
+    md.parts = parts;
+    md.nparts = nparts;
+    md.next_part = 0;
+    pthread_mutex_init(&md.lock, NULL);
+    if (num_threads == 1){
+        merge_worker(&md);
+    }
+    else{
+        fprintf(stderr, "Comparing k-mers in %d ranges using %d threads\n", nparts, num_threads);
+        pthread_t threads[num_threads];
+        for (int t = 0; t < num_threads; ++t){
+            if (pthread_create(&threads[t], NULL, merge_worker, &md) != 0){
+                fprintf(stderr, "ERROR creating thread\n");
+                exit(1);
             }
         }
+        for (int t = 0; t < num_threads; ++t){
+            pthread_join(threads[t], NULL);
+        }
     }
+    pthread_mutex_destroy(&md.lock);
     
-    // Any remaining entries in the last iterator are unique.
-    for (int i = 0; i < num_tables; ++i){
-        while (tables[i]->csuf != NULL){
-            char* b = Current_Kmer(tables[i], &kmer_text[0]);
-            int c = Current_Count(tables[i]);
-            if (num_samp <= 0){
-                if (print_dat_gz(&outs[i], kmer, b, c, tree, maxdust) == 1){
-
+    // Gather per-range output, in order
+    for (int p = 0; p < nparts; ++p){
+        for (int i = 0; i < num_tables; ++i){
+            if (num_samp > 0){
+                for (int x = 0; x < parts[p].counts[i].nvals; ++x){
+                    counts_add(&counts_tables[i], -parts[p].counts[i].vals[x]);
                 }
+                counts_destroy(&parts[p].counts[i]);
             }
-            else{
-                if (print_dat(outs_tmp[i], kmer, b, c, tree, maxdust) == 1){
-                    counts_add(&counts_tables[i], c);
+            if (nparts > 1){
+                if (num_samp > 0){
+                    fclose(parts[p].outs_tmp[i]);
+                    sprintf(&namebuf[0], "%s.%d.%d.tmp", output_prefix, i, p);
+                    append_file(outs_tmp[i], namebuf);
+                }
+                else{
+                    gzclose(parts[p].outs[i]);
                 }
             }
-            Next_Kmer_Entry(tables[i]);
+        }
+        free(parts[p].start);
+        free(parts[p].end);
+        free(parts[p].outs);
+        free(parts[p].outs_tmp);
+        free(parts[p].counts);
+    }
+    if (nparts > 1 && num_samp <= 0){
+        // Replace (empty) output files with concatenated range files
+        for (int i = 0; i < num_tables; ++i){
+            gzclose(outs[i]);
+            sprintf(&namebuf[0], "%s.%d.kmers", output_prefix, i);
+            FILE* outf = fopen(namebuf, "wb");
+            if (!outf){
+                fprintf(stderr, "ERROR opening %s for writing.\n", &namebuf[0]);
+                exit(1);
+            }
+            for (int p = 0; p < nparts; ++p){
+                sprintf(&namebuf[0], "%s.%d.%d.gz.tmp", output_prefix, i, p);
+                append_file(outf, namebuf);
+            }
+            fclose(outf);
         }
     }
+    char kmer_text[kmer+1];
     
     if (num_samp <= 0){
-        for (int i = 0; i < num_tables; ++i){
-            gzclose(outs[i]);
+        if (nparts == 1){
+            for (int i = 0; i < num_tables; ++i){
+                gzclose(outs[i]);
+            }
         }
     }
     else{
@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "kmer_index.h"
+#include "kmer_bloom.h"
+
+using namespace std;
+
+kmer_bloom::kmer_bloom(){
+    blocks = NULL;
+    blocks_mem = NULL;
+    nblocks = 0;
+    block_bits = 0;
+}
+
+kmer_bloom::~kmer_bloom(){
+    clear();
+}
+
+void kmer_bloom::clear(){
+    if (blocks_mem != NULL){
+        free(blocks_mem);
+        blocks_mem = NULL;
+    }
+    blocks = NULL;
+    nblocks = 0;
+    block_bits = 0;
+}
+
+void kmer_bloom::add(uint64_t hi, uint64_t lo){
+    uint64_t h = hash(hi, lo);
+    uint64_t* b = blocks_mem + ((h >> (64 - block_bits)) << 3);
+    for (int i = 0; i < 8; ++i){
+        b[i] |= bit(h, i);
+    }
+}
+
+void kmer_bloom::init(uint64_t nkmers, int bits_per_kmer){
+    clear();
+    // Round up to a power of two number of blocks (at least 2, so a block
+    // index always takes at least one bit of the hash)
+    uint64_t nbits = nkmers * bits_per_kmer;
+    block_bits = 1;
+    while (((uint64_t)1 << block_bits) * 512 < nbits){
+        block_bits++;
+    }
+    nblocks = (uint64_t)1 << block_bits;
+    // Align blocks to cache lines
+    if (posix_memalign((void**)&blocks_mem, 64, nblocks * 64) != 0){
+        fprintf(stderr, "ERROR: could not allocate memory for k-mer filter\n");
+        exit(1);
+    }
+    memset(blocks_mem, 0, nblocks * 64);
+    blocks = blocks_mem;
+}
+
+void kmer_bloom::attach(const uint64_t* blocks, uint64_t nblocks){
+    clear();
+    this->blocks = blocks;
+    this->nblocks = nblocks;
+    block_bits = 0;
+    while (((uint64_t)1 << block_bits) < nblocks){
+        block_bits++;
+    }
+}
+
+void kmer_bloom::build(const kmer_index& idx, int bits_per_kmer){
+    if (idx.filter_data() != NULL){
+        attach(idx.filter_data(), idx.filter_blocks());
+        return;
+    }
+    init(idx.size(), bits_per_kmer);
+    idx.for_each([&](uint64_t hi, uint64_t lo){
+        add(hi, lo);
+    });
+}
@@ -0,0 +1,76 @@
+#ifndef _CELLBOUNCER_KMER_BLOOM_H
+#define _CELLBOUNCER_KMER_BLOOM_H
+#include <stdint.h>
+#include <stdlib.h>
+#include "kmer_index.h"
+
+// ===== kmer_bloom.h
+// A blocked Bloom filter over the species-specific k-mers in a kmer_index,
+// used to skip hash table probes for k-mers that cannot be in the table
+// (most k-mers in reads are shared between species). Each k-mer maps to
+// one 64-byte block (one cache line) and sets one bit in each of its eight
+// 64-bit words, so a query touches a single cache line. The filter uses
+// about 2 bytes per k-mer, versus at least 20 for the table itself.
+//
+// An index written to disk stores its filter, which is then mapped along
+// with the table rather than rebuilt (which would read every slot).
+
+class kmer_bloom{
+    private:
+        const uint64_t* blocks;
+        // Blocks allocated here (NULL if mapped from an index file)
+        uint64_t* blocks_mem;
+        uint64_t nblocks;
+        int block_bits;
+
+        static inline uint64_t hash(uint64_t hi, uint64_t lo){
+            uint64_t h = (lo ^ (hi * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL;
+            h ^= h >> 29;
+            h *= 0xBF58476D1CE4E5B9ULL;
+            h ^= h >> 32;
+            return h;
+        }
+        // Bit set in each word of a block, taken from the low 32 bits of the
+        // hash (the block comes from the top bits)
+        static inline uint64_t bit(uint64_t h, int word){
+            static const uint32_t salt[8] = { 0x47B6137BU, 0x44974D91U, 0x8824AD5BU,
+                0xA2B7289DU, 0x705495C7U, 0x2DF1424BU, 0x9EFC4947U, 0x5C6BFB31U };
+            return (uint64_t)1 << (((uint32_t)h * salt[word]) >> 26);
+        }
+
+        // Not copyable
+        kmer_bloom(const kmer_bloom&);
+        kmer_bloom& operator=(const kmer_bloom&);
+    public:
+        kmer_bloom();
+        ~kmer_bloom();
+
+        // Use the filter stored with a mapped table, or else add all 
+        // species-specific k-mers in the table (k-mers listed for more
+        // than one species are left out, since lookups of them fail anyway)
+        void build(const kmer_index& idx, int bits_per_kmer = 16);
+        // Allocate an empty filter sized for a number of k-mers
+        void init(uint64_t nkmers, int bits_per_kmer = 16);
+        void add(uint64_t hi, uint64_t lo);
+        // Use blocks stored elsewhere (not copied or freed)
+        void attach(const uint64_t* blocks, uint64_t nblocks);
+        void clear();
+        bool built() const { return blocks != NULL; }
+        uint64_t bytes() const { return nblocks * 64; }
+        const uint64_t* data() const { return blocks; }
+        uint64_t num_blocks() const { return nblocks; }
+
+        // False if the k-mer is certainly not species-specific
+        inline bool contains(uint64_t hi, uint64_t lo) const{
+            uint64_t h = hash(hi, lo);
+            const uint64_t* b = blocks + ((h >> (64 - block_bits)) << 3);
+            bool found = true;
+            for (int i = 0; i < 8; ++i){
+                uint64_t m = bit(h, i);
+                found &= (b[i] & m) == m;
+            }
+            return found;
+        }
+};
+
+#endif
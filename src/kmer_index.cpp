@@ -0,0 +1,545 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <htswrapper/gzreader.h>
+#include "kmer_index.h"
+#include "kmer_bloom.h"
+
+using namespace std;
+
+kmer_index::kmer_index(){
+    keys = NULL;
+    species = NULL;
+    nslots = 0;
+    slot_bits = 0;
+    nkeys = 0;
+    filter = NULL;
+    filter_nblocks = 0;
+    mapped = NULL;
+    mapped_len = 0;
+    k = 0;
+    num_species = 0;
+    words = 1;
+    nconflicts = 0;
+    sample_w = 0;
+    sample_thresh = (uint64_t)1 << 32;
+}
+
+kmer_index::~kmer_index(){
+    close();
+}
+
+void kmer_index::close(){
+    if (mapped != NULL){
+        munmap(mapped, mapped_len);
+        mapped = NULL;
+        mapped_len = 0;
+    }
+    keys_mem.clear();
+    species_mem.clear();
+    keys = NULL;
+    species = NULL;
+    filter = NULL;
+    filter_nblocks = 0;
+    nslots = 0;
+    slot_bits = 0;
+    nkeys = 0;
+}
+
+/**
+ * Where the filter starts in an index file: after the table, aligned to a
+ * cache line (the mapping itself is page-aligned)
+ */
+static uint64_t filter_offset(uint64_t nslots, int words){
+    uint64_t off = sizeof(kmer_index_header) + nslots * words * sizeof(uint64_t) +
+        nslots * sizeof(short);
+    return (off + 63) & ~(uint64_t)63;
+}
+
+void kmer_index::set_nslots(uint64_t n){
+    nslots = n;
+    slot_bits = 0;
+    while (((uint64_t)1 << slot_bits) < n){
+        slot_bits++;
+    }
+}
+
+void kmer_index::set_k(int k){
+    if (k < 1 || k > 64){
+        fprintf(stderr, "ERROR: k-mer length %d not supported (must be 1-64)\n", k);
+        exit(1);
+    }
+    this->k = k;
+    this->words = k <= 32 ? 1 : 2;
+}
+
+void kmer_index::set_sampling(int w){
+    if (w < 0){
+        fprintf(stderr, "ERROR: invalid k-mer sampling window %d\n", w);
+        exit(1);
+    }
+    sample_w = w;
+    if (w <= 1){
+        // Every k-mer is its own minimizer
+        sample_thresh = (uint64_t)1 << 32;
+    }
+    else{
+        sample_thresh = (((uint64_t)1 << 32) * 2) / (w + 1);
+    }
+}
+
+/**
+ * Add a k-mer to a table being built in memory. K-mers that turn up
+ * in more than one species' list are kept, but marked as belonging
+ * to no species.
+ */
+void kmer_index::insert(uint64_t hi, uint64_t lo, short sp){
+    if ((nkeys + 1) * 2 > nslots){
+        grow();
+    }
+    uint64_t s = slot(hi, lo);
+    while (species_mem[s] != -1){
+        if (keys_mem[s*words] == lo && (words == 1 || keys_mem[s*words+1] == hi)){
+            if (species_mem[s] != sp && species_mem[s] != -2){
+                species_mem[s] = -2;
+                nconflicts++;
+            }
+            return;
+        }
+        s = (s + 1) & (nslots - 1);
+    }
+    keys_mem[s*words] = lo;
+    if (words == 2){
+        keys_mem[s*words+1] = hi;
+    }
+    species_mem[s] = sp;
+    nkeys++;
+}
+
+void kmer_index::grow(){
+    vector<uint64_t> keys_old;
+    vector<short> species_old;
+    keys_old.swap(keys_mem);
+    species_old.swap(species_mem);
+    uint64_t nslots_old = nslots;
+
+    set_nslots(nslots == 0 ? 65536 : nslots * 2);
+    keys_mem.resize(nslots * words, 0);
+    species_mem.resize(nslots, -1);
+
+    for (uint64_t i = 0; i < nslots_old; ++i){
+        if (species_old[i] != -1){
+            uint64_t lo = keys_old[i*words];
+            uint64_t hi = words == 2 ? keys_old[i*words+1] : 0;
+            uint64_t s = slot(hi, lo);
+            while (species_mem[s] != -1){
+                s = (s + 1) & (nslots - 1);
+            }
+            keys_mem[s*words] = lo;
+            if (words == 2){
+                keys_mem[s*words+1] = hi;
+            }
+            species_mem[s] = species_old[i];
+        }
+    }
+}
+
+void kmer_index::build(vector<string>& kmerfiles){
+    close();
+    k = 0;
+    num_species = 0;
+    nconflicts = 0;
+    for (int i = 0; i < kmerfiles.size(); ++i){
+        add(kmerfiles[i], (short)i);
+    }
+}
+
+void kmer_index::add(const string& kmerfile, short species_idx){
+    if (mapped != NULL){
+        close();
+    }
+    if (keys == NULL){
+        k = 0;
+        num_species = 0;
+        nconflicts = 0;
+    }
+    if (species_idx + 1 > num_species){
+        num_species = species_idx + 1;
+    }
+    kmer_scanner* scanner = NULL;
+    gzreader reader(kmerfile);
+    while (reader.next()){
+        if (scanner == NULL){
+            if (k == 0){
+                set_k(strlen(reader.line));
+                grow();
+            }
+            scanner = new kmer_scanner(k);
+        }
+        // Each line holds exactly one k-mer
+        scanner->scan(reader.line, k, [&](uint64_t hi, uint64_t lo){
+            if (sampled(hi, lo)){
+                insert(hi, lo, species_idx);
+            }
+            return true;
+        });
+    }
+    if (scanner != NULL){
+        delete scanner;
+    }
+    keys = keys_mem.data();
+    species = species_mem.data();
+}
+
+/**
+ * Add a k-mer to the part of a table (starting at slot base) being built
+ * in memory by build_on_disk(). Returns false if probing ran past the end
+ * of the part, in which case the k-mer belongs in the next one.
+ */
+bool kmer_index::insert_part(uint64_t base, uint64_t hi, uint64_t lo, short sp){
+    uint64_t nslots_part = species_mem.size();
+    uint64_t s = slot(hi, lo) - base;
+    while (s < nslots_part && species_mem[s] != -1){
+        if (keys_mem[s*words] == lo && (words == 1 || keys_mem[s*words+1] == hi)){
+            if (species_mem[s] != sp && species_mem[s] != -2){
+                species_mem[s] = -2;
+                nconflicts++;
+            }
+            return true;
+        }
+        s++;
+    }
+    if (s == nslots_part){
+        return false;
+    }
+    keys_mem[s*words] = lo;
+    if (words == 2){
+        keys_mem[s*words+1] = hi;
+    }
+    species_mem[s] = sp;
+    nkeys++;
+    return true;
+}
+
+// A k-mer waiting to be placed in a table built on disk
+struct kmer_rec{
+    uint64_t lo;
+    uint64_t hi;
+    short sp;
+};
+
+/**
+ * Store a k-mer that probed past the end of one part of a table, to be
+ * placed in the next part. K-mers listed for more than one species are
+ * caught here, too, since every copy of a k-mer follows the same path.
+ */
+static void add_overflow(vector<kmer_rec>& overflow, uint64_t hi, uint64_t lo, short sp,
+    long& nconflicts){
+    for (int i = 0; i < overflow.size(); ++i){
+        if (overflow[i].lo == lo && overflow[i].hi == hi){
+            if (overflow[i].sp != sp && overflow[i].sp != -2){
+                overflow[i].sp = -2;
+                nconflicts++;
+            }
+            return;
+        }
+    }
+    kmer_rec rec;
+    rec.lo = lo;
+    rec.hi = hi;
+    rec.sp = sp;
+    overflow.push_back(rec);
+}
+
+bool kmer_index::build_on_disk(vector<string>& kmerfiles, const string& filename, 
+    int nparts){
+    close();
+    k = 0;
+    num_species = kmerfiles.size();
+    nconflicts = 0;
+    
+    int part_bits = 0;
+    while ((1 << part_bits) < nparts){
+        part_bits++;
+    }
+    nparts = 1 << part_bits;
+
+    // Split k-mers into temporary files by the top bits of their hashes
+    vector<string> partfiles;
+    vector<FILE*> partf;
+    for (int p = 0; p < nparts; ++p){
+        char buf[50];
+        sprintf(&buf[0], ".%d.tmp", p);
+        partfiles.push_back(filename + buf);
+        FILE* f = fopen(partfiles[p].c_str(), "wb");
+        if (!f){
+            fprintf(stderr, "ERROR opening %s for writing\n", partfiles[p].c_str());
+            exit(1);
+        }
+        partf.push_back(f);
+    }
+    uint64_t nkmers = 0;
+    for (int i = 0; i < kmerfiles.size(); ++i){
+        short sp = (short)i;
+        kmer_scanner* scanner = NULL;
+        gzreader reader(kmerfiles[i]);
+        while (reader.next()){
+            if (scanner == NULL){
+                if (k == 0){
+                    set_k(strlen(reader.line));
+                }
+                scanner = new kmer_scanner(k);
+            }
+            scanner->scan(reader.line, k, [&](uint64_t hi, uint64_t lo){
+                if (sampled(hi, lo)){
+                    int p = part_bits == 0 ? 0 : slot_hash(hi, lo) >> (64 - part_bits);
+                    fwrite(&lo, sizeof(uint64_t), 1, partf[p]);
+                    if (words == 2){
+                        fwrite(&hi, sizeof(uint64_t), 1, partf[p]);
+                    }
+                    fwrite(&sp, sizeof(short), 1, partf[p]);
+                    nkmers++;
+                }
+                return true;
+            });
+        }
+        if (scanner != NULL){
+            delete scanner;
+        }
+    }
+    bool ok = true;
+    for (int p = 0; p < nparts; ++p){
+        if (fclose(partf[p]) != 0){
+            ok = false;
+        }
+    }
+    if (k == 0 || !ok){
+        for (int p = 0; p < nparts; ++p){
+            unlink(partfiles[p].c_str());
+        }
+        return false;
+    }
+    
+    // Same load factor as a table built in memory
+    uint64_t n = 65536;
+    while (n < nkmers * 2 || n < (uint64_t)nparts){
+        n *= 2;
+    }
+    set_nslots(n);
+    uint64_t nslots_part = nslots / nparts;
+    off_t keys_off = sizeof(kmer_index_header);
+    off_t species_off = keys_off + nslots * words * sizeof(uint64_t);
+    off_t filter_off = filter_offset(nslots, words);
+    
+    // Filled in one part at a time, alongside the table
+    kmer_bloom bloom;
+    bloom.init(nkmers);
+
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, filter_off + bloom.bytes()) != 0){
+        ok = false;
+    }
+    
+    keys_mem.resize(nslots_part * words);
+    species_mem.resize(nslots_part);
+    vector<kmer_rec> overflow;
+    for (int p = 0; p < nparts && ok; ++p){
+        uint64_t base = p * nslots_part;
+        fill(keys_mem.begin(), keys_mem.end(), 0);
+        fill(species_mem.begin(), species_mem.end(), -1);
+        
+        // K-mers that ran off the end of the last part go first, so they
+        // sit just past it
+        vector<kmer_rec> overflow_prev;
+        overflow_prev.swap(overflow);
+        for (int i = 0; i < overflow_prev.size(); ++i){
+            uint64_t s = 0;
+            while (s < nslots_part && species_mem[s] != -1){
+                s++;
+            }
+            if (s == nslots_part){
+                overflow.push_back(overflow_prev[i]);
+            }
+            else{
+                keys_mem[s*words] = overflow_prev[i].lo;
+                if (words == 2){
+                    keys_mem[s*words+1] = overflow_prev[i].hi;
+                }
+                species_mem[s] = overflow_prev[i].sp;
+                nkeys++;
+            }
+        }
+
+        FILE* f = fopen(partfiles[p].c_str(), "rb");
+        if (!f){
+            ok = false;
+            break;
+        }
+        uint64_t lo;
+        uint64_t hi = 0;
+        short sp;
+        while (fread(&lo, sizeof(uint64_t), 1, f) == 1 &&
+            (words == 1 || fread(&hi, sizeof(uint64_t), 1, f) == 1) &&
+            fread(&sp, sizeof(short), 1, f) == 1){
+            if (!insert_part(base, hi, lo, sp)){
+                add_overflow(overflow, hi, lo, sp, nconflicts);
+            }
+        }
+        fclose(f);
+        unlink(partfiles[p].c_str());
+
+        size_t keys_len = nslots_part * words * sizeof(uint64_t);
+        size_t species_len = nslots_part * sizeof(short);
+        if (pwrite(fd, keys_mem.data(), keys_len, keys_off + base * words * sizeof(uint64_t)) 
+            != keys_len ||
+            pwrite(fd, species_mem.data(), species_len, species_off + base * sizeof(short)) 
+            != species_len){
+            ok = false;
+        }
+        for (uint64_t s = 0; s < nslots_part; ++s){
+            if (species_mem[s] >= 0){
+                bloom.add(words == 2 ? keys_mem[s*words+1] : 0, keys_mem[s*words]);
+            }
+        }
+    }
+    
+    // K-mers that ran off the end of the table wrap around to the start
+    for (int i = 0; i < overflow.size() && ok; ++i){
+        for (uint64_t s = 0; s < nslots; ++s){
+            short sp;
+            if (pread(fd, &sp, sizeof(short), species_off + s * sizeof(short)) != sizeof(short)){
+                ok = false;
+                break;
+            }
+            if (sp == -1){
+                ok = pwrite(fd, &overflow[i].lo, sizeof(uint64_t), 
+                    keys_off + s * words * sizeof(uint64_t)) == sizeof(uint64_t) &&
+                    (words == 1 || pwrite(fd, &overflow[i].hi, sizeof(uint64_t),
+                    keys_off + (s * words + 1) * sizeof(uint64_t)) == sizeof(uint64_t)) &&
+                    pwrite(fd, &overflow[i].sp, sizeof(short), 
+                    species_off + s * sizeof(short)) == sizeof(short);
+                break;
+            }
+        }
+        if (overflow[i].sp >= 0){
+            bloom.add(overflow[i].hi, overflow[i].lo);
+        }
+    }
+    nkeys += overflow.size();
+    keys_mem.clear();
+    keys_mem.shrink_to_fit();
+    species_mem.clear();
+    species_mem.shrink_to_fit();
+    
+    if (ok){
+        kmer_index_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(&header.magic[0], KMER_INDEX_MAGIC, strlen(KMER_INDEX_MAGIC));
+        header.k = k;
+        header.num_species = num_species;
+        header.words = words;
+        header.sample_w = sample_w;
+        header.nslots = nslots;
+        header.nkeys = nkeys;
+        header.filter_nblocks = bloom.num_blocks();
+        ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            pwrite(fd, bloom.data(), bloom.bytes(), filter_off) == bloom.bytes();
+    }
+    if (fd >= 0 && ::close(fd) != 0){
+        ok = false;
+    }
+    for (int p = 0; p < nparts; ++p){
+        unlink(partfiles[p].c_str());
+    }
+    if (!ok){
+        unlink(filename.c_str());
+    }
+    nslots = 0;
+    nkeys = 0;
+    return ok;
+}
+
+bool kmer_index::write(const string& filename){
+    if (keys == NULL){
+        return false;
+    }
+    kmer_bloom bloom;
+    bloom.build(*this);
+    FILE* outf = fopen(filename.c_str(), "wb");
+    if (!outf){
+        return false;
+    }
+    kmer_index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(&header.magic[0], KMER_INDEX_MAGIC, strlen(KMER_INDEX_MAGIC));
+    header.k = k;
+    header.num_species = num_species;
+    header.words = words;
+    header.sample_w = sample_w;
+    header.nslots = nslots;
+    header.nkeys = nkeys;
+    header.filter_nblocks = bloom.num_blocks();
+    uint64_t pad = filter_offset(nslots, words) - (sizeof(header) + 
+        nslots * words * sizeof(uint64_t) + nslots * sizeof(short));
+    char zeros[64] = { 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, outf) == 1 &&
+        fwrite(keys, sizeof(uint64_t), nslots*words, outf) == nslots*words &&
+        fwrite(species, sizeof(short), nslots, outf) == nslots &&
+        fwrite(&zeros[0], 1, pad, outf) == pad &&
+        fwrite(bloom.data(), 64, bloom.num_blocks(), outf) == bloom.num_blocks();
+    if (fclose(outf) != 0){
+        ok = false;
+    }
+    return ok;
+}
+
+bool kmer_index::load(const string& filename){
+    close();
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0){
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(kmer_index_header)){
+        ::close(fd);
+        return false;
+    }
+    void* m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after closing the file
+    ::close(fd);
+    if (m == MAP_FAILED){
+        return false;
+    }
+    const kmer_index_header* header = (const kmer_index_header*)m;
+    if (strncmp(&header->magic[0], KMER_INDEX_MAGIC, 8) != 0 ||
+        header->words != (header->k <= 32 ? 1 : 2) ||
+        header->nslots == 0 || (header->nslots & (header->nslots - 1)) != 0 ||
+        header->filter_nblocks < 2 || 
+        (header->filter_nblocks & (header->filter_nblocks - 1)) != 0 ||
+        filter_offset(header->nslots, header->words) + header->filter_nblocks * 64 
+        != st.st_size){
+        munmap(m, st.st_size);
+        return false;
+    }
+    set_k(header->k);
+    set_sampling(header->sample_w);
+    num_species = header->num_species;
+    set_nslots(header->nslots);
+    nkeys = header->nkeys;
+    nconflicts = 0;
+    mapped = m;
+    mapped_len = st.st_size;
+    keys = (const uint64_t*)((const char*)m + sizeof(kmer_index_header));
+    species = (const short*)(keys + nslots*words);
+    filter = (const uint64_t*)((const char*)m + filter_offset(nslots, words));
+    filter_nblocks = header->filter_nblocks;
+    return true;
+}
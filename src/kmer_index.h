@@ -0,0 +1,163 @@
+#ifndef _CELLBOUNCER_KMER_INDEX_H
+#define _CELLBOUNCER_KMER_INDEX_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "kmer_scan.h"
+
+// ===== kmer_index.h
+// A prebuilt, immutable hash table mapping species-specific k-mers to
+// species indices, used by demux_species. The table is stored in a binary
+// file that is memory-mapped read-only, so loading it takes constant time
+// and concurrent jobs on the same machine share one copy in the page cache.
+//
+// The table can also be built in memory from k-mer lists, which is how
+// demux_species stores k-mers when there is no prebuilt index, or built
+// directly on disk one part at a time (build_on_disk()), for when the whole
+// table does not fit in memory.
+//
+// K-mers (k <= 64) are packed 2 bits per base (A=0, C=1, G=2, T=3) into one
+// (k <= 32) or two 64-bit words (see kmer_scan.h), and only the canonical
+// form (the lesser of the k-mer and its reverse complement) is stored.
+// The table uses open addressing with linear probing. A k-mer's home slot
+// is given by the top bits of its hash, so splitting k-mers by the top few
+// bits of their hashes also splits the table into contiguous ranges of
+// slots.
+//
+// To save memory, the table can hold only a sample of k-mers: with a
+// sampling window w, a k-mer is kept if a hash of it falls in the lowest
+// 2/(w+1) of all values. This is the same density as (w,k)-minimizers,
+// but since the choice depends only on the k-mer itself (the k-mer lists
+// carry no sequence context), reads are scanned by applying the same test
+// to each k-mer (see sampled()), and every sampled k-mer is found.
+//
+// File layout: a kmer_index_header, then the key words of every slot
+// (words per slot, least significant word first), then the species index
+// of every slot (short; -1 = empty slot, -2 = k-mer listed for more than
+// one species), then, starting at the next multiple of 64 bytes, the 
+// blocks of a kmer_bloom filter over the species-specific k-mers.
+
+#define KMER_INDEX_MAGIC "CBKIDX3"
+
+struct kmer_index_header{
+    char magic[8];
+    uint32_t k;
+    uint32_t num_species;
+    uint32_t words;
+    // Sampling window (0 = all k-mers kept)
+    uint32_t sample_w;
+    uint64_t nslots;
+    uint64_t nkeys;
+    // Number of 64-byte kmer_bloom blocks
+    uint64_t filter_nblocks;
+};
+
+class kmer_index{
+    private:
+        // The table, either built in memory or mapped from a file
+        const uint64_t* keys;
+        const short* species;
+        uint64_t nslots;
+        // log2(nslots)
+        int slot_bits;
+        uint64_t nkeys;
+        std::vector<uint64_t> keys_mem;
+        std::vector<short> species_mem;
+        // Filter stored with a mapped table (NULL otherwise)
+        const uint64_t* filter;
+        uint64_t filter_nblocks;
+        void* mapped;
+        size_t mapped_len;
+
+        // K-mers are kept if the top 32 bits of their sampling hash are 
+        // below this
+        uint64_t sample_thresh;
+
+        void set_k(int k);
+        static inline uint64_t slot_hash(uint64_t hi, uint64_t lo){
+            uint64_t h = lo * 0x9E3779B97F4A7C15ULL ^ (hi + 0x632BE59BD9B4E019ULL) * 0xC2B2AE3D27D4EB4FULL;
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDULL;
+            h ^= h >> 33;
+            return h;
+        }
+        inline uint64_t slot(uint64_t hi, uint64_t lo) const{
+            return slot_hash(hi, lo) >> (64 - slot_bits);
+        }
+        void set_nslots(uint64_t n);
+        void insert(uint64_t hi, uint64_t lo, short sp);
+        void grow();
+        bool insert_part(uint64_t base, uint64_t hi, uint64_t lo, short sp);
+    public:
+        int k;
+        int num_species;
+        int words;
+        // Number of k-mers found in more than one species' list
+        long nconflicts;
+        // Sampling window (0 = all k-mers)
+        int sample_w;
+
+        kmer_index();
+        ~kmer_index();
+
+        // Keep only a sample of k-mers added from now on (see above). 
+        // Must be set before adding k-mers.
+        void set_sampling(int w);
+        // Build the table in memory from one k-mer list per species (gzipped
+        // text, one k-mer per line, as written by get_unique_kmers)
+        void build(std::vector<std::string>& kmerfiles);
+        // Add one species' k-mer list to a table in memory
+        void add(const std::string& kmerfile, short species_idx);
+        // Build a table from k-mer lists and write it to disk, holding only
+        // 1/nparts of it in memory at a time. K-mers are first split by
+        // part into temporary files (named after the output file). Map the 
+        // table with load() afterward.
+        bool build_on_disk(std::vector<std::string>& kmerfiles, 
+            const std::string& filename, int nparts);
+        // Write a built table to disk
+        bool write(const std::string& filename);
+        // Map a table from disk
+        bool load(const std::string& filename);
+        void close();
+        bool loaded() const { return keys != NULL; }
+        // Filter blocks mapped with the table, if any (see kmer_bloom)
+        const uint64_t* filter_data() const { return filter; }
+        uint64_t filter_blocks() const { return filter_nblocks; }
+        uint64_t size() const { return nkeys; }
+        // Memory used by the table
+        uint64_t bytes() const { return nslots * (words * sizeof(uint64_t) + sizeof(short)); }
+
+        // Whether a canonical k-mer would be kept under the sampling scheme
+        inline bool sampled(uint64_t hi, uint64_t lo) const{
+            uint64_t h = (lo ^ (hi * 0x9E3779B97F4A7C15ULL)) * 0xD6E8FEB86659FD93ULL;
+            h ^= h >> 32;
+            h *= 0xD6E8FEB86659FD93ULL;
+            return (h >> 32) < sample_thresh;
+        }
+
+        // Call fn(hi, lo) for every k-mer specific to one species
+        template <typename F>
+        void for_each(F fn) const{
+            for (uint64_t s = 0; s < nslots; ++s){
+                if (species[s] >= 0){
+                    fn(words == 2 ? keys[s*words+1] : 0, keys[s*words]);
+                }
+            }
+        }
+
+        // Look up a canonical k-mer (as given by kmer_scanner)
+        inline bool lookup(uint64_t hi, uint64_t lo, short& sp) const{
+            uint64_t s = slot(hi, lo);
+            while (species[s] != -1){
+                if (keys[s*words] == lo && (words == 1 || keys[s*words+1] == hi)){
+                    sp = species[s];
+                    return sp >= 0;
+                }
+                s = (s + 1) & (nslots - 1);
+            }
+            return false;
+        }
+};
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef _CELLBOUNCER_KMER_SCAN_H
+#define _CELLBOUNCER_KMER_SCAN_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// ===== kmer_scan.h
+// Scans reads for canonical k-mers (k <= 64), packed 2 bits per base
+// (A=0, C=1, G=2, T=3) into one (k <= 32) or two 64-bit words. This is the
+// encoding used by kmer_index.
+//
+// A read is first translated to 2-bit codes all at once (16 bases at a time
+// using SIMD where available), with any non-ACGT base marked as 4. The
+// scanner then keeps forward and reverse complement words that are updated
+// with each new base, so the canonical form of each k-mer (the lesser of
+// the two) is available at each position without re-reading the k-mer.
+// K-mers containing non-ACGT bases are skipped.
+
+/**
+ * 2-bit code for a single base (4 = not ACGT)
+ */
+inline unsigned char kmer_base_code(char c){
+    switch(c){
+        case 'A':
+        case 'a':
+            return 0;
+        case 'C':
+        case 'c':
+            return 1;
+        case 'G':
+        case 'g':
+            return 2;
+        case 'T':
+        case 't':
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+/**
+ * Translate a sequence to 2-bit codes (4 = not ACGT).
+ */
+inline void kmer_encode_bases(const char* seq, int len, unsigned char* codes){
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i upper = _mm_set1_epi8((char)0xDF);
+    const __m128i base_a = _mm_set1_epi8('A');
+    const __m128i base_c = _mm_set1_epi8('C');
+    const __m128i base_g = _mm_set1_epi8('G');
+    const __m128i base_t = _mm_set1_epi8('T');
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi8(2);
+    const __m128i three = _mm_set1_epi8(3);
+    const __m128i four = _mm_set1_epi8(4);
+    for (; i + 16 <= len; i += 16){
+        __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i*)(seq + i)), upper);
+        __m128i is_a = _mm_cmpeq_epi8(x, base_a);
+        __m128i is_c = _mm_cmpeq_epi8(x, base_c);
+        __m128i is_g = _mm_cmpeq_epi8(x, base_g);
+        __m128i is_t = _mm_cmpeq_epi8(x, base_t);
+        __m128i code = _mm_or_si128(_mm_and_si128(is_c, one),
+            _mm_or_si128(_mm_and_si128(is_g, two), _mm_and_si128(is_t, three)));
+        __m128i valid = _mm_or_si128(_mm_or_si128(is_a, is_c), _mm_or_si128(is_g, is_t));
+        code = _mm_or_si128(code, _mm_andnot_si128(valid, four));
+        _mm_storeu_si128((__m128i*)(codes + i), code);
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t upper = vdupq_n_u8(0xDF);
+    const uint8x16_t one = vdupq_n_u8(1);
+    const uint8x16_t two = vdupq_n_u8(2);
+    const uint8x16_t three = vdupq_n_u8(3);
+    const uint8x16_t four = vdupq_n_u8(4);
+    for (; i + 16 <= len; i += 16){
+        uint8x16_t x = vandq_u8(vld1q_u8((const uint8_t*)(seq + i)), upper);
+        uint8x16_t is_a = vceqq_u8(x, vdupq_n_u8('A'));
+        uint8x16_t is_c = vceqq_u8(x, vdupq_n_u8('C'));
+        uint8x16_t is_g = vceqq_u8(x, vdupq_n_u8('G'));
+        uint8x16_t is_t = vceqq_u8(x, vdupq_n_u8('T'));
+        uint8x16_t code = vorrq_u8(vandq_u8(is_c, one),
+            vorrq_u8(vandq_u8(is_g, two), vandq_u8(is_t, three)));
+        uint8x16_t valid = vorrq_u8(vorrq_u8(is_a, is_c), vorrq_u8(is_g, is_t));
+        code = vorrq_u8(code, vbicq_u8(four, valid));
+        vst1q_u8(codes + i, code);
+    }
+#endif
+    for (; i < len; ++i){
+        codes[i] = kmer_base_code(seq[i]);
+    }
+}
+
+class kmer_scanner{
+    private:
+        std::vector<unsigned char> codes;
+        uint64_t lo_mask;
+        uint64_t hi_mask;
+        int rc_shift;
+    public:
+        int k;
+        // Words per k-mer (1 if k <= 32, otherwise 2)
+        int words;
+
+        kmer_scanner(int k){
+            if (k < 1 || k > 64){
+                fprintf(stderr, "ERROR: k-mer length %d not supported (must be 1-64)\n", k);
+                exit(1);
+            }
+            this->k = k;
+            if (k <= 32){
+                words = 1;
+                lo_mask = k == 32 ? ~(uint64_t)0 : ((uint64_t)1 << (2*k)) - 1;
+                hi_mask = 0;
+                rc_shift = 2*k - 2;
+            }
+            else{
+                words = 2;
+                lo_mask = ~(uint64_t)0;
+                hi_mask = k == 64 ? ~(uint64_t)0 : ((uint64_t)1 << (2*(k-32))) - 1;
+                rc_shift = 2*(k-32) - 2;
+            }
+        }
+
+        /**
+         * Call fn(hi, lo) with each canonical k-mer in a sequence, in order,
+         * until fn returns true (for k <= 32, hi is always 0). Returns true if
+         * fn stopped the scan.
+         */
+        template<typename F>
+        inline bool scan(const char* seq, int len, F fn){
+            if (codes.size() < len){
+                codes.resize(len);
+            }
+            kmer_encode_bases(seq, len, codes.data());
+            const unsigned char* c = codes.data();
+            uint64_t f_hi = 0;
+            uint64_t f_lo = 0;
+            uint64_t r_hi = 0;
+            uint64_t r_lo = 0;
+            // Number of consecutive ACGT bases ending at the current position
+            int nvalid = 0;
+            if (words == 1){
+                for (int i = 0; i < len; ++i){
+                    uint64_t b = c[i];
+                    if (b > 3){
+                        nvalid = 0;
+                        continue;
+                    }
+                    f_lo = ((f_lo << 2) | b) & lo_mask;
+                    r_lo = (r_lo >> 2) | ((3-b) << rc_shift);
+                    if (++nvalid >= k && fn((uint64_t)0, r_lo < f_lo ? r_lo : f_lo)){
+                        return true;
+                    }
+                }
+            }
+            else{
+                for (int i = 0; i < len; ++i){
+                    uint64_t b = c[i];
+                    if (b > 3){
+                        nvalid = 0;
+                        continue;
+                    }
+                    f_hi = ((f_hi << 2) | (f_lo >> 62)) & hi_mask;
+                    f_lo = (f_lo << 2) | b;
+                    r_lo = (r_lo >> 2) | (r_hi << 62);
+                    r_hi = (r_hi >> 2) | ((3-b) << rc_shift);
+                    if (++nvalid >= k){
+                        bool rc = r_hi < f_hi || (r_hi == f_hi && r_lo < f_lo);
+                        if (fn(rc ? r_hi : f_hi, rc ? r_lo : f_lo)){
+                            return true;
+                        }
+                    }
+                }
+            }
+            return false;
+        }
+};
+
+#endif
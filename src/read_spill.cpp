@@ -0,0 +1,119 @@
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "read_spill.h"
+
+using namespace std;
+
+// Compress records for a bin once this much is buffered
+#define SPILL_BUF_SIZE 65536
+
+read_spill::read_spill(const string& prefix){
+    this->prefix = prefix;
+}
+
+read_spill::~read_spill(){
+    close();
+}
+
+void read_spill::open(int nbins){
+    close();
+    filenames.clear();
+    for (int i = 0; i < nbins; ++i){
+        char buf[50];
+        sprintf(&buf[0], ".%d.gz", i);
+        filenames.push_back(prefix + buf);
+        // Favor speed over size: these files are only read once
+        gzFile fp = gzopen(filenames[i].c_str(), "wb1");
+        if (!fp){
+            fprintf(stderr, "ERROR opening %s for writing.\n", filenames[i].c_str());
+            exit(1);
+        }
+        bins.push_back(fp);
+        bufs.push_back(string());
+        bufs[i].reserve(SPILL_BUF_SIZE + 1024);
+    }
+}
+
+void read_spill::flush(int bin){
+    if (bufs[bin].length() > 0){
+        if (gzwrite(bins[bin], bufs[bin].data(), bufs[bin].length()) != bufs[bin].length()){
+            fprintf(stderr, "ERROR writing to %s\n", filenames[bin].c_str());
+            exit(1);
+        }
+        bufs[bin].clear();
+    }
+}
+
+void read_spill::close(){
+    for (int i = 0; i < bins.size(); ++i){
+        flush(i);
+        if (gzclose(bins[i]) != Z_OK){
+            fprintf(stderr, "ERROR writing to %s\n", filenames[i].c_str());
+            exit(1);
+        }
+    }
+    bins.clear();
+    bufs.clear();
+}
+
+void read_spill::remove(){
+    close();
+    for (int i = 0; i < filenames.size(); ++i){
+        unlink(filenames[i].c_str());
+    }
+    filenames.clear();
+}
+
+void read_spill::add(int bin, const char* id, int id_len, const char* seq_f,
+    const char* qual_f, int len_f, const char* seq_r, const char* qual_r, int len_r){
+    string& buf = bufs[bin];
+    int32_t lens[3] = { id_len, len_f, len_r };
+    buf.append((const char*)&lens[0], sizeof(lens));
+    buf.append(id, id_len);
+    buf.append(seq_f, len_f);
+    buf.append(qual_f, len_f);
+    buf.append(seq_r, len_r);
+    buf.append(qual_r, len_r);
+    if (buf.length() >= SPILL_BUF_SIZE){
+        flush(bin);
+    }
+}
+
+read_spill_reader::read_spill_reader(const string& filename){
+    fp = gzopen(filename.c_str(), "rb");
+    if (!fp){
+        fprintf(stderr, "ERROR opening %s for reading.\n", filename.c_str());
+        exit(1);
+    }
+    gzbuffer(fp, 1 << 20);
+}
+
+read_spill_reader::~read_spill_reader(){
+    gzclose(fp);
+}
+
+bool read_spill_reader::read_str(string& str, int len){
+    str.resize(len);
+    return len == 0 || gzread(fp, &str[0], len) == len;
+}
+
+bool read_spill_reader::next(){
+    int32_t lens[3];
+    int nread = gzread(fp, &lens[0], sizeof(lens));
+    if (nread == 0){
+        return false;
+    }
+    if (nread != sizeof(lens) || !read_str(id, lens[0]) || !read_str(seq_f, lens[1]) ||
+        !read_str(qual_f, lens[1]) || !read_str(seq_r, lens[2]) ||
+        !read_str(qual_r, lens[2])){
+        fprintf(stderr, "ERROR: temporary read file is truncated or corrupted\n");
+        exit(1);
+    }
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef _CELLBOUNCER_READ_SPILL_H
+#define _CELLBOUNCER_READ_SPILL_H
+#include <zlib.h>
+#include <string>
+#include <vector>
+
+// ===== read_spill.h
+// Temporary storage for RNA-seq read pairs seen while counting species
+// k-mers, so that demux_species can write them to per-species output files
+// once cell barcodes have been assigned to species, without reading and
+// decompressing the original FASTQ files a second time.
+//
+// Reads from one pair of input files are written to several gzipped bins,
+// one per UMI shard of species_kmer_counter (i.e. keyed by a hash of the
+// cell barcode), so each bin is only written by one thread at a time and
+// compression is spread across worker threads.
+//
+// Each record holds the read name, both sequences and both quality strings:
+// three 32-bit lengths (name, forward read, reverse read), then the name,
+// forward sequence, forward quality, reverse sequence, and reverse quality.
+
+class read_spill{
+    private:
+        std::string prefix;
+        std::vector<gzFile> bins;
+        // Records waiting to be compressed, per bin
+        std::vector<std::string> bufs;
+        void flush(int bin);
+    public:
+        // Names of bin files
+        std::vector<std::string> filenames;
+
+        // Bins will be named prefix.<bin>.gz
+        read_spill(const std::string& prefix);
+        ~read_spill();
+
+        // Create bin files
+        void open(int nbins);
+        // Finish writing bin files
+        void close();
+        // Delete bin files
+        void remove();
+
+        void add(int bin, const char* id, int id_len, const char* seq_f,
+            const char* qual_f, int len_f, const char* seq_r, const char* qual_r,
+            int len_r);
+};
+
+// Reads records back from one bin file
+class read_spill_reader{
+    private:
+        gzFile fp;
+        bool read_str(std::string& str, int len);
+    public:
+        std::string id;
+        std::string seq_f;
+        std::string qual_f;
+        std::string seq_r;
+        std::string qual_r;
+
+        read_spill_reader(const std::string& filename);
+        ~read_spill_reader();
+        bool next();
+};
+
+#endif
@@ -15,17 +15,25 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <cstdlib>
+#include <deque>
+#include <thread>
+#include <mutex>
 #include <htslib/kseq.h>
 #include <htswrapper/bc.h>
 #include <htswrapper/robin_hood/robin_hood.h>
 #include <htswrapper/bc_scanner.h>
 #include "common.h"
 #include "reads_demux.h"
+#include "fq_stream.h"
 
 using namespace std;
 
 //KSEQ_INIT(gzFile, gzread);
 
+// How much output each reader of a chunk collects for a species before 
+// writing it
+#define DEMUX_CHUNK_BUFSIZE 262144
+
 // Constructor
 reads_demuxer::reads_demuxer(bc_whitelist& whitelist,
     robin_hood::unordered_map<unsigned long, short>& bc2species,
@@ -38,18 +46,51 @@ reads_demuxer::reads_demuxer(bc_whitelist& whitelist,
     
     this->atac_preproc = false;
     this->corr_barcodes = true;
+    this->nthreads = 1;
+    this->nreaders = 1;
+    this->chunk = 0;
+    this->num_chunks = 1;
+    this->pool = NULL;
     initialized = false;
 }
 
 // Destructor
 reads_demuxer::~reads_demuxer(){
     close();
+    if (pool != NULL){
+        delete pool;
+    }
 }
 
 void reads_demuxer::set_threads(int nt){
     nthreads = nt;
 }
 
+void reads_demuxer::set_readers(int nr){
+    nreaders = nr > 1 ? nr : 1;
+}
+
+void reads_demuxer::set_chunk(int chunk, int num_chunks){
+    this->chunk = chunk;
+    this->num_chunks = num_chunks;
+}
+
+/**
+ * Add a chunk index to an output file name, as split_read_files does
+ * (sample_R1_001.fastq.gz -> sample_R1_001.<chunk>.fastq.gz)
+ */
+static string chunk_outname(const string& filename, int chunk){
+    const char* exts[] = { ".fastq.gz", ".fq.gz", ".gz" };
+    for (int i = 0; i < 3; ++i){
+        size_t extlen = strlen(exts[i]);
+        if (filename.length() > extlen && filename.substr(filename.length()-extlen) == exts[i]){
+            return filename.substr(0, filename.length()-extlen) + "." + 
+                to_string(chunk) + exts[i];
+        }
+    }
+    return filename + "." + to_string(chunk);
+}
+
 void reads_demuxer::preproc_atac(bool option){
     this->atac_preproc = option;
 }
@@ -62,11 +103,9 @@ void reads_demuxer::correct_bcs(bool option){
 void reads_demuxer::close(){
     if (this->initialized){
         for (int i = 0; i < n_outfiles; ++i){
-            gzclose(outfiles[i]);
-            outfiles[i] = NULL;
+            outfiles[i].close();
         }
         n_outfiles = 0;
-        free(outfiles);
 
         r1 = "";
         r2 = "";
@@ -76,13 +115,50 @@ void reads_demuxer::close(){
     }
 }
 
+// Prepare the set of (not yet open) output files
+void reads_demuxer::open_outfiles(){
+    if (nthreads > 1 && pool == NULL){
+        pool = new fq_writer_pool(nthreads);
+    }
+    while (outfiles.size() < n_outfiles){
+        outfiles.emplace_back();
+    }
+}
+
+string mate_outname(const string& filename, const string& mate){
+    string base = "stdin";
+    if (filename != "-"){
+        string fn = filename;
+        base = filename_nopath(fn);
+        const char* exts[] = { ".gz", ".fastq", ".fq" };
+        for (int i = 0; i < 3; ++i){
+            size_t extlen = strlen(exts[i]);
+            if (base.length() > extlen && base.substr(base.length()-extlen) == exts[i]){
+                base = base.substr(0, base.length()-extlen);
+            }
+        }
+    }
+    return base + "_" + mate + "_001.fastq.gz";
+}
+
 // Set up for RNA-seq reads or feature barcoding data
+// (an empty r2filename means r1filename is interleaved)
 void reads_demuxer::init_rna_or_custom(string file_prefix, string& r1filename, string& r2filename){
     // If already initialized for something else, close existing files
     close();
     // Trim paths from filenames for output filenames
-    string r1filetrim = filename_nopath(r1filename);
-    string r2filetrim = filename_nopath(r2filename);
+    string r1filetrim;
+    string r2filetrim;
+    if (r2filename == ""){
+        r1filetrim = mate_outname(r1filename, "R1");
+        r2filetrim = mate_outname(r1filename, "R2");
+    }
+    else{
+        r1filetrim = r1filename == "-" ? mate_outname(r1filename, "R1") : 
+            filename_nopath(r1filename);
+        r2filetrim = r2filename == "-" ? mate_outname(r2filename, "R2") : 
+            filename_nopath(r2filename);
+    }
     // Append prefix (i.e. "GEX") identifier to output files, if necessary
     string prefix = file_prefix + "_";
     if (r1filetrim.length() < prefix.length() || r1filetrim.substr(0, prefix.length()) != prefix){
@@ -97,6 +173,10 @@ void reads_demuxer::init_rna_or_custom(string file_prefix, string& r1filename, s
     if (r2filetrim.length() < 3 || r2filetrim.substr(r2filetrim.length()-3, 3) != ".gz"){
         r2filetrim += ".gz";
     }
+    if (num_chunks > 1){
+        r1filetrim = chunk_outname(r1filetrim, chunk);
+        r2filetrim = chunk_outname(r2filetrim, chunk);
+    }
     // To keep the 10X pipeline happy, we'll create output files with the same name as
     // input files, separated in directories according to species of origin.
     if (outdir != ""){
@@ -105,25 +185,15 @@ void reads_demuxer::init_rna_or_custom(string file_prefix, string& r1filename, s
         }
     }
     n_outfiles = idx2species.size()*2;
-    outfiles = (gzFile*)malloc(n_outfiles * sizeof(gzFile)); 
+    open_outfiles();
     
     for (map<short, string>::iterator spec = idx2species.begin(); spec != idx2species.end(); ++spec){
         string dirn = outdir + spec->second;
         if (!mkdir(dirn.c_str(), 0775)){
             // Assume directory already exists
         }
-        string fn = dirn + "/" + r1filetrim;
-        outfiles[spec->first * 2] = gzopen(fn.c_str(), "w");
-        if (!outfiles[spec->first * 2]){
-            fprintf(stderr, "ERROR opening %s for writing.\n", fn.c_str());
-            exit(1);
-        }
-        fn = dirn + "/" + r2filetrim;
-        outfiles[spec->first * 2 + 1] = gzopen(fn.c_str(), "w");
-        if (!outfiles[spec->first * 2 + 1]){
-            fprintf(stderr, "ERROR opening %s for writing.\n", fn.c_str());
-            exit(1);
-        }
+        outfiles[spec->first * 2].open(dirn + "/" + r1filetrim, pool);
+        outfiles[spec->first * 2 + 1].open(dirn + "/" + r2filetrim, pool);
     }
     this->r1 = r1filename;
     this->r2 = r2filename;
@@ -144,8 +214,47 @@ bool reads_demuxer::scan_rna(){
     if (!initialized || is_atac){
         return false;
     }
+    if (nthreads > 1 && nreaders > 1 && fq_chunkable(r1) && (r2 == "" || fq_chunkable(r2))){
+        // Read chunks of BGZF input at once; each reader takes an equal part
+        // of the chunk to read
+        vector<thread> readers;
+        for (int i = 0; i < nreaders; ++i){
+            readers.push_back(thread(&reads_demuxer::scan_rna_chunk, this, 
+                chunk * nreaders + i, num_chunks * nreaders));
+        }
+        for (int i = 0; i < readers.size(); ++i){
+            readers[i].join();
+        }
+        return true;
+    }
+    else if (num_chunks > 1){
+        scan_rna_chunk(chunk, num_chunks);
+        return true;
+    }
+    if (r2 == ""){
+        // Interleaved input, which bc_scanner cannot read
+        fq_pair_reader reader;
+        reader.open(r1, r2, nthreads);
+        while (reader.next()){
+            route_rna_pair(reader.id, reader.id_len, reader.seq_f, reader.qual_f,
+                reader.len_f, reader.seq_r, reader.qual_r, reader.len_r);
+        }
+        return true;
+    }
     // Now iterate through read files, find/match barcodes, and assign to the correct files.
-    bc_scanner scanner(r1, r2);
+    // With multiple threads, decompress each input file in its own thread
+    deque<fq_stream> streams;
+    vector<string> paths{ r1, r2 };
+    for (int i = 0; i < paths.size(); ++i){
+        if (paths[i] == "-"){
+            paths[i] = "/dev/stdin";
+        }
+    }
+    if (nthreads > 1){
+        vector<string> filenames = paths;
+        open_fq_streams(streams, filenames, paths, nthreads);
+    }
+    bc_scanner scanner(paths[0], paths[1]);
     scanner.init_10x_RNA(*whitelist);
     if (nthreads > 1){
         scanner.set_threads(nthreads);
@@ -154,7 +263,10 @@ bool reads_demuxer::scan_rna(){
         scanner.corr_barcodes(true);
     }   
     while(scanner.next()){
-        int species = bc2species[scanner.barcode];
+        int species = barcode_species(scanner.barcode);
+        if (species < 0){
+            continue;
+        }
         write_fastq(scanner.seq_id, scanner.seq_id_len,
             scanner.barcode_read, scanner.barcode_read_len,
             scanner.barcode_read_qual, species*2);
@@ -165,6 +277,123 @@ bool reads_demuxer::scan_rna(){
     return true;  
 }
 
+/**
+ * Look up a barcode's species without inserting it, since readers of 
+ * different chunks share the map. Not every whitelisted barcode has a 
+ * species: with multiome data, the whitelist holds every barcode in 
+ * bc_conversion, and only assigned barcodes are in bc2species.
+ */
+int reads_demuxer::barcode_species(unsigned long bc_key){
+    robin_hood::unordered_map<unsigned long, short>::iterator s = 
+        bc2species.find(bc_key);
+    if (s == bc2species.end()){
+        return -1;
+    }
+    return s->second;
+}
+
+/**
+ * Add a FASTQ record to the end of a buffer.
+ */
+static void append_fastq(string& buf, const char* id, int idlen, const char* seq, 
+    int seqlen, const char* qual){
+    buf += '@';
+    buf.append(id, idlen);
+    buf += '\n';
+    buf.append(seq, seqlen);
+    buf.append("\n+\n", 3);
+    buf.append(qual, seqlen);
+    buf += '\n';
+}
+
+/**
+ * Write buffered R1 and R2 records for a species together, so that mates
+ * stay in the same order in both files when several readers write to them.
+ */
+void reads_demuxer::flush_species(vector<string>& bufs, int species){
+    string& buf1 = bufs[species*2];
+    string& buf2 = bufs[species*2 + 1];
+    if (buf1.length() == 0){
+        return;
+    }
+    {
+        unique_lock<mutex> lock(out_mutex);
+        outfiles[species*2].write(buf1.data(), buf1.length());
+        outfiles[species*2 + 1].write(buf2.data(), buf2.length());
+    }
+    buf1.clear();
+    buf2.clear();
+}
+
+/**
+ * Demultiplex one chunk of BGZF-compressed RNA-seq (or custom) input.
+ * Several of these can run at once, on different chunks.
+ */
+void reads_demuxer::scan_rna_chunk(int chunk, int num_chunks){
+    fq_pair_reader reader;
+    reader.open(r1, r2, 1, chunk, num_chunks);
+    vector<string> bufs(n_outfiles);
+    while (reader.next()){
+        unsigned long bc_key;
+        bool exact;
+        if (!whitelist->lookup(reader.seq_f, bc_key, exact, reader.len_f)){
+            continue;
+        }
+        int species = barcode_species(bc_key);
+        if (species < 0){
+            continue;
+        }
+        append_fastq(bufs[species*2], reader.id, reader.id_len, reader.seq_f, 
+            reader.len_f, reader.qual_f);
+        append_fastq(bufs[species*2 + 1], reader.id, reader.id_len, reader.seq_r,
+            reader.len_r, reader.qual_r);
+        if (bufs[species*2].length() + bufs[species*2 + 1].length() >= DEMUX_CHUNK_BUFSIZE){
+            flush_species(bufs, species);
+        }
+    }
+    for (int i = 0; i*2 < n_outfiles; ++i){
+        flush_species(bufs, i);
+    }
+}
+
+bool reads_demuxer::route_rna(read_spill& spill){
+    if (!initialized || is_atac){
+        return false;
+    }
+    // Barcodes are matched to the whitelist (with correction) in 
+    // route_rna_pair(), as bc_scanner would when reading the original files
+    for (int i = 0; i < spill.filenames.size(); ++i){
+        read_spill_reader reader(spill.filenames[i]);
+        while (reader.next()){
+            route_rna_pair(reader.id.c_str(), reader.id.length(), reader.seq_f.c_str(),
+                reader.qual_f.c_str(), reader.seq_f.length(), reader.seq_r.c_str(),
+                reader.qual_r.c_str(), reader.seq_r.length());
+        }
+    }
+    spill.remove();
+    return true;
+}
+
+/**
+ * Match the barcode at the start of R1 to the whitelist, and write the pair
+ * to the files for its species (or skip it if the barcode does not match,
+ * or has no species).
+ */
+void reads_demuxer::route_rna_pair(const char* id, int id_len, const char* seq_f,
+    const char* qual_f, int len_f, const char* seq_r, const char* qual_r, int len_r){
+    unsigned long bc_key;
+    bool exact;
+    if (!whitelist->lookup(seq_f, bc_key, exact, len_f)){
+        return;
+    }
+    int species = barcode_species(bc_key);
+    if (species < 0){
+        return;
+    }
+    write_fastq(id, id_len, seq_f, len_f, qual_f, species*2);
+    write_fastq(id, id_len, seq_r, len_r, qual_r, species*2 + 1);
+}
+
 bool reads_demuxer::scan_custom(){
     return scan_rna();
 }
@@ -202,6 +431,10 @@ void reads_demuxer::init_atac(string& r1filename,
     if (r2filetrim.length() < 3 || r2filetrim.substr(r2filetrim.length()-3, 3) != ".gz"){
         r2filetrim += ".gz";
     }
+    if (num_chunks > 1){
+        r1filetrim = chunk_outname(r1filetrim, chunk);
+        r2filetrim = chunk_outname(r2filetrim, chunk);
+    }
     if (r3filetrim.length() < 3 || r3filetrim.substr(r3filetrim.length()-3, 3) != ".gz"){
         r3filetrim += ".gz";
     }
@@ -217,7 +450,7 @@ void reads_demuxer::init_atac(string& r1filename,
     if (atac_preproc){
         n_outfiles = idx2species.size()*2;
     }
-    outfiles = (gzFile*)malloc(n_outfiles * sizeof(gzFile));
+    open_outfiles();
 
     for (map<short, string>::iterator spec = idx2species.begin(); spec != idx2species.end(); ++spec){
         string dirn = outdir + spec->second;
@@ -227,39 +460,14 @@ void reads_demuxer::init_atac(string& r1filename,
 
         if (atac_preproc){
             // Prepare to write two output files.
-            string fn = dirn + "/" + r1filetrim;
-            outfiles[spec->first * 2] = gzopen(fn.c_str(), "w");
-            if (!outfiles[spec->first * 2]){
-                fprintf(stderr, "ERROR opening %s for writing.\n", fn.c_str());
-                exit(1);
-            }
-            fn = dirn + "/" + r2filetrim;
-            outfiles[spec->first * 2 + 1] = gzopen(fn.c_str(), "w");
-            if (!outfiles[spec->first * 2 + 1]){
-                fprintf(stderr, "ERROR opening %s for writing.\n", fn.c_str());
-                exit(1);
-            }
+            outfiles[spec->first * 2].open(dirn + "/" + r1filetrim, pool);
+            outfiles[spec->first * 2 + 1].open(dirn + "/" + r2filetrim, pool);
         }
         else{
             // Prepare to write three output files.
-            string fn = dirn + "/" + r1filetrim;
-            outfiles[spec->first * 3] = gzopen(fn.c_str(), "w");
-            if (!outfiles[spec->first * 3]){
-                fprintf(stderr, "ERROR opening %s for writing.\n", fn.c_str());
-                exit(1);
-            }
-            fn = dirn + "/" + r2filetrim;
-            outfiles[spec->first * 3 + 1] = gzopen(fn.c_str(), "w");
-            if (!outfiles[spec->first * 3 + 1]){
-                fprintf(stderr, "ERROR opening %s for writing.\n", fn.c_str());
-                exit(1);
-            }
-            fn = dirn + "/" + r3filetrim;
-            outfiles[spec->first * 3 + 2] = gzopen(fn.c_str(), "w");
-            if (!outfiles[spec->first * 3 + 2]){
-                fprintf(stderr, "ERROR opening %s for writing.\n", fn.c_str());
-                exit(1);
-            }
+            outfiles[spec->first * 3].open(dirn + "/" + r1filetrim, pool);
+            outfiles[spec->first * 3 + 1].open(dirn + "/" + r2filetrim, pool);
+            outfiles[spec->first * 3 + 2].open(dirn + "/" + r3filetrim, pool);
         }
     }
     this->r1 = r1filename;
@@ -275,7 +483,14 @@ bool reads_demuxer::scan_atac(){
     }
 
     // Now iterate through read files, find/match barcodes, and assign to the correct files.
-    bc_scanner scanner(r1, r2, r3);
+    // With multiple threads, decompress each input file in its own thread
+    deque<fq_stream> streams;
+    vector<string> paths{ r1, r2, r3 };
+    if (nthreads > 1){
+        vector<string> filenames = paths;
+        open_fq_streams(streams, filenames, paths, nthreads);
+    }
+    bc_scanner scanner(paths[0], paths[1], paths[2]);
     scanner.init_10x_multiome_ATAC(*whitelist);
     if (nthreads > 1){
         scanner.set_threads(nthreads);
@@ -287,7 +502,10 @@ bool reads_demuxer::scan_atac(){
     int bc_len = whitelist->len_bc();
 
     while(scanner.next()){
-        int species = bc2species[scanner.barcode];
+        int species = barcode_species(scanner.barcode);
+        if (species < 0){
+            continue;
+        }
         if (atac_preproc){
             string bc_str = bc2str(scanner.barcode, bc_len);
             write_fastq(scanner.seq_id, scanner.seq_id_len,
@@ -317,7 +535,7 @@ bool reads_demuxer::scan_atac(){
 }
 
 /**
- * Write a FASTQ record to disk.
+ * Write a FASTQ record to an output file.
  */
 void reads_demuxer::write_fastq(const char* id, 
     int idlen, 
@@ -328,17 +546,19 @@ void reads_demuxer::write_fastq(const char* id,
     const char* comment,
     int comment_len){
     
-    gzwrite(outfiles[out_idx], "@", 1);
-    gzwrite(outfiles[out_idx], id, idlen);
+    // Only copies into the file's buffer; compression happens in whole 
+    // blocks, on other threads if there is a pool
+    fq_writer& out = outfiles[out_idx];
+    out.write("@", 1);
+    out.write(id, idlen);
     if (comment != NULL){
-        gzwrite(outfiles[out_idx], " CB:Z:", 6);
-        gzwrite(outfiles[out_idx], comment, comment_len); 
-    }
-    gzwrite(outfiles[out_idx], "\n", 1);
-    gzwrite(outfiles[out_idx], seq, seqlen);
-    gzwrite(outfiles[out_idx], "\n", 1);
-    gzwrite(outfiles[out_idx], "+\n", 2);
-    gzwrite(outfiles[out_idx], qual, seqlen);
-    gzwrite(outfiles[out_idx], "\n", 1);
+        out.write(" CB:Z:", 6);
+        out.write(comment, comment_len); 
+    }
+    out.write("\n", 1);
+    out.write(seq, seqlen);
+    out.write("\n+\n", 3);
+    out.write(qual, seqlen);
+    out.write("\n", 1);
 }
 
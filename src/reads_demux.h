@@ -14,11 +14,22 @@
 #include <map>
 #include <unordered_map>
 #include <set>
+#include <deque>
 #include <cstdlib>
+#include <mutex>
 #include <htslib/kseq.h>
 #include <htswrapper/bc.h>
 #include <htswrapper/robin_hood/robin_hood.h>
 #include "common.h"
+#include "read_spill.h"
+#include "fq_writer.h"
+
+/**
+ * Output file name (without directory) for one mate (i.e. "R1"), when reads
+ * come from an interleaved file or standard input and there is no R1/R2 file
+ * name to reuse. Follows 10X naming: sample.fq.gz -> sample_R1_001.fastq.gz
+ */
+std::string mate_outname(const std::string& filename, const std::string& mate);
 
 class reads_demuxer{
     private:
@@ -50,8 +61,10 @@ class reads_demuxer{
         std::map<short, std::string> idx2species;
         
         // Map species to output file
-        gzFile* outfiles;
+        std::deque<fq_writer> outfiles;
         int n_outfiles;
+        // Compression threads shared by output files (if multithreaded)
+        fq_writer_pool* pool;
 
         // Output directory
         std::string outdir;
@@ -59,10 +72,27 @@ class reads_demuxer{
         bool initialized;
         
         void close();
+        // Species assigned to a cell barcode, or -1 if none (reads from 
+        // unassigned barcodes are not written anywhere)
+        int barcode_species(unsigned long bc_key);
         void init_rna_or_custom(std::string prefix, std::string& r1, std::string& r2);
+        void open_outfiles();
+        void route_rna_pair(const char* id, int id_len, const char* seq_f,
+            const char* qual_f, int len_f, const char* seq_r, const char* qual_r,
+            int len_r);
         
         int nthreads;
 
+        // How many chunks of BGZF input to read at once
+        int nreaders;
+        // Which part of RNA-seq/custom input files to read (see set_chunk())
+        int chunk;
+        int num_chunks;
+        // Held by a reader of one chunk while writing to output files
+        std::mutex out_mutex;
+        void scan_rna_chunk(int chunk, int num_chunks);
+        void flush_species(std::vector<std::string>& bufs, int species);
+
     public:
         
         reads_demuxer(bc_whitelist& whitelist,
@@ -73,6 +103,8 @@ class reads_demuxer{
         ~reads_demuxer();
 
         void init_atac(std::string& r1, std::string& r2, std::string& r3, bool preproc = false);
+        // Input file names can be "-" (standard input). If r2 is empty, r1 
+        // is interleaved (each R1 record followed by its R2 record).
         void init_rna(std::string& r1, std::string& r2);
         void init_custom(std::string prefix, std::string& r1, std::string& r2);
         
@@ -82,8 +114,20 @@ class reads_demuxer{
         bool scan_atac();
         bool scan_rna();
         bool scan_custom();
+        // Demultiplex RNA-seq reads saved while counting k-mers, instead of
+        // reading the files given to init_rna() again. Deletes the saved reads.
+        bool route_rna(read_spill& spill);
         
         void set_threads(int nthreads);
+        // With multiple threads, read BGZF-compressed RNA-seq and custom 
+        // input files in this many chunks at once (default 1)
+        void set_readers(int nreaders);
+        // Only demultiplex chunk (0-based) of num_chunks of each pair of
+        // RNA-seq/custom input files, which must be BGZF-compressed (see 
+        // fq_pair_reader). Output file names then include the chunk, as
+        // if the input had been split with split_read_files (i.e. 
+        // sample_R1_001.<chunk>.fastq.gz). Call before init_rna()/init_custom().
+        void set_chunk(int chunk, int num_chunks);
 
         void write_fastq(const char* id, int idlen, const char* seq, int seqlen,
             const char* qual, int out_idx, const char* comment = NULL, int comment_len = 0);
@@ -0,0 +1,226 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <htswrapper/robin_hood/robin_hood.h>
+#include "species_counts_bin.h"
+
+using namespace std;
+
+// Size of stdio buffers for reading and writing count files
+#define SPECIES_COUNTS_IO_BUF 1048576
+
+bool is_species_counts_bin(const string& filename){
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (fp == NULL){
+        return false;
+    }
+    char magic[8];
+    bool match = fread(&magic[0], 1, 8, fp) == 8 &&
+        memcmp(&magic[0], SPECIES_COUNTS_MAGIC, 8) == 0;
+    fclose(fp);
+    return match;
+}
+
+species_counts_writer::species_counts_writer(){
+    fp = NULL;
+    num_species = 0;
+    nrecords = 0;
+}
+
+species_counts_writer::~species_counts_writer(){
+    close();
+}
+
+void species_counts_writer::write_error(){
+    fprintf(stderr, "ERROR writing to %s\n", filename.c_str());
+    exit(1);
+}
+
+void species_counts_writer::open(const string& filename, int num_species){
+    close();
+    this->filename = filename;
+    this->num_species = num_species;
+    this->nrecords = 0;
+    fp = fopen(filename.c_str(), "wb");
+    if (fp == NULL){
+        fprintf(stderr, "ERROR opening %s for writing.\n", filename.c_str());
+        exit(1);
+    }
+    setvbuf(fp, NULL, _IOFBF, SPECIES_COUNTS_IO_BUF);
+    buf.resize(sizeof(uint64_t) + num_species * sizeof(int32_t));
+    // Record count is filled in on close
+    species_counts_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(&h.magic[0], SPECIES_COUNTS_MAGIC, 8);
+    h.num_species = num_species;
+    if (fwrite(&h, sizeof(h), 1, fp) != 1){
+        write_error();
+    }
+}
+
+void species_counts_writer::write(unsigned long bc_key, const int* counts){
+    uint64_t key = bc_key;
+    memcpy(&buf[0], &key, sizeof(key));
+    for (int i = 0; i < num_species; ++i){
+        int32_t count = counts[i];
+        memcpy(&buf[sizeof(key) + i * sizeof(int32_t)], &count, sizeof(count));
+    }
+    if (fwrite(&buf[0], buf.size(), 1, fp) != 1){
+        write_error();
+    }
+    nrecords++;
+}
+
+void species_counts_writer::close(){
+    if (fp == NULL){
+        return;
+    }
+    if (fseeko(fp, offsetof(species_counts_header, nrecords), SEEK_SET) != 0 ||
+        fwrite(&nrecords, sizeof(nrecords), 1, fp) != 1 || fclose(fp) != 0){
+        fp = NULL;
+        write_error();
+    }
+    fp = NULL;
+}
+
+species_counts_reader::species_counts_reader(){
+    fp = NULL;
+    rec_size = 0;
+    num_species = 0;
+    nrecords = 0;
+    bc_key = 0;
+}
+
+species_counts_reader::~species_counts_reader(){
+    close();
+}
+
+void species_counts_reader::open(const string& filename){
+    close();
+    this->filename = filename;
+    fp = fopen(filename.c_str(), "rb");
+    if (fp == NULL){
+        fprintf(stderr, "ERROR opening %s for reading.\n", filename.c_str());
+        exit(1);
+    }
+    setvbuf(fp, NULL, _IOFBF, SPECIES_COUNTS_IO_BUF);
+    species_counts_header h;
+    if (fread(&h, sizeof(h), 1, fp) != 1 ||
+        memcmp(&h.magic[0], SPECIES_COUNTS_MAGIC, 8) != 0){
+        fprintf(stderr, "ERROR: %s is not a binary species counts file\n", filename.c_str());
+        exit(1);
+    }
+    num_species = h.num_species;
+    nrecords = h.nrecords;
+    rec_size = sizeof(uint64_t) + num_species * sizeof(int32_t);
+    buf.resize(rec_size);
+    counts.resize(num_species);
+}
+
+void species_counts_reader::close(){
+    if (fp != NULL){
+        fclose(fp);
+        fp = NULL;
+    }
+}
+
+bool species_counts_reader::next(){
+    size_t nread = fread(&buf[0], 1, rec_size, fp);
+    if (nread == 0 && feof(fp)){
+        return false;
+    }
+    if (nread != rec_size){
+        fprintf(stderr, "ERROR: %s is truncated or corrupted\n", filename.c_str());
+        exit(1);
+    }
+    uint64_t key;
+    memcpy(&key, &buf[0], sizeof(key));
+    bc_key = key;
+    for (int i = 0; i < num_species; ++i){
+        int32_t count;
+        memcpy(&count, &buf[sizeof(key) + i * sizeof(int32_t)], sizeof(count));
+        counts[i] = count;
+    }
+    return true;
+}
+
+void species_counts_reader::seek(uint64_t rec){
+    if (fseeko(fp, sizeof(species_counts_header) + rec * rec_size, SEEK_SET) != 0){
+        fprintf(stderr, "ERROR seeking in %s\n", filename.c_str());
+        exit(1);
+    }
+}
+
+unsigned long species_counts_reader::key_at(uint64_t rec){
+    seek(rec);
+    uint64_t key;
+    if (fread(&key, sizeof(key), 1, fp) != 1){
+        fprintf(stderr, "ERROR: %s is truncated or corrupted\n", filename.c_str());
+        exit(1);
+    }
+    return key;
+}
+
+uint64_t species_counts_reader::find(unsigned long bc_key){
+    uint64_t lo = 0;
+    uint64_t hi = nrecords;
+    while (lo < hi){
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (key_at(mid) < bc_key){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    seek(lo);
+    return lo;
+}
+
+void write_species_counts_bin(const string& filename,
+    robin_hood::unordered_map<unsigned long, map<short, int> >& bc_species_counts,
+    int num_species){
+
+    vector<unsigned long> keys;
+    keys.reserve(bc_species_counts.size());
+    for (robin_hood::unordered_map<unsigned long, map<short, int> >::iterator bsc =
+        bc_species_counts.begin(); bsc != bc_species_counts.end(); ++bsc){
+        keys.push_back(bsc->first);
+    }
+    sort(keys.begin(), keys.end());
+
+    species_counts_writer writer;
+    writer.open(filename, num_species);
+    vector<int> row(num_species);
+    for (int i = 0; i < keys.size(); ++i){
+        map<short, int>& m = bc_species_counts[keys[i]];
+        fill(row.begin(), row.end(), 0);
+        for (map<short, int>::iterator c = m.begin(); c != m.end(); ++c){
+            if (c->first >= 0 && c->first < num_species){
+                row[c->first] = c->second;
+            }
+        }
+        writer.write(keys[i], row.data());
+    }
+    writer.close();
+}
+
+void load_species_counts_bin(const string& filename,
+    robin_hood::unordered_map<unsigned long, map<short, int> >& bc_species_counts){
+
+    species_counts_reader reader;
+    reader.open(filename);
+    bc_species_counts.reserve(bc_species_counts.size() + reader.nrecords);
+    while (reader.next()){
+        map<short, int>& m = bc_species_counts[reader.bc_key];
+        for (int i = 0; i < reader.num_species; ++i){
+            m[i] += reader.counts[i];
+        }
+    }
+}
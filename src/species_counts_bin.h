@@ -0,0 +1,101 @@
+#ifndef _CELLBOUNCER_SPECIES_COUNTS_BIN_H
+#define _CELLBOUNCER_SPECIES_COUNTS_BIN_H
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <htswrapper/robin_hood/robin_hood.h>
+
+// ===== species_counts_bin.h
+// Binary format for per-cell barcode species counts, as written by
+// demux_species in batch mode and by combine_species_counts, and read by
+// demux_species in place of the tab-separated counts table.
+//
+// Records are sorted by barcode key, so counts from many batches can be
+// combined by merging the files, without holding them all in memory, and
+// since every record has the same size, a range of barcodes can be found
+// in a file by binary search (so merging can be split across threads).
+//
+// File layout: a species_counts_header, then one record per barcode: the
+// barcode key (uint64_t, as from str2bc/bc_ul), then one int32_t count per
+// species, in species index order.
+
+#define SPECIES_COUNTS_MAGIC "CBSPCT1"
+
+struct species_counts_header{
+    char magic[8];
+    uint32_t num_species;
+    uint32_t unused;
+    uint64_t nrecords;
+};
+
+// Is a file in this format (rather than a text table)?
+bool is_species_counts_bin(const std::string& filename);
+
+class species_counts_writer{
+    private:
+        FILE* fp;
+        std::string filename;
+        int num_species;
+        std::vector<char> buf;
+        void write_error();
+        // Not copyable
+        species_counts_writer(const species_counts_writer&);
+        species_counts_writer& operator=(const species_counts_writer&);
+    public:
+        uint64_t nrecords;
+
+        species_counts_writer();
+        ~species_counts_writer();
+
+        // Exits on failure
+        void open(const std::string& filename, int num_species);
+        // Barcodes must be added in increasing order
+        void write(unsigned long bc_key, const int* counts);
+        // Write the number of records to the header and close the file
+        void close();
+};
+
+class species_counts_reader{
+    private:
+        FILE* fp;
+        std::string filename;
+        size_t rec_size;
+        std::vector<char> buf;
+        // Not copyable
+        species_counts_reader(const species_counts_reader&);
+        species_counts_reader& operator=(const species_counts_reader&);
+    public:
+        int num_species;
+        uint64_t nrecords;
+        // The current record
+        unsigned long bc_key;
+        std::vector<int> counts;
+
+        species_counts_reader();
+        ~species_counts_reader();
+
+        // Exits on failure
+        void open(const std::string& filename);
+        void close();
+        bool next();
+        // Move to a record, by index
+        void seek(uint64_t rec);
+        // Index of the first record with barcode key >= bc_key (nrecords
+        // if none). Leaves the file at that record.
+        uint64_t find(unsigned long bc_key);
+        // Barcode key of a record, by index
+        unsigned long key_at(uint64_t rec);
+};
+
+// Write a whole table of counts (sorting barcodes)
+void write_species_counts_bin(const std::string& filename,
+    robin_hood::unordered_map<unsigned long, std::map<short, int> >& bc_species_counts,
+    int num_species);
+
+// Add the counts in a file to a table
+void load_species_counts_bin(const std::string& filename,
+    robin_hood::unordered_map<unsigned long, std::map<short, int> >& bc_species_counts);
+
+#endif
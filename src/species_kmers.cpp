@@ -24,14 +24,13 @@
 #include <condition_variable>
 #include <mutex>
 #include <htswrapper/bc.h>
+#include <htswrapper/bc_scanner.h>
 #include <htswrapper/umi.h>
 #include <htswrapper/gzreader.h>
-#include <htswrapper/khashtable.h>
 #include <random>
 #include "common.h"
 #include "species_kmers.h"
-
-KSEQ_INIT(gzFile, gzread);
+#include "fq_stream.h"
 
 using std::cout;
 using std::endl;
@@ -41,27 +40,160 @@ using namespace std;
 // This file contains functions used to scan reads for species-specific k-mers
 // Used by demux_species.
 
-rp_info::~rp_info(){
-    //free(seq_f);
-    //free(seq_r);  
+rp_batch::rp_batch(){
+    this->n = 0;
+    this->shard = -1;
+    this->bc_keys.reserve(RP_BATCH_SIZE);
+    this->offsets_f.reserve(RP_BATCH_SIZE);
+    this->offsets_r.reserve(RP_BATCH_SIZE);
+    this->lens_f.reserve(RP_BATCH_SIZE);
+    this->lens_r.reserve(RP_BATCH_SIZE);
+}
+
+void rp_batch::add(unsigned long bc_key, const char* seq_f, int seq_f_len, 
+    const char* seq_r, int seq_r_len){
+    bc_keys.push_back(bc_key);
+    // Store each sequence null-terminated
+    int off = seqs.size();
+    seqs.resize(off + seq_f_len + seq_r_len + 2);
+    memcpy(&seqs[off], seq_f, seq_f_len);
+    seqs[off + seq_f_len] = '\0';
+    memcpy(&seqs[off + seq_f_len + 1], seq_r, seq_r_len);
+    seqs[off + seq_f_len + 1 + seq_r_len] = '\0';
+    offsets_f.push_back(off);
+    offsets_r.push_back(off + seq_f_len + 1);
+    lens_f.push_back(seq_f_len);
+    lens_r.push_back(seq_r_len);
+    n++;
+}
+
+void rp_batch::add(unsigned long bc_key, const char* seq_f, int seq_f_len, 
+    const char* seq_r, int seq_r_len, const char* id, int id_len,
+    const char* qual_f, const char* qual_r){
+    add(bc_key, seq_f, seq_f_len, seq_r, seq_r_len);
+    int off = seqs.size();
+    seqs.resize(off + id_len + seq_f_len + seq_r_len);
+    memcpy(&seqs[off], id, id_len);
+    memcpy(&seqs[off + id_len], qual_f, seq_f_len);
+    memcpy(&seqs[off + id_len + seq_f_len], qual_r, seq_r_len);
+    offsets_id.push_back(off);
+    lens_id.push_back(id_len);
+    offsets_qual_f.push_back(off + id_len);
+    offsets_qual_r.push_back(off + id_len + seq_f_len);
+}
+
+void rp_batch::clear(){
+    // Keeps capacity
+    bc_keys.clear();
+    seqs.clear();
+    offsets_f.clear();
+    offsets_r.clear();
+    lens_f.clear();
+    lens_r.clear();
+    offsets_id.clear();
+    lens_id.clear();
+    offsets_qual_f.clear();
+    offsets_qual_r.clear();
+    n = 0;
+}
+
+bool rp_batch::full(){
+    return n >= RP_BATCH_SIZE;
+}
+
+static inline uint64_t umi_key_hash(unsigned long bc, uint64_t umi, uint64_t umi_n){
+    uint64_t h = (uint64_t)bc * 0x9E3779B97F4A7C15ULL;
+    h ^= umi + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+    h ^= umi_n + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    return h ^ (h >> 31);
+}
+
+umi_shard::umi_shard(){
+    this->n = 0;
+}
+
+void umi_shard::grow(){
+    size_t cap = slots.size() == 0 ? 1024 : slots.size() * 2;
+    vector<umi_key> slots_old;
+    vector<char> used_old;
+    slots_old.swap(slots);
+    used_old.swap(used);
+    slots.resize(cap);
+    used.resize(cap, 0);
+    for (size_t i = 0; i < slots_old.size(); ++i){
+        if (used_old[i]){
+            size_t idx = umi_key_hash(slots_old[i].bc, slots_old[i].umi, 
+                slots_old[i].umi_n) & (cap - 1);
+            while (used[idx]){
+                idx = (idx + 1) & (cap - 1);
+            }
+            slots[idx] = slots_old[i];
+            used[idx] = 1;
+        }
+    }
+}
+
+bool umi_shard::add(unsigned long bc, uint64_t umi, uint64_t umi_n){
+    // Keep load factor below 1/2
+    if ((n + 1) * 2 > slots.size()){
+        grow();
+    }
+    size_t mask = slots.size() - 1;
+    size_t idx = umi_key_hash(bc, umi, umi_n) & mask;
+    while (used[idx]){
+        if (slots[idx].bc == bc && slots[idx].umi == umi && slots[idx].umi_n == umi_n){
+            return true;
+        }
+        idx = (idx + 1) & mask;
+    }
+    slots[idx].bc = bc;
+    slots[idx].umi = umi;
+    slots[idx].umi_n = umi_n;
+    used[idx] = 1;
+    n++;
+    return false;
+}
+
+void umi_shard::clear(){
+    vector<umi_key>().swap(slots);
+    vector<char>().swap(used);
+    n = 0;
+}
+
+bc_species_tab::bc_species_tab(int ns){
+    this->num_species = ns;
+}
+
+int* bc_species_tab::get(unsigned long bc_key){
+    robin_hood::unordered_flat_map<unsigned long, int>::iterator row = rows.find(bc_key);
+    if (row == rows.end()){
+        int idx = counts.size();
+        rows.emplace(bc_key, idx);
+        counts.resize(idx + num_species, 0);
+        return &counts[idx];
+    }
+    return &counts[row->second];
 }
 
-rp_info::rp_info(const char* kseq_f, int seq_f_len, const char* kseq_r, int seq_r_len){
-    this->seq_f = (char*)malloc((seq_f_len+1)*sizeof(char));
-    this->seq_r = (char*)malloc((seq_r_len+1)*sizeof(char));
-    strncpy(this->seq_f, kseq_f, seq_f_len);
-    strncpy(this->seq_r, kseq_r, seq_r_len);
-    this->seq_f[seq_f_len] = '\0';
-    this->seq_r[seq_r_len] = '\0';
-    this->len_f = seq_f_len;
-    this->len_r = seq_r_len;
+void bc_species_tab::clear(){
+    rows.clear();
+    counts.clear();
 }
 
-rp_info::rp_info(const rp_info& other){
-    this->seq_f = other.seq_f;
-    this->seq_r = other.seq_r;
-    this->len_f = other.len_f;
-    this->len_r = other.len_r;
+kmer_lookup_stats::kmer_lookup_stats(){
+    clear();
+}
+
+void kmer_lookup_stats::clear(){
+    kmers = 0;
+    rejected = 0;
+    hits = 0;
+}
+
+void kmer_lookup_stats::add(const kmer_lookup_stats& other){
+    kmers += other.kmers;
+    rejected += other.rejected;
+    hits += other.hits;
 }
 
 /*
@@ -90,16 +222,29 @@ species_kmer_counter::species_kmer_counter(int nt,
     bc_whitelist* wl,
     robin_hood::unordered_map<unsigned long, map<short, int> >* bsc,
     int umi_start,
-    int umi_len): tab(k){
+    int umi_len){
     
     this->terminate_threads = false;
     this->num_threads = nt;
+    this->max_rp_batches = 2*nt;
+    // Several shards per thread, so workers rarely wait on each other
+    this->num_shards = nt > 1 ? 4*nt : 1;
+    this->umi_shards.resize(this->num_shards);
+    this->shard_busy.resize(this->num_shards, false);
     this->k = k;
     this->wl = wl;
     this->num_species = ns;
     this->initialized = false;
     this->on = false;
     this->bc_species_counts = bsc;
+    this->spill = NULL;
+    this->num_readers = 1;
+    this->active_readers = 1;
+    this->atac = false;
+    this->chunk = 0;
+    this->num_chunks = 1;
+    this->kidx = &tab;
+    this->lookup_stats.resize(nt > 1 ? nt : 1);
     this->umi_start = umi_start;
     this->umi_len = umi_len;
     
@@ -109,6 +254,10 @@ species_kmer_counter::species_kmer_counter(int nt,
     if (umi_start == -1 || umi_len == -1){
         use_umis = false;
     }
+    else if (umi_len > 32){
+        fprintf(stderr, "ERROR: UMIs longer than 32 bases are not supported\n");
+        exit(1);
+    }
 }
 
 species_kmer_counter::~species_kmer_counter(){
@@ -118,15 +267,8 @@ species_kmer_counter::~species_kmer_counter(){
     }
     if (this->initialized){
         //kmsuftree_destruct(kt, 0);
-        tab.clear();
+        tab.close();
     }
-    // Free all UMI counters
-    for (robin_hood::unordered_map<unsigned long, umi_set_exact* >::iterator x = bc_species_umis.begin();
-        x != bc_species_umis.end(); ++x){
-        delete x->second;
-        x->second = NULL;
-    }
-    bc_species_umis.clear();
 }
 
 void species_kmer_counter::set_n_samp(int ns){
@@ -139,9 +281,10 @@ void species_kmer_counter::init(short species_idx, string& kmerfile){
     //this_species = species_idx;
 
     if (this->initialized){
-        tab.clear();
+        tab.close();
         //kmsuftree_destruct(kt, 0);
     }
+    filter.clear();
     //tab = khashtable<short>(k); 
     parse_kmer_counts_serial(kmerfile, species_idx);
     
@@ -155,9 +298,21 @@ void species_kmer_counter::add(short species_idx, string& kmerfile){
         this->initialized = true;
         this->terminate_threads = false;
     }
+    filter.clear();
     parse_kmer_counts_serial(kmerfile, species_idx);
 }
 
+void species_kmer_counter::set_sampling(int w){
+    tab.set_sampling(w);
+}
+
+void species_kmer_counter::use_index(kmer_index* idx){
+    this->kidx = idx;
+    filter.clear();
+    this->initialized = true;
+    this->terminate_threads = false;
+}
+
 /**
  * Only using canonical k-mers = first in sort order relative to reverse complement.
  * Check if a given k-mer or its reverse complement comes first in alphabetical sort order.
@@ -231,12 +386,23 @@ void species_kmer_counter::enable_umis(){
     this->use_umis = true;
 }
 
+void species_kmer_counter::set_readers(int nr){
+    this->num_readers = nr > 1 ? nr : 1;
+}
+
+void species_kmer_counter::set_chunk(int chunk, int num_chunks){
+    this->chunk = chunk;
+    this->num_chunks = num_chunks;
+}
+
 /**
- * Adds sequences from reads to data that will be retrieved by worker threads.
+ * Start worker threads (or set up to count in this thread) before
+ * reading a set of input files.
  */
-void species_kmer_counter::process_gex_files(string& r1filename, 
-    string& r2filename){
-    
+void species_kmer_counter::start_scan(){
+    if (!filter.built() && kidx->loaded()){
+        filter.build(*kidx);
+    }
     if (num_threads > 1){
         launch_gex_threads();
     }
@@ -246,65 +412,335 @@ void species_kmer_counter::process_gex_files(string& r1filename,
             v.push_back(0);
         }
         species_counts.push_back(v);
-        khashkeys.emplace_back(k);
+        scanners.emplace_back(k);
+        thread_bc_species_counts.clear();
+        thread_bc_species_counts.emplace_back(num_species);
     }
+}
 
-    // Now iterate through read files, find/match barcodes, and assign to the correct files.
-    // Prep input file(s).
-    int f_progress;
-    int r_progress;
-    gzFile f_fp;
-    gzFile r_fp;
-    kseq_t* seq_f;
-    kseq_t* seq_r;
-    f_fp = gzopen(r1filename.c_str(), "r");
-    if (!f_fp){
-        fprintf(stderr, "ERROR opening %s for reading\n", r1filename.c_str());
-        exit(1);
-    }    
-    r_fp = gzopen(r2filename.c_str(), "r");
-    if (!r_fp){
-        fprintf(stderr, "ERROR opening %s for reading\n", r2filename.c_str());
-        exit(1);
+/**
+ * Wait for workers to count everything read from a set of input files,
+ * and add up their counts.
+ */
+void species_kmer_counter::finish_scan(){
+    if (num_threads > 1){
+        close_pool();
+    }
+    else{
+        merge_bc_species_counts();
+    }
+    
+    // Per-thread counts and scanners are set up again by start_scan()
+    species_counts.clear();
+    scanners.clear();
+    
+    // UMIs (and ATAC-seq fragments) are only collapsed within a set of files
+    for (int i = 0; i < num_shards; ++i){
+        umi_shards[i].clear();
     }
-   
-    seq_f = kseq_init(f_fp);
-    seq_r = kseq_init(r_fp);
-    while ((f_progress = kseq_read(seq_f)) >= 0){
-        r_progress = kseq_read(seq_r);
-        if (r_progress < 0){
-            fprintf(stderr, "ERROR: %s still contains reads, but %s reached end of file\n", 
-                r1filename.c_str(), r2filename.c_str());
-            fprintf(stderr, "%s is likely truncated or corrupted.\n", r2filename.c_str());
-            exit(1);
+}
+
+/**
+ * Adds sequences from reads to data that will be retrieved by worker threads.
+ */
+void species_kmer_counter::process_gex_files(string& r1filename, 
+    string& r2filename, read_spill* spill){
+    
+    // One spill bin per UMI shard, so only one thread writes to a bin at
+    // a time
+    this->spill = spill;
+    if (spill != NULL){
+        spill->open(num_shards);
+    }
+    // BGZF input can be split into chunks that are read at once, each by
+    // its own reader (readers only look up barcodes in the whitelist, and
+    // hand read pairs to workers the same way)
+    this->active_readers = 1;
+    if (num_threads > 1 && num_readers > 1 && fq_chunkable(r1filename) &&
+        (r2filename == "" || fq_chunkable(r2filename))){
+        this->active_readers = num_readers;
+    }
+    start_scan();
+
+    if (active_readers > 1){
+        // Each reader takes an equal part of the chunk to read
+        vector<thread> readers;
+        for (int i = 0; i < active_readers; ++i){
+            readers.push_back(thread(&species_kmer_counter::read_gex_chunk, this,
+                r1filename, r2filename, chunk * active_readers + i, 
+                num_chunks * active_readers));
+        }
+        for (int i = 0; i < readers.size(); ++i){
+            readers[i].join();
+        }
+    }
+    else{
+        read_gex_chunk(r1filename, r2filename, chunk, num_chunks);
+    }
+    
+    finish_scan();
+    if (spill != NULL){
+        spill->close();
+        this->spill = NULL;
+    }
+}
+
+/**
+ * Count species-specific k-mers in ATAC-seq read triplets: R1 and R3 are 
+ * the two ends of a fragment, and R2 holds the cell barcode. Barcodes are 
+ * matched to the ATAC-seq whitelist by bc_scanner; in multiome data, they
+ * are then converted to the matching RNA-seq barcodes, so counts from both
+ * data types are stored under the same cell barcodes.
+ */
+void species_kmer_counter::process_atac_files(string& r1filename, 
+    string& r2filename, string& r3filename, bool multiome){
+    
+    this->active_readers = 1;
+    this->atac = true;
+    start_scan();
+
+    // With multiple threads, decompress each input file in its own thread
+    deque<fq_stream> streams;
+    vector<string> paths{ r1filename, r2filename, r3filename };
+    if (num_threads > 1){
+        vector<string> filenames = paths;
+        open_fq_streams(streams, filenames, paths, num_threads);
+    }
+    bc_scanner scanner(paths[0], paths[1], paths[2]);
+    if (multiome){
+        scanner.init_10x_multiome_ATAC(*wl);
+    }
+    else{
+        scanner.init_10x_ATAC(*wl);
+    }
+    if (num_threads > 1){
+        scanner.set_threads(num_threads);
+    }
+    
+    // One batch being filled per shard
+    vector<rp_batch*> batches;
+    if (num_threads > 1){
+        for (int i = 0; i < num_shards; ++i){
+            batches.push_back(get_free_rp_batch());
+            batches[i]->shard = i;
         }
+    }
+    while (scanner.next()){
+        int shard = bc_shard(scanner.barcode);
         if (num_threads > 1){
-            add_rp_job(seq_f->seq.s, seq_f->seq.l, seq_r->seq.s, seq_r->seq.l);        
+            rp_batch* batch = batches[shard];
+            batch->add(scanner.barcode, scanner.read_f, scanner.read_f_len, 
+                scanner.read_r, scanner.read_r_len);
+            if (batch->full()){
+                add_rp_job(batch);
+                batches[shard] = get_free_rp_batch();
+                batches[shard]->shard = shard;
+            }
         }
         else{
-            // Just count normally, without wasting overhead counting sequences
-            scan_gex_data(seq_f->seq.s, seq_f->seq.l, seq_r->seq.s, seq_r->seq.l, 0);
+            scan_atac_data(scanner.barcode, scanner.read_f, scanner.read_f_len,
+                scanner.read_r, scanner.read_r_len, shard, 0);
+        }
+    }
+    if (num_threads > 1){
+        // Hand off the last (partial) batches
+        for (int i = 0; i < num_shards; ++i){
+            if (batches[i]->n > 0){
+                add_rp_job(batches[i]);
+            }
+            else{
+                unique_lock<mutex> lock(this->queue_mutex);
+                rp_batches_free.push_back(batches[i]);
+            }
         }
     }
 
-    // Check that R2 has hit EOF as well.
-    if ((r_progress = kseq_read(seq_r)) >= 0){
-        fprintf(stderr, "ERROR: %s still contains reads, but %s reached end of file\n", 
-            r2filename.c_str(), r1filename.c_str());
-        fprintf(stderr, "%s is likely truncated or corrupted.\n", r1filename.c_str());
-        exit(1);
+    finish_scan();
+    this->atac = false;
+}
+
+/**
+ * Read pairs from one chunk of input files (or all of them, if num_chunks
+ * is 1), look up their barcodes, and count them or hand them to workers.
+ * Several of these can run at once (on different chunks).
+ */
+void species_kmer_counter::read_gex_chunk(const string& r1filename,
+    const string& r2filename, int chunk, int num_chunks){
+    
+    // Prep input file(s). An empty r2filename means r1filename is interleaved.
+    // A reader of one chunk decompresses its own input.
+    fq_pair_reader reader;
+    reader.open(r1filename, r2filename, num_chunks > 1 ? 1 : num_threads, chunk, 
+        num_chunks);
+    
+    // One batch being filled per shard
+    vector<rp_batch*> batches;
+    if (num_threads > 1){
+        for (int i = 0; i < num_shards; ++i){
+            batches.push_back(get_free_rp_batch());
+            batches[i]->shard = i;
+        }
+    }
+    // Next shard for spilling reads with no valid barcode
+    int spill_shard_nomatch = chunk % num_shards;
+    while (reader.next()){
+        unsigned long bc_key = 0;
+        bool exact;
+        int shard;
+        if (!wl->lookup(reader.seq_f, bc_key, exact, reader.len_f)){
+            if (spill == NULL){
+                continue;
+            }
+            // Keep the read to demultiplex later, since its barcode may be 
+            // corrected then; spread these reads evenly across shards
+            bc_key = BC_KEY_NONE;
+            shard = spill_shard_nomatch;
+            spill_shard_nomatch = (spill_shard_nomatch + 1) % num_shards;
+        }
+        else{
+            shard = bc_shard(bc_key);
+        }
+        if (num_threads > 1){
+            rp_batch* batch = batches[shard];
+            if (spill != NULL){
+                batch->add(bc_key, reader.seq_f, reader.len_f, reader.seq_r, reader.len_r,
+                    reader.id, reader.id_len, reader.qual_f, reader.qual_r);
+            }
+            else{
+                batch->add(bc_key, reader.seq_f, reader.len_f, reader.seq_r, reader.len_r);
+            }
+            if (batch->full()){
+                add_rp_job(batch);
+                batches[shard] = get_free_rp_batch();
+                batches[shard]->shard = shard;
+            }
+        }
+        else{
+            // Just count normally, without wasting overhead counting sequences
+            if (bc_key != BC_KEY_NONE){
+                scan_gex_data(bc_key, reader.seq_f, reader.len_f, reader.seq_r, 
+                    reader.len_r, shard, 0);
+            }
+            if (spill != NULL){
+                spill->add(shard, reader.id, reader.id_len, reader.seq_f, 
+                    reader.qual_f, reader.len_f, reader.seq_r, reader.qual_r, 
+                    reader.len_r);
+            }
+        }
     }
+
+    reader.close();
     
     if (num_threads > 1){
-       close_pool();
+        // Hand off the last (partial) batches
+        for (int i = 0; i < num_shards; ++i){
+            if (batches[i]->n > 0){
+                add_rp_job(batches[i]);
+            }
+            else{
+                unique_lock<mutex> lock(this->queue_mutex);
+                rp_batches_free.push_back(batches[i]);
+            }
+        }
     }
+}
 
-    for (robin_hood::unordered_map<unsigned long, umi_set_exact* >::iterator x = bc_species_umis.begin();
-        x != bc_species_umis.end(); ++x){
-        delete x->second;
-        x->second = NULL;
+void species_kmer_counter::get_lookup_stats(kmer_lookup_stats& stats){
+    stats.clear();
+    for (int i = 0; i < lookup_stats.size(); ++i){
+        stats.add(lookup_stats[i]);
+    }
+}
+
+/**
+ * Which UMI shard a cell barcode belongs to.
+ */
+int species_kmer_counter::bc_shard(unsigned long bc_key){
+    return (int)((((uint64_t)bc_key * 0x9E3779B97F4A7C15ULL) >> 32) % num_shards);
+}
+
+/**
+ * Check whether a read's UMI has already been seen with its cell barcode
+ * (and remember it if not). The calling thread must own the shard.
+ */
+bool species_kmer_counter::is_dup_umi(unsigned long bc_key, const char* seq_f, int shard){
+    uint64_t umi = 0;
+    uint64_t umi_n = 0;
+    const char* u = seq_f + umi_start;
+    for (int i = 0; i < umi_len; ++i){
+        umi <<= 2;
+        umi_n <<= 1;
+        switch(u[i]){
+            case 'A':
+            case 'a':
+                break;
+            case 'C':
+            case 'c':
+                umi |= 1;
+                break;
+            case 'G':
+            case 'g':
+                umi |= 2;
+                break;
+            case 'T':
+            case 't':
+                umi |= 3;
+                break;
+            default:
+                umi_n |= 1;
+                break;
+        }
     }
-    bc_species_umis.clear();
+    return umi_shards[shard].add(bc_key, umi, umi_n);
+}
+
+/**
+ * Pack up to 16 bases from the start of a read, 2 bits per base, and mark
+ * non-ACGT bases (and missing bases in shorter reads) in mask.
+ */
+static void pack_read_start(const char* seq, int len, uint64_t& bases, uint64_t& mask){
+    bases = 0;
+    mask = 0;
+    for (int i = 0; i < 16; ++i){
+        bases <<= 2;
+        mask <<= 1;
+        switch(i < len ? seq[i] : 'N'){
+            case 'A':
+            case 'a':
+                break;
+            case 'C':
+            case 'c':
+                bases |= 1;
+                break;
+            case 'G':
+            case 'g':
+                bases |= 2;
+                break;
+            case 'T':
+            case 't':
+                bases |= 3;
+                break;
+            default:
+                mask |= 1;
+                break;
+        }
+    }
+}
+
+/**
+ * Check whether an ATAC-seq fragment has already been seen with its cell
+ * barcode (and remember it if not). Without alignments, a fragment is known
+ * by the start of each of its two reads, i.e. where it was cut on each end,
+ * so PCR duplicates of a fragment match. Stored in the same shards as UMIs.
+ * The calling thread must own the shard.
+ */
+bool species_kmer_counter::is_dup_fragment(unsigned long bc_key, const char* seq_f,
+    int seq_f_len, const char* seq_r, int seq_r_len, int shard){
+    uint64_t bases_f, mask_f, bases_r, mask_r;
+    pack_read_start(seq_f, seq_f_len, bases_f, mask_f);
+    pack_read_start(seq_r, seq_r_len, bases_r, mask_r);
+    return umi_shards[shard].add(bc_key, (bases_f << 32) | bases_r, 
+        (mask_f << 16) | mask_r);
 }
 
 // Stop all running threads and then destroy them
@@ -319,46 +755,89 @@ void species_kmer_counter::close_pool(){
     }
     this->threads.clear();
     this->on = false;
+    merge_bc_species_counts();
 }
 
 /**
- * Add to the queue of jobs to read paired reads
+ * Add up counts from each thread into the shared bc_species_counts.
  */
-void species_kmer_counter::add_rp_job(const char* seq_f, int seq_f_len, const char* seq_r, int seq_r_len){
-
-    {
-        // Add job to processing queue
-        unique_lock<mutex> lock(this->queue_mutex);
-        this->rp_jobs.emplace_back(seq_f, seq_f_len, seq_r, seq_r_len);
+void species_kmer_counter::merge_bc_species_counts(){
+    for (int t = 0; t < thread_bc_species_counts.size(); ++t){
+        bc_species_tab& tab_t = thread_bc_species_counts[t];
+        for (robin_hood::unordered_flat_map<unsigned long, int>::iterator row = 
+            tab_t.rows.begin(); row != tab_t.rows.end(); ++row){
+            int* counts = &tab_t.counts[row->second];
+            for (int j = 0; j < num_species; ++j){
+                if (counts[j] > 0){
+                    (*bc_species_counts)[row->first][j] += counts[j];
+                }
+            }
+        }
+        tab_t.clear();
     }
-    this->has_jobs.notify_one();
 }
 
 /**
- * Add to the queue of jobs to read read triplets
+ * Add a batch of read pairs to the queue of jobs. If the queue is full,
+ * waits for a worker to take a batch off of it first.
  */
-void species_kmer_counter::add_rt_job(rt_info& info){
+void species_kmer_counter::add_rp_job(rp_batch* batch){
     {
         unique_lock<mutex> lock(this->queue_mutex);
-        this->rt_jobs.push_back(info);
+        this->has_space.wait(lock, [this]{ return rp_jobs.size() < max_rp_batches; });
+        this->rp_jobs.push_back(batch);
     }
     this->has_jobs.notify_one();
 }
 
+/**
+ * Get an empty batch to fill with read pairs. There are enough batches
+ * for a full queue, one per worker, and one being filled per shard by each
+ * reader, so one is always available once add_rp_job() has returned.
+ */
+rp_batch* species_kmer_counter::get_free_rp_batch(){
+    unique_lock<mutex> lock(this->queue_mutex);
+    rp_batch* batch = this->rp_batches_free.back();
+    this->rp_batches_free.pop_back();
+    return batch;
+}
+
 // Count k-mers for one species in a specific read.
-void species_kmer_counter::scan_seq_kmers(const char* seq, int len, int* result_counts, khashkey& key){
-    key.reset();
-    int pos = 0;
-    while(key.scan_kmers(seq, len, pos)){
+void species_kmer_counter::scan_seq_kmers(const char* seq, int len, int* result_counts, 
+    kmer_scanner& scanner, kmer_lookup_stats& stats){
+    if (!kidx->loaded()){
+        return;
+    }
+    // Stop at the first species-specific k-mer. If the table only holds a
+    // sample of k-mers, only look up k-mers that could have been sampled.
+    // Most k-mers are in no species' list, so check the (much smaller) 
+    // filter before probing the table.
+    const kmer_index* idx = kidx;
+    const kmer_bloom* bloom = &filter;
+    bool all = idx->sample_w <= 1;
+    long nkmers = 0;
+    long nrejected = 0;
+    long nhits = 0;
+    scanner.scan(seq, len, [&](uint64_t hi, uint64_t lo){
+        if (!all && !idx->sampled(hi, lo)){
+            return false;
+        }
+        nkmers++;
+        if (!bloom->contains(hi, lo)){
+            nrejected++;
+            return false;
+        }
         short spec;
-        if (tab.lookup(key, spec)){
+        if (idx->lookup(hi, lo, spec)){
             result_counts[spec]++;
-            return;
-        }
-        else{
-            //key.print(false);
+            nhits++;
+            return true;
         }
-    }
+        return false;
+    });
+    stats.kmers += nkmers;
+    stats.rejected += nrejected;
+    stats.hits += nhits;
     /*
     kmer_node_ptr* cur = NULL;
     bool cur_rc = false;
@@ -557,62 +1036,73 @@ void species_kmer_counter::scan_seq_kmers(const char* seq, int len, int* result_
     */
 }
 
-void species_kmer_counter::scan_gex_data(const char* seq_f, 
-    int seq_f_len, const char* seq_r, int seq_r_len, int thread_idx){
+void species_kmer_counter::scan_gex_data(unsigned long bc_key, 
+    const char* seq_f, int seq_f_len, const char* seq_r, int seq_r_len, 
+    int shard, int thread_idx){
     
-    unsigned long bc_key = 0;
-    bool exact;
+    if (use_umis && umi_start >= 0 && umi_len > 0 && 
+        umi_start + umi_len <= seq_f_len && 
+        is_dup_umi(bc_key, seq_f, shard)){
+        return;
+    }
+
+    // In 10x scRNA-seq data, only the reverse read contains information
+    // forward read is barcode
+    for (int j = 0; j < num_species; ++j){
+        species_counts[thread_idx][j] = 0;
+    }
+    scan_seq_kmers(seq_r, seq_r_len, species_counts[thread_idx].data(), scanners[thread_idx],
+        lookup_stats[thread_idx]);
     
-    if (wl->lookup(seq_f, bc_key, exact, seq_f_len)){
-        
-        bool dup_read = false;
-        if (use_umis && umi_start >= 0 && umi_len > 0){
-            umi u(seq_f + umi_start, umi_len);
-            
-            umi_set_exact* us; 
-            {
-               unique_lock<mutex> lock(umi_mutex);
-                 
-               if (bc_species_umis.count(bc_key) == 0){
-                   us = new umi_set_exact();
-                   bc_species_umis.emplace(bc_key, us); 
-                }
-                else{
-                    us = bc_species_umis[bc_key];
-                }
+    // Accumulate in this thread's own table; no locking needed.
+    int* bc_counts = NULL;
+    for (int j = 0; j < num_species; ++j){
+        if (species_counts[thread_idx][j] > 0){
+            if (bc_counts == NULL){
+                bc_counts = thread_bc_species_counts[thread_idx].get(bc_key);
             }
-            {
-                unique_lock<mutex> lock(us->umi_mutex);
-                dup_read = us->add(u);
-            }
-        }
-        
-        if (dup_read){
-            return;
+            bc_counts[j] += species_counts[thread_idx][j];
         }
+    }
+}
 
-        // In 10x scRNA-seq data, only the reverse read contains information
-        // forward read is barcode
-        for (int j = 0; j < num_species; ++j){
-            species_counts[thread_idx][j] = 0;
+void species_kmer_counter::scan_atac_data(unsigned long bc_key, 
+    const char* seq_f, int seq_f_len, const char* seq_r, int seq_r_len, 
+    int shard, int thread_idx){
+    
+    if (use_umis && is_dup_fragment(bc_key, seq_f, seq_f_len, seq_r, seq_r_len, shard)){
+        return;
+    }
+    
+    // Both reads are genomic. Count each fragment at most once (as each
+    // UMI is counted at most once in RNA-seq data): look at the second read
+    // only if the first has no species-specific k-mer.
+    for (int j = 0; j < num_species; ++j){
+        species_counts[thread_idx][j] = 0;
+    }
+    int* counts = species_counts[thread_idx].data();
+    scan_seq_kmers(seq_f, seq_f_len, counts, scanners[thread_idx], 
+        lookup_stats[thread_idx]);
+    bool hit = false;
+    for (int j = 0; j < num_species; ++j){
+        if (counts[j] > 0){
+            hit = true;
+            break;
         }
-        scan_seq_kmers(seq_r, seq_r_len, species_counts[thread_idx].data(), khashkeys[thread_idx]);
-        
-        for (int j = 0; j < num_species; ++j){
-            if (species_counts[thread_idx][j] > 0){
-                int this_species = j;
-                int nk = species_counts[thread_idx][j];
-                unique_lock<mutex> lock(this->counts_mutex);
-                if (bc_species_counts->count(bc_key) == 0){
-                    map<short, int> m;
-                    bc_species_counts->emplace(bc_key, m);
-                }
-                if ((*bc_species_counts)[bc_key].count(this_species) == 0){
-                    (*bc_species_counts)[bc_key].insert(make_pair(this_species, 0));
-                }
-                //(*bc_species_counts)[bc_key][this_species]++;
-                (*bc_species_counts)[bc_key][this_species] += nk;
+    }
+    if (!hit){
+        scan_seq_kmers(seq_r, seq_r_len, counts, scanners[thread_idx],
+            lookup_stats[thread_idx]);
+    }
+    
+    // Accumulate in this thread's own table; no locking needed.
+    int* bc_counts = NULL;
+    for (int j = 0; j < num_species; ++j){
+        if (counts[j] > 0){
+            if (bc_counts == NULL){
+                bc_counts = thread_bc_species_counts[thread_idx].get(bc_key);
             }
+            bc_counts[j] += counts[j];
         }
     }
 }
@@ -1017,51 +1507,75 @@ void species_kmer_counter::add_node_to_tree_canonical(char* kmer, char* buf, kme
 void species_kmer_counter::parse_kmer_counts_serial(string& countsfilename,
     short species_idx){
     
-    gzreader reader(countsfilename);
-    int k = -1;
-    
-    while (reader.next()){
-        if (k == -1){
-            k = strlen(reader.line);
-        }
-        tab.add(reader.line, species_idx);
-        //add_node_to_tree_canonical(reader.line, buf2, kt, species_idx);
-    }
+    tab.add(countsfilename, species_idx);
 }
 
 /**
- * Worker function for a GEX read scanning job
+ * Worker function for a GEX (or ATAC) read scanning job
  */
 void species_kmer_counter::gex_thread(int thread_idx){
     
      while(true){
-        char* seq_f = NULL;
-        int seq_f_len = 0;
-        char* seq_r = NULL;
-        int seq_r_len = 0;
+        rp_batch* batch = NULL;
         {
+            // Wait for a batch whose shard no other thread is working on
             unique_lock<mutex> lock(this->queue_mutex);
-            this->has_jobs.wait(lock, [this]{ return rp_jobs.size() > 0 ||
-                terminate_threads;});
+            deque<rp_batch*>::iterator job;
+            this->has_jobs.wait(lock, [this, &job]{ return next_rp_job(job) ||
+                (rp_jobs.size() == 0 && terminate_threads);});
             if (this->rp_jobs.size() == 0 && this->terminate_threads){
                 return;
             }
-            seq_f = this->rp_jobs[0].seq_f;
-            seq_f_len = this->rp_jobs[0].len_f;
-            seq_r = this->rp_jobs[0].seq_r;
-            seq_r_len = this->rp_jobs[0].len_r;
-            
-            // Can't free here; need pointers to stick around
-            this->rp_jobs.pop_front();
+            batch = *job;
+            this->rp_jobs.erase(job);
+            this->shard_busy[batch->shard] = true;
+        }
+        this->has_space.notify_one();
+        
+        const char* seqs = batch->seqs.data();
+        for (int i = 0; i < batch->n; ++i){
+            if (atac){
+                scan_atac_data(batch->bc_keys[i], seqs + batch->offsets_f[i], 
+                    batch->lens_f[i], seqs + batch->offsets_r[i], batch->lens_r[i], 
+                    batch->shard, thread_idx);
+            }
+            else if (batch->bc_keys[i] != BC_KEY_NONE){
+                scan_gex_data(batch->bc_keys[i], seqs + batch->offsets_f[i], 
+                    batch->lens_f[i], seqs + batch->offsets_r[i], batch->lens_r[i], 
+                    batch->shard, thread_idx);
+            }
+            if (spill != NULL){
+                spill->add(batch->shard, seqs + batch->offsets_id[i], batch->lens_id[i],
+                    seqs + batch->offsets_f[i], seqs + batch->offsets_qual_f[i], 
+                    batch->lens_f[i], seqs + batch->offsets_r[i], 
+                    seqs + batch->offsets_qual_r[i], batch->lens_r[i]);
+            }
         }
-        if (seq_f != NULL && seq_r != NULL){
-            scan_gex_data(seq_f, seq_f_len, seq_r, seq_r_len, thread_idx);
-            free(seq_f);
-            free(seq_r);
+        
+        {
+            unique_lock<mutex> lock(this->queue_mutex);
+            this->shard_busy[batch->shard] = false;
+            batch->clear();
+            this->rp_batches_free.push_back(batch);
         }
+        // Another worker may be waiting for this shard
+        this->has_jobs.notify_all();
      }
  }
 
+/**
+ * Find the first queued batch that belongs to a shard no thread is
+ * working on. Must hold queue_mutex.
+ */
+bool species_kmer_counter::next_rp_job(deque<rp_batch*>::iterator& job){
+    for (job = rp_jobs.begin(); job != rp_jobs.end(); ++job){
+        if (!shard_busy[(*job)->shard]){
+            return true;
+        }
+    }
+    return false;
+}
+
 void species_kmer_counter::launch_gex_threads(){
     
     if (!this->initialized){
@@ -1070,6 +1584,23 @@ void species_kmer_counter::launch_gex_threads(){
     }
 
     this->terminate_threads = false;
+    
+    this->thread_bc_species_counts.clear();
+    for (int i = 0; i < this->num_threads; ++i){
+        this->thread_bc_species_counts.emplace_back(num_species);
+    }
+
+    // Enough batches for a full queue, one per worker, and one being filled
+    // per shard by each reader
+    int nbatches = this->max_rp_batches + this->num_threads + 
+        this->num_shards * this->active_readers;
+    while (this->rp_batch_pool.size() < nbatches){
+        this->rp_batch_pool.emplace_back();
+    }
+    this->rp_batches_free.clear();
+    for (int i = 0; i < this->rp_batch_pool.size(); ++i){
+        this->rp_batches_free.push_back(&this->rp_batch_pool[i]);
+    }
 
     for (int i = 0; i < this->num_threads; ++i){
         
@@ -1078,7 +1609,7 @@ void species_kmer_counter::launch_gex_threads(){
         for (int j = 0; j < num_species; ++j){
             this->species_counts[this->species_counts.size()-1].push_back(0);
         }
-        this->khashkeys.emplace_back(k);
+        this->scanners.emplace_back(k);
 
         this->threads.push_back(thread(&species_kmer_counter::gex_thread,
             this, i));
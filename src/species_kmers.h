@@ -21,6 +21,7 @@
 #include <htslib/kseq.h>
 #include <zlib.h>
 #include <limits.h>
+#include <stdint.h>
 #include <thread>
 #include <condition_variable>
 #include <mutex>
@@ -28,34 +29,109 @@
 #include <htswrapper/bc.h>
 #include <htswrapper/umi.h>
 #include <htswrapper/robin_hood/robin_hood.h>
-#include <htswrapper/khashtable.h>
 #include "common.h"
+#include "kmer_index.h"
+#include "kmer_bloom.h"
+#include "kmer_scan.h"
+#include "read_spill.h"
 
 // ===== species_kmers.h
 // Contains functions used to scan reads for species-specific kmers
 // used by demux_species.
 
-// Information to represent read pairs.
-struct rp_info{
-    //std::string seq_f;
-    //std::string seq_r;
-    //char[FQ_READ_LEN] seq_f;
-    //char[FQ_READ_LEN] = seq_r;
-    char* seq_f;
-    char* seq_r;
-    int len_f;
-    int len_r;
-    rp_info(const char* seq_f, int seq_f_len, const char* seq_r, int seq_r_len); 
-    rp_info(const rp_info& other);
-    ~rp_info();    
+// How many read pairs to hand to a worker thread at once
+#define RP_BATCH_SIZE 4096
+
+// Barcode key given to reads with no valid barcode, which are only kept to
+// spill to disk
+#define BC_KEY_NONE ((unsigned long)-1)
+
+// A batch of read pairs, with all sequences stored back to back in one
+// buffer. Batches are reused rather than freed, so once the buffers have
+// grown to fit a batch, adding reads no longer allocates memory.
+// Reads are added once their cell barcodes are known, and all reads in a
+// batch belong to the same UMI shard (see umi_shard).
+// For ATAC-seq data, the forward and reverse reads of a pair are R1 and R3
+// (the two ends of a fragment); the barcode read (R2) is not kept.
+// When reads are also being spilled to disk (see read_spill.h), batches
+// also hold read names and quality strings, and reads without a valid 
+// barcode (BC_KEY_NONE), which are spilled but not counted.
+struct rp_batch{
+    int shard;
+    std::vector<unsigned long> bc_keys;
+    std::vector<char> seqs;
+    // Offsets of forward and reverse reads (in seqs) for each pair
+    std::vector<int> offsets_f;
+    std::vector<int> offsets_r;
+    std::vector<int> lens_f;
+    std::vector<int> lens_r;
+    // Offsets of read names and qualities (in seqs), if spilling
+    std::vector<int> offsets_id;
+    std::vector<int> lens_id;
+    std::vector<int> offsets_qual_f;
+    std::vector<int> offsets_qual_r;
+    int n;
+    rp_batch();
+    void add(unsigned long bc_key, const char* seq_f, int seq_f_len, 
+        const char* seq_r, int seq_r_len);
+    void add(unsigned long bc_key, const char* seq_f, int seq_f_len, 
+        const char* seq_r, int seq_r_len, const char* id, int id_len,
+        const char* qual_f, const char* qual_r);
+    void clear();
+    bool full();
+};
+
+// One partition of the (cell barcode, UMI) pairs seen so far, stored in an 
+// open-addressing hash set. Cell barcodes are assigned to shards by hash, and
+// only one thread works on a given shard at a time, so no locking is needed.
+// UMIs are packed 2 bits per base, with a separate mask marking non-ACGT bases.
+struct umi_key{
+    unsigned long bc;
+    uint64_t umi;
+    uint64_t umi_n;
+};
+
+struct umi_shard{
+    std::vector<umi_key> slots;
+    std::vector<char> used;
+    size_t n;
+    umi_shard();
+    // Returns true if the barcode/UMI combination was already present
+    bool add(unsigned long bc, uint64_t umi, uint64_t umi_n);
+    void clear();
+    private:
+        void grow();
 };
 
-// Information to represent read triplets.
-struct rt_info{
-    std::string seq_1;
-    std::string seq_2;
-    std::string seq_3;
+// Species k-mer counts per cell barcode, private to one worker thread.
+// Each barcode maps to a row of num_species counts in one flat array.
+struct bc_species_tab{
+    robin_hood::unordered_flat_map<unsigned long, int> rows;
+    std::vector<int> counts;
+    int num_species;
+    bc_species_tab(int ns);
+    // Pointer to the row of counts for a barcode (only valid until the
+    // next call, since adding rows can move the array)
+    int* get(unsigned long bc_key);
+    void clear();
 };
+
+// How often k-mers in reads were looked up, per worker thread. Padded to
+// its own cache line, since each thread updates its own copy after every
+// read.
+struct kmer_lookup_stats{
+    // K-mers checked against the prefilter
+    long kmers;
+    // K-mers the prefilter ruled out
+    long rejected;
+    // K-mers that passed the prefilter and were found in the table
+    long hits;
+    char pad[40];
+    kmer_lookup_stats();
+    void clear();
+    void add(const kmer_lookup_stats& other);
+};
+
 /*
 struct kmer_node_ptr{
     kmer_node_ptr* f_A;
@@ -89,19 +165,29 @@ class species_kmer_counter{
         // Common to all jobs
         std::mutex queue_mutex;
         std::condition_variable has_jobs;
+        std::condition_variable has_space;
         bool terminate_threads;
         int num_threads;
         std::vector<std::thread> threads;
         std::vector<std::vector<int> > species_counts;
-        std::deque<khashkey> khashkeys;
+        // One k-mer scanner per thread
+        std::deque<kmer_scanner> scanners;
 
         bool initialized;
         bool on;
         std::string out_base;
         int num_species;
-        khashtable<short> tab;
+        // Species-specific k-mers, loaded from k-mer lists
+        kmer_index tab;
         int k;
         
+        // Table to use: either tab or a prebuilt (memory-mapped) index
+        kmer_index* kidx;
+        // Filter in front of the table, built once all k-mers are loaded
+        // (or mapped along with a prebuilt index)
+        kmer_bloom filter;
+        std::vector<kmer_lookup_stats> lookup_stats;
+        
         char* kmer_buf;
         bool kmer_buf_init;
          
@@ -111,16 +197,42 @@ class species_kmer_counter{
         int umi_start;
         int umi_len;
 
-        std::mutex counts_mutex;
-        std::mutex umi_mutex;
         robin_hood::unordered_map<unsigned long, std::map<short, int> >* bc_species_counts;
         
-        robin_hood::unordered_map<unsigned long, umi_set_exact* > bc_species_umis;
+        // Per-thread counts, merged into bc_species_counts when done
+        std::vector<bc_species_tab> thread_bc_species_counts;
+        void merge_bc_species_counts();
+        
+        // Barcode/UMI combinations seen so far, split into shards
+        int num_shards;
+        std::vector<umi_shard> umi_shards;
+        std::vector<bool> shard_busy;
+        int bc_shard(unsigned long bc_key);
+        bool is_dup_umi(unsigned long bc_key, const char* seq_f, int shard);
+        bool is_dup_fragment(unsigned long bc_key, const char* seq_f, int seq_f_len,
+            const char* seq_r, int seq_r_len, int shard);
 
         bool use_umis;
         bc_whitelist* wl;
         
+        // Where to copy reads, if anywhere
+        read_spill* spill;
+        
+        // How many chunks of BGZF input to read at once, and how many are
+        // being read for the current files
+        int num_readers;
+        int active_readers;
+        // Which part of the input files to read (see set_chunk())
+        int chunk;
+        int num_chunks;
+        void read_gex_chunk(const std::string& r1filename, 
+            const std::string& r2filename, int chunk, int num_chunks);
+        
         void close_pool();
+        
+        // Set up and tear down counting for one set of input files
+        void start_scan();
+        void finish_scan();
          
         void launch_gex_threads();
         
@@ -128,25 +240,38 @@ class species_kmer_counter{
         // Parameter queue for kmer file parsing jobs
         std::deque<std::pair<std::string, short> > kmer_parse_jobs;
 
-        // Parameter queue for paired-read (GEX) jobs
-        std::deque<rp_info> rp_jobs;
-        
-        // Parameter queue for three-read (ATAC) jobs
-        std::deque<rt_info> rt_jobs;
+        // Queue of paired-read (GEX) batches waiting for a worker. This 
+        // is bounded (max_rp_batches), so reading input blocks when workers
+        // fall behind.
+        std::deque<rp_batch*> rp_jobs;
+        int max_rp_batches;
+        // Every batch that exists, and those not currently in use
+        std::deque<rp_batch> rp_batch_pool;
+        std::vector<rp_batch*> rp_batches_free;
         
         //void add_node_to_tree_simple(char* kmer, char* buf, kmer_tree_p kt, short species_idx);
         //void add_node_to_tree_canonical(char* kmer, char* buf, kmer_tree_p kt, short species_idx);
 
-        // Function to process RNA-seq reads
+        // Whether batches hold ATAC-seq fragments (both reads genomic) rather
+        // than RNA-seq read pairs
+        bool atac;
+
+        // Function to process batches of RNA-seq or ATAC-seq reads
         void gex_thread(int thread_idx);
         
-        void scan_seq_kmers(const char* seq, int len, int* species_counts, khashkey& key);
+        void scan_seq_kmers(const char* seq, int len, int* species_counts, 
+            kmer_scanner& scanner, kmer_lookup_stats& stats);
         
-        void scan_gex_data(const char* seq_f, int seq_f_len, const char* seq_r, int seq_r_len, int thread_idx=0);
+        void scan_gex_data(unsigned long bc_key, const char* seq_f, int seq_f_len, 
+            const char* seq_r, int seq_r_len, int shard, int thread_idx=0);
         
-        void add_rp_job(const char* seq_f, int seq_f_len, const char* seq_r, int seq_r_len);
-
-        void add_rt_job(rt_info& info);
+        void scan_atac_data(unsigned long bc_key, const char* seq_f, int seq_f_len, 
+            const char* seq_r, int seq_r_len, int shard, int thread_idx=0);
+        
+        bool next_rp_job(std::deque<rp_batch*>::iterator& job);
+        
+        void add_rp_job(rp_batch* batch);
+        rp_batch* get_free_rp_batch();
 
         void parse_kmer_counts_serial(std::string& filename,
             short species_idx);
@@ -163,13 +288,40 @@ class species_kmer_counter{
 
         void init(short species_idx, std::string& kmerfile);
         void add(short species_idx, std::string& kmerfile);
+        // Use a prebuilt k-mer index (for all species) instead of loading
+        // k-mer lists
+        void use_index(kmer_index* idx);
 
         void disable_umis(); 
         void enable_umis();
         
         void set_n_samp(int ns);
+        
+        // Keep only a sample of k-mers, at the density of (w,k)-minimizers
+        // (see kmer_index.h)
+        void set_sampling(int w);
+
+        // With multiple threads, read BGZF-compressed input files in this 
+        // many chunks at once, each in its own thread (default 1)
+        void set_readers(int nr);
+        
+        // Only read chunk (0-based) of num_chunks of each pair of input
+        // files, which must be BGZF-compressed (see fq_pair_reader)
+        void set_chunk(int chunk, int num_chunks);
 
-        void process_gex_files(std::string& r1filename, std::string& r2filename);
+        // If spill is given, every read pair (including those with no valid
+        // barcode) is also written to it
+        void process_gex_files(std::string& r1filename, std::string& r2filename,
+            read_spill* spill = NULL);
+        
+        // Count ATAC-seq read triplets (R1, barcode read R2, R3). If 
+        // multiome, ATAC-seq barcodes are stored as the matching RNA-seq
+        // barcodes (the whitelist must hold both lists).
+        void process_atac_files(std::string& r1filename, std::string& r2filename,
+            std::string& r3filename, bool multiome);
+        
+        // Totals over all reads processed so far
+        void get_lookup_stats(kmer_lookup_stats& stats);
         
 };
 
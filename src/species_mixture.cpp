@@ -0,0 +1,414 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include "common.h"
+#include "species_mixture.h"
+
+using namespace std;
+
+// Barcodes processed together in the E-step (small enough that per-block
+// arrays stay in cache)
+#define MIX_BLOCK 512
+
+// Smallest multinomial parameter, so a species with no counts in a
+// component has a finite log probability
+#define MIX_MIN_PROB 1e-300
+
+species_count_table::species_count_table(int n_species){
+    this->n = 0;
+    this->n_species = n_species;
+    this->counts.resize(n_species);
+}
+
+void species_count_table::add(const double* row, double weight){
+    for (int s = 0; s < n_species; ++s){
+        counts[s].push_back(row[s]);
+    }
+    weights.push_back(weight);
+    n++;
+}
+
+void species_count_table::subsample(int step, species_count_table& sub) const{
+    vector<double> row(n_species);
+    for (int i = 0; i < n; i += step){
+        for (int s = 0; s < n_species; ++s){
+            row[s] = counts[s][i];
+        }
+        sub.add(row.data(), weights[i]);
+    }
+}
+
+void species_count_table::totals(vector<double>& tot) const{
+    tot.assign(n, 0.0);
+    for (int s = 0; s < n_species; ++s){
+        for (int i = 0; i < n; ++i){
+            tot[i] += counts[s][i];
+        }
+    }
+}
+
+void species_count_table::filter_knee(species_count_table& filt) const{
+    vector<double> tot;
+    totals(tot);
+    vector<double> totsort = tot;
+    double knee = find_knee_totals(totsort, 0.1);
+    vector<double> row(n_species);
+    for (int i = 0; i < n; ++i){
+        if (tot[i] >= knee){
+            for (int s = 0; s < n_species; ++s){
+                row[s] = counts[s][i];
+            }
+            filt.add(row.data(), tot[i]);
+        }
+    }
+}
+
+species_mixture::species_mixture(const vector<string>& species_names,
+    double target_weight, double doublet_rate, int nthreads){
+
+    this->nthreads = nthreads > 1 ? nthreads : 1;
+    this->n_species = species_names.size();
+    this->doublet_rate = doublet_rate;
+    this->maxits = 1000;
+    this->delta = 0.1;
+    this->subsample_size = 20000;
+
+    // One component per species
+    for (int i = 0; i < n_species; ++i){
+        vector<double> p;
+        for (int s = 0; s < n_species; ++s){
+            if (s == i){
+                p.push_back(target_weight);
+            }
+            else{
+                p.push_back((1.0 - target_weight) / (double)(n_species - 1));
+            }
+        }
+        names.push_back(species_names[i]);
+        parent1.push_back(-1);
+        parent2.push_back(-1);
+        probs.push_back(p);
+    }
+    // One component per pair of species
+    for (int i = 0; i < n_species - 1; ++i){
+        for (int j = i + 1; j < n_species; ++j){
+            vector<double> p;
+            for (int s = 0; s < n_species; ++s){
+                if (s == i || s == j){
+                    p.push_back(target_weight / 2.0);
+                }
+                else{
+                    p.push_back((1.0 - target_weight) / (double)(n_species - 2));
+                }
+            }
+            if (species_names[i] < species_names[j]){
+                names.push_back(species_names[i] + "+" + species_names[j]);
+            }
+            else{
+                names.push_back(species_names[j] + "+" + species_names[i]);
+            }
+            parent1.push_back(i);
+            parent2.push_back(j);
+            probs.push_back(p);
+        }
+    }
+    this->n_components = probs.size();
+    int n_doublet = n_components - n_species;
+    for (int c = 0; c < n_components; ++c){
+        if (is_doublet(c)){
+            weights.push_back(doublet_rate / (double)n_doublet);
+        }
+        else{
+            weights.push_back((1.0 - doublet_rate) / (double)n_species);
+        }
+    }
+}
+
+/**
+ * Set each doublet component's parameters to the mean of its parents'.
+ */
+void species_mixture::tie_doublets(){
+    for (int c = 0; c < n_components; ++c){
+        if (is_doublet(c)){
+            double psum = 0.0;
+            for (int s = 0; s < n_species; ++s){
+                probs[c][s] = (probs[parent1[c]][s] + probs[parent2[c]][s]) / 2.0;
+                psum += probs[c][s];
+            }
+            if (psum != 1.0){
+                for (int s = 0; s < n_species; ++s){
+                    probs[c][s] /= psum;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Compute responsibilities for a range of barcodes and add up this thread's
+ * sufficient statistics.
+ */
+void species_mixture::estep(const species_count_table& data, int start, int end,
+    int thread_idx){
+
+    vector<double>& sw = stats_w[thread_idx];
+    vector<double>& sx = stats_x[thread_idx];
+    double ll_tot = 0.0;
+
+    vector<double> logp(n_components * n_species);
+    vector<double> logw(n_components);
+    for (int c = 0; c < n_components; ++c){
+        logw[c] = log2(weights[c] > MIX_MIN_PROB ? weights[c] : MIX_MIN_PROB);
+        for (int s = 0; s < n_species; ++s){
+            logp[c * n_species + s] = log2(probs[c][s] > MIX_MIN_PROB ?
+                probs[c][s] : MIX_MIN_PROB);
+        }
+    }
+
+    // Per-block log likelihoods (ll[c * MIX_BLOCK + i]), row maxima & sums
+    vector<double> ll(n_components * MIX_BLOCK);
+    double llmax[MIX_BLOCK];
+    double llsum[MIX_BLOCK];
+
+    for (int b = start; b < end; b += MIX_BLOCK){
+        int nb = end - b < MIX_BLOCK ? end - b : MIX_BLOCK;
+        const double* w = data.weights.data() + b;
+        for (int c = 0; c < n_components; ++c){
+            double* llc = ll.data() + c * MIX_BLOCK;
+            for (int i = 0; i < nb; ++i){
+                llc[i] = logw[c];
+            }
+            for (int s = 0; s < n_species; ++s){
+                const double* x = data.counts[s].data() + b;
+                double lp = logp[c * n_species + s];
+                for (int i = 0; i < nb; ++i){
+                    llc[i] += x[i] * lp;
+                }
+            }
+        }
+        for (int i = 0; i < nb; ++i){
+            llmax[i] = ll[i];
+        }
+        for (int c = 1; c < n_components; ++c){
+            const double* llc = ll.data() + c * MIX_BLOCK;
+            for (int i = 0; i < nb; ++i){
+                llmax[i] = llc[i] > llmax[i] ? llc[i] : llmax[i];
+            }
+        }
+        for (int i = 0; i < nb; ++i){
+            llsum[i] = 0.0;
+        }
+        // Turn log likelihoods into unnormalized responsibilities
+        for (int c = 0; c < n_components; ++c){
+            double* llc = ll.data() + c * MIX_BLOCK;
+            for (int i = 0; i < nb; ++i){
+                llc[i] = exp2(llc[i] - llmax[i]);
+                llsum[i] += llc[i];
+            }
+        }
+        for (int i = 0; i < nb; ++i){
+            ll_tot += w[i] * (llmax[i] + log2(llsum[i]));
+            // Weight of each barcode, divided by its normalizing constant
+            llsum[i] = w[i] / llsum[i];
+        }
+        for (int c = 0; c < n_components; ++c){
+            const double* llc = ll.data() + c * MIX_BLOCK;
+            double tot = 0.0;
+            for (int i = 0; i < nb; ++i){
+                tot += llc[i] * llsum[i];
+            }
+            sw[c] += tot;
+            for (int s = 0; s < n_species; ++s){
+                const double* x = data.counts[s].data() + b;
+                double totx = 0.0;
+                for (int i = 0; i < nb; ++i){
+                    totx += llc[i] * llsum[i] * x[i];
+                }
+                sx[c * n_species + s] += totx;
+            }
+        }
+    }
+    stats_ll[thread_idx] = ll_tot;
+}
+
+/**
+ * Fit parameters by expectation maximization, starting from the current
+ * parameters.
+ */
+double species_mixture::fit_em(const species_count_table& data){
+    int nt = nthreads;
+    if (nt > 1 && data.n < nt * MIX_BLOCK){
+        // Not worth starting threads
+        nt = 1;
+    }
+    stats_w.assign(nt, vector<double>(n_components));
+    stats_x.assign(nt, vector<double>(n_components * n_species));
+    stats_ll.assign(nt, 0.0);
+
+    double wtot = 0.0;
+    for (int i = 0; i < data.n; ++i){
+        wtot += data.weights[i];
+    }
+
+    tie_doublets();
+    double ll_prev = 0.0;
+    double ll = 0.0;
+    for (int it = 0; it < maxits; ++it){
+        for (int t = 0; t < nt; ++t){
+            fill(stats_w[t].begin(), stats_w[t].end(), 0.0);
+            fill(stats_x[t].begin(), stats_x[t].end(), 0.0);
+        }
+        if (nt > 1){
+            // Give each thread an equal range of barcodes, in whole blocks
+            int nblocks = (data.n + MIX_BLOCK - 1) / MIX_BLOCK;
+            vector<thread> threads;
+            for (int t = 0; t < nt; ++t){
+                int start = (int)(((long)nblocks * t) / nt) * MIX_BLOCK;
+                int end = (int)(((long)nblocks * (t + 1)) / nt) * MIX_BLOCK;
+                if (end > data.n){
+                    end = data.n;
+                }
+                threads.push_back(thread(&species_mixture::estep, this,
+                    std::ref(data), start, end, t));
+            }
+            for (int t = 0; t < nt; ++t){
+                threads[t].join();
+            }
+        }
+        else{
+            estep(data, 0, data.n, 0);
+        }
+
+        // Add up threads' statistics
+        ll = 0.0;
+        for (int t = 0; t < nt; ++t){
+            ll += stats_ll[t];
+            if (t > 0){
+                for (int c = 0; c < n_components; ++c){
+                    stats_w[0][c] += stats_w[t][c];
+                }
+                for (int j = 0; j < n_components * n_species; ++j){
+                    stats_x[0][j] += stats_x[t][j];
+                }
+            }
+        }
+
+        // M-step
+        for (int c = 0; c < n_components; ++c){
+            weights[c] = stats_w[0][c] / wtot;
+            double xsum = 0.0;
+            for (int s = 0; s < n_species; ++s){
+                xsum += stats_x[0][c * n_species + s];
+            }
+            if (xsum > 0){
+                for (int s = 0; s < n_species; ++s){
+                    probs[c][s] = stats_x[0][c * n_species + s] / xsum;
+                }
+            }
+        }
+        tie_doublets();
+
+        if (it > 0 && fabs(ll - ll_prev) < delta){
+            break;
+        }
+        ll_prev = ll;
+    }
+    return ll;
+}
+
+double species_mixture::fit(const species_count_table& data){
+    if (data.n == 0){
+        return 0.0;
+    }
+    if (subsample_size > 0 && data.n / 2 >= subsample_size){
+        // Warm start: parameters fit to every step-th barcode are close to
+        // those for all barcodes
+        species_count_table sub(n_species);
+        data.subsample(data.n / subsample_size, sub);
+        fit_em(sub);
+    }
+    return fit_em(data);
+}
+
+void species_mixture::loglik_range(const species_count_table& data, int start,
+    int end, vector<double>* ll){
+    for (int c = 0; c < n_components; ++c){
+        double* llc = ll[c].data();
+        for (int i = start; i < end; ++i){
+            llc[i] = 0.0;
+        }
+        for (int s = 0; s < n_species; ++s){
+            const double* x = data.counts[s].data();
+            double lp = log2(probs[c][s] > MIX_MIN_PROB ? probs[c][s] : MIX_MIN_PROB);
+            for (int i = start; i < end; ++i){
+                llc[i] += x[i] * lp;
+            }
+        }
+    }
+}
+
+void species_mixture::loglik(const species_count_table& data,
+    vector<vector<double> >& ll){
+    ll.resize(n_components);
+    for (int c = 0; c < n_components; ++c){
+        ll[c].resize(data.n);
+    }
+    if (nthreads > 1 && data.n >= nthreads * MIX_BLOCK){
+        vector<thread> threads;
+        for (int t = 0; t < nthreads; ++t){
+            int start = (int)(((long)data.n * t) / nthreads);
+            int end = (int)(((long)data.n * (t + 1)) / nthreads);
+            threads.push_back(thread(&species_mixture::loglik_range, this,
+                std::ref(data), start, end, ll.data()));
+        }
+        for (int t = 0; t < nthreads; ++t){
+            threads[t].join();
+        }
+    }
+    else{
+        loglik_range(data, 0, data.n, ll.data());
+    }
+}
+
+void species_mixture::assign(const species_count_table& data, vector<int>& best,
+    vector<double>& llr){
+    vector<vector<double> > lls;
+    loglik(data, lls);
+    
+    double prior_doublet = log2(doublet_rate);
+    double prior_singlet = log2(1.0 - doublet_rate);
+    
+    best.resize(data.n);
+    llr.resize(data.n);
+    for (int i = 0; i < data.n; ++i){
+        // Find the best and second best components
+        int b = -1;
+        int second = -1;
+        double ll_best = 0.0;
+        double ll_second = 0.0;
+        for (int j = 0; j < n_components; ++j){
+            double ll = lls[j][i] + (is_doublet(j) ? prior_doublet : prior_singlet);
+            if (b == -1){
+                b = j;
+                ll_best = ll;
+            }
+            else if (ll > ll_best){
+                second = b;
+                ll_second = ll_best;
+                b = j;
+                ll_best = ll;
+            }
+            else if (second == -1 || ll > ll_second){
+                second = j;
+                ll_second = ll;
+            }
+        }
+        best[i] = b;
+        llr[i] = ll_best - ll_second;
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef _CELLBOUNCER_SPECIES_MIXTURE_H
+#define _CELLBOUNCER_SPECIES_MIXTURE_H
+#include <string>
+#include <vector>
+
+// ===== species_mixture.h
+// Mixture of multinomial distributions over per-cell species k-mer counts,
+// used by demux_species to assign cell barcodes to species. There is one
+// component per species (most counts from that species) and one per pair
+// of species (doublets). Doublet components are not fit freely: their
+// parameters are always the mean of their two parent species' parameters.
+//
+// This is the model demux_species used to fit with mixtureModel,
+// specialized for its shape: few species (so few dimensions and
+// components) and up to hundreds of thousands of cell barcodes. Only the
+// multinomial model is implemented; there is no Dirichlet-multinomial 
+// option (demux_species never used one). Counts are stored as one array
+// per species rather than one vector per barcode, so the E-step runs as a
+// few tight loops over blocks of barcodes held in cache, and barcodes are
+// split across threads, each of which adds up its own sufficient 
+// statistics. The E-step is not written for SIMD: the compiler can 
+// vectorize the multiply-adds over counts, but not the exp2() calls or
+// (without fast-math) the sums. With many barcodes, the model is first
+// fit to a subsample, and those parameters are used as a starting point
+// for the full fit, which then needs few iterations.
+//
+// Log likelihoods are base 2, and leave out the multinomial coefficient,
+// which is the same for every component (so does not affect assignments
+// or likelihood ratios).
+
+// Counts per species for a set of cell barcodes
+struct species_count_table{
+    int n;
+    int n_species;
+    // Count of species s for barcode i is counts[s][i]
+    std::vector<std::vector<double> > counts;
+    // Weight of each barcode in the fit
+    std::vector<double> weights;
+    species_count_table(int n_species);
+    void add(const double* row, double weight);
+    // Every step-th barcode
+    void subsample(int step, species_count_table& sub) const;
+    // Total count of each barcode
+    void totals(std::vector<double>& tot) const;
+    // Barcodes with total counts at or above the knee of all totals (see 
+    // find_knee_totals), weighted by total counts: the barcodes likely to
+    // be cells, to which demux_species fits the model
+    void filter_knee(species_count_table& filt) const;
+};
+
+class species_mixture{
+    private:
+        int nthreads;
+        // Per-thread sufficient statistics: weighted responsibilities,
+        // and weighted counts per component & species
+        std::vector<std::vector<double> > stats_w;
+        std::vector<std::vector<double> > stats_x;
+        std::vector<double> stats_ll;
+        void estep(const species_count_table& data, int start, int end, int thread_idx);
+        void loglik_range(const species_count_table& data, int start, int end,
+            std::vector<double>* ll);
+        double fit_em(const species_count_table& data);
+        void tie_doublets();
+    public:
+        int n_species;
+        int n_components;
+        // Component names (species names, or "a+b" for doublets)
+        std::vector<std::string> names;
+        // For doublet components, indices of parent species (-1 for singlets)
+        std::vector<int> parent1;
+        std::vector<int> parent2;
+        // Mixing weights, and multinomial parameters (probs[c][s])
+        std::vector<double> weights;
+        std::vector<std::vector<double> > probs;
+
+        // Maximum EM iterations, and change in log likelihood at which to stop
+        int maxits;
+        double delta;
+        // Fit a subsample first if there are at least twice this many barcodes
+        int subsample_size;
+
+        // Components start with target_weight of counts on their own species
+        // (split between both species for doublets), and weights set by the
+        // expected doublet rate
+        species_mixture(const std::vector<std::string>& species_names,
+            double target_weight, double doublet_rate, int nthreads = 1);
+
+        // Prior probability of a doublet
+        double doublet_rate;
+
+        bool is_doublet(int c) const { return parent1[c] >= 0; }
+
+        // Returns the final log likelihood
+        double fit(const species_count_table& data);
+
+        // Log likelihood of every barcode under every component, without
+        // mixing weights: ll[c][i]
+        void loglik(const species_count_table& data,
+            std::vector<std::vector<double> >& ll);
+
+        // Assign every barcode its most likely component, including the
+        // doublet rate prior (lower index wins ties), along with the log 
+        // likelihood ratio of that component over the next best
+        void assign(const species_count_table& data, std::vector<int>& best,
+            std::vector<double>& llr);
+};
+
+#endif
@@ -14,12 +14,14 @@
 #include <sstream>
 #include <map>
 #include <set>
+#include <deque>
 #include <cstdlib>
 #include <utility>
 #include <math.h>
 #include <htslib/kseq.h>
 #include <zlib.h>
 #include "common.h"
+#include "fq_writer.h"
 
 using std::cout;
 using std::endl;
@@ -39,33 +41,27 @@ processing can be run more efficiently on a cluster.\n");
     fprintf(stderr, "    --single -s The input file for unpaired reads\n");
     fprintf(stderr, "    --output_directory -o The output directory for split files\n");
     fprintf(stderr, "    --num_chunks -n The number of smaller read files to create\n");
+    fprintf(stderr, "    --num_threads -T The number of threads to use for compressing output\n");
+    fprintf(stderr, "       files (default 1). Output is BGZF-compressed, which is readable as\n");
+    fprintf(stderr, "       normal gzip.\n");
     fprintf(stderr, "    --help -h Display this message and exit.\n");
     exit(code);
 }
 
 KSEQ_INIT(gzFile, gzread);
 
-void write_fastq(kseq_t* seq, gzFile& out){
-    int buflen = seq->name.l + 3;
+void write_fastq(kseq_t* seq, fq_writer& out){
+    out.write("@", 1);
+    out.write(seq->name.s, seq->name.l);
     if (seq->comment.l > 0){
-        buflen += seq->comment.l + 1;
+        out.write(" ", 1);
+        out.write(seq->comment.s, seq->comment.l);
     }
-    char buf[buflen];
-    if (seq->comment.l > 0){
-        sprintf(buf, "@%s %s\n", seq->name.s, seq->comment.s);
-    }
-    else{
-        sprintf(buf, "@%s\n", seq->name.s);
-    }
-    gzwrite(out, buf, buflen-1);
-    char buf2[seq->seq.l + 1];
-    sprintf(buf2, "%s\n", seq->seq.s);
-    gzwrite(out, buf2, seq->seq.l + 1);
-    char buf3[3];
-    sprintf(buf3, "+\n");
-    gzwrite(out, buf3, 2);
-    sprintf(buf2, "%s\n", seq->qual.s);
-    gzwrite(out, buf2, seq->qual.l + 1);
+    out.write("\n", 1);
+    out.write(seq->seq.s, seq->seq.l);
+    out.write("\n+\n", 3);
+    out.write(seq->qual.s, seq->qual.l);
+    out.write("\n", 1);
 }
 
 string filename_noext(const string& filename){
@@ -100,6 +96,7 @@ int main(int argc, char *argv[]) {
        {"single", required_argument, 0, 's'},
        {"output_directory", required_argument, 0, 'o'},
        {"num_chunks", required_argument, 0, 'n'},
+       {"num_threads", required_argument, 0, 'T'},
        {0, 0, 0, 0} 
     };
     
@@ -116,6 +113,7 @@ int main(int argc, char *argv[]) {
     string output_directory;
     bool has_output_directory = false;
     int num_chunks = -1;
+    int num_threads = 1;
 
     int option_index = 0;
     int ch;
@@ -123,7 +121,7 @@ int main(int argc, char *argv[]) {
     if (argc == 1){
         help(0);
     }
-    while((ch = getopt_long(argc, argv, "1:2:3:s:o:n:h", long_options, &option_index )) != -1){
+    while((ch = getopt_long(argc, argv, "1:2:3:s:o:n:T:h", long_options, &option_index )) != -1){
         switch(ch){
             case 0:
                 // This option set a flag. No need to do anything here.
@@ -154,6 +152,9 @@ int main(int argc, char *argv[]) {
             case 'n':
                 num_chunks = atoi(optarg);
                 break;
+            case 'T':
+                num_threads = atoi(optarg);
+                break;
             default:
                 help(0);
                 break;
@@ -174,6 +175,10 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "ERROR: num chunks must be a positive integer\n");
         exit(1);
     }    
+    if (num_threads < 1){
+        fprintf(stderr, "ERROR: --num_threads / -T must be at least 1\n");
+        exit(1);
+    }
     
     if (!has_output_directory){
         fprintf(stderr, "ERROR: output_directory / -o required\n");
@@ -189,7 +194,11 @@ int main(int argc, char *argv[]) {
     }
     
     // Define output files
-    gzFile outfiles[num_chunks*3 + 1];
+    fq_writer_pool* pool = NULL;
+    if (num_threads > 1){
+        pool = new fq_writer_pool(num_threads);
+    }
+    deque<fq_writer> outfiles(num_chunks*3 + 1);
     
     string base1;
     string base2;
@@ -220,44 +229,20 @@ int main(int argc, char *argv[]) {
             if (has_r3){
                 char fn3[150];
                 sprintf(&fn3[0], "%s/%s.%d.fastq.gz", output_directory.c_str(), base3.c_str(), i+1);
-                outfiles[i*3] = gzopen(fn1, "w");
-                outfiles[i*3+1] = gzopen(fn2, "w");
-                outfiles[i*3+2] = gzopen(fn3, "w");
-                if (!outfiles[i*3]){
-                    fprintf(stderr, "ERROR opening %s for writing.\n", fn1);
-                    exit(1);
-                }
-                if (!outfiles[i*3+1]){
-                    fprintf(stderr, "ERROR opening %s for writing.\n", fn2);
-                    exit(1);
-                }
-                if (!outfiles[i*3+2]){
-                    fprintf(stderr, "ERROR opening %s for writing.\n", fn3);
-                    exit(1);
-                }
+                outfiles[i*3].open(fn1, pool);
+                outfiles[i*3+1].open(fn2, pool);
+                outfiles[i*3+2].open(fn3, pool);
             }
             else{
-                outfiles[i*2] = gzopen(fn1, "w");
-                outfiles[i*2+1] = gzopen(fn2, "w");
-                if (!outfiles[i*2]){
-                    fprintf(stderr, "ERROR opening %s for writing.\n", fn1);
-                    exit(1);
-                }
-                if (!outfiles[i*2+1]){
-                    fprintf(stderr, "ERROR opening %s for writing.\n", fn2);
-                    exit(1);
-                }
+                outfiles[i*2].open(fn1, pool);
+                outfiles[i*2+1].open(fn2, pool);
             }
         }
         else{
             char fn[150];
             sprintf(&fn[0], "%s/%s.%d.fastq.gz", output_directory.c_str(), base_single.c_str(),
                 i+1);
-            outfiles[i*2] = gzopen(fn, "w");
-            if (!outfiles[i*2]){
-                fprintf(stderr, "ERROR opening %s for writing.\n", fn);
-                exit(1);
-            }
+            outfiles[i*2].open(fn, pool);
         }
     }
 
@@ -351,20 +336,23 @@ int main(int argc, char *argv[]) {
         }
         for (int i = 0; i < num_chunks; ++i){
             if (has_r3){
-                gzclose(outfiles[i*3]);
-                gzclose(outfiles[i*3 + 1]);
-                gzclose(outfiles[i*3 + 2]);
+                outfiles[i*3].close();
+                outfiles[i*3 + 1].close();
+                outfiles[i*3 + 2].close();
             }
             else{
-                gzclose(outfiles[i*2]);
-                gzclose(outfiles[i*2 + 1]);
+                outfiles[i*2].close();
+                outfiles[i*2 + 1].close();
             }
         }
     }
     else{
         for (int i = 0; i < num_chunks; ++i){
-            gzclose(outfiles[i*2]);
+            outfiles[i*2].close();
         }
     }    
+    if (pool != NULL){
+        delete pool;
+    }
     return 0;
 }
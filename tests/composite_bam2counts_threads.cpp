@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <htslib/sam.h>
+
+// ===== composite_bam2counts_threads.cpp
+// Checks that utils/composite_bam2counts --umis gives the same counts with
+// one thread (reading the whole BAM in order) as with several (reading
+// groups of sequences through the index), and that each UMI is counted once
+// per cell barcode, for the species most of its reads map to, even when
+// its reads map to sequences counted in different threads.
+//
+// Writes a small indexed BAM to the given directory, runs
+// composite_bam2counts on it, and exits with status 1 on failure. Run from
+// the top-level directory (make test).
+
+using namespace std;
+
+// One read to write: where it maps, and its cell barcode and UMI
+struct test_read{
+    int tid;
+    int pos;
+    int bc;
+    int umi;
+    bool operator<(const test_read& other) const{
+        if (tid != other.tid){
+            return tid < other.tid;
+        }
+        return pos < other.pos;
+    }
+};
+
+// Sequences in the BAM; species are sorted by name, so hg38 = 0, mm10 = 1
+static const char* seqnames[] = { "hg38_chr1", "hg38_chr2", "mm10_chr1" };
+static const int seqspecies[] = { 0, 0, 1 };
+#define TEST_NUM_SEQS 3
+#define TEST_SEQ_LEN 100000
+#define TEST_NUM_BCS 20
+#define TEST_NUM_UMIS 30
+
+/**
+ * A distinct sequence for each index (base 3, without A, so that barcodes
+ * never have leading bases that pack to zero)
+ */
+string test_seq(int idx, int len){
+    string s(len, 'C');
+    for (int i = len - 1; i >= 0; --i){
+        s[i] = "CGT"[idx % 3];
+        idx /= 3;
+    }
+    return s;
+}
+
+void write_bam(const string& filename, vector<test_read>& reads){
+    sort(reads.begin(), reads.end());
+    samFile* out = sam_open(filename.c_str(), "wb");
+    if (out == NULL){
+        fprintf(stderr, "ERROR opening %s for writing.\n", filename.c_str());
+        exit(1);
+    }
+    sam_hdr_t* hdr = sam_hdr_init();
+    string header = "@HD\tVN:1.6\tSO:coordinate\n";
+    for (int i = 0; i < TEST_NUM_SEQS; ++i){
+        char buf[100];
+        sprintf(&buf[0], "@SQ\tSN:%s\tLN:%d\n", seqnames[i], TEST_SEQ_LEN);
+        header += buf;
+    }
+    if (sam_hdr_add_lines(hdr, header.c_str(), 0) < 0 || sam_hdr_write(out, hdr) < 0){
+        fprintf(stderr, "ERROR writing header to %s\n", filename.c_str());
+        exit(1);
+    }
+    bam1_t* b = bam_init1();
+    string seq(50, 'A');
+    string qual(50, 30);
+    uint32_t cigar = bam_cigar_gen(50, BAM_CMATCH);
+    for (int i = 0; i < reads.size(); ++i){
+        char qname[50];
+        sprintf(&qname[0], "read%d", i);
+        string cb = test_seq(reads[i].bc, 16) + "-1";
+        string ub = test_seq(reads[i].umi, 12);
+        if (bam_set1(b, strlen(qname), qname, 0, reads[i].tid, reads[i].pos, 60,
+            1, &cigar, -1, -1, 0, seq.length(), seq.c_str(), qual.c_str(), 0) < 0 ||
+            bam_aux_append(b, "CB", 'Z', cb.length() + 1, (const uint8_t*)cb.c_str()) < 0 ||
+            bam_aux_append(b, "UB", 'Z', ub.length() + 1, (const uint8_t*)ub.c_str()) < 0 ||
+            sam_write1(out, hdr, b) < 0){
+            fprintf(stderr, "ERROR writing to %s\n", filename.c_str());
+            exit(1);
+        }
+    }
+    bam_destroy1(b);
+    sam_hdr_destroy(hdr);
+    sam_close(out);
+    if (sam_index_build(filename.c_str(), 0) < 0){
+        fprintf(stderr, "ERROR indexing %s\n", filename.c_str());
+        exit(1);
+    }
+}
+
+/**
+ * Load a text counts table (barcode, then one count per species).
+ */
+void load_counts(const string& filename, map<string, vector<int> >& counts){
+    FILE* fp = fopen(filename.c_str(), "r");
+    if (fp == NULL){
+        fprintf(stderr, "ERROR: %s not found\n", filename.c_str());
+        exit(1);
+    }
+    char bc[100];
+    int c0, c1;
+    while (fscanf(fp, "%99s\t%d\t%d", &bc[0], &c0, &c1) == 3){
+        vector<int> row;
+        row.push_back(c0);
+        row.push_back(c1);
+        counts.insert(make_pair(string(bc), row));
+    }
+    fclose(fp);
+}
+
+bool run_and_check(const string& bamfile, const string& outdir, int nthreads,
+    map<string, vector<int> >& expected){
+
+    char cmd[1000];
+    sprintf(&cmd[0], "utils/composite_bam2counts -b %s -o %s -T %d -u -t 2> /dev/null",
+        bamfile.c_str(), outdir.c_str(), nthreads);
+    if (system(cmd) != 0){
+        fprintf(stderr, "FAIL: composite_bam2counts -T %d exited with an error\n", nthreads);
+        return false;
+    }
+    map<string, vector<int> > counts;
+    load_counts(outdir + "/species_counts.txt", counts);
+    if (counts != expected){
+        fprintf(stderr, "FAIL: counts with -T %d differ from expected counts\n", nthreads);
+        return false;
+    }
+    fprintf(stderr, "PASS: -T %d\n", nthreads);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    string dir = argc > 1 ? argv[1] : "tests/out";
+    mkdir(dir.c_str(), 0775);
+    string bamfile = dir + "/composite.bam";
+
+    // Each molecule (barcode, UMI) has a few reads, on one or more sequences;
+    // some have reads from both species, and some from two sequences of the
+    // same species
+    vector<test_read> reads;
+    map<string, vector<int> > expected;
+    for (int bc = 0; bc < TEST_NUM_BCS; ++bc){
+        vector<int> row(2, 0);
+        for (int umi = 0; umi < TEST_NUM_UMIS; ++umi){
+            int nreads_seq[TEST_NUM_SEQS] = { 0, 0, 0 };
+            int pattern = (bc * TEST_NUM_UMIS + umi) % 5;
+            switch(pattern){
+                case 0:
+                    // One species, one sequence
+                    nreads_seq[2] = 2;
+                    break;
+                case 1:
+                    // One species, two sequences
+                    nreads_seq[0] = 1;
+                    nreads_seq[1] = 2;
+                    break;
+                case 2:
+                    // Mostly species 1
+                    nreads_seq[0] = 1;
+                    nreads_seq[2] = 3;
+                    break;
+                case 3:
+                    // Mostly species 0, split over two sequences
+                    nreads_seq[0] = 1;
+                    nreads_seq[1] = 1;
+                    nreads_seq[2] = 1;
+                    break;
+                default:
+                    // Tie, counted for species 0
+                    nreads_seq[1] = 1;
+                    nreads_seq[2] = 1;
+                    break;
+            }
+            int nreads_species[2] = { 0, 0 };
+            for (int s = 0; s < TEST_NUM_SEQS; ++s){
+                for (int r = 0; r < nreads_seq[s]; ++r){
+                    test_read rd;
+                    rd.tid = s;
+                    rd.pos = ((bc * TEST_NUM_UMIS + umi) * 7 + r * 13) % (TEST_SEQ_LEN - 100);
+                    rd.bc = bc;
+                    rd.umi = umi;
+                    reads.push_back(rd);
+                    nreads_species[seqspecies[s]]++;
+                }
+            }
+            row[nreads_species[1] > nreads_species[0] ? 1 : 0]++;
+        }
+        expected.insert(make_pair(test_seq(bc, 16), row));
+    }
+    write_bam(bamfile, reads);
+
+    bool pass = run_and_check(bamfile, dir + "/T1", 1, expected) &&
+        run_and_check(bamfile, dir + "/T3", 3, expected);
+    return pass ? 0 : 1;
+}